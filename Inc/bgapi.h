@@ -17,6 +17,31 @@
 
 /* Defines */
 
+/*
+ * BT122 UART rate. The BGScript sets the UART to BT122_DEFAULT_BAUD_RATE on every boot, so a reset of
+ * the BT122 always returns the link to it. For the firmware download the rate is raised with
+ * setBT122BaudRate(). The DFU bootloader only accepts DFU commands, it runs at the rate of the BT122
+ * hardware configuration.
+ */
+#define BT122_DEFAULT_BAUD_RATE 115200			/* Rate after a reset of the BT122 (set by the BGScript) */
+#define BT122_DFU_BAUD_RATE 115200				/* Rate of the BT122 DFU bootloader */
+#define BT122_OTA_BAUD_RATE 921600				/* Rate requested for the firmware download */
+#define BT122_UART_RECONFIGURE_DELAY_MS 110		/* The BT122 applies a new UART configuration 100 ms after its response */
+#define BT122_BGAPI_TIMEOUT_MS 500				/* Time to wait for the response to a BGAPI command */
+#define BT122_PROBE_ATTEMPTS 3					/* system_hello commands sent to check the link at a new rate */
+
+/*
+ * BGAPI receive. bgapiFeed() frames the bytes waiting in the UART receive buffer into packets, without
+ * blocking, and queues them. bgapiDispatch() passes queued packets to the handler registered for their
+ * message ID. A header whose device type is not dumo is not the start of a packet, the framer drops its
+ * first byte and tries again, so it finds the next packet after garbage or a lost byte.
+ */
+#define BGAPI_PACKET_MAXLEN 260					/* Largest packet queued (header + 256 bytes), longer ones are skipped. Multiple of 4. */
+#define BGAPI_QUEUE_LENGTH 4					/* Packets waiting to be dispatched */
+#define BGAPI_MAX_HANDLERS 16					/* Message handlers that can be registered at the same time */
+#define BGAPI_FRAMER_TIMEOUT_MS 100				/* A packet whose bytes stop arriving for this long is dropped */
+#define BGAPI_DEFAULT_HANDLER_ID 0				/* bgapiRegisterHandler() ID of the handler of messages without their own */
+
 
 /* Exported types */
 /**
@@ -28,11 +53,35 @@ typedef enum
   DATA_MODE    = 0x01
 } BT122_UART_MODES;
 
+/*
+ * Called by bgapiDispatch() for a received packet. The packet is only valid until the handler returns.
+ * Handlers may send commands, but must not call bgapiDispatch() or bgapiFeed().
+ */
+typedef void (*BgapiHandler)(const struct dumo_cmd_packet *packet, void *context);
+
+typedef struct __BgapiFramerStats {
+	uint32_t packets;							/* Packets framed */
+	uint32_t resyncBytes;						/* Bytes dropped looking for the start of a packet */
+	uint32_t skippedPackets;					/* Packets longer than BGAPI_PACKET_MAXLEN, dropped */
+	uint32_t timeouts;							/* Packets dropped because their bytes stopped arriving */
+} BgapiFramerStats;
+
 /* Functions prototypes */
 void initializeBGLIB();
 void printMACAddress(bd_addr address);
 void echoReceived(uint8_t endpoint, unsigned int bytes);
 HAL_StatusTypeDef setBT122UARTMode(int mode);
+HAL_StatusTypeDef probeBT122();
+HAL_StatusTypeDef setBT122BaudRate(uint32_t baudRate);
+HAL_StatusTypeDef followBT122BaudRate(uint32_t baudRate);
+
+// Receive
+int bgapiFeed();
+int bgapiDispatch();
+int bgapiRegisterHandler(uint32_t id, BgapiHandler handler, void *context);
+void bgapiClearHandlers();
+void bgapiResetFramer();
+const BgapiFramerStats *bgapiGetFramerStats();
 
 // Test functions
 void testBGAPI_Test1();
@@ -15,32 +15,77 @@
 #include "stm32u5xx_hal.h"
 
 /* Defines */
+#define FLASH_BURST_SIZE 128			/* Bytes programmed by one burst operation (8 quadwords) */
 
 
 /* Constants */
 
 
+/* Types */
+typedef void (*FlashEraseCallback)(HAL_StatusTypeDef status);	/* Called when a background erase finishes */
+
+/* Structs */
+typedef struct __FlashImageView {
+	const char *data;				/* Memory-mapped start of the image */
+	uint32_t size;					/* Size of the image in bytes */
+	uint32_t bank;					/* Physical bank holding the start of the image (FLASH_BANK_1 or FLASH_BANK_2) */
+} FlashImageView;
+
+typedef struct __FlashStreamWriter {
+	uint32_t address;				/* Next flash address to program (quadword aligned) */
+	uint32_t endAddress;			/* End of the region being written (quadword aligned) */
+	uint32_t erasedAddress;			/* All pages of the region below this address have been erased */
+	uint32_t quadword[4];			/* Staging for a partial / unaligned quadword */
+	int quadwordLength;				/* Number of bytes in quadword */
+} FlashStreamWriter;
+
+
 /* Functions prototypes */
 
+// Setup
+void flashInit();
+
 // Error handling
 void printFlashError(uint32_t flashErrorCode);
 void clearAllFlashFlags();
 
 // Flash Options Bytes Queries
 int areFlashBanksSwapped();
+uint32_t flashGetBank(uint32_t flashAddress);
 
 // Read functions
 uint32_t readFlash(int baseAddress, int offset);
 HAL_StatusTypeDef readFlashPage(int page, char *buffer);
 void printFlashData(const uint32_t FLASH_START_ADDR, const uint32_t FLASH_END_ADDR);
 
+// Image views (zero-copy reads)
+HAL_StatusTypeDef flashImageOpen(FlashImageView *view, uint32_t flashAddress, uint32_t size);
+const char *flashImageData(const FlashImageView *view, uint32_t offset, uint32_t length);
+
 // Write functions
 HAL_StatusTypeDef writeFlash(uint32_t flashAddress, uint32_t dataAddress);
 HAL_StatusTypeDef writeFlashPage(int page, const char *buffer);
 HAL_StatusTypeDef writeFlashLarge(uint32_t flashAddress, const char * buffer, const int length);
+HAL_StatusTypeDef writeFlashRange(uint32_t flashAddress, const char *buffer, int length);
+
+// Programming statistics
+void flashResetProgramStats();
+uint32_t flashGetProgramTimePerPage();
+uint32_t flashGetSkippedBytes();
 
 // Erase functions
 HAL_StatusTypeDef eraseFlashPage(int page);
+HAL_StatusTypeDef eraseFlashRange(uint32_t address, uint32_t length);
+HAL_StatusTypeDef eraseFlashRange_IT(uint32_t address, uint32_t length, FlashEraseCallback callback);
+HAL_StatusTypeDef eraseFlashPages_IT(uint32_t address, uint32_t length, const uint8_t *pageMask, FlashEraseCallback callback);
+int isFlashEraseBusy();
+HAL_StatusTypeDef waitForFlashErase();
+
+// Streaming write functions
+HAL_StatusTypeDef flashStreamBegin(FlashStreamWriter *writer, uint32_t flashAddress, uint32_t size, int erased);
+HAL_StatusTypeDef flashStreamWrite(FlashStreamWriter *writer, const char *data, int length);
+HAL_StatusTypeDef flashStreamEraseAhead(FlashStreamWriter *writer);
+HAL_StatusTypeDef flashStreamFinish(FlashStreamWriter *writer);
 
 // Test functions
 void flashTest_1();
@@ -48,6 +93,7 @@ void flashTest_2();
 void flashTest_3();
 void flashTest_4();
 void flashTest_5();
+void flashTest_6();
 HAL_StatusTypeDef compareBuffers(char *buffer1, char *buffer2, int bufferLength);
 
 
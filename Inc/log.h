@@ -0,0 +1,246 @@
+/**
+  ******************************************************************************
+  * @file           log.h
+  * @brief          Header for log.c file.
+  *                   This file contains the definitions for the console log:
+  *                   printf() and the LOG_ macros write to a ring buffer that
+  *                   is sent over USART1 in the background (DMA or TX
+  *                   interrupts), so printing does not wait for the UART.
+  *                   With LOG_TOKENIZED the LOG_ macros send binary records
+  *                   instead, decoded by "Python Client/log_decode.py".
+  ******************************************************************************
+*/
+
+/* Define to prevent recursive inclusion -------------------------------------*/
+#ifndef __LOG_H
+#define __LOG_H
+
+/* Includes */
+#include <string.h>
+#include "stm32u5xx_hal.h"
+
+/* Defines */
+#define LOG_TX_DMA_ENABLED					/* Send the log by GPDMA (comment out to send it with TX interrupts) */
+#define LOG_BUFFER_LENGTH 8192				/* Bytes waiting to be sent, a message that does not fit is dropped (a power of 2, at most 65536) */
+#define LOG_LINE_LENGTH 160					/* Longest message logPrintf() formats, longer ones are cut */
+#define LOG_FLUSH_TIMEOUT_MS 2000			/* logFlush() gives up after this long (the UART stalled, or interrupts are disabled) */
+//#define LOG_TOKENIZED						/* LOG_ macros send binary records, formatted on the host (uncomment, or define on the command line). printf() output stays text. */
+#define LOG_RECORD_SYNC 0xF5				/* First byte of a record (never in the text output) */
+#define LOG_RECORD_ARGS_LENGTH 63			/* Most argument bytes in a record, the arguments that do not fit are left out */
+#define LOG_RECORD_STRING_LENGTH 32			/* %s and LOG_HEX() arguments are cut to this many bytes in a record */
+
+#define LOG_LEVEL_ERROR 0
+#define LOG_LEVEL_WARNING 1
+#define LOG_LEVEL_INFO 2					/* Level of printf() output, which is always logged */
+#define LOG_LEVEL_DEBUG 3
+
+#ifndef LOG_LEVEL_MAX
+#define LOG_LEVEL_MAX LOG_LEVEL_DEBUG		/* LOG_ macros above this level compile to nothing */
+#endif
+#define LOG_LEVEL_DEFAULT LOG_LEVEL_INFO	/* Messages above this level are dropped at run time, see logSetLevel() */
+
+#if (LOG_BUFFER_LENGTH & (LOG_BUFFER_LENGTH - 1)) != 0 || LOG_BUFFER_LENGTH > 65536
+#error "LOG_BUFFER_LENGTH must be a power of 2 of at most 65536"
+#endif
+
+
+/* Constants */
+
+
+/* Structs */
+
+/*
+ * Tokenized record, sent by the LOG_ macros with LOG_TOKENIZED:
+ *   LOG_RECORD_SYNC
+ *   level << 6 | number of argument bytes
+ *   token (2 bytes): offset of the format string in the log_strings section of the ELF file
+ *   arguments, as the format string reads them:
+ *     %s, %H (LOG_HEX()): a length byte and the bytes
+ *     %ll.., %f, %e, %g: 8 bytes
+ *     anything else (%d, %ld, %x, %c, %p...): 4 bytes
+ *   checksum: the sum of the bytes after the sync byte
+ * Multi-byte values are little endian.
+ */
+typedef struct __LogRecord {
+	uint8_t data[4 + LOG_RECORD_ARGS_LENGTH + 1];
+	int length;								/* Bytes in data, without the checksum */
+} LogRecord;
+
+/* Bytes of a LOG_HEX() argument */
+typedef struct __LogBytes {
+	const void *data;
+	int length;
+} LogBytes;
+
+typedef struct __LogStats {
+	uint32_t droppedMessages;				/* Messages dropped because the buffer was full */
+	uint32_t droppedBytes;					/* Bytes in those messages */
+	uint32_t maxUsed;						/* Most bytes waiting in the buffer at once */
+} LogStats;
+
+
+/* Functions prototypes */
+
+void logInit(UART_HandleTypeDef *huart);
+int logWrite(const char *data, int length);
+void logPrintf(int level, const char *format, ...) __attribute__((format(printf, 2, 3)));
+void logHexDump(int level, const char *label, const void *data, int length);
+void logSetLevel(int level);
+int logGetLevel();
+HAL_StatusTypeDef logFlush();
+const LogStats *logGetStats();
+void logTxCallback(UART_HandleTypeDef *huart);
+void testLogCost();
+
+#ifdef LOG_TOKENIZED
+
+/* Start of the section the format strings are kept in, defined by the linker */
+extern const char __start_log_strings[];
+
+static inline void logRecordBegin(LogRecord *record, int level, const char *format) {
+	uint16_t token = format - __start_log_strings;
+	record->data[0] = LOG_RECORD_SYNC;
+	record->data[1] = level << 6;
+	record->data[2] = token;
+	record->data[3] = token >> 8;
+	record->length = 4;
+}
+
+static inline void logRecordPut(LogRecord *record, const void *data, int length) {
+	if (record->length + length <= 4 + LOG_RECORD_ARGS_LENGTH) {
+		memcpy(&record->data[record->length], data, length);
+		record->length += length;
+	} else {
+		// left out, with the arguments after it: the host shows them as missing
+		record->length = 4 + LOG_RECORD_ARGS_LENGTH + 1;
+	}
+}
+
+static inline void logRecord32(LogRecord *record, uint32_t value) {
+	logRecordPut(record, &value, 4);
+}
+
+static inline void logRecord64(LogRecord *record, uint64_t value) {
+	logRecordPut(record, &value, 8);
+}
+
+static inline void logRecordDouble(LogRecord *record, double value) {
+	logRecordPut(record, &value, 8);
+}
+
+static inline void logRecordPointer(LogRecord *record, const void *value) {
+	logRecord32(record, (uint32_t) (uintptr_t) value);
+}
+
+static inline void logRecordBytes(LogRecord *record, LogBytes bytes) {
+	uint8_t length = bytes.length < LOG_RECORD_STRING_LENGTH ? bytes.length : LOG_RECORD_STRING_LENGTH;
+	logRecordPut(record, &length, 1);
+	logRecordPut(record, bytes.data, length);
+}
+
+static inline void logRecordString(LogRecord *record, const char *value) {
+	LogBytes bytes = { value != NULL ? value : "(null)", 0 };
+	bytes.length = strnlen(bytes.data, LOG_RECORD_STRING_LENGTH);
+	logRecordBytes(record, bytes);
+}
+
+static inline void logRecordEnd(LogRecord *record) {
+	if (record->length > 4 + LOG_RECORD_ARGS_LENGTH) {
+		record->length = 4 + LOG_RECORD_ARGS_LENGTH;
+	}
+	record->data[1] |= record->length - 4;
+	uint8_t checksum = 0;
+	for (int i = 1; i < record->length; i++) {
+		checksum += record->data[i];
+	}
+	record->data[record->length] = checksum;
+	logWrite((const char *) record->data, record->length + 1);
+}
+
+/* Never called: checks the arguments against the format string, like logPrintf() */
+static inline __attribute__((format(printf, 1, 2))) void logCheckFormat(const char *format, ...) {
+}
+
+/* Encoder of an argument, picked by its type (long is 32 bits, like on the MCU) */
+#define LOG_RECORD_ARG(record, arg) _Generic((arg), \
+		_Bool: logRecord32, char: logRecord32, signed char: logRecord32, unsigned char: logRecord32, \
+		short: logRecord32, unsigned short: logRecord32, int: logRecord32, unsigned int: logRecord32, \
+		long: logRecord32, unsigned long: logRecord32, long long: logRecord64, unsigned long long: logRecord64, \
+		float: logRecordDouble, double: logRecordDouble, \
+		char *: logRecordString, const char *: logRecordString, LogBytes: logRecordBytes, \
+		default: logRecordPointer)((record), (arg));
+
+#define LOG_RECORD_COUNT(...) LOG_RECORD_COUNT_(0, ##__VA_ARGS__, 8, 7, 6, 5, 4, 3, 2, 1, 0)
+#define LOG_RECORD_COUNT_(_0, _1, _2, _3, _4, _5, _6, _7, _8, count, ...) count
+#define LOG_RECORD_ARGS(record, ...) LOG_RECORD_ARGS_N(LOG_RECORD_COUNT(__VA_ARGS__), record, ##__VA_ARGS__)
+#define LOG_RECORD_ARGS_N(count, record, ...) LOG_RECORD_ARGS_N_(count, record, ##__VA_ARGS__)
+#define LOG_RECORD_ARGS_N_(count, record, ...) LOG_RECORD_ARGS_##count(record, ##__VA_ARGS__)
+#define LOG_RECORD_ARGS_0(record)
+#define LOG_RECORD_ARGS_1(record, a) LOG_RECORD_ARG(record, a)
+#define LOG_RECORD_ARGS_2(record, a, ...) LOG_RECORD_ARG(record, a) LOG_RECORD_ARGS_1(record, __VA_ARGS__)
+#define LOG_RECORD_ARGS_3(record, a, ...) LOG_RECORD_ARG(record, a) LOG_RECORD_ARGS_2(record, __VA_ARGS__)
+#define LOG_RECORD_ARGS_4(record, a, ...) LOG_RECORD_ARG(record, a) LOG_RECORD_ARGS_3(record, __VA_ARGS__)
+#define LOG_RECORD_ARGS_5(record, a, ...) LOG_RECORD_ARG(record, a) LOG_RECORD_ARGS_4(record, __VA_ARGS__)
+#define LOG_RECORD_ARGS_6(record, a, ...) LOG_RECORD_ARG(record, a) LOG_RECORD_ARGS_5(record, __VA_ARGS__)
+#define LOG_RECORD_ARGS_7(record, a, ...) LOG_RECORD_ARG(record, a) LOG_RECORD_ARGS_6(record, __VA_ARGS__)
+#define LOG_RECORD_ARGS_8(record, a, ...) LOG_RECORD_ARG(record, a) LOG_RECORD_ARGS_7(record, __VA_ARGS__)
+
+/* Send a record: the format string only goes to the ELF file, at most 8 arguments */
+#define LOG_RECORD(level, format, ...) do { \
+	if (0) { \
+		logCheckFormat(format, ##__VA_ARGS__); \
+	} \
+	LOG_RECORD_SEND(level, format, ##__VA_ARGS__); \
+} while (0)
+#define LOG_RECORD_SEND(level, format, ...) do { \
+	static const char logFormat[] __attribute__((section("log_strings"))) = format; \
+	if ((level) <= logGetLevel()) { \
+		LogRecord logRecord; \
+		logRecordBegin(&logRecord, (level), logFormat); \
+		LOG_RECORD_ARGS(&logRecord, ##__VA_ARGS__) \
+		logRecordEnd(&logRecord); \
+	} \
+} while (0)
+
+#define LOG_MESSAGE(level, ...) LOG_RECORD(level, __VA_ARGS__)
+#define LOG_HEX(level, label, data, length) do { \
+	if ((level) <= LOG_LEVEL_MAX) { \
+		LOG_RECORD_SEND(level, label ": %H\n", ((LogBytes) { (data), (length) })); \
+	} \
+} while (0)
+
+#else
+
+#define LOG_MESSAGE(level, ...) logPrintf(level, __VA_ARGS__)
+/* Log bytes in hex after a label (a string literal), e.g. "label: 0a1b2c\n" */
+#define LOG_HEX(level, label, data, length) do { \
+	if ((level) <= LOG_LEVEL_MAX) { \
+		logHexDump((level), label, (data), (length)); \
+	} \
+} while (0)
+
+#endif /* LOG_TOKENIZED */
+
+#if LOG_LEVEL_MAX >= LOG_LEVEL_ERROR
+#define LOG_ERROR(...) LOG_MESSAGE(LOG_LEVEL_ERROR, __VA_ARGS__)
+#else
+#define LOG_ERROR(...) ((void) 0)
+#endif
+#if LOG_LEVEL_MAX >= LOG_LEVEL_WARNING
+#define LOG_WARNING(...) LOG_MESSAGE(LOG_LEVEL_WARNING, __VA_ARGS__)
+#else
+#define LOG_WARNING(...) ((void) 0)
+#endif
+#if LOG_LEVEL_MAX >= LOG_LEVEL_INFO
+#define LOG_INFO(...) LOG_MESSAGE(LOG_LEVEL_INFO, __VA_ARGS__)
+#else
+#define LOG_INFO(...) ((void) 0)
+#endif
+#if LOG_LEVEL_MAX >= LOG_LEVEL_DEBUG
+#define LOG_DEBUG(...) LOG_MESSAGE(LOG_LEVEL_DEBUG, __VA_ARGS__)
+#else
+#define LOG_DEBUG(...) ((void) 0)
+#endif
+
+
+#endif /* __LOG_H */
@@ -0,0 +1,43 @@
+/**
+  ******************************************************************************
+  * @file           lz.h
+  * @brief          Header for lz.c file.
+  *                 This file contains the definitions for the streaming LZ
+  *                 (LZ4 block format) decompressor used for compressed OTA
+  *                 images.
+  ******************************************************************************
+*/
+
+/* Define to prevent recursive inclusion -------------------------------------*/
+#ifndef __LZ_H
+#define __LZ_H
+
+/* Includes */
+#include "stm32u5xx_hal.h"
+
+/* Defines */
+#define LZ_MIN_MATCH 4					/* Shortest match encoded by a sequence */
+
+
+/* Structs */
+typedef struct __LzDecoder {
+	char *output;					/* Decompressed data. Matches are copied from here, so it is also the window. */
+	int outputSize;					/* Size of the output buffer */
+	const char *dictionary;			/* Data that precedes the output in the window (e.g. in flash), or NULL */
+	int dictionaryLength;			/* Number of bytes in the dictionary */
+	int outputLength;				/* Number of bytes decompressed so far */
+	int state;						/* Part of the current sequence expected next */
+	uint8_t token;					/* Token of the current sequence */
+	int length;						/* Literal or match length of the current sequence */
+	uint16_t offset;				/* Match offset of the current sequence */
+} LzDecoder;
+
+
+/* Functions prototypes */
+void lzDecoderInit(LzDecoder *decoder, char *output, int outputSize);
+void lzDecoderSetDictionary(LzDecoder *decoder, const char *dictionary, int length);
+HAL_StatusTypeDef lzDecoderFeed(LzDecoder *decoder, const char *input, int length);
+HAL_StatusTypeDef lzDecoderFinish(LzDecoder *decoder);
+
+
+#endif /* __LZ_H */
@@ -13,10 +13,127 @@
 
 /* Includes */
 #include "stm32u5xx_hal.h"
+#include "uart.h"
 
 /* Defines */
 
+/*
+ * Firmware data transfer protocol. After the firmware size and hash have been received, the device
+ * replies with the offset to resume the download from (uint32_t, a multiple of the flash page size,
+ * 0 for a new download), followed by the page manifest: the SHA256 digest of every flash page in the
+ * download region (of the part of the page the image covers), as it is now. The client answers with
+ * a bitmap of the pages it will send (bit i % 8 of byte i / 8 for page i), those whose digest differs
+ * from the image. Only these pages are erased and programmed. The client follows the bitmap with the
+ * size of the image it would send delta chunks against (uint32_t, 0 for none, see OTA_CHUNK_DELTA).
+ * Then the device starts erasing the pages in the background and sends the session parameters
+ * (OtaSessionParams) without waiting for the erase, which finishes before the first chunk is written.
+ * The client sends the image as a sequence of
+ * chunks, each an OtaChunkHeader followed by the chunk data, keeping up to windowSize chunks in
+ * flight. The device answers every chunk with an OtaAck:
+ *  - OTA_ACK: cumulative acknowledgement, sequence is the first chunk not yet written to flash.
+ *  - OTA_NAK: chunk sequence failed its CRC32 check, only that chunk needs to be sent again.
+ *  - OTA_RESYNC: a chunk header was corrupted, the device dropped everything in flight (go-back-N).
+ *    sequence is the first chunk not yet written, like OTA_ACK. The client resends all of its
+ *    unacknowledged chunks right away.
+ * Chunks that arrive after a NAKed chunk are still written (at their offset), so a bad chunk costs
+ * a single retransmission. If a header is corrupted the device waits for the link to go quiet, drops
+ * everything in flight and answers OTA_RESYNC. The client resends its unacknowledged chunks after
+ * its timeout only if replies are lost. Only the chunks of the pages in the
+ * bitmap, from the resume offset on, are sent. Cumulative acknowledgements count the other chunks as
+ * written.
+ * A chunk flagged OTA_CHUNK_COMPRESSED carries its data compressed on its own in the LZ4 block format
+ * (see lz.c). The CRC32 is of the data as sent, and the data must decompress to the full chunk.
+ * A chunk also flagged OTA_CHUNK_DELTA is compressed against the image the device is running (delta
+ * update): the window starts with a dictionary that ends OTA_DELTA_DICTIONARY_AHEAD bytes past the
+ * chunk offset in the running image, so matches can copy from the running image around the same
+ * offset. Delta chunks are only sent if the device lists OTA_CHUNK_DELTA in OtaSessionParams.chunkFlags,
+ * and if OtaSessionParams.deltaSourceDigest, the SHA256 digest of the start of the running image (as
+ * much of it as the size the client sent), matches the image the client compresses against.
+ * A chunk flagged OTA_CHUNK_ERASED is all 0xFF (erased flash) and carries no data, nothing is
+ * programmed for it.
+ * If nothing arrives from the client for OTA_IDLE_TIMEOUT_MS after the confirmation bytes, the device
+ * gives up on the session and waits for the confirmation bytes again. The client reconnects and starts
+ * over, and the download resumes from the journal (see below).
+ */
+#define OTA_CHUNK_SIZE 2048				/* Data bytes per chunk (the last chunk may be shorter). Must be a multiple of 16. */
+#define OTA_CHUNK_HEADER_SIZE 16		/* sizeof(OtaChunkHeader) */
+#define OTA_WINDOW_SIZE ((UART_IT_BUFFER_LENGTH / (OTA_CHUNK_SIZE + OTA_CHUNK_HEADER_SIZE)) - 1)	/* Chunks that fit in the UART receive buffer, less one for a retransmission */
+#define OTA_MAX_IMAGE_SIZE ((FLASH_SIZE_DEFAULT / 2) - FLASH_PAGE_SIZE)	/* One flash bank, less the journal page */
+#define OTA_MAX_CHUNKS (OTA_MAX_IMAGE_SIZE / OTA_CHUNK_SIZE)
+#define OTA_MAX_PAGES (OTA_MAX_IMAGE_SIZE / FLASH_PAGE_SIZE)
+#define OTA_PAGE_MASK_SIZE ((OTA_MAX_PAGES + 7) / 8)	/* Bytes in the bitmap of pages to send */
+#define OTA_ACK 0xFF					/* OtaAck type: cumulative acknowledgement */
+#define OTA_NAK 0xFE					/* OtaAck type: chunk failed its CRC check */
+#define OTA_RESYNC 0xFD					/* OtaAck type: chunks in flight dropped after a corrupted header, resend from sequence */
+#define OTA_CHUNK_COMPRESSED 0x0001	/* OtaChunkHeader flag: the chunk data is LZ compressed */
+#define OTA_CHUNK_DELTA 0x0002			/* OtaChunkHeader flag: the chunk data is LZ compressed against the running image */
+#define OTA_CHUNK_ERASED 0x0004			/* OtaChunkHeader flag: the chunk is all 0xFF, no data is sent */
+#define OTA_DELTA_DICTIONARY_AHEAD 32768	/* The delta dictionary ends this far past the chunk offset in the running image */
+#define OTA_DELTA_DICTIONARY_SIZE 65535	/* Bytes of the running image in the delta dictionary (the maximum LZ offset) */
+#define OTA_RESYNC_QUIET_MS 50			/* Idle time that marks the end of the chunks in flight when resynchronizing */
+#define OTA_IDLE_TIMEOUT_MS 10000		/* Nothing received from the client for this long: the link is lost, back to the handshake */
+
+/*
+ * Download journal. Records which pages of an interrupted download were written, so the next attempt
+ * at the same image (same address, size and digest) resumes from the first missing page. The journal
+ * is the last page of flash, outside of both download regions. Flash is programmed a quadword at a
+ * time (ECC), so each completed page gets its own quadword slot after the header.
+ */
+#define OTA_JOURNAL_ADDRESS (FLASH_BASE + FLASH_SIZE_DEFAULT - FLASH_PAGE_SIZE)
+#define OTA_JOURNAL_MAGIC 0x4A41544F			/* "OTAJ" */
+#define OTA_JOURNAL_SLOTS_OFFSET 64				/* Offset of the first page slot in the journal page */
+
+/*
+ * BT122 DFU upload. Every dfu_flash_upload command is a round trip (the next one is sent when its
+ * response arrives), so the upload time is mostly set by the number of commands. The payload is a
+ * BGAPI uint8array, whose length is a single byte: a command carries at most 255 bytes, even though
+ * BGLIB_MSG_MAXLEN allows longer messages. The bootloader writes whole words, so the chunk size is
+ * kept a multiple of 4 (the image size is one too).
+ */
+#ifndef BT122_DFU_CHUNK_SIZE
+#define BT122_DFU_CHUNK_SIZE 252		/* Firmware bytes per dfu_flash_upload command (the last one may be shorter) */
+#endif
+#define BT122_DFU_TIMEOUT_MS 10000		/* The DFU upload fails if no BGAPI message arrives for this long (covers the reboots) */
+
+#if OTA_WINDOW_SIZE < 2
+#error "The UART receive buffer must hold at least three chunks"
+#endif
+
+#if BT122_DFU_CHUNK_SIZE > 255 || BT122_DFU_CHUNK_SIZE % 4 != 0 || BT122_DFU_CHUNK_SIZE <= 0
+#error "BT122_DFU_CHUNK_SIZE must be a multiple of 4 of at most 255 bytes (uint8array payload)"
+#endif
+
 /* Structs */
+typedef struct __attribute__((packed)) __OtaSessionParams {
+	uint16_t chunkSize;							/* Data bytes per chunk */
+	uint16_t windowSize;						/* Maximum number of unacknowledged chunks */
+	uint16_t chunkFlags;						/* Chunk flags (OTA_CHUNK_*) the device accepts */
+	uint16_t reserved;							/* Must be 0 */
+	char deltaSourceDigest[32];					/* SHA256 digest of the running image, as long as the delta source size the client sent. 0 if OTA_CHUNK_DELTA is not accepted. */
+} OtaSessionParams;
+
+typedef struct __attribute__((packed)) __OtaChunkHeader {
+	uint32_t offset;							/* Offset of the chunk data in the image (sequence * chunkSize) */
+	uint16_t sequence;							/* Chunk number */
+	uint16_t length;							/* Number of data bytes following the header */
+	uint32_t crc;								/* CRC32 (zlib) of the chunk data as sent */
+	uint16_t flags;								/* OTA_CHUNK_COMPRESSED, OTA_CHUNK_DELTA, OTA_CHUNK_ERASED */
+	uint16_t reserved;							/* Must be 0 */
+} OtaChunkHeader;
+
+typedef struct __attribute__((packed)) __OtaAck {
+	uint8_t type;								/* OTA_ACK, OTA_NAK or OTA_RESYNC */
+	uint16_t sequence;							/* OTA_ACK, OTA_RESYNC: first chunk not yet written. OTA_NAK: chunk to send again. */
+} OtaAck;
+
+typedef struct __OtaJournalHeader {
+	uint32_t magic;								/* OTA_JOURNAL_MAGIC */
+	uint32_t flashAddress;						/* Download address of the image */
+	uint32_t size;								/* Size of the image in bytes */
+	uint32_t reserved;							/* Pads the header to a multiple of a quadword */
+	char digest[32];							/* Expected SHA256 digest of the image */
+} OtaJournalHeader;
+
 typedef struct __FirmwareInfo {
 	HAL_StatusTypeDef status;					/* Status of firmware upload (HAL_OK or HAL_ERROR) */
 	uint32_t oldBootloaderVersion;				/* */
@@ -37,7 +154,10 @@ HAL_StatusTypeDef U5FirmwareUpgrade(UART_HandleTypeDef *huart, HASH_HandleTypeDe
 
 // Firmware download functions
 int download_firmware(UART_HandleTypeDef *huart, char *firmware, int size);
-HAL_StatusTypeDef downloadFirmwareToFlash(UART_HandleTypeDef *huart, uint32_t flashAddress, int size);
+HAL_StatusTypeDef downloadFirmwareToFlash(UART_HandleTypeDef *huart, uint32_t flashAddress, int size, int resumeOffset, const uint8_t *changedPages, int erased, uint32_t deltaSourceAddress, HASH_HandleTypeDef *hhash, char *digest);
+uint32_t negotiateResume(UART_HandleTypeDef *huart, uint32_t flashAddress, uint32_t size, const char *digest);
+HAL_StatusTypeDef exchangePageManifest(UART_HandleTypeDef *huart, HASH_HandleTypeDef *hhash, uint32_t flashAddress, uint32_t size, uint32_t resumeOffset, uint8_t *changedPages);
+void clearDownloadJournal();
 
 // Firmware upload functions
 FirmwareInfo uploadFirmwareToBT122(UART_HandleTypeDef *huart, const uint32_t flashAddress, const uint32_t firmwareSize);
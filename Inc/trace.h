@@ -0,0 +1,130 @@
+/**
+  ******************************************************************************
+  * @file           trace.h
+  * @brief          Header for trace.c file.
+  *                   This file contains the definitions for the cycle counted
+  *                   trace of the OTA hot paths: begin / end markers stamped
+  *                   with DWT->CYCCNT into a RAM ring buffer, dumped over the
+  *                   console UART and viewed with "Python Client/trace_view.py".
+  ******************************************************************************
+*/
+
+/* Define to prevent recursive inclusion -------------------------------------*/
+#ifndef __TRACE_H
+#define __TRACE_H
+
+/* Includes */
+#include "stm32u5xx_hal.h"
+
+/* Defines */
+//#define TRACE_ENABLED						/* Record trace events (uncomment, or define on the command line). When not defined, the TRACE_ macros compile to nothing and their arguments are not evaluated. */
+#define TRACE_BUFFER_LENGTH 4096			/* Events kept, the oldest are overwritten (a power of 2, 8 bytes each) */
+#define TRACE_DUMP_MAGIC "OTATRACE"			/* Start of a dump, the host finds it in the console output */
+#define TRACE_DUMP_VERSION 1
+
+#define TRACE_EVENT_BEGIN 0					/* TraceEvent type: start of a span */
+#define TRACE_EVENT_END 1					/* TraceEvent type: end of the last span of the same ID */
+#define TRACE_EVENT_MARK 2					/* TraceEvent type: an instant */
+
+#if (TRACE_BUFFER_LENGTH & (TRACE_BUFFER_LENGTH - 1)) != 0
+#error "TRACE_BUFFER_LENGTH must be a power of 2"
+#endif
+
+
+/* Constants */
+
+/*
+ * What is traced. The names in the dump come from traceNames (trace.c), keep them in step.
+ */
+typedef enum {
+	TRACE_FLASH_ERASE,					/* eraseFlashRange(), value: pages */
+	TRACE_FLASH_ERASE_IT,				/* Mark: a background erase finished a page, value: page (0xFFFF: end of a run of pages) */
+	TRACE_FLASH_PROGRAM,				/* writeFlashRange(), value: quadwords */
+	TRACE_OTA_WAIT,						/* downloadFirmwareToFlash() waiting for the next chunk (hashing meanwhile) */
+	TRACE_OTA_CHUNK,					/* downloadFirmwareToFlash() handling a received chunk, value: sequence */
+	TRACE_OTA_CRC,						/* computeChunkCrc(), value: bytes */
+	TRACE_OTA_HASH,						/* hashProgrammedFlash(), value: SHA-256 blocks (64 bytes) */
+	TRACE_LZ_DECODE,					/* writeCompressedChunkToFlash(), value: compressed bytes */
+	TRACE_UART_RX_IRQ,					/* UART receive DMA event, value: UART number (not traced in interrupt mode, one interrupt per byte would fill the buffer) */
+	TRACE_BGAPI_HANDLER,				/* bgapiDispatch() calling a handler, value: class << 8 | method */
+	TRACE_DFU_ROUND_TRIP,				/* dfu_flash_upload command to its response, value: command number */
+	TRACE_ID_COUNT
+} TraceId;
+
+
+/* Structs */
+typedef struct __TraceEvent {
+	uint32_t cycles;					/* DWT->CYCCNT when recorded */
+	uint8_t type;						/* TRACE_EVENT_BEGIN, TRACE_EVENT_END or TRACE_EVENT_MARK */
+	uint8_t id;							/* TraceId */
+	uint16_t value;						/* Detail of the event (see TraceId) */
+} TraceEvent;
+
+/*
+ * Start of a dump, followed by nameCount names (a length byte and the characters, no terminator), the
+ * eventCount most recent events (oldest first) and the CRC32 of everything after the magic.
+ */
+typedef struct __attribute__((packed)) __TraceDumpHeader {
+	char magic[8];						/* TRACE_DUMP_MAGIC */
+	uint16_t version;					/* TRACE_DUMP_VERSION */
+	uint16_t eventSize;					/* sizeof(TraceEvent) */
+	uint32_t coreClock;					/* CYCCNT frequency (SystemCoreClock) */
+	uint32_t recorded;					/* Events recorded since traceInit(), more than eventCount if the buffer wrapped */
+	uint16_t eventCount;				/* Events in the dump */
+	uint8_t nameCount;					/* TRACE_ID_COUNT */
+	uint8_t reserved;
+} TraceDumpHeader;
+
+
+/* Functions prototypes */
+
+#ifdef TRACE_ENABLED
+
+extern TraceEvent traceBuffer[TRACE_BUFFER_LENGTH];
+extern uint32_t traceRecorded;
+
+/**
+ * Record an event. Interrupts are masked for the few instructions it takes, so events recorded from
+ * interrupt handlers keep the buffer in time order.
+ */
+static inline void traceRecord(uint8_t type, uint8_t id, uint16_t value) {
+	uint32_t primask = __get_PRIMASK();
+	__disable_irq();
+	TraceEvent *event = &traceBuffer[traceRecorded++ & (TRACE_BUFFER_LENGTH - 1)];
+	event->cycles = DWT->CYCCNT;
+	event->type = type;
+	event->id = id;
+	event->value = value;
+	__set_PRIMASK(primask);
+}
+
+static inline void traceScopeEnd(const uint8_t *id) {
+	traceRecord(TRACE_EVENT_END, *id, 0);
+}
+
+void traceInit(UART_HandleTypeDef *huart);
+void traceDump();
+void testTraceOverhead();
+
+#define TRACE_BEGIN(id, value) traceRecord(TRACE_EVENT_BEGIN, (id), (value))
+#define TRACE_END(id) traceRecord(TRACE_EVENT_END, (id), 0)
+#define TRACE_MARK(id, value) traceRecord(TRACE_EVENT_MARK, (id), (value))
+/* Span from here to the end of the enclosing block, whichever way it is left */
+#define TRACE_SCOPE(id, value) \
+	__attribute__((cleanup(traceScopeEnd))) uint8_t traceScope_##id = (TRACE_BEGIN(id, value), (id))
+#define TRACE_INIT(huart) traceInit(huart)
+#define TRACE_DUMP() traceDump()
+
+#else
+
+#define TRACE_BEGIN(id, value) ((void) 0)
+#define TRACE_END(id) ((void) 0)
+#define TRACE_MARK(id, value) ((void) 0)
+#define TRACE_SCOPE(id, value)
+#define TRACE_INIT(huart) ((void) 0)
+#define TRACE_DUMP() ((void) 0)
+
+#endif /* TRACE_ENABLED */
+
+
+#endif /* __TRACE_H */
@@ -24,30 +24,104 @@
 /* Defines */
 //#define UART_DEBUG 0
 
-#define MAX_NUMBER_UART_HANDLES 10
-#define UART_IT_BUFFER_LENGTH 12288 // 12 KB
+#define MAX_NUMBER_UART_HANDLES 10 // UART numbers accepted by register_UART() are 1 to (MAX_NUMBER_UART_HANDLES - 1)
+#define UART_MAX_CHANNELS 4 // Number of UARTs that can be registered at the same time
+#define UART_INSTANCE_SLOTS 7 // USART1, USART2, USART3, UART4, UART5, USART6, LPUART1
+#define UART_IT_BUFFER_LENGTH 16384 // 16 KB, must be a power of two
+
+// Receive through GPDMA (circular) + idle line detection instead of 1 byte UART interrupts.
+// Comment out to fall back to HAL_UART_Receive_IT() 1 byte at a time.
+#define UART_RX_DMA_ENABLED
+#define UART_RX_DMA_BUFFER_LENGTH 1024 // DMA writes here, drained to the interrupt buffer on HT/TC/IDLE
+
+// Send header + payload (uart_tx_gather()) as one GPDMA linked-list transfer of 2 nodes on USART2.
+// Comment out to send them with blocking transmits.
+#define UART_TX_DMA_ENABLED
+#define UART_TX_HEADER_LENGTH 64 // Longest header uart_tx_gather() copies, longer ones are sent blocking
+#define UART_TX_TIMEOUT_MS 1000 // uart_tx_wait() gives up after this long
 
 /* Constants */
 
 
+/* Types */
+
+/*
+ * Single-producer / single-consumer receive ring (see uart.c).
+ */
+typedef struct __UART_RingBuffer {
+	volatile uint32_t head;					/* Total bytes written, only modified by the producer (ISR) */
+	volatile uint32_t tail;					/* Total bytes read, only modified by the consumer (main loop) */
+	char buffer[UART_IT_BUFFER_LENGTH];		/* Ring storage */
+} UART_RingBuffer;
+
+typedef struct __UART_Stats {
+	uint32_t interrupts;					/* Receive interrupts that delivered data */
+	uint32_t bytes;							/* Bytes received */
+	uint32_t dropped;						/* Bytes lost because the receive ring was full */
+} UART_Stats;
+
+/*
+ * Everything needed to receive on one UART. Created by register_UART().
+ */
+typedef struct __UART_Channel {
+	UART_HandleTypeDef *huart;				/* HAL handle */
+	int huartNum;							/* Number the UART was registered with */
+	UART_RingBuffer rx;						/* Received data not yet consumed */
+	UART_Stats stats;						/* Receive statistics */
+	uint8_t rxItByte;						/* Interrupt mode receive buffer */
+	uint16_t rxDmaPosition;					/* Position in rxDmaBuffer up to which data has been moved to rx */
+	uint8_t rxDmaStarted;					/* 1 once the DMA writes to rxDmaBuffer, up to its counter on an abort */
+	char rxDmaBuffer[UART_RX_DMA_BUFFER_LENGTH];	/* DMA mode receive buffer (circular) */
+	char txHeader[UART_TX_HEADER_LENGTH];	/* Header of the uart_tx_gather() transfer in progress */
+} UART_Channel;
+
+
 /* Function prototypes */
 
 // SETUP
 int register_UART(int huartNum, UART_HandleTypeDef *huart);
 int get_UART_num(UART_HandleTypeDef *huart);
+UART_Channel* uart_get_channel(UART_HandleTypeDef *huart);
+UART_Channel* uart_get_channel_by_num(int huartNum);
 void checkConnection(UART_HandleTypeDef *huart);
+HAL_StatusTypeDef uart_rx_start(UART_HandleTypeDef *huart);
+HAL_StatusTypeDef uart_set_baud_rate(UART_HandleTypeDef *huart, uint32_t baudRate);
 
 // BLOCKING
 int uart_rx(UART_HandleTypeDef *huart, int data_length, char *data);
 int uart_tx(UART_HandleTypeDef *huart, int data_length, const char *data);
+HAL_StatusTypeDef uart_tx_wait(UART_HandleTypeDef *huart);
+
+// CHANNEL (resolve the channel once with uart_get_channel(), then use these in loops)
+int uart_channel_rx(UART_Channel *channel, int data_length, char *data);
+int uart_channel_put(UART_Channel *channel, int data_length, const char *data);
+int uart_channel_get(UART_Channel *channel, int data_length, char *data);
+int uart_channel_get_span(UART_Channel *channel, const char **data);
+int uart_channel_peek_span(UART_Channel *channel, int offset, const char **data);
+void uart_channel_consume(UART_Channel *channel, int data_length);
+int uart_channel_get_length(UART_Channel *channel);
+void uart_channel_clear_buffer(UART_Channel *channel);
 
 // INTERRUPT
+HAL_StatusTypeDef uart_rx_it_start(UART_HandleTypeDef *huart);
+void uart_rx_it_callback(UART_HandleTypeDef *huart);
 int uart_rx_it(UART_HandleTypeDef *huart, int data_length, char *data);
 int uart_rx_it_put(int huartNum, int data_length, char *data);
 int uart_rx_it_get(int huartNum, int data_length, char *data);
+int uart_rx_it_get_span(int huartNum, const char **data);
+void uart_rx_it_consume(int huartNum, int data_length);
 int uart_rx_it_get_length(int huartNum);
 void uart_rx_it_clear_buffer(int huartNum);
 
+// DMA
+HAL_StatusTypeDef uart_rx_dma_start(UART_HandleTypeDef *huart);
+void uart_rx_dma_event(UART_HandleTypeDef *huart, uint16_t position);
+int uart_tx_gather(UART_HandleTypeDef *huart, int header_length, const char *header, int payload_length, const char *payload);
+
+// STATISTICS
+uint32_t uart_rx_it_get_interrupts_per_kb(int huartNum);
+void uart_rx_it_reset_stats(int huartNum);
+
 // TESTING
 void testUARTInterruptBuffer_Test1(int huartNum);
 void testUARTInterruptBuffer_Test2(UART_HandleTypeDef *huart);
@@ -55,5 +129,3 @@ void testUARTInterruptBuffer_Test2(UART_HandleTypeDef *huart);
 /*******************************************************************************/
 
 #endif /* UART_H */
-
-
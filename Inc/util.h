@@ -15,6 +15,9 @@
 #include "stm32u5xx_hal.h"
 
 /* Defines */
+#define HASH_DMA_ENABLED					/* Feed the HASH peripheral by GPDMA (comment out to hash by polling) */
+#define HASH_DMA_BLOCK_SIZE (32 * 1024)		/* Bytes per DMA transfer when hashing (GPDMA blocks are limited to 64 KB) */
+#define HASH_DMA_TIMEOUT_MS 1000			/* waitForHash() gives up after this long (far longer than hashing a 2 MB bank takes) */
 
 /* Constants */
 
@@ -30,6 +33,22 @@ HAL_StatusTypeDef fixEndianness(uint8_t *buffer, int length);
 
 // Hashing
 HAL_StatusTypeDef computeHashFromFlash(HASH_HandleTypeDef *hhash, uint32_t flashAddress, int size, char *digest);
+HAL_StatusTypeDef computeHashFromFlash_DMA(HASH_HandleTypeDef *hhash, uint32_t flashAddress, int size);
+HAL_StatusTypeDef accumulateHashFromFlash_DMA(HASH_HandleTypeDef *hhash, uint32_t flashAddress, int size);
+int isHashBusy();
+HAL_StatusTypeDef waitForHash(HASH_HandleTypeDef *hhash, char *digest);
+
+// CRC32 (CRC peripheral, same result as zlib.crc32)
+void crc32Begin();
+void crc32Update(const char *data, int length);
+uint32_t crc32End();
+
+// Cycle counting
+void enableCycleCounter();
+
+// Testing
+void testEndianness(HASH_HandleTypeDef *hhash);
+void testHashBenchmark(HASH_HandleTypeDef *hhash);
 
 
 #endif /* __UTIL_H */
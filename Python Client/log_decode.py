@@ -0,0 +1,182 @@
+"""
+Decode the console output of the U5 firmware built with LOG_TOKENIZED (see Inc/log.h): the LOG_ macros send
+binary records (a format string token and the raw arguments) instead of text, and the format strings are
+only in the ELF file of the firmware, in its log_strings section. This turns the records back into text;
+anything else in the output (printf() text) is passed through.
+
+The ELF file must be the one the firmware running on the board was built from (Debug/U5A5_OTA_DFU.elf from
+STM32CubeIDE, or Sim/build/ota_sim for the simulation).
+
+    python log_decode.py U5A5_OTA_DFU.elf console_capture.bin
+    python log_decode.py U5A5_OTA_DFU.elf --port COM3
+"""
+
+import argparse
+import re
+import struct
+import sys
+
+SECTION = b"log_strings"
+SYNC = 0xF5
+HEADER_SIZE = 4                         # sync, level and argument length, token
+LEVELS = "EWID"                         # LOG_LEVEL_ERROR, _WARNING, _INFO, _DEBUG
+
+CONVERSION = re.compile(rb"%([-+ #0]*)(\*|\d+)?(?:\.(\*|\d+))?(hh|h|ll|l|z|j|t|L)?([diouxXcsfFeEgGpH%])")
+
+
+def read_log_strings(path):
+    """
+    The contents of the log_strings section of an ELF file (32 or 64 bits, little endian).
+    """
+    with open(path, "rb") as file:
+        elf = file.read()
+    if elf[:4] != b"\x7fELF" or elf[5] != 1:
+        raise ValueError(path + " is not a little endian ELF file")
+    if elf[4] == 1:
+        shoff, = struct.unpack_from("<I", elf, 0x20)
+        shentsize, shnum, shstrndx = struct.unpack_from("<HHH", elf, 0x2E)
+        section = struct.Struct("<IIIIII")
+    else:
+        shoff, = struct.unpack_from("<Q", elf, 0x28)
+        shentsize, shnum, shstrndx = struct.unpack_from("<HHH", elf, 0x3A)
+        section = struct.Struct("<IIQQQQ")
+    sections = [section.unpack_from(elf, shoff + i * shentsize) for i in range(shnum)]
+    names_offset = sections[shstrndx][4]
+    for name, _, _, _, offset, size in sections:
+        end = elf.index(b"\0", names_offset + name)
+        if elf[names_offset + name:end] == SECTION:
+            return elf[offset:offset + size]
+    raise ValueError(path + " has no log_strings section (built without LOG_TOKENIZED?)")
+
+
+def format_record(format_string, args):
+    """
+    printf() the raw arguments of a record with its format string. Arguments missing from the record (cut
+    on the device) are shown as <?>.
+    """
+    offset = 0
+
+    def take(size):
+        nonlocal offset
+        if offset + size > len(args):
+            raise IndexError
+        value = args[offset:offset + size]
+        offset += size
+        return value
+
+    def take_int(size, signed):
+        return int.from_bytes(take(size), "little", signed=signed)
+
+    def convert(match):
+        flags, width, precision, length, conversion = match.groups()
+        conversion = conversion.decode()
+        if conversion == "%":
+            return b"%"
+        try:
+            if width == b"*":
+                width = str(take_int(4, True)).encode()
+            if precision == b"*":
+                precision = str(take_int(4, True)).encode()
+            if conversion in "sH":
+                data = take(take_int(1, False))
+                value = data.hex() if conversion == "H" else data.decode("latin-1")
+                conversion = "s"
+            elif conversion in "fFeEgG":
+                value, = struct.unpack("<d", take(8))
+            elif conversion == "p":
+                value = "0x%08x" % take_int(4, False)
+                conversion = "s"
+            elif conversion == "c":
+                value = chr(take_int(4, False) & 0xFF)
+            else:
+                size = 8 if length == b"ll" else 4
+                value = take_int(size, conversion in "di")
+        except IndexError:
+            return b"<?>"
+        spec = "%" + flags.decode() + (width or b"").decode() + ("." + precision.decode() if precision else "") + conversion
+        return (spec % value).encode("latin-1", "replace")
+
+    return CONVERSION.sub(convert, format_string)
+
+
+def decode(data, strings, show_levels, final):
+    """
+    Decode a chunk of console output. Returns (text, bytes consumed): a record cut at the end of data is
+    left for the next chunk unless final.
+    """
+    text = bytearray()
+    i = 0
+    while i < len(data):
+        sync = data.find(bytes([SYNC]), i)
+        if sync < 0:
+            text += data[i:]
+            i = len(data)
+            break
+        text += data[i:sync]
+        i = sync
+        if i + 2 > len(data) or i + HEADER_SIZE + (data[i + 1] & 0x3F) + 1 > len(data):
+            if not final:
+                break
+            text += data[i:i + 1]
+            i += 1
+            continue
+        length = data[i + 1] & 0x3F
+        end = i + HEADER_SIZE + length
+        token = data[i + 2] | data[i + 3] << 8
+        valid = sum(data[i + 1:end]) & 0xFF == data[end] and token < len(strings) and (token == 0 or strings[token - 1] == 0)
+        if not valid:
+            # not a record, a byte of something else
+            text += data[i:i + 1]
+            i += 1
+            continue
+        format_string = strings[token:strings.index(b"\0", token)]
+        if show_levels:
+            text += (LEVELS[data[i + 1] >> 6] + ": ").encode()
+        text += format_record(format_string, data[i + HEADER_SIZE:end])
+        i = end + 1
+    return bytes(text), i
+
+
+def write(text):
+    sys.stdout.write(text.decode("latin-1"))
+    sys.stdout.flush()
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Decode the tokenized log of the OTA firmware.")
+    parser.add_argument("elf", help="ELF file of the firmware (its log_strings section holds the format strings)")
+    parser.add_argument("capture", nargs="?", help="console capture to decode (default: standard input)")
+    parser.add_argument("--port", help="decode the console from this serial port until interrupted")
+    parser.add_argument("--baud", type=int, default=115200, help="console baud rate")
+    parser.add_argument("--levels", action="store_true", help="start decoded messages with their level (E, W, I, D)")
+    args = parser.parse_args()
+
+    strings = read_log_strings(args.elf)
+    if args.port:
+        import serial
+        console = serial.Serial(port=args.port, baudrate=args.baud, timeout=0.1)
+        pending = b""
+        try:
+            while True:
+                pending += console.read(4096)
+                text, consumed = decode(pending, strings, args.levels, False)
+                write(text)
+                pending = pending[consumed:]
+        except KeyboardInterrupt:
+            console.close()
+        return
+
+    if args.capture:
+        with open(args.capture, "rb") as file:
+            data = file.read()
+    else:
+        data = sys.stdin.buffer.read()
+    write(decode(data, strings, args.levels, True)[0])
+
+
+if __name__ == "__main__":
+    try:
+        main()
+    except ValueError as error:
+        print("Error: " + str(error))
+        sys.exit(1)
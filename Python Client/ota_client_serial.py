@@ -1,10 +1,18 @@
 #!/usr/bin/env python3
 
+import os
 import sys
+import struct
+import zlib
+from bisect import bisect_left
 from hashlib import md5, sha256
 from ota_functions_serial import RFCOMM_Connection, load_firmware_from_file, get_size_of_firmware, print_long_hex, print_bytes
+from ota_compression import compress_chunks, OTA_CHUNK_DELTA
 
-serial_com_port = "COM10"
+# OTA_SERIAL_PORT overrides the port, e.g. the link of the host simulation (see Sim/)
+serial_com_port = os.environ.get("OTA_SERIAL_PORT", "COM10")
+# send chunks LZ compressed (the device decompresses them). All 0xFF chunks are never sent.
+compress_firmware = True
 
 # Create rfcomm connection
 rf = RFCOMM_Connection("")
@@ -13,6 +21,11 @@ if rf.add_service(serial_com_port, verbose=True) == False:
     exit(1)
 
 
+# wait for user input to confirm transmission of firmware image (optional). Asked before the handshake,
+# the device gives up on a session that stays idle for OTA_IDLE_TIMEOUT_MS (see ota.h).
+input("press enter to send firmware")
+
+
 # Connection confirmation
 confirmation = bytearray([1,2])
 rf.send( bytes(confirmation))
@@ -30,6 +43,11 @@ else:
     #filepath = "./firmware_files/BT122_UART_STREAMING_2.0.bin"
     filepath = "./firmware_files/U5A5_OTA_DFU_2.0.bin"
 
+# optional second argument: the firmware image the U5 is currently running, to send a delta update against
+old_filepath = None
+if len(sys.argv) > 2:
+    old_filepath = sys.argv[2]
+
 firmware_data = load_firmware_from_file(filepath)
 firmware_size = get_size_of_firmware(filepath)
 print("firmware size: " + str(firmware_size))
@@ -50,43 +68,137 @@ print("Firmware SHA256 digest: " + str(firmware_digest))
 # send expected sha256 hash of firmware data
 rf.send( firmware_hash.digest())
 
-# wait for user input to confirm transmission of firmware image (optional)
-input("press enter to send firmware")
+# the device replies with the offset to resume from, if an earlier download of this image was interrupted
+resume_offset = struct.unpack("<I", rf.recv_exact(4))[0]
+if resume_offset > 0:
+    print("Resuming firmware download at offset " + str(resume_offset))
+
+# then with the digest of every flash page in the download region (the page manifest). Only pages
+# that differ from the new image (from the resume offset on) are sent, the device skips the others.
+FLASH_PAGE_SIZE = 8192
+num_pages = (firmware_size + FLASH_PAGE_SIZE - 1) // FLASH_PAGE_SIZE
+changed_pages = []
+for page in range(num_pages):
+    page_digest = rf.recv_exact(32)
+    if page_digest is None:
+        print("Error: connection lost")
+        exit(1)
+    page_data = firmware_data[page * FLASH_PAGE_SIZE:(page + 1) * FLASH_PAGE_SIZE]
+    if page * FLASH_PAGE_SIZE >= resume_offset and sha256(page_data).digest() != page_digest:
+        changed_pages.append(page)
+page_mask = bytearray((num_pages + 7) // 8)
+for page in changed_pages:
+    page_mask[page // 8] |= 1 << (page % 8)
+rf.send(bytes(page_mask))
+print(str(len(changed_pages)) + " of " + str(num_pages) + " pages differ from the firmware on the device")
+
+# then with the size of the image to send a delta update against (0 for none). The device replies
+# with the digest of that much of its running image in the session parameters.
+old_firmware_data = None
+old_firmware_size = 0
+if old_filepath is not None:
+    old_firmware_data = load_firmware_from_file(old_filepath)
+    old_firmware_size = len(old_firmware_data)
+rf.send(old_firmware_size.to_bytes(4, "little"))
 
 # send entire firmware file
 
-# send 8192 bytes at a time. 
-# If you change this value, also make sure to change CHUNK_SIZE variable in the ota.c downloadFirmwareToFlash() function
-chunkSize = 8192 
+# the device replies with the session parameters: chunk size, window size, accepted chunk flags and
+# the digest of its running image (see ota.h)
+session_params = rf.recv_exact(40)
+chunkSize, windowSize, chunkFlags, _, delta_source_digest = struct.unpack("<HHHH32s", session_params)
+print("chunk size: " + str(chunkSize) + ", window size: " + str(windowSize) + ", chunk flags: " + hex(chunkFlags))
+
+# Sliding window transfer. Each chunk is sent with a header (offset, sequence number, length,
+# CRC32 of the data, flags), compressed if that makes it smaller, and without data if it is all
+# 0xFF. Up to windowSize chunks are sent without waiting, the device acknowledges each chunk once
+# it is written to flash with a cumulative ack (the sequence number of the first chunk it is
+# missing), or NAKs a chunk that failed its CRC check so only that chunk is resent. After a
+# corrupted header the device drops everything in flight and replies OTA_RESYNC, all unacknowledged
+# chunks are resent. If no reply arrives before the timeout, all unacknowledged chunks are resent. Only the chunks of
+# the pages that differ are sent.
+OTA_ACK = 0xFF
+OTA_NAK = 0xFE
+OTA_RESYNC = 0xFD
+REPLY_TIMEOUT = 2.0
+MAX_TIMEOUTS = 5
+numChunks = (firmware_size + chunkSize - 1) // chunkSize
+
+# delta chunks only decompress to the image if the device runs the image they are compressed against
+if old_firmware_data is not None:
+    if not chunkFlags & OTA_CHUNK_DELTA:
+        print("device does not accept delta updates, sending the full image")
+        old_firmware_data = None
+    elif sha256(old_firmware_data).digest() != delta_source_digest:
+        print("device is not running " + old_filepath + ", sending the full image")
+        old_firmware_data = None
+    else:
+        print("sending delta update against " + old_filepath)
+chunks = compress_chunks(firmware_data, chunkSize, old_firmware_data, compress_firmware)
+encoded_size = max(1, sum(len(chunk) for chunk, flags in chunks))
+print("encoded firmware size: " + str(encoded_size) + " (ratio " + "{:.2f}".format(firmware_size / encoded_size) + ")")
+
+def send_chunk(sequence):
+    chunk, flags = chunks[sequence]
+    rf.send(struct.pack("<IHHIHH", sequence * chunkSize, sequence, len(chunk), zlib.crc32(chunk), flags, 0) + chunk)
+    return len(chunk)
+
+rf.set_timeout(REPLY_TIMEOUT)
+# the chunks to send, in order
+chunks_to_send = [sequence for sequence in range(numChunks) if (sequence * chunkSize) // FLASH_PAGE_SIZE in changed_pages]
+# index in chunks_to_send of the next chunk to send
+next_chunk = 0
+# all chunks before this index in chunks_to_send have been acknowledged
+acked_chunks = 0
+# consecutive replies that timed out
+timeouts = 0
 # keep track of how many bytes have been sent
-bytes_written = 0 
-# Number of chunks that will be sent
-numChunks = int(firmware_size // chunkSize)
-# firmware_size = (chunkSize * numChunks) + leftOverBytes
-# ex: IF (firmware_size = 80) & (chunkSize = 32) THEN (numChunks = 2) & (leftOverBytes = 16)
-leftOverBytes = int(firmware_size - (numChunks * chunkSize)) 
-for i in range(0, numChunks):
-    firmware_chunk = firmware_data[i*chunkSize:(i+1)*chunkSize]
-    #print_long_hex(firmware_chunk, print_len=64)
-    rf.send( firmware_chunk)
-    bytes_written += chunkSize
-    print("wrote chunk, waiting for confirmation before next chunk")
-    reply = rf.recv( 1)
-    print("received reply: " + str(reply) + ", sending next bytes.")
-
-
-# send left over bytes (firmware data may not be equally divisible by chunkSize)
-if leftOverBytes > 0:
-    firmware_chunk = firmware_data[numChunks*chunkSize:numChunks*chunkSize+leftOverBytes]
-    rf.send( firmware_chunk)
-    bytes_written += leftOverBytes
-    print("wrote left over bytes, waiting for confirmation before finishing")
-    reply = rf.recv( 1)
-    print("received reply: " + str(reply) + ", finished sending firmware data")
+bytes_written = 0
+retransmitted_chunks = 0
+while acked_chunks < len(chunks_to_send):
+    # fill the window
+    while next_chunk < len(chunks_to_send) and next_chunk - acked_chunks < windowSize:
+        bytes_written += send_chunk(chunks_to_send[next_chunk])
+        next_chunk += 1
+
+    # wait for an acknowledgement
+    reply = rf.recv_exact(3)
+    if reply is None:
+        timeouts += 1
+        if timeouts >= MAX_TIMEOUTS:
+            print("Error: connection lost")
+            exit(1)
+        print("Timed out waiting for acknowledgement, resending " + str(next_chunk - acked_chunks) + " chunks")
+        for sequence in chunks_to_send[acked_chunks:next_chunk]:
+            send_chunk(sequence)
+            retransmitted_chunks += 1
+        continue
+    timeouts = 0
+    reply_type, reply_sequence = struct.unpack("<BH", reply)
+    if reply_type == OTA_ACK:
+        # the device acknowledges the first chunk it is missing, count the chunks to send before it
+        acked_chunks = max(acked_chunks, bisect_left(chunks_to_send, reply_sequence))
+        print("chunks acknowledged: " + str(acked_chunks) + " / " + str(len(chunks_to_send)))
+    elif reply_type == OTA_NAK:
+        if reply_sequence in chunks_to_send[acked_chunks:next_chunk]:
+            print("chunk " + str(reply_sequence) + " failed CRC check, resending")
+            send_chunk(reply_sequence)
+            retransmitted_chunks += 1
+    elif reply_type == OTA_RESYNC:
+        # a chunk header was corrupted and the device dropped everything in flight: go back to the
+        # first chunk it is missing and resend the window now, instead of after the timeout
+        acked_chunks = max(acked_chunks, bisect_left(chunks_to_send, reply_sequence))
+        print("device resynchronized, resending " + str(next_chunk - acked_chunks) + " chunks")
+        for sequence in chunks_to_send[acked_chunks:next_chunk]:
+            send_chunk(sequence)
+            retransmitted_chunks += 1
+    else:
+        print("Error: unexpected reply: " + str(reply))
+        exit(1)
 
 
 # firmware data transmission complete
-print("Firmware upload complete. Sent " + str(bytes_written) + " bytes of firmware")
+print("Firmware upload complete. Sent " + str(bytes_written) + " bytes for " + str(firmware_size) + " bytes of firmware, " + str(retransmitted_chunks) + " chunks retransmitted")
 
 
 
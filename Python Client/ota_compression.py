@@ -0,0 +1,196 @@
+"""
+LZ compression for OTA firmware chunks.
+
+Chunks are compressed one at a time in the LZ4 block format, which the device
+decompresses while receiving (see lz.c). Only the chunk itself is used as the
+window, so every chunk can be decompressed (and resent) on its own. For delta
+updates, the window also starts with the part of the image running on the
+device around the chunk offset, so unchanged code is copied from it.
+"""
+
+# chunk flags (see ota.h)
+OTA_CHUNK_COMPRESSED = 0x0001
+OTA_CHUNK_DELTA = 0x0002
+OTA_CHUNK_ERASED = 0x0004
+# the delta dictionary ends this far past the chunk offset in the running image
+DELTA_DICTIONARY_AHEAD = 32768
+DELTA_DICTIONARY_SIZE = 65535
+
+MIN_MATCH = 4
+# the last match must start at least this many bytes before the end of the block
+MF_LIMIT = 12
+# the block must end with at least this many literals
+LAST_LITERALS = 5
+MAX_OFFSET = 65535
+
+
+def _write_length(out, length):
+    while length >= 255:
+        out.append(255)
+        length -= 255
+    out.append(length)
+
+
+def _write_sequence(out, literals, offset=0, match_length=0):
+    literal_length = len(literals)
+    token = min(literal_length, 15) << 4
+    if offset:
+        token |= min(match_length - MIN_MATCH, 15)
+    out.append(token)
+    if literal_length >= 15:
+        _write_length(out, literal_length - 15)
+    out += literals
+    if offset:
+        out += offset.to_bytes(2, "little")
+        if match_length - MIN_MATCH >= 15:
+            _write_length(out, match_length - MIN_MATCH - 15)
+
+
+def lz_compress_block(data, dictionary=b"", dictionary_length=None):
+    """
+    Compress data as a single LZ4 block. Greedy matching, against the offset
+    of the previous match and the last position each 4 byte string was seen at.
+
+    dictionary is data that precedes the block in the window, matches can
+    copy from it. dictionary_length is the distance from the start of the
+    dictionary to the start of the block, if it is longer than dictionary the
+    bytes in between are unknown and never matched.
+    """
+    if dictionary_length is None:
+        dictionary_length = len(dictionary)
+
+    def window_byte(position):
+        if position >= dictionary_length:
+            return data[position - dictionary_length]
+        if position < len(dictionary):
+            return dictionary[position]
+        return None
+
+    out = bytearray()
+    last_seen = dict()
+    for position in range(len(dictionary) - MIN_MATCH + 1):
+        last_seen[dictionary[position:position + MIN_MATCH]] = position
+    anchor = 0
+    i = 0
+    last_offset = 0
+    match_limit = len(data) - MF_LIMIT
+    while i < match_limit:
+        position = dictionary_length + i
+        key = data[i:i + MIN_MATCH]
+        candidates = [position - last_offset if last_offset else None, last_seen.get(key)]
+        last_seen[key] = position
+        # find the longest match
+        max_length = len(data) - LAST_LITERALS - i
+        match_length = 0
+        match_position = None
+        for candidate in candidates:
+            if candidate is None or candidate < 0 or position - candidate > MAX_OFFSET:
+                continue
+            length = 0
+            while length < max_length and window_byte(candidate + length) == data[i + length]:
+                length += 1
+            if length > match_length:
+                match_length = length
+                match_position = candidate
+        if match_length < MIN_MATCH:
+            i += 1
+            continue
+        last_offset = position - match_position
+        _write_sequence(out, data[anchor:i], last_offset, match_length)
+        i += match_length
+        anchor = i
+    _write_sequence(out, data[anchor:])
+    return bytes(out)
+
+
+def lz_decompress_block(data, max_length, dictionary=b""):
+    """
+    Decompress a single LZ4 block, like the device does (see lz.c): matches
+    may copy from dictionary, which precedes the block in the window. Raises
+    ValueError if the block is truncated, a match offset is out of the window
+    or it decompresses to more than max_length bytes. Used to check the
+    compressor (see Sim/lz_test.py).
+    """
+    out = bytearray(dictionary)
+    max_length += len(dictionary)
+    i = 0
+
+    def read_length(length):
+        nonlocal i
+        while True:
+            if i >= len(data):
+                raise ValueError("block truncated in a length")
+            length += data[i]
+            i += 1
+            if data[i - 1] != 255:
+                return length
+
+    while i < len(data):
+        token = data[i]
+        i += 1
+        literal_length = token >> 4
+        if literal_length == 15:
+            literal_length = read_length(literal_length)
+        if i + literal_length > len(data):
+            raise ValueError("block truncated in the literals")
+        if len(out) + literal_length > max_length:
+            raise ValueError("block decompresses to more than " + str(max_length - len(dictionary)) + " bytes")
+        out += data[i:i + literal_length]
+        i += literal_length
+        if i >= len(data):
+            break
+        if i + 2 > len(data):
+            raise ValueError("block truncated in a match offset")
+        offset = data[i] | (data[i + 1] << 8)
+        i += 2
+        match_length = (token & 0xF) + MIN_MATCH
+        if token & 0xF == 15:
+            match_length = read_length(match_length)
+        if offset == 0 or offset > len(out):
+            raise ValueError("match offset " + str(offset) + " out of the window")
+        if len(out) + match_length > max_length:
+            raise ValueError("block decompresses to more than " + str(max_length - len(dictionary)) + " bytes")
+        for _ in range(match_length):
+            out.append(out[-offset])
+    return bytes(out[len(dictionary):])
+
+
+def delta_dictionary(old_firmware_data, offset):
+    """
+    Returns the dictionary for a delta chunk at offset (see ota.h): the running
+    image up to DELTA_DICTIONARY_AHEAD bytes past offset. The second value is
+    the full length of the dictionary, the running image may end before it.
+    """
+    end = offset + DELTA_DICTIONARY_AHEAD
+    start = max(0, end - DELTA_DICTIONARY_SIZE)
+    return old_firmware_data[start:end], end - start
+
+
+def compress_chunks(firmware_data, chunk_size, old_firmware_data=None, compress=True):
+    """
+    Returns a list with one (data, flags) tuple per chunk of the firmware.
+    Chunks that are all 0xFF (erased flash) are sent without data. Other
+    chunks are sent in the smallest form: as is, LZ compressed (if compress),
+    or (if old_firmware_data, the image running on the device, is given) LZ
+    compressed against the running image.
+    """
+    chunks = []
+    for offset in range(0, len(firmware_data), chunk_size):
+        chunk = firmware_data[offset:offset + chunk_size]
+        if chunk == b"\xff" * len(chunk):
+            chunks.append((b"", OTA_CHUNK_ERASED))
+            continue
+        best = (chunk, 0)
+        if not compress:
+            chunks.append(best)
+            continue
+        compressed = lz_compress_block(chunk)
+        if len(compressed) < len(best[0]):
+            best = (compressed, OTA_CHUNK_COMPRESSED)
+        if old_firmware_data is not None:
+            dictionary, dictionary_length = delta_dictionary(old_firmware_data, offset)
+            compressed = lz_compress_block(chunk, dictionary, dictionary_length)
+            if len(compressed) < len(best[0]):
+                best = (compressed, OTA_CHUNK_COMPRESSED | OTA_CHUNK_DELTA)
+        chunks.append(best)
+    return chunks
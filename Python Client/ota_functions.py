@@ -55,6 +55,12 @@ class RFCOMM_Connection:
     def send(self, service_uuid, data):
         self.services[service_uuid].send(data)
         
+    def set_timeout(self, service_uuid, timeout):
+        """
+        Set the receive timeout in seconds, recv returns None when it expires.
+        """
+        self.services[service_uuid].settimeout(timeout)
+        
     def recv(self, service_uuid, recv_len):
         try:
             data = self.services[service_uuid].recv(recv_len)
@@ -64,6 +70,18 @@ class RFCOMM_Connection:
             print("OSError")
             return None
         
+    def recv_exact(self, service_uuid, recv_len):
+        """
+        Receive exactly recv_len bytes. Returns None if the connection fails or times out.
+        """
+        data = b''
+        while len(data) < recv_len:
+            part = self.recv(service_uuid, recv_len - len(data))
+            if part is None or len(part) == 0:
+                return None
+            data += part
+        return data
+        
 
        
 
@@ -32,6 +32,12 @@ class RFCOMM_Connection:
         #self.services[service_uuid].send(data)
         self.ser.write(data)
         
+    def set_timeout(self, timeout):
+        """
+        Set the receive timeout in seconds, recv returns fewer bytes when it expires.
+        """
+        self.ser.timeout = timeout
+        
     def recv(self, recv_len):
         try:
             #data = self.services[service_uuid].recv(recv_len)
@@ -42,6 +48,18 @@ class RFCOMM_Connection:
             print("OSError")
             return None
         
+    def recv_exact(self, recv_len):
+        """
+        Receive exactly recv_len bytes. Returns None if the connection fails or times out.
+        """
+        data = b''
+        while len(data) < recv_len:
+            part = self.recv(recv_len - len(data))
+            if part is None or len(part) == 0:
+                return None
+            data += part
+        return data
+        
 
        
 
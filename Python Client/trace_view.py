@@ -0,0 +1,207 @@
+"""
+View a trace of the OTA hot paths, dumped by the U5 over its console (USART1) when the firmware is built
+with TRACE_ENABLED (see Inc/trace.h).
+
+The dump is found in a capture of the console output (anything around it is ignored), or captured from
+the serial port with --port. Prints how long each traced span took, and can write:
+  --chrome FILE  a timeline in the Chrome trace event format (open it in https://ui.perfetto.dev or
+                 chrome://tracing), one row per span name
+  --folded FILE  the time of each stack of nested spans, in cycles, for a flame graph (flamegraph.pl,
+                 https://www.speedscope.app)
+
+    python trace_view.py console_capture.bin --chrome trace.json --folded trace.folded
+    python trace_view.py console_capture.bin --port COM3 --chrome trace.json
+"""
+
+import argparse
+import json
+import struct
+import sys
+import zlib
+
+MAGIC = b"OTATRACE"
+VERSION = 1
+HEADER = struct.Struct("<HHIIHBB")		# TraceDumpHeader after the magic
+EVENT = struct.Struct("<IBBH")			# TraceEvent
+CRC = struct.Struct("<I")
+
+EVENT_BEGIN = 0
+EVENT_END = 1
+EVENT_MARK = 2
+
+
+def capture_dump(port, baud, path):
+    """
+    Save the console output to path until a whole dump has been received.
+    """
+    import serial
+    console = serial.Serial(port=port, baudrate=baud, timeout=1)
+    data = b""
+    print("Waiting for a trace dump on " + port + "...")
+    while True:
+        data += console.read(4096)
+        start = data.rfind(MAGIC)
+        if start >= 0 and parse_dump(data[start:]) is not None:
+            break
+    console.close()
+    with open(path, "wb") as file:
+        file.write(data)
+
+
+def parse_dump(data):
+    """
+    Parse a dump that starts at data[0]. Returns (core clock, events recorded, names, events), or None if
+    the dump is incomplete. Events are (type, name index, value, time in cycles from the first event).
+    """
+    offset = len(MAGIC)
+    if len(data) < offset + HEADER.size:
+        return None
+    version, event_size, core_clock, recorded, event_count, name_count, _ = HEADER.unpack_from(data, offset)
+    if version != VERSION or event_size != EVENT.size:
+        raise ValueError("unsupported trace dump version " + str(version))
+    offset += HEADER.size
+
+    names = []
+    for _ in range(name_count):
+        if offset >= len(data) or offset + 1 + data[offset] > len(data):
+            return None
+        length = data[offset]
+        names.append(data[offset + 1:offset + 1 + length].decode("ascii"))
+        offset += 1 + length
+
+    end = offset + event_count * EVENT.size
+    if end + CRC.size > len(data):
+        return None
+    if zlib.crc32(data[len(MAGIC):end]) != CRC.unpack_from(data, end)[0]:
+        raise ValueError("trace dump CRC mismatch")
+
+    events = []
+    time = 0
+    last_cycles = None
+    for i in range(event_count):
+        cycles, event_type, name_index, value = EVENT.unpack_from(data, offset + i * EVENT.size)
+        if last_cycles is not None:
+            # CYCCNT wraps at 2^32, and events recorded at the same time may be a few cycles out of order
+            delta = (cycles - last_cycles) & 0xFFFFFFFF
+            time += delta - (1 << 32) if delta >= (1 << 31) else delta
+        last_cycles = cycles
+        events.append((event_type, name_index, value, time))
+    events.sort(key=lambda event: event[3])
+    return core_clock, recorded, names, events
+
+
+def find_dump(data):
+    """
+    Parse the last complete dump in a console capture.
+    """
+    start = data.rfind(MAGIC)
+    while start >= 0:
+        dump = parse_dump(data[start:])
+        if dump is not None:
+            return dump
+        start = data.rfind(MAGIC, 0, start)
+    raise ValueError("no complete trace dump found")
+
+
+def match_spans(events):
+    """
+    Pair each end with the last begin of the same name. Returns spans (name index, value, start, end) and
+    marks (name index, value, time). Spans still open at the end of the trace end with it, ends whose
+    begin was overwritten in the ring buffer are dropped.
+    """
+    open_spans = {}
+    spans = []
+    marks = []
+    for event_type, name_index, value, time in events:
+        if event_type == EVENT_BEGIN:
+            open_spans.setdefault(name_index, []).append((value, time))
+        elif event_type == EVENT_END and open_spans.get(name_index):
+            value, start = open_spans[name_index].pop()
+            spans.append((name_index, value, start, time))
+        elif event_type == EVENT_MARK:
+            marks.append((name_index, value, time))
+    end_time = events[-1][3] if events else 0
+    for name_index, begins in open_spans.items():
+        for value, start in begins:
+            spans.append((name_index, value, start, end_time))
+    return spans, marks
+
+
+def fold_stacks(events, names):
+    """
+    Cycles spent in each stack of nested spans (the time between events goes to the spans open then).
+    """
+    stack = []
+    folded = {}
+    last_time = events[0][3] if events else 0
+    for event_type, name_index, value, time in events:
+        key = ";".join(names[i] for i in stack) if stack else "(untraced)"
+        folded[key] = folded.get(key, 0) + time - last_time
+        last_time = time
+        if event_type == EVENT_BEGIN:
+            stack.append(name_index)
+        elif event_type == EVENT_END and name_index in stack:
+            # usually the innermost span, a span that ends in another one (a command and its response) is taken out
+            del stack[len(stack) - 1 - stack[::-1].index(name_index)]
+    return folded
+
+
+def print_summary(core_clock, recorded, names, events, spans):
+    duration = (events[-1][3] - events[0][3]) if events else 0
+    print("%d events recorded, %d in the dump, %.3f ms at %d Hz" % (recorded, len(events), duration * 1000 / core_clock, core_clock))
+    print("%-22s %8s %12s %10s %10s %8s" % ("span", "count", "total ms", "mean us", "max us", "% time"))
+    for name_index, name in enumerate(names):
+        durations = [end - start for index, _, start, end in spans if index == name_index]
+        if not durations:
+            continue
+        total = sum(durations)
+        print("%-22s %8d %12.3f %10.1f %10.1f %8.1f" % (name, len(durations), total * 1000 / core_clock,
+              total * 1e6 / core_clock / len(durations), max(durations) * 1e6 / core_clock,
+              100 * total / duration if duration else 0))
+
+
+def write_chrome(path, core_clock, names, spans, marks):
+    trace = []
+    for name_index, name in enumerate(names):
+        trace.append({"name": "thread_name", "ph": "M", "pid": 0, "tid": name_index, "args": {"name": name}})
+    for name_index, value, start, end in spans:
+        trace.append({"name": names[name_index], "ph": "X", "pid": 0, "tid": name_index,
+                      "ts": start * 1e6 / core_clock, "dur": (end - start) * 1e6 / core_clock, "args": {"value": value}})
+    for name_index, value, time in marks:
+        trace.append({"name": names[name_index], "ph": "i", "s": "t", "pid": 0, "tid": name_index,
+                      "ts": time * 1e6 / core_clock, "args": {"value": value}})
+    with open(path, "w") as file:
+        json.dump({"traceEvents": trace, "displayTimeUnit": "ms"}, file)
+
+
+def main():
+    parser = argparse.ArgumentParser(description="View a trace dump of the OTA firmware.")
+    parser.add_argument("capture", help="console capture holding the dump (written when --port is given)")
+    parser.add_argument("--port", help="capture the dump from this serial port first")
+    parser.add_argument("--baud", type=int, default=115200, help="console baud rate")
+    parser.add_argument("--chrome", help="write a timeline in the Chrome trace event format")
+    parser.add_argument("--folded", help="write folded stacks for a flame graph")
+    args = parser.parse_args()
+
+    if args.port:
+        capture_dump(args.port, args.baud, args.capture)
+    with open(args.capture, "rb") as file:
+        core_clock, recorded, names, events = find_dump(file.read())
+
+    spans, marks = match_spans(events)
+    print_summary(core_clock, recorded, names, events, spans)
+    if args.chrome:
+        write_chrome(args.chrome, core_clock, names, spans, marks)
+    if args.folded:
+        with open(args.folded, "w") as file:
+            for stack, cycles in sorted(fold_stacks(events, names).items()):
+                if cycles > 0:
+                    file.write("%s %d\n" % (stack, cycles))
+
+
+if __name__ == "__main__":
+    try:
+        main()
+    except ValueError as error:
+        print("Error: " + str(error))
+        sys.exit(1)
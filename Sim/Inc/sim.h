@@ -0,0 +1,100 @@
+/**
+  ******************************************************************************
+  * @file           sim.h
+  * @brief          Internal interface between the parts of the host simulation
+  *                 (clock, emulated flash, UART, HASH and BT122 model). The OTA
+  *                 modules only see stm32u5xx_hal.h.
+  ******************************************************************************
+*/
+
+/* Define to prevent recursive inclusion -------------------------------------*/
+#ifndef __SIM_H
+#define __SIM_H
+
+/* Includes */
+#include <pthread.h>
+#include "stm32u5xx_hal.h"
+
+/* Defines */
+#define SIM_CORE_CLOCK 160000000UL			/* SystemCoreClock of the U5 (PLL1 at 160 MHz) */
+#define SIM_THREAD_STACK_SIZE (1024 * 1024)	/* Stack of the threads that run firmware code */
+
+/*
+ * Flash timing model, approximately the typical values of the STM32U5 datasheet. Multiplied by the timing
+ * scale (see simFlashOpen()), 0 programs and erases instantly.
+ */
+#define SIM_FLASH_QUADWORD_PROGRAM_US 118	/* Program one quadword (16 bytes) */
+#define SIM_FLASH_BURST_PROGRAM_US 720		/* Program a burst of 8 quadwords (128 bytes) */
+#define SIM_FLASH_PAGE_ERASE_US 1500		/* Erase one 8 KB page */
+#define SIM_FLASH_MASS_ERASE_US 30000		/* Erase one bank */
+
+#define SIM_UART_QUEUE_LENGTH 65536			/* Bytes in flight to one U5 UART, the sender waits (RTS/CTS) when it is full */
+#define SIM_LINK_FRAME_SIZE 512			/* Most bytes per frame on the Bluetooth link */
+#define SIM_LINK_QUEUE_FRAMES 32			/* Frames in flight in each direction of the link */
+#define SIM_BT122_BOOT_MS 50				/* BT122 reset to boot event */
+#define SIM_BT122_UART_SWITCH_MS 100		/* hardware_set_uart_configuration response to the new rate taking effect */
+#define SIM_BT122_DFU_VERSION 6				/* Bootloader version reported by dfu_boot */
+
+
+/* Structs */
+
+/*
+ * Receives the bytes a U5 UART transmits (the other end of the line). baudRate is the rate the U5 sent at,
+ * if the receiver is at another rate the bytes arrive corrupted.
+ */
+typedef void (*SimUartReceiver)(const uint8_t *data, int length, uint32_t baudRate);
+
+/*
+ * Bluetooth link between the client and the BT122 (see sim_link.c).
+ */
+typedef struct {
+	uint32_t rate;							/* Bytes per second in each direction, 0 for no limit */
+	uint32_t latencyUs;						/* Time a frame takes to arrive once sent */
+	double loss;							/* Probability that a frame is lost */
+	uint32_t lossStartBytes;				/* Bytes sent in a direction before frames can be lost */
+	unsigned int seed;						/* Seed of the losses */
+} SimLinkConfig;
+
+typedef struct {
+	uint64_t bytes;							/* Bytes sent */
+	uint64_t frames;						/* Frames sent */
+	uint64_t lostFrames;					/* Frames lost */
+} SimLinkStats;
+
+
+/* Functions prototypes */
+
+// Clock and threads (sim_hal.c)
+uint64_t simTimeUs(void);
+void simSleepUs(uint64_t us);
+int simThreadCreate(pthread_t *thread, void *(*function)(void *), void *argument);
+void simSystemReset(void);
+
+// Flash (sim_flash.c)
+int simFlashOpen(const char *path, double timingScale);
+void simFlashClose(void);
+
+// UART (sim_uart.c)
+void simUartConnect(USART_TypeDef *instance, SimUartReceiver receiver);
+uint32_t simUartGetBaudRate(USART_TypeDef *instance);
+int simUartGetSpace(USART_TypeDef *instance);
+int simUartDeliver(USART_TypeDef *instance, const uint8_t *data, int length, uint32_t baudRate);
+
+// SHA-256 (sim_hash.c)
+void simSha256Init(HASH_HandleTypeDef *context);
+void simSha256Update(HASH_HandleTypeDef *context, const uint8_t *data, uint32_t length);
+void simSha256Final(HASH_HandleTypeDef *context, uint8_t *digest);
+
+// Bluetooth link (sim_link.c)
+int simLinkOpen(const char *path, const SimLinkConfig *config);
+void simLinkClose(void);
+void simLinkSend(const uint8_t *data, int length);
+
+// BT122 model (sim_bt122.c)
+int simBt122Start(void);
+int simBt122LinkReceive(const uint8_t *data, int length);
+void simBt122GpioWrite(GPIO_TypeDef *port, uint16_t pin, GPIO_PinState state);
+GPIO_PinState simBt122ModePin(void);
+
+
+#endif /* __SIM_H */
@@ -0,0 +1,358 @@
+/**
+  ******************************************************************************
+  * @file           stm32u5xx_hal.h
+  * @brief          Host simulation of the part of the STM32U5 HAL used by the
+  *                 OTA modules (ota.c, flash.c, uart.c, util.c, bgapi.c, lz.c).
+  *                 Takes the place of the real HAL header in the simulation
+  *                 build (see Sim/Makefile), the modules compile unchanged.
+  ******************************************************************************
+*/
+
+/* Define to prevent recursive inclusion -------------------------------------*/
+#ifndef __STM32U5xx_HAL_H
+#define __STM32U5xx_HAL_H
+
+/* Includes */
+#include <stdint.h>
+#include <stddef.h>
+
+/* Defines */
+#define __IO volatile
+
+/*******************************************************************************/
+/*							Common											   */
+/*******************************************************************************/
+
+typedef enum {
+	HAL_OK = 0x00,
+	HAL_ERROR = 0x01,
+	HAL_BUSY = 0x02,
+	HAL_TIMEOUT = 0x03
+} HAL_StatusTypeDef;
+
+typedef enum {
+	HAL_UNLOCKED = 0x00,
+	HAL_LOCKED = 0x01
+} HAL_LockTypeDef;
+
+#define HAL_MAX_DELAY 0xFFFFFFFFU
+#define __DMB() __sync_synchronize()
+// interrupts are threads, masking them takes a lock the simulated interrupts that need it take too (sim_hal.c)
+uint32_t simGetPrimask(void);
+void simSetPrimask(uint32_t priMask);
+#define __get_PRIMASK() simGetPrimask()
+#define __set_PRIMASK(priMask) simSetPrimask(priMask)
+#define __disable_irq() simSetPrimask(1)
+#define __HAL_UNLOCK(__HANDLE__) do { (__HANDLE__)->Lock = HAL_UNLOCKED; } while (0)
+
+typedef enum {
+	FLASH_IRQn = 6,
+	USART1_IRQn = 61,
+	USART2_IRQn = 62,
+	HASH_IRQn = 96
+} IRQn_Type;
+
+extern uint32_t SystemCoreClock;
+
+uint32_t HAL_GetTick(void);
+void HAL_Delay(uint32_t Delay);
+void HAL_NVIC_SetPriority(IRQn_Type IRQn, uint32_t PreemptPriority, uint32_t SubPriority);
+void HAL_NVIC_EnableIRQ(IRQn_Type IRQn);
+void HAL_NVIC_SystemReset(void);
+void Error_Handler(void);
+
+/*******************************************************************************/
+/*							Core debug (DWT cycle counter)					   */
+/*******************************************************************************/
+
+typedef struct {
+	volatile uint32_t CTRL;
+	volatile uint32_t CYCCNT;
+} DWT_Type;
+
+typedef struct {
+	volatile uint32_t DEMCR;
+} CoreDebug_Type;
+
+DWT_Type *simDwt(void);							/* Updates CYCCNT from the simulated clock */
+extern CoreDebug_Type simCoreDebug;
+
+#define DWT (simDwt())
+#define CoreDebug (&simCoreDebug)
+#define DWT_CTRL_CYCCNTENA_Msk (1UL << 0)
+#define CoreDebug_DEMCR_TRCENA_Msk (1UL << 24)
+
+/*******************************************************************************/
+/*							RCC / CRC										   */
+/*******************************************************************************/
+
+/* There is no CRC peripheral, util.c computes the CRC32 in software (OTA_SIMULATION) */
+#define __HAL_RCC_CRC_CLK_ENABLE() do { } while (0)
+
+/*******************************************************************************/
+/*							GPIO											   */
+/*******************************************************************************/
+
+typedef struct {
+	uint32_t port;								/* Port number (GPIOA = 0) */
+} GPIO_TypeDef;
+
+typedef enum {
+	GPIO_PIN_RESET = 0U,
+	GPIO_PIN_SET
+} GPIO_PinState;
+
+extern GPIO_TypeDef simGpioPorts[9];
+#define GPIOA (&simGpioPorts[0])
+#define GPIOB (&simGpioPorts[1])
+#define GPIOC (&simGpioPorts[2])
+#define GPIOD (&simGpioPorts[3])
+#define GPIOE (&simGpioPorts[4])
+#define GPIOF (&simGpioPorts[5])
+#define GPIOG (&simGpioPorts[6])
+#define GPIOH (&simGpioPorts[7])
+#define GPIOI (&simGpioPorts[8])
+
+#define GPIO_PIN_0 ((uint16_t) 0x0001)
+#define GPIO_PIN_1 ((uint16_t) 0x0002)
+#define GPIO_PIN_2 ((uint16_t) 0x0004)
+#define GPIO_PIN_3 ((uint16_t) 0x0008)
+#define GPIO_PIN_4 ((uint16_t) 0x0010)
+#define GPIO_PIN_5 ((uint16_t) 0x0020)
+#define GPIO_PIN_6 ((uint16_t) 0x0040)
+#define GPIO_PIN_7 ((uint16_t) 0x0080)
+#define GPIO_PIN_8 ((uint16_t) 0x0100)
+#define GPIO_PIN_9 ((uint16_t) 0x0200)
+#define GPIO_PIN_10 ((uint16_t) 0x0400)
+#define GPIO_PIN_11 ((uint16_t) 0x0800)
+#define GPIO_PIN_12 ((uint16_t) 0x1000)
+#define GPIO_PIN_13 ((uint16_t) 0x2000)
+#define GPIO_PIN_14 ((uint16_t) 0x4000)
+#define GPIO_PIN_15 ((uint16_t) 0x8000)
+
+GPIO_PinState HAL_GPIO_ReadPin(GPIO_TypeDef *GPIOx, uint16_t GPIO_Pin);
+void HAL_GPIO_WritePin(GPIO_TypeDef *GPIOx, uint16_t GPIO_Pin, GPIO_PinState PinState);
+
+/*******************************************************************************/
+/*							FLASH											   */
+/*******************************************************************************/
+
+/*
+ * 4 MB, two banks of 256 pages of 8 KB, mapped at FLASH_BASE (see sim_flash.c). On the device
+ * FLASH_SIZE is read from a register, here it is a constant.
+ */
+#define FLASH_BASE 0x08000000UL
+#define FLASH_SIZE_DEFAULT 0x400000UL
+#define FLASH_SIZE FLASH_SIZE_DEFAULT
+#define FLASH_BANK_SIZE (FLASH_SIZE >> 1)
+#define FLASH_PAGE_SIZE 0x2000U
+#define FLASH_PAGE_NB (FLASH_BANK_SIZE / FLASH_PAGE_SIZE)
+
+#define FLASH_BANK_1 0x00000001U
+#define FLASH_BANK_2 0x00000002U
+#define FLASH_BANK_BOTH (FLASH_BANK_1 | FLASH_BANK_2)
+
+#define FLASH_TYPEERASE_PAGES 0x00000000U
+#define FLASH_TYPEERASE_MASSERASE 0x00000001U
+
+#define FLASH_TYPEPROGRAM_QUADWORD 0x00000001U
+#define FLASH_TYPEPROGRAM_BURST 0x00000002U
+
+#define HAL_FLASH_ERROR_NONE 0x00000000U
+#define HAL_FLASH_ERROR_OP 0x00000001U
+#define HAL_FLASH_ERROR_PROG 0x00000008U
+#define HAL_FLASH_ERROR_WRP 0x00000010U
+#define HAL_FLASH_ERROR_PGA 0x00000020U
+#define HAL_FLASH_ERROR_SIZ 0x00000040U
+#define HAL_FLASH_ERROR_PGS 0x00000080U
+#define HAL_FLASH_ERROR_OPTW 0x00002000U
+
+#define FLASH_FLAG_ALL_ERRORS 0x000020FBU
+#define FLASH_IT_EOP 0x00000001U
+#define FLASH_IT_OPERR 0x00000002U
+
+#define OPTIONBYTE_USER 0x00000004U
+#define OB_USER_SWAP_BANK 0x00000200U
+#define FLASH_OPTR_SWAP_BANK (1UL << 20)
+#define OB_SWAP_BANK_DISABLE 0x00000000U
+#define OB_SWAP_BANK_ENABLE FLASH_OPTR_SWAP_BANK
+
+typedef struct {
+	uint32_t TypeErase;							/* FLASH_TYPEERASE_PAGES or FLASH_TYPEERASE_MASSERASE */
+	uint32_t Banks;								/* FLASH_BANK_1 or FLASH_BANK_2 (physical) */
+	uint32_t Page;								/* First page to erase, within the bank */
+	uint32_t NbPages;							/* Number of pages to erase */
+} FLASH_EraseInitTypeDef;
+
+typedef struct {
+	uint32_t OptionType;						/* OPTIONBYTE_USER */
+	uint32_t USERType;							/* OB_USER_SWAP_BANK */
+	uint32_t USERConfig;						/* OB_SWAP_BANK_ENABLE or OB_SWAP_BANK_DISABLE */
+} FLASH_OBProgramInitTypeDef;
+
+typedef struct {
+	HAL_LockTypeDef Lock;
+	volatile uint32_t ErrorCode;
+} FLASH_ProcessTypeDef;
+
+extern FLASH_ProcessTypeDef pFlash;
+
+HAL_StatusTypeDef HAL_FLASH_Unlock(void);
+HAL_StatusTypeDef HAL_FLASH_Lock(void);
+HAL_StatusTypeDef HAL_FLASH_OB_Unlock(void);
+HAL_StatusTypeDef HAL_FLASH_OB_Lock(void);
+HAL_StatusTypeDef HAL_FLASH_OB_Launch(void);
+HAL_StatusTypeDef HAL_FLASH_Program(uint32_t TypeProgram, uint32_t Address, uint32_t DataAddress);
+HAL_StatusTypeDef HAL_FLASHEx_Erase(FLASH_EraseInitTypeDef *pEraseInit, uint32_t *PageError);
+HAL_StatusTypeDef HAL_FLASHEx_Erase_IT(FLASH_EraseInitTypeDef *pEraseInit);
+HAL_StatusTypeDef HAL_FLASHEx_OBProgram(FLASH_OBProgramInitTypeDef *pOBInit);
+void HAL_FLASHEx_OBGetConfig(FLASH_OBProgramInitTypeDef *pOBInit);
+uint32_t HAL_FLASH_GetError(void);
+HAL_StatusTypeDef FLASH_WaitForLastOperation(uint32_t Timeout);
+void HAL_FLASH_EndOfOperationCallback(uint32_t ReturnValue);
+void HAL_FLASH_OperationErrorCallback(uint32_t ReturnValue);
+
+void simFlashClearFlags(uint32_t flags);
+void simFlashDisableIt(uint32_t interrupts);
+#define __HAL_FLASH_CLEAR_FLAG(__FLAG__) simFlashClearFlags(__FLAG__)
+#define __HAL_FLASH_DISABLE_IT(__INTERRUPT__) simFlashDisableIt(__INTERRUPT__)
+
+/*******************************************************************************/
+/*							DMA (linked-list queues)						   */
+/*******************************************************************************/
+
+/*
+ * Only what uart_tx_gather() touches: the node registers and the queue head. A node links to the next one
+ * like on the device, by the low 16 bits of its address in CLLR (nodes are in the 64 KB region of the head).
+ */
+#define DMA_NORMAL 0x0000U
+#define DMA_LINKEDLIST 0x0080U
+#define DMA_LINKEDLIST_NORMAL DMA_LINKEDLIST
+#define DMA_CLBAR_LBA 0xFFFF0000U
+#define DMA_CLLR_LA 0x0000FFFCU
+#define NODE_CBR1_DEFAULT_OFFSET 0x0002U
+#define NODE_CSAR_DEFAULT_OFFSET 0x0003U
+#define NODE_CDAR_DEFAULT_OFFSET 0x0004U
+#define NODE_CLLR_LINEAR_DEFAULT_OFFSET 0x0005U
+
+typedef struct {
+	uint32_t LinkRegisters[8];
+	uint32_t NodeInfo;
+} DMA_NodeTypeDef;
+
+typedef struct {
+	DMA_NodeTypeDef *Head;
+	uint32_t NodeNumber;
+} DMA_QListTypeDef;
+
+typedef struct {
+	uint32_t Mode;								/* DMA_NORMAL or DMA_LINKEDLIST_NORMAL */
+	DMA_QListTypeDef *LinkedListQueue;			/* Linked-list mode: the queue */
+} DMA_HandleTypeDef;
+
+/*******************************************************************************/
+/*							UART											   */
+/*******************************************************************************/
+
+typedef struct {
+	uint32_t id;								/* Never dereferenced, the instance only identifies the UART */
+} USART_TypeDef;
+
+#define USART1_BASE 0x40013800UL
+#define USART2_BASE 0x40004400UL
+#define USART3_BASE 0x40004800UL
+#define UART4_BASE 0x40004C00UL
+#define UART5_BASE 0x40005000UL
+#define USART6_BASE 0x40006400UL
+#define LPUART1_BASE 0x46002400UL
+#define USART1 ((USART_TypeDef *) USART1_BASE)
+#define USART2 ((USART_TypeDef *) USART2_BASE)
+#define USART3 ((USART_TypeDef *) USART3_BASE)
+#define UART4 ((USART_TypeDef *) UART4_BASE)
+#define UART5 ((USART_TypeDef *) UART5_BASE)
+#define USART6 ((USART_TypeDef *) USART6_BASE)
+#define LPUART1 ((USART_TypeDef *) LPUART1_BASE)
+
+#define UART_WORDLENGTH_8B 0x00000000U
+#define UART_STOPBITS_1 0x00000000U
+#define UART_PARITY_NONE 0x00000000U
+#define UART_MODE_TX_RX 0x0000000CU
+#define UART_HWCONTROL_NONE 0x00000000U
+#define UART_HWCONTROL_RTS_CTS 0x00000300U
+#define UART_OVERSAMPLING_16 0x00000000U
+#define HAL_UART_STATE_READY 0x00000000U
+
+typedef struct {
+	uint32_t BaudRate;
+	uint32_t WordLength;
+	uint32_t StopBits;
+	uint32_t Parity;
+	uint32_t Mode;
+	uint32_t HwFlowCtl;
+	uint32_t OverSampling;
+} UART_InitTypeDef;
+
+typedef struct __UART_HandleTypeDef {
+	USART_TypeDef *Instance;
+	UART_InitTypeDef Init;
+	DMA_HandleTypeDef *hdmarx;					/* Non-NULL: receive to idle by "DMA" (as linked in HAL_UART_MspInit()) */
+	DMA_HandleTypeDef *hdmatx;					/* Non-NULL: HAL_UART_Transmit_DMA() may be used, in linked-list mode it sends the whole queue */
+	volatile uint32_t gState;					/* 0: idle, 1: transmitting (HAL_UART_Transmit_IT() / _DMA()) */
+	uint8_t *pRxBuffPtr;						/* Receive buffer of the reception in progress */
+	uint16_t RxXferSize;						/* Size of the receive buffer */
+	volatile uint32_t RxState;					/* 0: idle, 1: interrupt reception, 2: DMA (circular, to idle) */
+	uint32_t ErrorCode;
+} UART_HandleTypeDef;
+
+HAL_StatusTypeDef HAL_UART_Init(UART_HandleTypeDef *huart);
+HAL_StatusTypeDef HAL_UART_Transmit(UART_HandleTypeDef *huart, const uint8_t *pData, uint16_t Size, uint32_t Timeout);
+HAL_StatusTypeDef HAL_UART_Transmit_IT(UART_HandleTypeDef *huart, const uint8_t *pData, uint16_t Size);
+HAL_StatusTypeDef HAL_UART_Transmit_DMA(UART_HandleTypeDef *huart, const uint8_t *pData, uint16_t Size);
+HAL_StatusTypeDef HAL_UART_Receive(UART_HandleTypeDef *huart, uint8_t *pData, uint16_t Size, uint32_t Timeout);
+HAL_StatusTypeDef HAL_UART_Receive_IT(UART_HandleTypeDef *huart, uint8_t *pData, uint16_t Size);
+HAL_StatusTypeDef HAL_UARTEx_ReceiveToIdle_DMA(UART_HandleTypeDef *huart, uint8_t *pData, uint16_t Size);
+HAL_StatusTypeDef HAL_UART_AbortReceive(UART_HandleTypeDef *huart);
+void HAL_UART_TxCpltCallback(UART_HandleTypeDef *huart);
+void HAL_UART_RxCpltCallback(UART_HandleTypeDef *huart);
+void HAL_UARTEx_RxEventCallback(UART_HandleTypeDef *huart, uint16_t Size);
+void HAL_UART_ErrorCallback(UART_HandleTypeDef *huart);
+
+// bytes the receive DMA of a UART still has to write before it wraps (sim_uart.c)
+uint32_t simUartDmaGetCounter(DMA_HandleTypeDef *hdma);
+#define __HAL_DMA_GET_COUNTER(__HANDLE__) simUartDmaGetCounter(__HANDLE__)
+
+/*******************************************************************************/
+/*							HASH											   */
+/*******************************************************************************/
+
+#define HASH_DATATYPE_8B 0x00000020U
+
+typedef struct {
+	uint32_t DataType;
+} HASH_InitTypeDef;
+
+typedef struct {
+	HASH_InitTypeDef Init;
+	void *hdmain;								/* Non-NULL: HAL_HASHEx_SHA256_Start_DMA() may be used */
+	int started;								/* 1 while a digest computation is in progress */
+	uint32_t state[8];							/* SHA256 state */
+	uint64_t length;							/* Bytes hashed */
+	uint8_t block[64];							/* Partial block */
+	uint32_t blockLength;						/* Bytes in block */
+} HASH_HandleTypeDef;
+
+HAL_StatusTypeDef HAL_HASH_Init(HASH_HandleTypeDef *hhash);
+HAL_StatusTypeDef HAL_HASHEx_SHA256_Start(HASH_HandleTypeDef *hhash, uint8_t *pInBuffer, uint32_t Size, uint8_t *pOutBuffer, uint32_t Timeout);
+HAL_StatusTypeDef HAL_HASHEx_SHA256_Accmlt(HASH_HandleTypeDef *hhash, uint8_t *pInBuffer, uint32_t Size);
+HAL_StatusTypeDef HAL_HASHEx_SHA256_Accmlt_End(HASH_HandleTypeDef *hhash, uint8_t *pInBuffer, uint32_t Size, uint8_t *pOutBuffer, uint32_t Timeout);
+HAL_StatusTypeDef HAL_HASHEx_SHA256_Start_DMA(HASH_HandleTypeDef *hhash, uint8_t *pInBuffer, uint32_t Size);
+HAL_StatusTypeDef HAL_HASHEx_SHA256_Finish(HASH_HandleTypeDef *hhash, uint8_t *pOutBuffer, uint32_t Timeout);
+void HAL_HASH_InCpltCallback(HASH_HandleTypeDef *hhash);
+void HAL_HASH_ErrorCallback(HASH_HandleTypeDef *hhash);
+
+void simHashSetMultipleDma(int enable);
+#define __HAL_HASH_SET_MDMAT() simHashSetMultipleDma(1)
+#define __HAL_HASH_RESET_MDMAT() simHashSetMultipleDma(0)
+
+
+#endif /* __STM32U5xx_HAL_H */
@@ -0,0 +1,78 @@
+/**
+ ******************************************************************************
+ * @file           lz_test.c
+ * @brief          Host harness: runs the LZ decoder (lz.c) on blocks from stdin
+ ******************************************************************************
+ *
+ * Driven by lz_test.py, which compresses the blocks with the client's
+ * compressor. Reads blocks from the standard input until it ends, each:
+ *   uint32_t outputSize, dictionaryLength, blockLength, pieceSize
+ *   dictionaryLength bytes of dictionary, blockLength bytes of block
+ * and decodes each one like writeCompressedChunkToFlash() does, feeding the
+ * block in pieces of pieceSize bytes (so every state of the decoder is left
+ * and resumed across calls). Writes back, for each block:
+ *   uint8_t status (0: HAL_OK), uint32_t outputLength, the output
+ * The decoder's error messages go to the standard error.
+ *
+ ******************************************************************************
+ */
+
+/* Includes -----------------------------------------------------------------*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "lz.h"
+
+/* Functions ----------------------------------------------------------------*/
+
+static int readAll(FILE *in, void *data, size_t length) {
+	return length == 0 || fread(data, length, 1, in) == 1;
+}
+
+int main(void) {
+	// the decoder prints its errors with printf(), keep them out of the results
+	FILE *results = fdopen(dup(STDOUT_FILENO), "wb");
+	if (results == NULL || dup2(STDERR_FILENO, STDOUT_FILENO) < 0) {
+		perror("lz_test");
+		return 2;
+	}
+
+	uint32_t header[4];
+	while (readAll(stdin, header, sizeof(header))) {
+		uint32_t outputSize = header[0], dictionaryLength = header[1], blockLength = header[2], pieceSize = header[3];
+		char *output = malloc(outputSize + 1);
+		char *dictionary = malloc(dictionaryLength + 1);
+		char *block = malloc(blockLength + 1);
+		if (output == NULL || dictionary == NULL || block == NULL || pieceSize == 0
+				|| !readAll(stdin, dictionary, dictionaryLength) || !readAll(stdin, block, blockLength)) {
+			fprintf(stderr, "lz_test: bad input\n");
+			return 2;
+		}
+
+		LzDecoder decoder;
+		lzDecoderInit(&decoder, output, outputSize);
+		if (dictionaryLength > 0) {
+			lzDecoderSetDictionary(&decoder, dictionary, dictionaryLength);
+		}
+		HAL_StatusTypeDef status = HAL_OK;
+		for (uint32_t offset = 0; status == HAL_OK && offset < blockLength; offset += pieceSize) {
+			uint32_t n = blockLength - offset < pieceSize ? blockLength - offset : pieceSize;
+			status = lzDecoderFeed(&decoder, block + offset, n);
+		}
+		if (status == HAL_OK) {
+			status = lzDecoderFinish(&decoder);
+		}
+
+		uint8_t statusByte = status;
+		uint32_t outputLength = decoder.outputLength;
+		fwrite(&statusByte, 1, 1, results);
+		fwrite(&outputLength, sizeof(outputLength), 1, results);
+		fwrite(output, 1, outputLength, results);
+		free(output);
+		free(dictionary);
+		free(block);
+	}
+	fclose(results);
+	return 0;
+}
@@ -0,0 +1,294 @@
+/**
+ ******************************************************************************
+ * @file           sim_bt122.c
+ * @brief          Host simulation: BT122 module on USART2
+ ******************************************************************************
+ *
+ * Models what the OTA flows use of the BT122 running uart_streaming.bgs:
+ *  - PF2 toggles the UART between BGAPI and data mode, PF3 reads the mode
+ *    (0: BGAPI)
+ *  - in data mode, the UART is bridged to the Bluetooth link (sim_link.c),
+ *    the OTA client is at the other end
+ *  - in BGAPI mode it answers system_hello and
+ *    hardware_set_uart_configuration (the new rate takes effect 100 ms after
+ *    the response), and resets on dfu_reset / system_reset
+ *  - after a reset (115200 baud, BGAPI mode) it sends a 0 byte, then
+ *    dfu_boot in the DFU bootloader or system_boot in the firmware
+ *  - the DFU bootloader only accepts the dfu_ commands, it keeps the
+ *    uploaded image and prints its size and SHA-256 on upload_finish
+ *
+ * Bytes the U5 sends at another rate than the BT122's arrive corrupted, and
+ * so do the BT122's (see sim_uart.c).
+ *
+ ******************************************************************************
+ */
+
+/* Includes -----------------------------------------------------------------*/
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "main.h"
+#include "bgapi.h"
+#include "sim.h"
+
+/* Private defines ----------------------------------------------------------*/
+#define BT122_UART USART2
+#define BT122_PARSER_TIMEOUT_US 100000	/* A command whose bytes stop arriving is dropped */
+#define BT122_POLL_MS 1					/* Model thread period */
+
+/* Variables ----------------------------------------------------------------*/
+static struct {
+	pthread_mutex_t lock;
+	int mode;							/* BGAPI_MODE or DATA_MODE */
+	GPIO_PinState pf2;					/* Last level of PF2, the mode toggles on a falling edge */
+	uint32_t baudRate;					/* Current UART rate */
+	uint32_t pendingBaudRate;			/* Rate set by hardware_set_uart_configuration, 0 if none */
+	uint64_t pendingBaudRateUs;			/* When it takes effect */
+	int dfu;							/* 1 in the DFU bootloader */
+	uint64_t bootUs;					/* Reset in progress, boot event at this time. 0 if running. */
+	uint8_t command[BGLIB_MSG_MAXLEN];	/* Command being received */
+	int commandLength;
+	uint64_t lastByteUs;
+	uint8_t *image;						/* Image uploaded to the DFU bootloader */
+	uint32_t imageLength;
+	uint32_t imageCapacity;
+	uint32_t uploadCommands;
+	pthread_t thread;
+} bt122 = { PTHREAD_MUTEX_INITIALIZER, BGAPI_MODE, GPIO_PIN_SET, BT122_DEFAULT_BAUD_RATE };
+
+/* Functions ----------------------------------------------------------------*/
+
+/**
+ * Send a response or event to the U5.
+ */
+static void bt122Send(uint32_t id, const void *payload, int length) {
+	uint8_t packet[BGLIB_MSG_HEADER_LEN + 16];
+	packet[0] = (uint8_t) (id & 0xF8) | (uint8_t) ((length >> 8) & 0x07);
+	packet[1] = (uint8_t) length;
+	packet[2] = (uint8_t) (id >> 16);
+	packet[3] = (uint8_t) (id >> 24);
+	memcpy(packet + BGLIB_MSG_HEADER_LEN, payload, length);
+	simUartDeliver(BT122_UART, packet, BGLIB_MSG_HEADER_LEN + length, bt122.baudRate);
+}
+
+/**
+ * Send a response with only a result code.
+ */
+static void bt122SendResult(uint32_t id, uint16_t result) {
+	bt122Send(id, &result, sizeof(result));
+}
+
+/**
+ * Reset the module, it boots SIM_BT122_BOOT_MS later (see bt122Boot()).
+ */
+static void bt122Reset(int dfu) {
+	printf("[sim] BT122: reset%s\n", dfu ? " to DFU" : "");
+	bt122.dfu = dfu;
+	bt122.mode = BGAPI_MODE;
+	bt122.baudRate = BT122_DEFAULT_BAUD_RATE;
+	bt122.pendingBaudRate = 0;
+	bt122.commandLength = 0;
+	bt122.bootUs = simTimeUs() + SIM_BT122_BOOT_MS * 1000;
+}
+
+static void bt122Boot() {
+	uint8_t zero = 0;
+	bt122.bootUs = 0;
+	simUartDeliver(BT122_UART, &zero, 1, bt122.baudRate);
+	if (bt122.dfu) {
+		uint32_t version = SIM_BT122_DFU_VERSION;
+		bt122Send(dumo_evt_dfu_boot_id, &version, sizeof(version));
+	} else {
+		struct dumo_msg_system_boot_evt_t boot = { 1, 2, 0, 0, SIM_BT122_DFU_VERSION, 0x0122 };
+		bt122Send(dumo_evt_system_boot_id, &boot, sizeof(boot));
+	}
+}
+
+/**
+ * Commands of the DFU bootloader.
+ */
+static void bt122HandleDfuCommand(uint32_t id, const uint8_t *payload, int length) {
+	if (id == dumo_cmd_dfu_reset_id) {
+		bt122Reset(payload[0]);
+	} else if (id == dumo_cmd_dfu_flash_set_address_id) {
+		bt122.imageLength = 0;
+		bt122.uploadCommands = 0;
+		bt122SendResult(dumo_rsp_dfu_flash_set_address_id, 0);
+	} else if (id == dumo_cmd_dfu_flash_upload_id) {
+		uint8_t dataLength = payload[0];
+		if (bt122.imageLength + dataLength > bt122.imageCapacity) {
+			bt122.imageCapacity = (bt122.imageLength + dataLength) * 2;
+			bt122.image = realloc(bt122.image, bt122.imageCapacity);
+		}
+		memcpy(bt122.image + bt122.imageLength, payload + 1, dataLength);
+		bt122.imageLength += dataLength;
+		bt122.uploadCommands++;
+		bt122SendResult(dumo_rsp_dfu_flash_upload_id, 0);
+	} else if (id == dumo_cmd_dfu_flash_upload_finish_id) {
+		HASH_HandleTypeDef sha256;
+		uint8_t digest[32];
+		simSha256Init(&sha256);
+		simSha256Update(&sha256, bt122.image, bt122.imageLength);
+		simSha256Final(&sha256, digest);
+		printf("[sim] BT122: DFU upload of %lu bytes in %lu commands, sha256 ", (unsigned long) bt122.imageLength,
+				(unsigned long) bt122.uploadCommands);
+		for (int i = 0; i < 32; i++) {
+			printf("%02x", digest[i]);
+		}
+		printf("\n");
+		bt122SendResult(dumo_rsp_dfu_flash_upload_finish_id, 0);
+	}
+	// the bootloader ignores everything else
+}
+
+static void bt122HandleCommand(uint32_t id, const uint8_t *payload, int length) {
+	if (bt122.dfu) {
+		bt122HandleDfuCommand(id, payload, length);
+	} else if (id == dumo_cmd_system_hello_id) {
+		bt122SendResult(dumo_rsp_system_hello_id, 0);
+	} else if (id == dumo_cmd_hardware_set_uart_configuration_id) {
+		const struct dumo_msg_hardware_set_uart_configuration_cmd_t *cmd = (const void *) payload;
+		if (cmd->rate == 0) {
+			bt122SendResult(dumo_rsp_hardware_set_uart_configuration_id, dumo_err_invalid_param);
+			return;
+		}
+		bt122SendResult(dumo_rsp_hardware_set_uart_configuration_id, 0);
+		bt122.pendingBaudRate = cmd->rate;
+		bt122.pendingBaudRateUs = simTimeUs() + SIM_BT122_UART_SWITCH_MS * 1000;
+	} else if (id == dumo_cmd_dfu_reset_id || id == dumo_cmd_system_reset_id) {
+		bt122Reset(payload[0]);
+	} else {
+		printf("[sim] BT122: command %08lx is not modelled\n", (unsigned long) id);
+		bt122SendResult(id, dumo_err_not_implemented);
+	}
+}
+
+/**
+ * Frame the commands the U5 sends in BGAPI mode.
+ */
+static void bt122ParseCommand(uint8_t byte) {
+	uint64_t now = simTimeUs();
+	if (bt122.commandLength > 0 && now - bt122.lastByteUs > BT122_PARSER_TIMEOUT_US) {
+		bt122.commandLength = 0;
+	}
+	bt122.lastByteUs = now;
+	if (bt122.commandLength == 0 && (byte & 0xF8) != (dumo_dev_type_dumo | dumo_msg_type_cmd)) {
+		// not the start of a command
+		return;
+	}
+
+	bt122.command[bt122.commandLength++] = byte;
+	if (bt122.commandLength < BGLIB_MSG_HEADER_LEN) {
+		return;
+	}
+	int length = BGLIB_MSG_HEADER_LEN + BGLIB_MSG_LEN(bt122.command);
+	if (bt122.commandLength == length) {
+		bt122.commandLength = 0;
+		bt122HandleCommand(BGLIB_MSG_ID(bt122.command), bt122.command + BGLIB_MSG_HEADER_LEN, length - BGLIB_MSG_HEADER_LEN);
+	}
+}
+
+/**
+ * Bytes transmitted by the U5 (SimUartReceiver). In data mode they go over the link, once the lock is
+ * released (the link may be full).
+ */
+static void bt122Receive(const uint8_t *data, int length, uint32_t baudRate) {
+	uint8_t linkData[length];
+	int linkLength = 0;
+
+	pthread_mutex_lock(&bt122.lock);
+	int corrupt = baudRate != bt122.baudRate;
+	for (int i = 0; i < length; i++) {
+		uint8_t byte = corrupt ? data[i] ^ 0xA5 : data[i];
+		if (bt122.bootUs != 0) {
+			// resetting
+		} else if (bt122.mode == DATA_MODE) {
+			linkData[linkLength++] = byte;
+		} else {
+			bt122ParseCommand(byte);
+		}
+	}
+	pthread_mutex_unlock(&bt122.lock);
+
+	if (linkLength > 0) {
+		simLinkSend(linkData, linkLength);
+	}
+}
+
+/**
+ * Data that arrived over the link, passed to the U5 in data mode, as fast as the UART takes it.
+ *
+ * @return The number of bytes taken, the link keeps the others.
+ */
+int simBt122LinkReceive(const uint8_t *data, int length) {
+	pthread_mutex_lock(&bt122.lock);
+	int receiving = bt122.bootUs == 0 && !bt122.dfu && bt122.mode == DATA_MODE;
+	uint32_t baudRate = bt122.baudRate;
+	pthread_mutex_unlock(&bt122.lock);
+
+	int space = simUartGetSpace(BT122_UART);
+	if (!receiving || space == 0) {
+		return 0;
+	}
+	if (length > space) {
+		length = space;
+	}
+	return simUartDeliver(BT122_UART, data, length, baudRate);
+}
+
+/**
+ * Boots after a reset and applies the new UART rate.
+ */
+static void *bt122Thread(void *argument) {
+	while (1) {
+		simSleepUs(BT122_POLL_MS * 1000);
+
+		pthread_mutex_lock(&bt122.lock);
+		uint64_t now = simTimeUs();
+		if (bt122.bootUs != 0 && now >= bt122.bootUs) {
+			bt122Boot();
+		}
+		if (bt122.pendingBaudRate != 0 && now >= bt122.pendingBaudRateUs) {
+			printf("[sim] BT122: UART at %lu baud\n", (unsigned long) bt122.pendingBaudRate);
+			bt122.baudRate = bt122.pendingBaudRate;
+			bt122.pendingBaudRate = 0;
+		}
+		pthread_mutex_unlock(&bt122.lock);
+	}
+	return NULL;
+}
+
+/**
+ * Start the module. The link must be open (simLinkOpen()).
+ *
+ * @return 0 on success, an error number otherwise.
+ */
+int simBt122Start() {
+	simUartConnect(BT122_UART, bt122Receive);
+	return simThreadCreate(&bt122.thread, bt122Thread, NULL);
+}
+
+/**
+ * PF2 falling edge: the BGScript toggles the UART mode.
+ */
+void simBt122GpioWrite(GPIO_TypeDef *port, uint16_t pin, GPIO_PinState state) {
+	if (port != BT122_PF2_GPIO_Port || pin != BT122_PF2_Pin) {
+		return;
+	}
+	pthread_mutex_lock(&bt122.lock);
+	if (bt122.pf2 == GPIO_PIN_SET && state == GPIO_PIN_RESET && bt122.bootUs == 0 && !bt122.dfu) {
+		bt122.mode = bt122.mode == BGAPI_MODE ? DATA_MODE : BGAPI_MODE;
+		bt122.commandLength = 0;
+	}
+	bt122.pf2 = state;
+	pthread_mutex_unlock(&bt122.lock);
+}
+
+/**
+ * @return PF3, the UART mode (LED0, on in BGAPI mode).
+ */
+GPIO_PinState simBt122ModePin() {
+	return bt122.mode == DATA_MODE ? GPIO_PIN_SET : GPIO_PIN_RESET;
+}
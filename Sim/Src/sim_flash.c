@@ -0,0 +1,365 @@
+/**
+ ******************************************************************************
+ * @file           sim_flash.c
+ * @brief          Host simulation: dual bank flash and option bytes
+ ******************************************************************************
+ *
+ * 4 MB of flash in two banks of 256 pages of 8 KB, kept in a file (or in
+ * memory) and mapped read-only at FLASH_BASE, so the firmware reads it
+ * through pointers like on the MCU. The file holds bank 1, bank 2 and the
+ * user option bytes (FLASH_OPTR), in that order.
+ *
+ * Like the U5 flash:
+ *  - a page erase sets it to 0xFF
+ *  - a quadword is programmed at once (or 8 of them in a burst), only if it
+ *    is erased (ECC), otherwise HAL_FLASH_ERROR_PROG
+ *  - erasing takes the bank and the page number within the bank (physical),
+ *    reads and programs use addresses (logical)
+ *  - the swap bank option bit maps bank 2 at FLASH_BASE, it takes effect on
+ *    the next start (HAL_FLASH_OB_Launch() resets)
+ *  - programming and erasing take time (see the timing model in sim.h)
+ *  - HAL_FLASHEx_Erase_IT() erases in the background and calls the end of
+ *    operation callback for every page, like HAL_FLASH_IRQHandler()
+ *
+ ******************************************************************************
+ */
+
+/* Includes -----------------------------------------------------------------*/
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "sim.h"
+
+/* Private defines ----------------------------------------------------------*/
+#define FLASH_FILE_SIZE (FLASH_SIZE + 16)		/* Banks, then FLASH_OPTR */
+#define FLASH_OPTR_OFFSET FLASH_SIZE
+#define FLASH_BURST_SIZE 128
+
+/* Variables ----------------------------------------------------------------*/
+FLASH_ProcessTypeDef pFlash = { HAL_UNLOCKED, HAL_FLASH_ERROR_NONE };
+
+static int flashFd = -1;
+static uint8_t *physical;				/* Both banks, writable (bank 1 first) */
+static int banksSwapped;				/* Swap bank option bit in effect (read at start) */
+static double timing;					/* Timing scale */
+static int locked = 1;					/* HAL_FLASH_Unlock() / HAL_FLASH_Lock() */
+static int optionsLocked = 1;			/* HAL_FLASH_OB_Unlock() / HAL_FLASH_OB_Lock() */
+
+/* Background erase (HAL_FLASHEx_Erase_IT()) */
+static struct {
+	pthread_mutex_t lock;
+	pthread_cond_t start;				/* Signaled when an erase is started */
+	pthread_cond_t idle;				/* Signaled when the last erase has finished */
+	volatile int procedureOnGoing;		/* Like pFlash.ProcedureOnGoing */
+	FLASH_EraseInitTypeDef erase;		/* The erase in progress */
+	pthread_t thread;
+} eraseIT = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, PTHREAD_COND_INITIALIZER };
+
+/* Functions ----------------------------------------------------------------*/
+
+static void flashDelay(uint32_t us) {
+	if (timing > 0) {
+		simSleepUs((uint64_t) (us * timing));
+	}
+}
+
+/**
+ * @return Offset of a (logical) address in the physical banks.
+ */
+static uint32_t flashPhysicalOffset(uint32_t address) {
+	uint32_t offset = address - FLASH_BASE;
+	return banksSwapped ? offset ^ FLASH_BANK_SIZE : offset;
+}
+
+static void *flashEraseThread(void *argument);
+
+/**
+ * Open the flash image and map it at FLASH_BASE. Must be called before the firmware runs.
+ *
+ * @param path File that keeps the flash between runs, created (erased) if it does not exist. NULL for
+ *             flash in memory, erased.
+ * @param timingScale Multiplies the program and erase durations, 0 for none.
+ * @return 0 on success, -1 on error.
+ */
+int simFlashOpen(const char *path, double timingScale) {
+	timing = timingScale;
+	flashFd = path != NULL ? open(path, O_RDWR | O_CREAT, 0644) : memfd_create("flash", 0);
+	if (flashFd < 0) {
+		perror("flash");
+		return -1;
+	}
+	struct stat st;
+	fstat(flashFd, &st);
+	int erased = st.st_size == 0;
+	if (ftruncate(flashFd, FLASH_FILE_SIZE) != 0) {
+		perror("flash");
+		return -1;
+	}
+
+	physical = mmap(NULL, FLASH_FILE_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, flashFd, 0);
+	if (physical == MAP_FAILED) {
+		perror("flash");
+		return -1;
+	}
+	if (erased) {
+		memset(physical, 0xFF, FLASH_SIZE);
+	}
+	uint32_t optr;
+	memcpy(&optr, physical + FLASH_OPTR_OFFSET, sizeof(optr));
+	banksSwapped = (optr & FLASH_OPTR_SWAP_BANK) != 0;
+
+	// the bank at FLASH_BASE, then the other one. Read-only, like flash without the programming sequence.
+	for (int bank = 0; bank < 2; bank++) {
+		void *address = (void *) (FLASH_BASE + bank * FLASH_BANK_SIZE);
+		off_t offset = (bank ^ banksSwapped) * FLASH_BANK_SIZE;
+		if (mmap(address, FLASH_BANK_SIZE, PROT_READ, MAP_SHARED | MAP_FIXED, flashFd, offset) != address) {
+			perror("flash");
+			return -1;
+		}
+	}
+
+	if (simThreadCreate(&eraseIT.thread, flashEraseThread, NULL) != 0) {
+		return -1;
+	}
+	printf("[sim] flash: %s, banks %sswapped\n", path != NULL ? path : "in memory", banksSwapped ? "" : "not ");
+	return 0;
+}
+
+/**
+ * Write the flash image back to its file.
+ */
+void simFlashClose() {
+	if (physical != NULL) {
+		msync(physical, FLASH_FILE_SIZE, MS_SYNC);
+	}
+}
+
+/**
+ * Erase pages of a physical bank.
+ */
+static void flashErasePages(uint32_t bank, uint32_t page, uint32_t count) {
+	uint8_t *base = physical + (bank == FLASH_BANK_2 ? FLASH_BANK_SIZE : 0);
+	memset(base + page * FLASH_PAGE_SIZE, 0xFF, count * FLASH_PAGE_SIZE);
+}
+
+/**
+ * Check the parameters of an erase, sets pFlash.ErrorCode.
+ */
+static HAL_StatusTypeDef flashCheckErase(FLASH_EraseInitTypeDef *pEraseInit) {
+	if (locked) {
+		pFlash.ErrorCode |= HAL_FLASH_ERROR_PGS;
+		return HAL_ERROR;
+	}
+	if (pEraseInit->TypeErase == FLASH_TYPEERASE_PAGES) {
+		if ((pEraseInit->Banks != FLASH_BANK_1 && pEraseInit->Banks != FLASH_BANK_2) || pEraseInit->NbPages == 0
+				|| pEraseInit->Page >= FLASH_PAGE_NB || pEraseInit->NbPages > FLASH_PAGE_NB - pEraseInit->Page) {
+			pFlash.ErrorCode |= HAL_FLASH_ERROR_OP;
+			return HAL_ERROR;
+		}
+	} else if ((pEraseInit->Banks & FLASH_BANK_BOTH) == 0) {
+		pFlash.ErrorCode |= HAL_FLASH_ERROR_OP;
+		return HAL_ERROR;
+	}
+	return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_FLASH_Unlock() {
+	locked = 0;
+	return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_FLASH_Lock() {
+	locked = 1;
+	return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_FLASH_OB_Unlock() {
+	if (locked) {
+		return HAL_ERROR;
+	}
+	optionsLocked = 0;
+	return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_FLASH_OB_Lock() {
+	optionsLocked = 1;
+	return HAL_OK;
+}
+
+/**
+ * Load the option bytes: resets the MCU, they are applied on the next start.
+ */
+HAL_StatusTypeDef HAL_FLASH_OB_Launch() {
+	if (optionsLocked) {
+		return HAL_ERROR;
+	}
+	simSystemReset();
+	return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_FLASHEx_OBProgram(FLASH_OBProgramInitTypeDef *pOBInit) {
+	if (locked || optionsLocked) {
+		pFlash.ErrorCode |= HAL_FLASH_ERROR_OPTW;
+		return HAL_ERROR;
+	}
+	if ((pOBInit->OptionType & OPTIONBYTE_USER) && (pOBInit->USERType & OB_USER_SWAP_BANK)) {
+		uint32_t optr;
+		memcpy(&optr, physical + FLASH_OPTR_OFFSET, sizeof(optr));
+		optr = (optr & ~FLASH_OPTR_SWAP_BANK) | (pOBInit->USERConfig & FLASH_OPTR_SWAP_BANK);
+		memcpy(physical + FLASH_OPTR_OFFSET, &optr, sizeof(optr));
+	}
+	return HAL_OK;
+}
+
+/**
+ * Reads FLASH_OPTR, the option bytes as programmed (those in effect until the next start may differ).
+ */
+void HAL_FLASHEx_OBGetConfig(FLASH_OBProgramInitTypeDef *pOBInit) {
+	uint32_t optr;
+	memcpy(&optr, physical + FLASH_OPTR_OFFSET, sizeof(optr));
+	pOBInit->OptionType = OPTIONBYTE_USER;
+	pOBInit->USERType = OB_USER_SWAP_BANK;
+	pOBInit->USERConfig = optr;
+}
+
+HAL_StatusTypeDef HAL_FLASH_Program(uint32_t TypeProgram, uint32_t Address, uint32_t DataAddress) {
+	uint32_t size = TypeProgram == FLASH_TYPEPROGRAM_BURST ? FLASH_BURST_SIZE : 16;
+	if (locked) {
+		pFlash.ErrorCode |= HAL_FLASH_ERROR_PGS;
+		return HAL_ERROR;
+	}
+	if (Address < FLASH_BASE || Address > FLASH_BASE + FLASH_SIZE - size || (Address & (size - 1)) != 0) {
+		pFlash.ErrorCode |= HAL_FLASH_ERROR_PGA;
+		return HAL_ERROR;
+	}
+
+	uint8_t *target = physical + flashPhysicalOffset(Address);
+	for (uint32_t i = 0; i < size; i++) {
+		if (target[i] != 0xFF) {
+			printf("[sim] flash: programming %08lx, quadword at %08lx is not erased\n", (unsigned long) Address,
+					(unsigned long) (Address + (i & ~0xfU)));
+			pFlash.ErrorCode |= HAL_FLASH_ERROR_PROG;
+			return HAL_ERROR;
+		}
+	}
+	flashDelay(TypeProgram == FLASH_TYPEPROGRAM_BURST ? SIM_FLASH_BURST_PROGRAM_US : SIM_FLASH_QUADWORD_PROGRAM_US);
+	memcpy(target, (const void *) (uintptr_t) DataAddress, size);
+	return HAL_OK;
+}
+
+/**
+ * Mass erase the banks of an erase.
+ */
+static void flashMassErase(uint32_t banks) {
+	for (uint32_t bank = FLASH_BANK_1; bank <= FLASH_BANK_2; bank++) {
+		if (banks & bank) {
+			flashDelay(SIM_FLASH_MASS_ERASE_US);
+			flashErasePages(bank, 0, FLASH_PAGE_NB);
+		}
+	}
+}
+
+HAL_StatusTypeDef HAL_FLASHEx_Erase(FLASH_EraseInitTypeDef *pEraseInit, uint32_t *PageError) {
+	*PageError = 0xFFFFFFFFU;
+	if (FLASH_WaitForLastOperation(HAL_MAX_DELAY) != HAL_OK || flashCheckErase(pEraseInit) != HAL_OK) {
+		return HAL_ERROR;
+	}
+	if (pEraseInit->TypeErase == FLASH_TYPEERASE_PAGES) {
+		for (uint32_t page = pEraseInit->Page; page < pEraseInit->Page + pEraseInit->NbPages; page++) {
+			flashDelay(SIM_FLASH_PAGE_ERASE_US);
+			flashErasePages(pEraseInit->Banks, page, 1);
+		}
+	} else {
+		flashMassErase(pEraseInit->Banks);
+	}
+	return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_FLASHEx_Erase_IT(FLASH_EraseInitTypeDef *pEraseInit) {
+	if (pFlash.Lock == HAL_LOCKED) {
+		return HAL_BUSY;
+	}
+	pFlash.Lock = HAL_LOCKED;
+	if (flashCheckErase(pEraseInit) != HAL_OK) {
+		pFlash.Lock = HAL_UNLOCKED;
+		return HAL_ERROR;
+	}
+
+	pthread_mutex_lock(&eraseIT.lock);
+	eraseIT.erase = *pEraseInit;
+	eraseIT.procedureOnGoing = 1;
+	pthread_cond_signal(&eraseIT.start);
+	pthread_mutex_unlock(&eraseIT.lock);
+	return HAL_OK;
+}
+
+/**
+ * The FLASH interrupt: erases the pages of the erase in progress one at a time and calls the end of
+ * operation callback after each of them (the page number, 0xFFFFFFFF for the last one or the bank for a
+ * mass erase). The HAL is unlocked after the last callback, unless it started another erase.
+ */
+static void *flashEraseThread(void *argument) {
+	pthread_mutex_lock(&eraseIT.lock);
+	while (1) {
+		while (!eraseIT.procedureOnGoing) {
+			pthread_cond_wait(&eraseIT.start, &eraseIT.lock);
+		}
+		FLASH_EraseInitTypeDef erase = eraseIT.erase;
+		pthread_mutex_unlock(&eraseIT.lock);
+
+		uint32_t returnValue;
+		if (erase.TypeErase == FLASH_TYPEERASE_PAGES) {
+			for (uint32_t i = 0; i < erase.NbPages - 1; i++) {
+				flashDelay(SIM_FLASH_PAGE_ERASE_US);
+				flashErasePages(erase.Banks, erase.Page + i, 1);
+				HAL_FLASH_EndOfOperationCallback(erase.Page + i);
+			}
+			flashDelay(SIM_FLASH_PAGE_ERASE_US);
+			flashErasePages(erase.Banks, erase.Page + erase.NbPages - 1, 1);
+			returnValue = 0xFFFFFFFFU;
+		} else {
+			flashMassErase(erase.Banks);
+			returnValue = erase.Banks;
+		}
+
+		pthread_mutex_lock(&eraseIT.lock);
+		eraseIT.procedureOnGoing = 0;
+		pthread_mutex_unlock(&eraseIT.lock);
+		HAL_FLASH_EndOfOperationCallback(returnValue);
+
+		pthread_mutex_lock(&eraseIT.lock);
+		if (!eraseIT.procedureOnGoing) {
+			pFlash.Lock = HAL_UNLOCKED;
+			pthread_cond_broadcast(&eraseIT.idle);
+		}
+	}
+	return NULL;
+}
+
+/**
+ * Wait for the background erase to finish (the BSY flag).
+ */
+HAL_StatusTypeDef FLASH_WaitForLastOperation(uint32_t Timeout) {
+	pthread_mutex_lock(&eraseIT.lock);
+	while (eraseIT.procedureOnGoing) {
+		pthread_cond_wait(&eraseIT.idle, &eraseIT.lock);
+	}
+	pthread_mutex_unlock(&eraseIT.lock);
+	return HAL_OK;
+}
+
+uint32_t HAL_FLASH_GetError() {
+	return pFlash.ErrorCode;
+}
+
+void simFlashClearFlags(uint32_t flags) {
+	pFlash.ErrorCode = HAL_FLASH_ERROR_NONE;
+}
+
+void simFlashDisableIt(uint32_t interrupts) {
+}
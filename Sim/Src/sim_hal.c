@@ -0,0 +1,175 @@
+/**
+ ******************************************************************************
+ * @file           sim_hal.c
+ * @brief          Host simulation: clock, DWT, GPIO, NVIC and threads
+ ******************************************************************************
+ *
+ * HAL_GetTick() and the DWT cycle counter follow the host's monotonic clock,
+ * so the simulation runs in real time and timings measured by the firmware
+ * (and the UART and flash timing models) are comparable to the board.
+ *
+ * The OTA modules store pointers in uint32_t like they do on the MCU, so
+ * every thread that runs firmware code gets its stack below 4 GB
+ * (simThreadCreate()), and the executable is linked without PIE.
+ *
+ * Interrupts are threads. Masking them (PRIMASK) takes a lock, which the
+ * simulated interrupts whose handlers share state with masked code take
+ * before calling them (the UART transmit complete callback).
+ *
+ ******************************************************************************
+ */
+
+/* Includes -----------------------------------------------------------------*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <sys/mman.h>
+
+#include "main.h"
+#include "sim.h"
+
+/* Variables ----------------------------------------------------------------*/
+uint32_t SystemCoreClock = SIM_CORE_CLOCK;
+GPIO_TypeDef simGpioPorts[9] = { { 0 }, { 1 }, { 2 }, { 3 }, { 4 }, { 5 }, { 6 }, { 7 }, { 8 } };
+CoreDebug_Type simCoreDebug;
+
+static uint16_t gpioOutputs[9];		/* Last level written to each pin */
+static DWT_Type dwt;
+static uint32_t dwtLastCount;		/* CYCCNT as last returned, a different value was written by the firmware */
+static int64_t dwtOffset;			/* Added to the cycles of the clock */
+static int buttonLevel = 1;			/* User button, see HAL_GPIO_ReadPin() */
+static pthread_mutex_t irqMask = PTHREAD_MUTEX_INITIALIZER;	/* Held while a thread has interrupts masked */
+static __thread uint32_t primask;	/* 1 while this thread holds irqMask */
+
+/* Functions ----------------------------------------------------------------*/
+
+/**
+ * @return Microseconds since an arbitrary point (host monotonic clock).
+ */
+uint64_t simTimeUs() {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t) now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+/**
+ * Sleep for a number of microseconds.
+ */
+void simSleepUs(uint64_t us) {
+	struct timespec duration = { us / 1000000, (us % 1000000) * 1000 };
+	while (nanosleep(&duration, &duration) != 0) {
+		// interrupted, sleep for the rest
+	}
+}
+
+/**
+ * Create a thread that may run firmware code (its stack is below 4 GB, see the file header).
+ *
+ * @return 0 on success, an error number otherwise.
+ */
+int simThreadCreate(pthread_t *thread, void *(*function)(void *), void *argument) {
+	void *stack = mmap(NULL, SIM_THREAD_STACK_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_32BIT | MAP_STACK, -1, 0);
+	if (stack == MAP_FAILED) {
+		return -1;
+	}
+	pthread_attr_t attr;
+	pthread_attr_init(&attr);
+	pthread_attr_setstack(&attr, stack, SIM_THREAD_STACK_SIZE);
+	int error = pthread_create(thread, &attr, function, argument);
+	pthread_attr_destroy(&attr);
+	return error;
+}
+
+/**
+ * The MCU resets (HAL_NVIC_SystemReset(), HAL_FLASH_OB_Launch()). The simulation ends, the flash image (and
+ * the option bytes, applied on the next start) is kept.
+ */
+void simSystemReset() {
+	printf("[sim] system reset\n");
+	fflush(stdout);
+	simLinkClose();
+	simFlashClose();
+	exit(0);
+}
+
+/**
+ * @return PRIMASK of the calling thread: 1 if it masked interrupts.
+ */
+uint32_t simGetPrimask() {
+	return primask;
+}
+
+/**
+ * Mask (1) or unmask (0) interrupts: while one thread has them masked, the others wait to mask them.
+ */
+void simSetPrimask(uint32_t priMask) {
+	if (priMask && !primask) {
+		pthread_mutex_lock(&irqMask);
+		primask = 1;
+	} else if (!priMask && primask) {
+		primask = 0;
+		pthread_mutex_unlock(&irqMask);
+	}
+}
+
+uint32_t HAL_GetTick() {
+	static uint64_t start;
+	if (start == 0) {
+		start = simTimeUs();
+	}
+	return (uint32_t) ((simTimeUs() - start) / 1000);
+}
+
+void HAL_Delay(uint32_t Delay) {
+	simSleepUs((uint64_t) Delay * 1000);
+}
+
+/**
+ * @return The DWT registers, with CYCCNT advanced to the current time at SystemCoreClock if the counter is enabled.
+ */
+DWT_Type *simDwt() {
+	if (dwt.CYCCNT != dwtLastCount) {
+		// written by the firmware (usually reset to 0), count on from there
+		dwtOffset += (int64_t) dwt.CYCCNT - dwtLastCount;
+	}
+	if ((dwt.CTRL & DWT_CTRL_CYCCNTENA_Msk) && (simCoreDebug.DEMCR & CoreDebug_DEMCR_TRCENA_Msk)) {
+		dwt.CYCCNT = (uint32_t) (simTimeUs() * (SIM_CORE_CLOCK / 1000000) + dwtOffset);
+	}
+	dwtLastCount = dwt.CYCCNT;
+	return &dwt;
+}
+
+/**
+ * Output pins keep the level written. PF3 is the BT122 UART mode (LED0), and the user button is pressed
+ * whenever the firmware waits for it: its level alternates on every read.
+ */
+GPIO_PinState HAL_GPIO_ReadPin(GPIO_TypeDef *GPIOx, uint16_t GPIO_Pin) {
+	if (GPIOx == BT122_PF3_GPIO_Port && GPIO_Pin == BT122_PF3_Pin) {
+		return simBt122ModePin();
+	}
+	if (GPIOx == USER_BUTTON_GPIO_Port && GPIO_Pin == USER_BUTTON_Pin) {
+		buttonLevel = !buttonLevel;
+		return buttonLevel ? GPIO_PIN_SET : GPIO_PIN_RESET;
+	}
+	return (gpioOutputs[GPIOx->port] & GPIO_Pin) ? GPIO_PIN_SET : GPIO_PIN_RESET;
+}
+
+void HAL_GPIO_WritePin(GPIO_TypeDef *GPIOx, uint16_t GPIO_Pin, GPIO_PinState PinState) {
+	if (PinState == GPIO_PIN_SET) {
+		gpioOutputs[GPIOx->port] |= GPIO_Pin;
+	} else {
+		gpioOutputs[GPIOx->port] &= ~GPIO_Pin;
+	}
+	simBt122GpioWrite(GPIOx, GPIO_Pin, PinState);
+}
+
+void HAL_NVIC_SetPriority(IRQn_Type IRQn, uint32_t PreemptPriority, uint32_t SubPriority) {
+	// interrupts are threads, all of them are always enabled
+}
+
+void HAL_NVIC_EnableIRQ(IRQn_Type IRQn) {
+}
+
+void HAL_NVIC_SystemReset() {
+	simSystemReset();
+}
@@ -0,0 +1,247 @@
+/**
+ ******************************************************************************
+ * @file           sim_hash.c
+ * @brief          Host simulation: HASH peripheral (SHA-256 in software)
+ ******************************************************************************
+ *
+ * The polling functions hash right away. HAL_HASHEx_SHA256_Start_DMA() hands
+ * the data to a thread that plays the part of the DMA channel and calls
+ * HAL_HASH_InCpltCallback() when it is done, so the firmware can do other
+ * work in the meantime like on the MCU. With MDMAT set the digest is not
+ * computed at the end of a transfer, the next one continues the message.
+ *
+ ******************************************************************************
+ */
+
+/* Includes -----------------------------------------------------------------*/
+#include <string.h>
+
+#include "sim.h"
+
+/* Variables ----------------------------------------------------------------*/
+static const uint32_t sha256K[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+/* DMA transfer to the HASH peripheral */
+static struct {
+	pthread_mutex_t lock;
+	pthread_cond_t changed;				/* Signaled when a transfer starts or ends */
+	HASH_HandleTypeDef *hhash;			/* Handle of the transfer in progress, NULL if none */
+	const uint8_t *data;
+	uint32_t length;
+	int multipleTransfers;				/* MDMAT */
+	uint8_t digest[32];					/* Computed at the end of the last transfer of a message */
+	int digestReady;
+	pthread_t thread;
+	int started;
+} hashDma = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER };
+
+/* Functions ----------------------------------------------------------------*/
+
+#define ROR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+static void sha256Block(uint32_t *state, const uint8_t *block) {
+	uint32_t w[64];
+	for (int i = 0; i < 16; i++) {
+		w[i] = (uint32_t) block[i * 4] << 24 | (uint32_t) block[i * 4 + 1] << 16 | (uint32_t) block[i * 4 + 2] << 8 | block[i * 4 + 3];
+	}
+	for (int i = 16; i < 64; i++) {
+		uint32_t s0 = ROR(w[i - 15], 7) ^ ROR(w[i - 15], 18) ^ (w[i - 15] >> 3);
+		uint32_t s1 = ROR(w[i - 2], 17) ^ ROR(w[i - 2], 19) ^ (w[i - 2] >> 10);
+		w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+	}
+
+	uint32_t a = state[0], b = state[1], c = state[2], d = state[3], e = state[4], f = state[5], g = state[6], h = state[7];
+	for (int i = 0; i < 64; i++) {
+		uint32_t t1 = h + (ROR(e, 6) ^ ROR(e, 11) ^ ROR(e, 25)) + ((e & f) ^ (~e & g)) + sha256K[i] + w[i];
+		uint32_t t2 = (ROR(a, 2) ^ ROR(a, 13) ^ ROR(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+		h = g;
+		g = f;
+		f = e;
+		e = d + t1;
+		d = c;
+		c = b;
+		b = a;
+		a = t1 + t2;
+	}
+	state[0] += a;
+	state[1] += b;
+	state[2] += c;
+	state[3] += d;
+	state[4] += e;
+	state[5] += f;
+	state[6] += g;
+	state[7] += h;
+}
+
+/**
+ * Start a SHA-256 digest, in the state fields of a HASH handle.
+ */
+void simSha256Init(HASH_HandleTypeDef *context) {
+	static const uint32_t initial[8] = {
+		0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+	};
+	memcpy(context->state, initial, sizeof(initial));
+	context->length = 0;
+	context->blockLength = 0;
+	context->started = 1;
+}
+
+void simSha256Update(HASH_HandleTypeDef *context, const uint8_t *data, uint32_t length) {
+	context->length += length;
+	if (context->blockLength > 0) {
+		uint32_t n = 64 - context->blockLength < length ? 64 - context->blockLength : length;
+		memcpy(context->block + context->blockLength, data, n);
+		context->blockLength += n;
+		data += n;
+		length -= n;
+		if (context->blockLength < 64) {
+			return;
+		}
+		sha256Block(context->state, context->block);
+		context->blockLength = 0;
+	}
+	for (; length >= 64; data += 64, length -= 64) {
+		sha256Block(context->state, data);
+	}
+	memcpy(context->block, data, length);
+	context->blockLength = length;
+}
+
+void simSha256Final(HASH_HandleTypeDef *context, uint8_t *digest) {
+	uint64_t bits = context->length * 8;
+	uint8_t padding[72] = { 0x80 };
+	uint32_t padLength = (context->blockLength < 56 ? 56 : 120) - context->blockLength;
+	for (int i = 0; i < 8; i++) {
+		padding[padLength + i] = (uint8_t) (bits >> (56 - i * 8));
+	}
+	simSha256Update(context, padding, padLength + 8);
+	for (int i = 0; i < 8; i++) {
+		digest[i * 4] = (uint8_t) (context->state[i] >> 24);
+		digest[i * 4 + 1] = (uint8_t) (context->state[i] >> 16);
+		digest[i * 4 + 2] = (uint8_t) (context->state[i] >> 8);
+		digest[i * 4 + 3] = (uint8_t) context->state[i];
+	}
+	context->started = 0;
+}
+
+/**
+ * The DMA channel: feeds each transfer to the digest, then calls the input complete callback.
+ */
+static void *hashDmaThread(void *argument) {
+	pthread_mutex_lock(&hashDma.lock);
+	while (1) {
+		while (hashDma.hhash == NULL) {
+			pthread_cond_wait(&hashDma.changed, &hashDma.lock);
+		}
+		HASH_HandleTypeDef *hhash = hashDma.hhash;
+		pthread_mutex_unlock(&hashDma.lock);
+
+		simSha256Update(hhash, hashDma.data, hashDma.length);
+		if (!hashDma.multipleTransfers) {
+			simSha256Final(hhash, hashDma.digest);
+			hashDma.digestReady = 1;
+		}
+
+		pthread_mutex_lock(&hashDma.lock);
+		hashDma.hhash = NULL;
+		pthread_cond_broadcast(&hashDma.changed);
+		pthread_mutex_unlock(&hashDma.lock);
+		HAL_HASH_InCpltCallback(hhash);
+		pthread_mutex_lock(&hashDma.lock);
+	}
+	return NULL;
+}
+
+HAL_StatusTypeDef HAL_HASH_Init(HASH_HandleTypeDef *hhash) {
+	hhash->started = 0;
+	if (!hashDma.started) {
+		if (simThreadCreate(&hashDma.thread, hashDmaThread, NULL) != 0) {
+			return HAL_ERROR;
+		}
+		hashDma.started = 1;
+	}
+	return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_HASHEx_SHA256_Start(HASH_HandleTypeDef *hhash, uint8_t *pInBuffer, uint32_t Size, uint8_t *pOutBuffer, uint32_t Timeout) {
+	simSha256Init(hhash);
+	simSha256Update(hhash, pInBuffer, Size);
+	simSha256Final(hhash, pOutBuffer);
+	return HAL_OK;
+}
+
+/**
+ * Feed part of a message. Like the HAL, the size must be a multiple of 4 (only the last part, given to
+ * HAL_HASHEx_SHA256_Accmlt_End(), may be any size).
+ */
+HAL_StatusTypeDef HAL_HASHEx_SHA256_Accmlt(HASH_HandleTypeDef *hhash, uint8_t *pInBuffer, uint32_t Size) {
+	if ((Size % 4) != 0) {
+		return HAL_ERROR;
+	}
+	if (!hhash->started) {
+		simSha256Init(hhash);
+	}
+	simSha256Update(hhash, pInBuffer, Size);
+	return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_HASHEx_SHA256_Accmlt_End(HASH_HandleTypeDef *hhash, uint8_t *pInBuffer, uint32_t Size, uint8_t *pOutBuffer, uint32_t Timeout) {
+	if (!hhash->started) {
+		simSha256Init(hhash);
+	}
+	simSha256Update(hhash, pInBuffer, Size);
+	simSha256Final(hhash, pOutBuffer);
+	return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_HASHEx_SHA256_Start_DMA(HASH_HandleTypeDef *hhash, uint8_t *pInBuffer, uint32_t Size) {
+	if (hhash->hdmain == NULL) {
+		return HAL_ERROR;
+	}
+	pthread_mutex_lock(&hashDma.lock);
+	if (hashDma.hhash != NULL) {
+		pthread_mutex_unlock(&hashDma.lock);
+		return HAL_BUSY;
+	}
+	if (!hhash->started) {
+		simSha256Init(hhash);
+		hashDma.digestReady = 0;
+	}
+	hashDma.data = pInBuffer;
+	hashDma.length = Size;
+	hashDma.hhash = hhash;
+	pthread_cond_broadcast(&hashDma.changed);
+	pthread_mutex_unlock(&hashDma.lock);
+	return HAL_OK;
+}
+
+/**
+ * Read the digest computed at the end of the last DMA transfer.
+ */
+HAL_StatusTypeDef HAL_HASHEx_SHA256_Finish(HASH_HandleTypeDef *hhash, uint8_t *pOutBuffer, uint32_t Timeout) {
+	pthread_mutex_lock(&hashDma.lock);
+	while (hashDma.hhash != NULL) {
+		pthread_cond_wait(&hashDma.changed, &hashDma.lock);
+	}
+	int ready = hashDma.digestReady;
+	hashDma.digestReady = 0;
+	pthread_mutex_unlock(&hashDma.lock);
+	if (!ready) {
+		return HAL_ERROR;
+	}
+	memcpy(pOutBuffer, hashDma.digest, 32);
+	return HAL_OK;
+}
+
+void simHashSetMultipleDma(int enable) {
+	hashDma.multipleTransfers = enable;
+}
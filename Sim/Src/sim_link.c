@@ -0,0 +1,235 @@
+/**
+ ******************************************************************************
+ * @file           sim_link.c
+ * @brief          Host simulation: Bluetooth (RFCOMM) link of the BT122
+ ******************************************************************************
+ *
+ * The remote end of the link is a pseudo terminal, the OTA client opens it
+ * as its serial port. Data crosses the link in frames of up to
+ * SIM_LINK_FRAME_SIZE bytes, each direction like an RFCOMM channel of its
+ * own:
+ *  - rate: a frame takes length / rate to send, frames are sent one after
+ *    the other
+ *  - latency: a frame arrives this long after it was sent
+ *  - loss: a frame is lost with this probability (pseudo random, seeded).
+ *    RFCOMM itself is reliable, this stands for what the rest of the path
+ *    (the BT122 buffers, the UART) can lose, the OTA protocol recovers.
+ *    The handshake before the download is not retransmitted, losses can be
+ *    held off for the first bytes of each direction (lossStartBytes).
+ * A direction that is full stops taking data (flow control): the client's
+ * writes wait, and so does the BT122 UART.
+ *
+ ******************************************************************************
+ */
+
+/* Includes -----------------------------------------------------------------*/
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <termios.h>
+#include <unistd.h>
+
+#include "sim.h"
+
+/* Private defines ----------------------------------------------------------*/
+#define LINK_POLL_MS 1					/* Longest the link thread sleeps */
+
+/* Variables ----------------------------------------------------------------*/
+typedef struct {
+	uint64_t dueUs;						/* Arrival time */
+	int length;
+	int offset;							/* Bytes already taken by the receiver */
+	uint8_t data[SIM_LINK_FRAME_SIZE];
+} LinkFrame;
+
+typedef struct {
+	LinkFrame frames[SIM_LINK_QUEUE_FRAMES];	/* Frames in flight */
+	uint32_t head;
+	uint32_t tail;
+	uint64_t busyUntilUs;				/* The last frame queued is sent at this time */
+	SimLinkStats stats;
+} LinkDirection;
+
+static struct {
+	pthread_mutex_t lock;
+	pthread_cond_t space;				/* Signaled when a frame to the client has arrived */
+	LinkDirection toDevice;
+	LinkDirection toClient;
+	SimLinkConfig config;
+	unsigned int random;				/* Loss state */
+	int master;							/* Pseudo terminal, link side */
+	int slave;							/* Kept open, so the master works before the client opens it */
+	char path[256];						/* Symbolic link to the pseudo terminal, or empty */
+	pthread_t thread;
+} simLink = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER };
+
+/* Functions ----------------------------------------------------------------*/
+
+/**
+ * Queue a frame on a direction of the link, with its arrival time, unless it is lost. The direction must
+ * have room for it. Called with the lock held.
+ */
+static void linkQueueFrame(LinkDirection *direction, const uint8_t *data, int length) {
+	uint64_t now = simTimeUs();
+	uint64_t start = direction->busyUntilUs > now ? direction->busyUntilUs : now;
+	if (simLink.config.rate > 0) {
+		direction->busyUntilUs = start + (uint64_t) length * 1000000 / simLink.config.rate;
+	} else {
+		direction->busyUntilUs = start;
+	}
+	int lossy = direction->stats.bytes >= simLink.config.lossStartBytes;
+	direction->stats.bytes += length;
+	direction->stats.frames++;
+	if (lossy && simLink.config.loss > 0 && (double) rand_r(&simLink.random) / RAND_MAX < simLink.config.loss) {
+		direction->stats.lostFrames++;
+		return;
+	}
+
+	LinkFrame *frame = &direction->frames[direction->head++ % SIM_LINK_QUEUE_FRAMES];
+	frame->dueUs = direction->busyUntilUs + simLink.config.latencyUs;
+	frame->length = length;
+	frame->offset = 0;
+	memcpy(frame->data, data, length);
+}
+
+/**
+ * @return The oldest frame of a direction if it has arrived, NULL otherwise. It stays queued until the tail
+ *         is advanced.
+ */
+static LinkFrame *linkNextFrame(LinkDirection *direction, uint64_t now) {
+	LinkFrame *frame = NULL;
+	pthread_mutex_lock(&simLink.lock);
+	if (direction->head != direction->tail) {
+		frame = &direction->frames[direction->tail % SIM_LINK_QUEUE_FRAMES];
+		if (frame->dueUs > now) {
+			frame = NULL;
+		}
+	}
+	pthread_mutex_unlock(&simLink.lock);
+	return frame;
+}
+
+/**
+ * Send data from the BT122 to the client. Waits while the link is full.
+ */
+void simLinkSend(const uint8_t *data, int length) {
+	pthread_mutex_lock(&simLink.lock);
+	while (length > 0) {
+		while (simLink.toClient.head - simLink.toClient.tail == SIM_LINK_QUEUE_FRAMES) {
+			pthread_cond_wait(&simLink.space, &simLink.lock);
+		}
+		int n = length < SIM_LINK_FRAME_SIZE ? length : SIM_LINK_FRAME_SIZE;
+		linkQueueFrame(&simLink.toClient, data, n);
+		data += n;
+		length -= n;
+	}
+	pthread_mutex_unlock(&simLink.lock);
+}
+
+/**
+ * Moves the frames: reads what the client sends (while the link has room for it) and hands the frames that
+ * have arrived to the BT122 and to the client, as fast as they take them.
+ */
+static void *linkThread(void *argument) {
+	uint8_t buffer[SIM_LINK_FRAME_SIZE];
+	while (1) {
+		pthread_mutex_lock(&simLink.lock);
+		int room = simLink.toDevice.head - simLink.toDevice.tail < SIM_LINK_QUEUE_FRAMES;
+		pthread_mutex_unlock(&simLink.lock);
+
+		struct pollfd fd = { simLink.master, room ? POLLIN : 0, 0 };
+		poll(&fd, 1, LINK_POLL_MS);
+		if (fd.revents & POLLIN) {
+			int length = read(simLink.master, buffer, sizeof(buffer));
+			if (length > 0) {
+				pthread_mutex_lock(&simLink.lock);
+				linkQueueFrame(&simLink.toDevice, buffer, length);
+				pthread_mutex_unlock(&simLink.lock);
+			}
+		}
+
+		uint64_t now = simTimeUs();
+		LinkFrame *frame;
+		// the receivers are called without the lock, the BT122 may be sending at the same time
+		while ((frame = linkNextFrame(&simLink.toDevice, now)) != NULL) {
+			frame->offset += simBt122LinkReceive(frame->data + frame->offset, frame->length - frame->offset);
+			if (frame->offset < frame->length) {
+				break;
+			}
+			pthread_mutex_lock(&simLink.lock);
+			simLink.toDevice.tail++;
+			pthread_mutex_unlock(&simLink.lock);
+		}
+		while ((frame = linkNextFrame(&simLink.toClient, now)) != NULL) {
+			int written = write(simLink.master, frame->data + frame->offset, frame->length - frame->offset);
+			if (written <= 0) {
+				// the client is not reading
+				break;
+			}
+			frame->offset += written;
+			if (frame->offset < frame->length) {
+				break;
+			}
+			pthread_mutex_lock(&simLink.lock);
+			simLink.toClient.tail++;
+			pthread_cond_broadcast(&simLink.space);
+			pthread_mutex_unlock(&simLink.lock);
+		}
+	}
+	return NULL;
+}
+
+/**
+ * Create the pseudo terminal and start the simLink.
+ *
+ * @param path If not NULL, a symbolic link to the pseudo terminal is created there.
+ * @param config Rate, latency and loss of the simLink.
+ * @return 0 on success, -1 on error.
+ */
+int simLinkOpen(const char *path, const SimLinkConfig *config) {
+	simLink.config = *config;
+	simLink.random = config->seed;
+	simLink.master = posix_openpt(O_RDWR | O_NOCTTY);
+	if (simLink.master < 0 || grantpt(simLink.master) != 0 || unlockpt(simLink.master) != 0) {
+		perror("pseudo terminal");
+		return -1;
+	}
+	const char *slavePath = ptsname(simLink.master);
+	simLink.slave = open(slavePath, O_RDWR | O_NOCTTY);
+	struct termios tio;
+	tcgetattr(simLink.slave, &tio);
+	cfmakeraw(&tio);
+	tcsetattr(simLink.slave, TCSANOW, &tio);
+	fcntl(simLink.master, F_SETFL, O_NONBLOCK);
+
+	if (path != NULL) {
+		snprintf(simLink.path, sizeof(simLink.path), "%s", path);
+		unlink(path);
+		if (symlink(slavePath, path) != 0) {
+			perror(path);
+			simLink.path[0] = 0;
+		}
+	}
+	printf("[sim] link on %s%s%s: %lu bytes/s (0: unlimited), %lu us latency, %.1f%% frames lost after %lu bytes\n",
+			slavePath, simLink.path[0] ? " -> " : "", simLink.path, (unsigned long) config->rate,
+			(unsigned long) config->latencyUs, config->loss * 100, (unsigned long) config->lossStartBytes);
+	return pthread_create(&simLink.thread, NULL, linkThread, NULL);
+}
+
+/**
+ * Print the link statistics and remove the link to the pseudo terminal.
+ */
+void simLinkClose() {
+	pthread_mutex_lock(&simLink.lock);
+	printf("[sim] link to device: %llu bytes, %llu frames, %llu lost\n", (unsigned long long) simLink.toDevice.stats.bytes,
+			(unsigned long long) simLink.toDevice.stats.frames, (unsigned long long) simLink.toDevice.stats.lostFrames);
+	printf("[sim] link to client: %llu bytes, %llu frames, %llu lost\n", (unsigned long long) simLink.toClient.stats.bytes,
+			(unsigned long long) simLink.toClient.stats.frames, (unsigned long long) simLink.toClient.stats.lostFrames);
+	pthread_mutex_unlock(&simLink.lock);
+	if (simLink.path[0]) {
+		unlink(simLink.path);
+	}
+}
@@ -0,0 +1,217 @@
+/**
+ ******************************************************************************
+ * @file           sim_main.c
+ * @brief          Host simulation: entry point
+ ******************************************************************************
+ *
+ * Sets up the peripherals like main.c does and runs one OTA flow (the U5 or
+ * the BT122 firmware upgrade) against the emulated flash, UARTs, HASH and
+ * BT122. The OTA client connects to the BT122 link (a pseudo terminal):
+ *
+ *   Sim/build/ota_sim --u5 --flash u5.bin --link /tmp/ota_sim
+ *   OTA_SERIAL_PORT=/tmp/ota_sim python3 ota_client_serial.py new.bin
+ *
+ * Exits with 0 if the flow succeeded (or reset the MCU), 1 otherwise.
+ *
+ ******************************************************************************
+ */
+
+/* Includes -----------------------------------------------------------------*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "main.h"
+#include "bgapi.h"
+#include "flash.h"
+#include "log.h"
+#include "ota.h"
+#include "trace.h"
+#include "uart.h"
+#include "sim.h"
+
+/* Private defines ----------------------------------------------------------*/
+#define FLASH_USER_START_ADDR 0x08100000	/* Where main.c downloads the BT122 image */
+
+/* Variables ----------------------------------------------------------------*/
+HASH_HandleTypeDef hhash;
+UART_HandleTypeDef huart1;
+UART_HandleTypeDef huart2;
+
+static int dmaChannel;						/* Linked to the handles, the simulated DMA needs no state */
+static DMA_HandleTypeDef consoleTxDma = { DMA_NORMAL, NULL };	/* USART1 TX (log.c) */
+static DMA_HandleTypeDef consoleRxDma;		/* USART1 RX, circular */
+static DMA_HandleTypeDef bgapiRxDma;		/* USART2 RX, circular */
+#ifdef UART_TX_DMA_ENABLED
+static DMA_NodeTypeDef bgapiTxNodes[2];		/* USART2 TX (uart_tx_gather()): header node, payload node */
+static DMA_QListTypeDef bgapiTxList = { bgapiTxNodes, 2 };
+static DMA_HandleTypeDef bgapiTxDma = { DMA_LINKEDLIST_NORMAL, &bgapiTxList };
+#endif
+static int u5Upgrade = 0;
+static int logLevel = LOG_LEVEL_DEFAULT;
+
+/* Functions ----------------------------------------------------------------*/
+
+void HAL_UART_RxCpltCallback(UART_HandleTypeDef *huart) {
+	uart_rx_it_callback(huart);
+}
+
+void HAL_UARTEx_RxEventCallback(UART_HandleTypeDef *huart, uint16_t Size) {
+	uart_rx_dma_event(huart, Size);
+}
+
+void HAL_UART_TxCpltCallback(UART_HandleTypeDef *huart) {
+	logTxCallback(huart);
+}
+
+void HAL_UART_ErrorCallback(UART_HandleTypeDef *huart) {
+	if (huart->RxState == HAL_UART_STATE_READY) {
+		uart_rx_start(huart);
+	}
+}
+
+void Error_Handler() {
+	printf("[sim] Error_Handler()\n");
+	exit(1);
+}
+
+#ifdef UART_TX_DMA_ENABLED
+/**
+ * The USART2 TX channel of HAL_UART_MspInit(): a queue of 2 nodes, the first links to the second.
+ */
+static void bgapiTxDmaInit() {
+	if ((((uint32_t) &bgapiTxNodes[0] ^ (uint32_t) &bgapiTxNodes[1]) & DMA_CLBAR_LBA) != 0) {
+		Error_Handler();
+	}
+	bgapiTxNodes[0].LinkRegisters[NODE_CLLR_LINEAR_DEFAULT_OFFSET] = (uint32_t) &bgapiTxNodes[1] & DMA_CLLR_LA;
+	bgapiTxNodes[1].LinkRegisters[NODE_CLLR_LINEAR_DEFAULT_OFFSET] = 0;
+}
+#endif
+
+static void uartInit(UART_HandleTypeDef *huart, USART_TypeDef *instance, uint32_t hwFlowCtl, DMA_HandleTypeDef *rxDma) {
+	huart->Instance = instance;
+	huart->Init.BaudRate = 115200;
+	huart->Init.WordLength = UART_WORDLENGTH_8B;
+	huart->Init.StopBits = UART_STOPBITS_1;
+	huart->Init.Parity = UART_PARITY_NONE;
+	huart->Init.Mode = UART_MODE_TX_RX;
+	huart->Init.HwFlowCtl = hwFlowCtl;
+	huart->Init.OverSampling = UART_OVERSAMPLING_16;
+	huart->hdmarx = rxDma;
+	if (HAL_UART_Init(huart) != HAL_OK) {
+		Error_Handler();
+	}
+}
+
+/**
+ * The firmware: main() of main.c, from the peripheral initialization on.
+ */
+static void *firmwareMain(void *argument) {
+	static HAL_StatusTypeDef status;
+
+	hhash.Init.DataType = HASH_DATATYPE_8B;
+	hhash.hdmain = &dmaChannel;
+	if (HAL_HASH_Init(&hhash) != HAL_OK) {
+		Error_Handler();
+	}
+	uartInit(&huart1, USART1, UART_HWCONTROL_NONE, &consoleRxDma);
+	uartInit(&huart2, USART2, UART_HWCONTROL_RTS_CTS, &bgapiRxDma);
+	huart1.hdmatx = &consoleTxDma;
+#ifdef UART_TX_DMA_ENABLED
+	bgapiTxDmaInit();
+	huart2.hdmatx = &bgapiTxDma;
+#endif
+
+	// host printf() goes to stdout directly, the LOG_ macros go through the log buffer and USART1
+	logInit(&huart1);
+	logSetLevel(logLevel);
+	flashInit();
+	register_UART(1, &huart1);
+	register_UART(2, &huart2);
+	if (uart_rx_start(&huart1) != HAL_OK || uart_rx_start(&huart2) != HAL_OK) {
+		Error_Handler();
+	}
+	initializeBGLIB(&huart2);
+	TRACE_INIT(&huart1);
+
+	printf("\n\nStarted on u5a5 (simulation)\n\n");
+
+	if (u5Upgrade) {
+		status = U5FirmwareUpgrade(&huart2, &hhash);
+	} else {
+		status = BT122FirmwareUpgrade(FLASH_USER_START_ADDR, &huart2, &hhash);
+		TRACE_DUMP();
+	}
+	logFlush();
+	return &status;
+}
+
+static void usage(const char *program) {
+	printf("usage: %s [--u5 | --bt122] [--flash FILE] [--flash-timing SCALE] [--link PATH] [--link-... VALUE]\n", program);
+	printf("  --u5                  run U5FirmwareUpgrade()\n");
+	printf("  --bt122               run BT122FirmwareUpgrade() (default, like main.c)\n");
+	printf("  --flash FILE          keep the flash (and option bytes) in FILE, in memory if not given\n");
+	printf("  --flash-timing SCALE  multiply the flash program and erase times (default 1, 0 for none)\n");
+	printf("  --link PATH           symbolic link to the BT122 link pseudo terminal\n");
+	printf("  --link-rate BYTES     Bluetooth link bytes per second in each direction (default 0, unlimited)\n");
+	printf("  --link-latency MS     Bluetooth link latency (default 0)\n");
+	printf("  --link-loss PERCENT   Bluetooth link frames lost (default 0)\n");
+	printf("  --link-loss-start N   bytes sent in each direction before frames are lost (default 0)\n");
+	printf("  --link-seed N         seed of the frame losses (default 1)\n");
+	printf("  --log-level N         log messages up to this level (default 2, 3 for the LOG_DEBUG ones)\n");
+}
+
+int main(int argc, char **argv) {
+	const char *flashPath = NULL;
+	const char *linkPath = NULL;
+	double flashTiming = 1;
+	SimLinkConfig link = { 0, 0, 0, 0, 1 };
+
+	for (int i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "--u5") == 0) {
+			u5Upgrade = 1;
+		} else if (strcmp(argv[i], "--bt122") == 0) {
+			u5Upgrade = 0;
+		} else if (strcmp(argv[i], "--flash") == 0 && i + 1 < argc) {
+			flashPath = argv[++i];
+		} else if (strcmp(argv[i], "--flash-timing") == 0 && i + 1 < argc) {
+			flashTiming = atof(argv[++i]);
+		} else if (strcmp(argv[i], "--link") == 0 && i + 1 < argc) {
+			linkPath = argv[++i];
+		} else if (strcmp(argv[i], "--link-rate") == 0 && i + 1 < argc) {
+			link.rate = strtoul(argv[++i], NULL, 0);
+		} else if (strcmp(argv[i], "--link-latency") == 0 && i + 1 < argc) {
+			link.latencyUs = (uint32_t) (atof(argv[++i]) * 1000);
+		} else if (strcmp(argv[i], "--link-loss") == 0 && i + 1 < argc) {
+			link.loss = atof(argv[++i]) / 100;
+		} else if (strcmp(argv[i], "--link-loss-start") == 0 && i + 1 < argc) {
+			link.lossStartBytes = strtoul(argv[++i], NULL, 0);
+		} else if (strcmp(argv[i], "--link-seed") == 0 && i + 1 < argc) {
+			link.seed = strtoul(argv[++i], NULL, 0);
+		} else if (strcmp(argv[i], "--log-level") == 0 && i + 1 < argc) {
+			logLevel = atoi(argv[++i]);
+		} else {
+			usage(argv[0]);
+			return 2;
+		}
+	}
+	setvbuf(stdout, NULL, _IOLBF, 0);
+
+	HAL_GetTick();
+	if (simFlashOpen(flashPath, flashTiming) != 0 || simLinkOpen(linkPath, &link) != 0
+			|| simBt122Start() != 0) {
+		return 1;
+	}
+
+	pthread_t firmware;
+	void *result;
+	if (simThreadCreate(&firmware, firmwareMain, NULL) != 0 || pthread_join(firmware, &result) != 0) {
+		return 1;
+	}
+	HAL_StatusTypeDef status = *(HAL_StatusTypeDef *) result;
+	printf("[sim] %s firmware upgrade: %s\n", u5Upgrade ? "U5" : "BT122", status == HAL_OK ? "OK" : "failed");
+
+	simLinkClose();
+	simFlashClose();
+	return status == HAL_OK ? 0 : 1;
+}
@@ -0,0 +1,423 @@
+/**
+ ******************************************************************************
+ * @file           sim_uart.c
+ * @brief          Host simulation: UARTs
+ ******************************************************************************
+ *
+ * Every UART has a receive thread that plays the part of the receive
+ * interrupt (HAL_UART_Receive_IT(), one byte at a time) or of the circular
+ * DMA with idle line detection (HAL_UARTEx_ReceiveToIdle_DMA(): half
+ * transfer, transfer complete and idle events). Bytes sent to the U5
+ * (simUartDeliver()) take the time they take on the line at the UART's baud
+ * rate, 10 bits per byte, and so do the bytes the U5 transmits. Bytes sent
+ * at another rate than the receiver's arrive corrupted, like on the wire.
+ *
+ * The receiver of what the U5 transmits is connected with simUartConnect()
+ * (USART2: the BT122 model). USART1, the console, prints to stdout.
+ * HAL_UART_Transmit_IT() and HAL_UART_Transmit_DMA() return at once, a
+ * transmit thread sends the bytes and calls the transfer complete callback
+ * with interrupts masked (see sim_hal.c). In linked-list mode
+ * HAL_UART_Transmit_DMA() sends the span of every node of the queue, one
+ * after the other, with a single callback at the end.
+ *
+ ******************************************************************************
+ */
+
+/* Includes -----------------------------------------------------------------*/
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+
+#include "sim.h"
+
+/* Private defines ----------------------------------------------------------*/
+#define UART_SLOTS 7
+#define UART_BURST 64					/* Most bytes received per receive event */
+#define UART_STATE_READY 0
+#define UART_STATE_IT 1
+#define UART_STATE_DMA 2
+#define UART_TX_SPANS 4					/* Most nodes in a linked-list transmit */
+
+/* Variables ----------------------------------------------------------------*/
+typedef struct {
+	USART_TypeDef *instance;
+	UART_HandleTypeDef *huart;			/* Set by HAL_UART_Init() */
+	SimUartReceiver receiver;			/* Receives what the U5 transmits */
+	pthread_mutex_t lock;				/* Protects the queue */
+	pthread_cond_t changed;				/* Signaled when bytes are queued or taken, or reception starts */
+	uint8_t queue[SIM_UART_QUEUE_LENGTH];	/* Bytes on their way to the U5 */
+	uint32_t head;
+	uint32_t tail;
+	pthread_mutex_t irq;				/* Held while receiving (the interrupt), recursive for the callbacks */
+	uint16_t dmaPosition;				/* DMA write position in pRxBuffPtr */
+	pthread_t thread;
+	int started;
+	pthread_cond_t transmit;			/* Signaled when a background transmit starts */
+	const uint8_t *txData[UART_TX_SPANS];	/* Background transmit in progress (huart->gState set) */
+	uint16_t txLength[UART_TX_SPANS];
+	int txSpans;						/* Spans in txData, 0 if no transmit is in progress */
+	pthread_t txThread;
+} SimUart;
+
+static SimUart uarts[UART_SLOTS];
+static pthread_mutex_t uartsLock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Functions ----------------------------------------------------------------*/
+
+static void *uartReceiveThread(void *argument);
+static void *uartTransmitThread(void *argument);
+
+/**
+ * @return The simulated UART of an instance, created on first use.
+ */
+static SimUart *uartGet(USART_TypeDef *instance) {
+	pthread_mutex_lock(&uartsLock);
+	SimUart *uart = NULL;
+	for (int i = 0; i < UART_SLOTS && uart == NULL; i++) {
+		if (uarts[i].instance == instance) {
+			uart = &uarts[i];
+		} else if (uarts[i].instance == NULL) {
+			uart = &uarts[i];
+			uart->instance = instance;
+			pthread_mutex_init(&uart->lock, NULL);
+			pthread_cond_init(&uart->changed, NULL);
+			pthread_cond_init(&uart->transmit, NULL);
+			pthread_mutexattr_t attr;
+			pthread_mutexattr_init(&attr);
+			pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+			pthread_mutex_init(&uart->irq, &attr);
+			pthread_mutexattr_destroy(&attr);
+		}
+	}
+	pthread_mutex_unlock(&uartsLock);
+	return uart;
+}
+
+/**
+ * Time the bytes take on the line.
+ */
+static uint64_t uartLineTimeUs(int length, uint32_t baudRate) {
+	return baudRate ? (uint64_t) length * 10 * 1000000 / baudRate : 0;
+}
+
+/**
+ * Connect the receiver of the bytes the U5 transmits on a UART.
+ */
+void simUartConnect(USART_TypeDef *instance, SimUartReceiver receiver) {
+	uartGet(instance)->receiver = receiver;
+}
+
+/**
+ * @return The baud rate the U5 UART is set to, 0 if it is not initialized.
+ */
+uint32_t simUartGetBaudRate(USART_TypeDef *instance) {
+	SimUart *uart = uartGet(instance);
+	return uart->huart != NULL ? uart->huart->Init.BaudRate : 0;
+}
+
+/**
+ * @return The number of bytes simUartDeliver() takes without waiting.
+ */
+int simUartGetSpace(USART_TypeDef *instance) {
+	SimUart *uart = uartGet(instance);
+	pthread_mutex_lock(&uart->lock);
+	int space = SIM_UART_QUEUE_LENGTH - (uart->head - uart->tail);
+	pthread_mutex_unlock(&uart->lock);
+	return space;
+}
+
+/**
+ * Send bytes to the U5. Waits while the queue is full (hardware flow control).
+ *
+ * @param instance The U5 UART.
+ * @param data The bytes.
+ * @param length Number of bytes.
+ * @param baudRate Rate the bytes are sent at. If the U5 UART is at another rate, they arrive corrupted.
+ * @return length.
+ */
+int simUartDeliver(USART_TypeDef *instance, const uint8_t *data, int length, uint32_t baudRate) {
+	SimUart *uart = uartGet(instance);
+	int corrupt = baudRate != simUartGetBaudRate(instance);
+
+	pthread_mutex_lock(&uart->lock);
+	for (int i = 0; i < length; i++) {
+		while (uart->head - uart->tail == SIM_UART_QUEUE_LENGTH) {
+			pthread_cond_wait(&uart->changed, &uart->lock);
+		}
+		uart->queue[uart->head++ % SIM_UART_QUEUE_LENGTH] = corrupt ? data[i] ^ 0xA5 : data[i];
+	}
+	pthread_cond_broadcast(&uart->changed);
+	pthread_mutex_unlock(&uart->lock);
+	return length;
+}
+
+/**
+ * Hand transmitted bytes to the connected receiver (USART1: stdout).
+ */
+static void uartSend(SimUart *uart, const uint8_t *data, int length) {
+	if (uart->receiver != NULL) {
+		uart->receiver(data, length, uart->huart->Init.BaudRate);
+	} else if (uart->instance == USART1) {
+		fwrite(data, 1, length, stdout);
+	}
+}
+
+/**
+ * Hand received bytes to the firmware, like the receive interrupt or the DMA. Called with the irq lock held.
+ */
+static void uartReceive(SimUart *uart, const uint8_t *data, int length) {
+	UART_HandleTypeDef *huart = uart->huart;
+	for (int i = 0; i < length; i++) {
+		if (huart->RxState == UART_STATE_IT) {
+			*huart->pRxBuffPtr = data[i];
+			huart->RxState = UART_STATE_READY;
+			HAL_UART_RxCpltCallback(huart);
+		} else if (huart->RxState == UART_STATE_DMA) {
+			huart->pRxBuffPtr[uart->dmaPosition++] = data[i];
+			if (uart->dmaPosition == huart->RxXferSize / 2) {
+				// half transfer
+				HAL_UARTEx_RxEventCallback(huart, uart->dmaPosition);
+			} else if (uart->dmaPosition == huart->RxXferSize) {
+				// transfer complete, the circular DMA starts over
+				HAL_UARTEx_RxEventCallback(huart, uart->dmaPosition);
+				uart->dmaPosition = 0;
+			}
+		}
+		// not receiving: the byte is lost (overrun)
+	}
+}
+
+/**
+ * The receive interrupt of a UART: bytes queued for the U5 are received UART_BURST at a time, once the line
+ * has carried them. The idle event follows the last byte.
+ */
+static void *uartReceiveThread(void *argument) {
+	SimUart *uart = argument;
+	uint8_t burst[UART_BURST];
+
+	pthread_mutex_lock(&uart->lock);
+	while (1) {
+		while (uart->head == uart->tail) {
+			pthread_cond_wait(&uart->changed, &uart->lock);
+		}
+		int length = uart->head - uart->tail;
+		if (length > UART_BURST) {
+			length = UART_BURST;
+		}
+		pthread_mutex_unlock(&uart->lock);
+		simSleepUs(uartLineTimeUs(length, uart->huart->Init.BaudRate));
+		pthread_mutex_lock(&uart->lock);
+		for (int i = 0; i < length; i++) {
+			burst[i] = uart->queue[uart->tail++ % SIM_UART_QUEUE_LENGTH];
+		}
+		int idle = uart->head == uart->tail;
+		pthread_cond_broadcast(&uart->changed);
+		pthread_mutex_unlock(&uart->lock);
+
+		pthread_mutex_lock(&uart->irq);
+		uartReceive(uart, burst, length);
+		if (idle && uart->huart->RxState == UART_STATE_DMA) {
+			HAL_UARTEx_RxEventCallback(uart->huart, uart->dmaPosition);
+		}
+		pthread_mutex_unlock(&uart->irq);
+		pthread_mutex_lock(&uart->lock);
+	}
+	return NULL;
+}
+
+HAL_StatusTypeDef HAL_UART_Init(UART_HandleTypeDef *huart) {
+	if (huart->Init.BaudRate == 0) {
+		return HAL_ERROR;
+	}
+	SimUart *uart = uartGet(huart->Instance);
+	uart->huart = huart;
+	if (!uart->started) {
+		if (simThreadCreate(&uart->thread, uartReceiveThread, uart) != 0
+				|| simThreadCreate(&uart->txThread, uartTransmitThread, uart) != 0) {
+			return HAL_ERROR;
+		}
+		uart->started = 1;
+	}
+	return HAL_OK;
+}
+
+/**
+ * Blocks for the time the bytes take on the line, then hands them to the connected receiver.
+ */
+HAL_StatusTypeDef HAL_UART_Transmit(UART_HandleTypeDef *huart, const uint8_t *pData, uint16_t Size, uint32_t Timeout) {
+	if (huart->gState != UART_STATE_READY) {
+		return HAL_BUSY;
+	}
+	SimUart *uart = uartGet(huart->Instance);
+	simSleepUs(uartLineTimeUs(Size, huart->Init.BaudRate));
+	uartSend(uart, pData, Size);
+	return HAL_OK;
+}
+
+/**
+ * Starts a background transmit: the transmit thread sends the bytes and calls HAL_UART_TxCpltCallback().
+ */
+HAL_StatusTypeDef HAL_UART_Transmit_IT(UART_HandleTypeDef *huart, const uint8_t *pData, uint16_t Size) {
+	if (Size == 0) {
+		return HAL_ERROR;
+	}
+	SimUart *uart = uartGet(huart->Instance);
+	pthread_mutex_lock(&uart->lock);
+	if (huart->gState != UART_STATE_READY) {
+		pthread_mutex_unlock(&uart->lock);
+		return HAL_BUSY;
+	}
+	huart->gState = UART_STATE_IT;
+	uart->txData[0] = pData;
+	uart->txLength[0] = Size;
+	uart->txSpans = 1;
+	pthread_cond_broadcast(&uart->transmit);
+	pthread_mutex_unlock(&uart->lock);
+	return HAL_OK;
+}
+
+/**
+ * Same as HAL_UART_Transmit_IT(), the DMA is not modelled. In linked-list mode pData goes to the head node
+ * like on the device, and the nodes the queue links to are sent after it.
+ */
+HAL_StatusTypeDef HAL_UART_Transmit_DMA(UART_HandleTypeDef *huart, const uint8_t *pData, uint16_t Size) {
+	DMA_HandleTypeDef *hdma = huart->hdmatx;
+	if (hdma == NULL || Size == 0) {
+		return HAL_ERROR;
+	}
+	if ((hdma->Mode & DMA_LINKEDLIST) != DMA_LINKEDLIST) {
+		return HAL_UART_Transmit_IT(huart, pData, Size);
+	}
+	DMA_NodeTypeDef *head = hdma->LinkedListQueue->Head;
+	SimUart *uart = uartGet(huart->Instance);
+	pthread_mutex_lock(&uart->lock);
+	if (huart->gState != UART_STATE_READY) {
+		pthread_mutex_unlock(&uart->lock);
+		return HAL_BUSY;
+	}
+	head->LinkRegisters[NODE_CBR1_DEFAULT_OFFSET] = Size;
+	head->LinkRegisters[NODE_CSAR_DEFAULT_OFFSET] = (uint32_t) pData;
+	uart->txSpans = 0;
+	for (DMA_NodeTypeDef *node = head; node != NULL && uart->txSpans < UART_TX_SPANS; ) {
+		uart->txData[uart->txSpans] = (const uint8_t *) node->LinkRegisters[NODE_CSAR_DEFAULT_OFFSET];
+		uart->txLength[uart->txSpans++] = node->LinkRegisters[NODE_CBR1_DEFAULT_OFFSET];
+		uint32_t link = node->LinkRegisters[NODE_CLLR_LINEAR_DEFAULT_OFFSET] & DMA_CLLR_LA;
+		node = link != 0 ? (DMA_NodeTypeDef *) (((uint32_t) head & DMA_CLBAR_LBA) | link) : NULL;
+	}
+	huart->gState = UART_STATE_DMA;
+	pthread_cond_broadcast(&uart->transmit);
+	pthread_mutex_unlock(&uart->lock);
+	return HAL_OK;
+}
+
+/**
+ * The transmit interrupt of a UART: sends the background transmit once the line has carried it, then
+ * calls the transfer complete callback with interrupts masked.
+ */
+static void *uartTransmitThread(void *argument) {
+	SimUart *uart = argument;
+
+	pthread_mutex_lock(&uart->lock);
+	while (1) {
+		while (uart->txSpans == 0) {
+			pthread_cond_wait(&uart->transmit, &uart->lock);
+		}
+		int spans = uart->txSpans;
+		pthread_mutex_unlock(&uart->lock);
+		for (int i = 0; i < spans; i++) {
+			simSleepUs(uartLineTimeUs(uart->txLength[i], uart->huart->Init.BaudRate));
+			uartSend(uart, uart->txData[i], uart->txLength[i]);
+		}
+
+		pthread_mutex_lock(&uart->lock);
+		uart->txSpans = 0;
+		uart->huart->gState = UART_STATE_READY;
+		pthread_mutex_unlock(&uart->lock);
+		__disable_irq();
+		HAL_UART_TxCpltCallback(uart->huart);
+		__set_PRIMASK(0);
+		pthread_mutex_lock(&uart->lock);
+	}
+	return NULL;
+}
+
+/**
+ * Polling receive, takes the bytes straight from the queue (no reception may be in progress).
+ */
+HAL_StatusTypeDef HAL_UART_Receive(UART_HandleTypeDef *huart, uint8_t *pData, uint16_t Size, uint32_t Timeout) {
+	if (huart->RxState != UART_STATE_READY) {
+		return HAL_BUSY;
+	}
+	SimUart *uart = uartGet(huart->Instance);
+	uint32_t start = HAL_GetTick();
+	pthread_mutex_lock(&uart->lock);
+	for (int i = 0; i < Size; i++) {
+		while (uart->head == uart->tail) {
+			if (Timeout != HAL_MAX_DELAY && HAL_GetTick() - start >= Timeout) {
+				pthread_mutex_unlock(&uart->lock);
+				return HAL_TIMEOUT;
+			}
+			pthread_mutex_unlock(&uart->lock);
+			simSleepUs(100);
+			pthread_mutex_lock(&uart->lock);
+		}
+		pData[i] = uart->queue[uart->tail++ % SIM_UART_QUEUE_LENGTH];
+	}
+	pthread_cond_broadcast(&uart->changed);
+	pthread_mutex_unlock(&uart->lock);
+	return HAL_OK;
+}
+
+/**
+ * Interrupt reception. Only single byte receptions are used by uart.c, Size must be 1.
+ */
+HAL_StatusTypeDef HAL_UART_Receive_IT(UART_HandleTypeDef *huart, uint8_t *pData, uint16_t Size) {
+	if (Size != 1) {
+		return HAL_ERROR;
+	}
+	SimUart *uart = uartGet(huart->Instance);
+	pthread_mutex_lock(&uart->irq);
+	huart->pRxBuffPtr = pData;
+	huart->RxXferSize = Size;
+	huart->RxState = UART_STATE_IT;
+	pthread_mutex_unlock(&uart->irq);
+	return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_UARTEx_ReceiveToIdle_DMA(UART_HandleTypeDef *huart, uint8_t *pData, uint16_t Size) {
+	if (huart->hdmarx == NULL || Size == 0) {
+		return HAL_ERROR;
+	}
+	SimUart *uart = uartGet(huart->Instance);
+	pthread_mutex_lock(&uart->irq);
+	huart->pRxBuffPtr = pData;
+	huart->RxXferSize = Size;
+	uart->dmaPosition = 0;
+	huart->RxState = UART_STATE_DMA;
+	pthread_mutex_unlock(&uart->irq);
+	return HAL_OK;
+}
+
+/**
+ * The DMA counter of a receive to idle: what is left of the buffer after the last byte written. Kept when
+ * the reception is aborted, like the channel registers.
+ */
+uint32_t simUartDmaGetCounter(DMA_HandleTypeDef *hdma) {
+	for (int i = 0; i < UART_SLOTS; i++) {
+		if (uarts[i].huart != NULL && uarts[i].huart->hdmarx == hdma) {
+			return uarts[i].huart->RxXferSize - uarts[i].dmaPosition;
+		}
+	}
+	return 0;
+}
+
+/**
+ * Stops the reception. Waits for the receive interrupt if it is running, like disabling it.
+ */
+HAL_StatusTypeDef HAL_UART_AbortReceive(UART_HandleTypeDef *huart) {
+	SimUart *uart = uartGet(huart->Instance);
+	pthread_mutex_lock(&uart->irq);
+	huart->RxState = UART_STATE_READY;
+	pthread_mutex_unlock(&uart->irq);
+	return HAL_OK;
+}
@@ -0,0 +1,159 @@
+"""
+LZ round trip test: compresses every chunk of the images in "Python Client/firmware_files" with the client's
+compressor ("Python Client/ota_compression.py"), on its own and as a delta against the previous version of the
+image, and checks that the device's decoder (Src/lz.c, run by build/lz_test) gives back the chunk. Truncated and
+corrupted blocks must be rejected by the decoder, or decode like lz_decompress_block() does.
+
+    make -C Sim test
+
+Exits with 1 if a check failed.
+"""
+
+import argparse
+import glob
+import os
+import random
+import re
+import struct
+import subprocess
+import sys
+
+SIM_DIR = os.path.dirname(os.path.abspath(__file__))
+CLIENT_DIR = os.path.join(SIM_DIR, "..", "Python Client")
+DEFAULT_DECODER = os.path.join(SIM_DIR, "build", "lz_test")
+sys.path.insert(0, CLIENT_DIR)
+
+from ota_compression import lz_compress_block, lz_decompress_block, delta_dictionary  # noqa: E402
+
+CHUNK_SIZE = 2048  # OTA_CHUNK_SIZE
+# sizes of the pieces the blocks are fed to the decoder in, like the spans of the UART receive buffer
+PIECE_SIZES = [1 << 30, 1, 2, 3, 7, 64, 251]
+
+
+def decode(decoder, cases):
+    """
+    Decodes (block, output_size, dictionary) cases with the device's decoder. Returns (ok, output) for each.
+    """
+    request = bytearray()
+    for index, (block, output_size, dictionary) in enumerate(cases):
+        piece_size = PIECE_SIZES[index % len(PIECE_SIZES)]
+        request += struct.pack("<IIII", output_size, len(dictionary), len(block), piece_size) + dictionary + block
+    reply = subprocess.run([decoder], input=bytes(request), stdout=subprocess.PIPE, stderr=subprocess.DEVNULL,
+                           check=True).stdout
+    results = []
+    position = 0
+    for _ in cases:
+        status, length = struct.unpack_from("<BI", reply, position)
+        position += 5
+        results.append((status == 0, reply[position:position + length]))
+        position += length
+    return results
+
+
+def reference_decode(block, output_size, dictionary):
+    try:
+        return True, lz_decompress_block(block, output_size, dictionary)
+    except ValueError:
+        return False, None
+
+
+def image_versions():
+    """
+    The images in firmware_files, by name without the version, each list sorted by version.
+    """
+    images = {}
+    for path in sorted(glob.glob(os.path.join(CLIENT_DIR, "firmware_files", "*"))):
+        match = re.match(r"(.*)_(\d+)\.(\d+)\.(\w+)$", os.path.basename(path))
+        if match:
+            key = match.group(1) + "." + match.group(4)
+            images.setdefault(key, []).append(((int(match.group(2)), int(match.group(3))), path))
+    return {key: [open(path, "rb").read() for _, path in sorted(versions)] for key, versions in images.items()}
+
+
+def padded_dictionary(old_image, offset, rng):
+    """
+    The delta dictionary of the chunk at offset as the decoder sees it: the running image, then whatever is in
+    flash past its end (random bytes here, the compressor must never match them).
+    """
+    dictionary, dictionary_length = delta_dictionary(old_image, offset)
+    return dictionary + bytes(rng.getrandbits(8) for _ in range(dictionary_length - len(dictionary)))
+
+
+def malformed_blocks():
+    """
+    Hand made blocks that are not valid: (name, block, output_size, dictionary).
+    """
+    return [
+        ("match offset 0", bytes([0x10]) + b"A" + bytes([0, 0]), 16, b""),
+        ("match before the window", bytes([0x10]) + b"A" + bytes([2, 0]), 16, b""),
+        ("match before the dictionary", bytes([0x10]) + b"A" + bytes([4, 0]), 16, b"xy"),
+        ("literals past the output", bytes([0x50]) + b"ABCDE", 4, b""),
+        ("match past the output", bytes([0x10]) + b"A" + bytes([1, 0]), 4, b""),
+        ("long match past the output", bytes([0x1F]) + b"A" + bytes([1, 0, 255, 255, 0]), 512, b""),
+        ("truncated literal length", bytes([0xF0, 255]), 1024, b""),
+        ("truncated literals", bytes([0x30]) + b"AB", 16, b""),
+        ("truncated match offset", bytes([0x10]) + b"A" + bytes([1]), 16, b""),
+        ("truncated match length", bytes([0x1F]) + b"A" + bytes([1, 0, 255]), 1024, b""),
+    ]
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("--decoder", default=DEFAULT_DECODER, help="decoder harness (make -C Sim build/lz_test)")
+    parser.add_argument("--seed", type=int, default=1, help="seed of the corrupted blocks")
+    args = parser.parse_args()
+    rng = random.Random(args.seed)
+
+    # (kind, name, block, output_size, dictionary, chunk the block was compressed from)
+    cases = []
+    for key, versions in sorted(image_versions().items()):
+        for version, image in enumerate(versions):
+            old_image = versions[version - 1] if version > 0 else None
+            for offset in range(0, len(image), CHUNK_SIZE):
+                chunk = image[offset:offset + CHUNK_SIZE]
+                name = "%s v%d chunk %d" % (key, version + 1, offset // CHUNK_SIZE)
+                cases.append(("round trip", name, lz_compress_block(chunk), len(chunk), b"", chunk))
+                if old_image is not None:
+                    dictionary = padded_dictionary(old_image, offset, rng)
+                    block = lz_compress_block(chunk, *delta_dictionary(old_image, offset))
+                    cases.append(("round trip", name + " delta", block, len(chunk), dictionary, chunk))
+    round_trips = len(cases)
+
+    # every truncation of a few blocks, and a corrupted byte in many
+    for _, name, block, output_size, dictionary, chunk in rng.sample(cases[:round_trips], 8):
+        for length in range(len(block)):
+            cases.append(("truncated", "%s truncated to %d" % (name, length), block[:length], output_size, dictionary, chunk))
+    for _, name, block, output_size, dictionary, chunk in rng.sample(cases[:round_trips], 400):
+        corrupted = bytearray(block)
+        position = rng.randrange(len(corrupted))
+        corrupted[position] ^= rng.randrange(1, 256)
+        cases.append(("corrupted", "%s corrupted at %d" % (name, position), bytes(corrupted), output_size, dictionary, chunk))
+    for name, block, output_size, dictionary in malformed_blocks():
+        cases.append(("malformed", name, block, output_size, dictionary, None))
+
+    results = decode(args.decoder, [(block, output_size, dictionary) for _, _, block, output_size, dictionary, _ in cases])
+    failures = 0
+    for (kind, name, block, output_size, dictionary, chunk), (ok, output) in zip(cases, results):
+        reference = reference_decode(block, output_size, dictionary)
+        if kind == "round trip":
+            error = None if (ok, output) == (True, chunk) == reference else "does not give back the chunk"
+        elif kind == "malformed":
+            error = None if not ok and not reference[0] else "accepted"
+        elif ok != reference[0] or (ok and output != reference[1]):
+            # a corrupted block may still be valid (e.g. a changed literal, the CRC32 catches those), but both
+            # decoders must agree on it
+            error = "decoder %s it, lz_decompress_block() %s it" % ("accepts" if ok else "rejects", "accepts" if reference[0] else "rejects")
+        elif kind == "truncated" and ok and len(output) == output_size:
+            error = "accepted as a whole chunk"
+        else:
+            error = None
+        if error is not None:
+            failures += 1
+            print("FAIL: %s: %s" % (name, error))
+
+    print("%d round trips, %d truncated or corrupted blocks, %d failures" % (round_trips, len(cases) - round_trips, failures))
+    return 1 if failures else 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
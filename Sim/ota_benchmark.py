@@ -0,0 +1,251 @@
+"""
+OTA benchmark: runs the serial client ("Python Client/ota_client_serial.py") against the host simulation
+(build/ota_sim) over a simulated Bluetooth link, and reports the throughput, the time of each phase of the
+upgrade and the CPU use as JSON. Compare against an earlier result with --baseline to catch regressions.
+
+    python3 Sim/ota_benchmark.py --u5 --link-rate 40000 --link-latency 20 --repeat 3 --output result.json
+    python3 Sim/ota_benchmark.py --u5 --link-rate 40000 --link-latency 20 --baseline result.json
+
+Needs pyserial for the client, and the simulation built (make -C Sim).
+"""
+
+import argparse
+import json
+import os
+import re
+import shutil
+import statistics
+import subprocess
+import sys
+import tempfile
+import threading
+import time
+
+SIM_DIR = os.path.dirname(os.path.abspath(__file__))
+CLIENT_DIR = os.path.join(SIM_DIR, "..", "Python Client")
+DEFAULT_SIM = os.path.join(SIM_DIR, "build", "ota_sim")
+DEFAULT_FIRMWARE = os.path.join(CLIENT_DIR, "firmware_files", "U5A5_OTA_DFU_2.0.bin")
+
+# phases of the upgrade: name, line that starts it (None: start of the simulation), line that ends it
+PHASES = [
+    ("setup", None, "Waiting for confirmation..."),
+    ("handshake", "Waiting for confirmation...", "Downloading "),
+    ("download", "Downloading ", "Downloaded "),
+    ("hash", "Downloaded ", "Firmware hashes match"),
+    ("dfu", "Starting BT122 DFU...", "Firmware upload status"),
+    ("bank_swap", "Firmware hashes match", "[sim] system reset"),
+]
+
+# results compared with --baseline: key, True if higher is better
+CHECKED_RESULTS = [
+    ("download_bytes_per_s", True),
+    ("total_s", False),
+    ("sim_cpu_busy_percent", False),
+]
+
+
+def find_line(lines, marker):
+    """
+    Time of the first simulation output line that holds marker, None if there is none (a LOG_TOKENIZED build
+    may send a binary record just before it on the same line).
+    """
+    for timestamp, line in lines:
+        if marker in line:
+            return timestamp
+    return None
+
+
+def read_lines(stream, start, lines):
+    for line in stream:
+        lines.append((time.monotonic() - start, line.rstrip("\n")))
+
+
+def run_once(args, run_index):
+    link_dir = tempfile.mkdtemp(prefix="ota_benchmark_")
+    link_path = os.path.join(link_dir, "link")
+    sim_command = [args.sim, "--u5" if args.u5 else "--bt122", "--link", link_path,
+                   "--flash-timing", str(args.flash_timing),
+                   "--link-rate", str(args.link_rate), "--link-latency", str(args.link_latency),
+                   "--link-loss", str(args.link_loss), "--link-loss-start", str(args.link_loss_start), "--link-seed", str(args.link_seed + run_index)]
+
+    start = time.monotonic()
+    sim = subprocess.Popen(sim_command, stdout=subprocess.PIPE, stderr=subprocess.STDOUT, text=True,
+                           errors="replace")  # a TRACE=1 build dumps its trace in binary
+    sim_lines = []
+    sim_reader = threading.Thread(target=read_lines, args=(sim.stdout, start, sim_lines), daemon=True)
+    sim_reader.start()
+
+    # like on the board, the client starts once the firmware waits for it (it drops what arrives before)
+    while find_line(list(sim_lines), "Waiting for confirmation...") is None and sim.poll() is None \
+            and time.monotonic() - start < args.timeout:
+        time.sleep(0.01)
+
+    client_env = dict(os.environ, OTA_SERIAL_PORT=link_path)
+    client = subprocess.Popen([sys.executable, "ota_client_serial.py", os.path.abspath(args.firmware)],
+                              cwd=CLIENT_DIR, env=client_env, stdin=subprocess.PIPE, stdout=subprocess.PIPE,
+                              stderr=subprocess.STDOUT, text=True)
+    client_lines = []
+    client_reader = threading.Thread(target=read_lines, args=(client.stdout, start, client_lines), daemon=True)
+    client_reader.start()
+    # "press enter to send firmware"
+    client.stdin.write("\n")
+    client.stdin.close()
+
+    # wait for both, with their resource usage (os.wait4 instead of Popen.wait)
+    usage = {}
+    timed_out = False
+    deadline = start + args.timeout
+    pending = {sim.pid: "sim", client.pid: "client"}
+    while pending:
+        for pid in list(pending):
+            waited, status, rusage = os.wait4(pid, os.WNOHANG)
+            if waited != 0:
+                usage[pending.pop(pid)] = (time.monotonic() - start, os.waitstatus_to_exitcode(status), rusage)
+        if pending and time.monotonic() > deadline:
+            timed_out = True
+            for pid in pending:
+                os.kill(pid, 9)
+            deadline = float("inf")
+        time.sleep(0.01)
+    # the wait statuses were consumed, keep Popen from waiting again
+    sim.returncode = usage["sim"][1]
+    client.returncode = usage["client"][1]
+    sim_reader.join()
+    client_reader.join()
+    shutil.rmtree(link_dir, ignore_errors=True)
+
+    result = {"ok": not timed_out and sim.returncode == 0 and client.returncode == 0, "timed_out": timed_out}
+    sim_time, _, sim_usage = usage["sim"]
+    client_time, _, client_usage = usage["client"]
+    result["total_s"] = round(sim_time, 3)
+    result["sim_cpu_busy_percent"] = round(100 * (sim_usage.ru_utime + sim_usage.ru_stime) / sim_time, 1)
+    result["client_cpu_busy_percent"] = round(100 * (client_usage.ru_utime + client_usage.ru_stime) / client_time, 1)
+
+    phases = {}
+    for name, start_marker, end_marker in PHASES:
+        phase_start = 0 if start_marker is None else find_line(sim_lines, start_marker)
+        phase_end = find_line(sim_lines, end_marker)
+        if phase_start is not None and phase_end is not None:
+            phases[name] = round(phase_end - phase_start, 3)
+    result["phases_s"] = phases
+
+    for _, line in sim_lines:
+        match = re.search(r"Downloading (\d+) bytes", line)
+        if match:
+            result["firmware_bytes"] = int(match.group(1))
+        match = re.search(r"Downloaded \d+ bytes in \d+ ms \((\d+) bytes/s\)", line)
+        if match:
+            result["firmware_bytes_per_s"] = int(match.group(1))
+        match = re.search(r"Chunks with CRC errors: (\d+), corrupted headers: (\d+)", line)
+        if match:
+            result["crc_errors"] = int(match.group(1))
+            result["header_errors"] = int(match.group(2))
+        match = re.search(r"\[sim\] link to (device|client): (\d+) bytes, (\d+) frames, (\d+) lost", line)
+        if match:
+            result["link_to_" + match.group(1)] = {"bytes": int(match.group(2)), "frames": int(match.group(3)),
+                                                   "lost_frames": int(match.group(4))}
+    for _, line in client_lines:
+        match = re.search(r"Firmware upload complete. Sent (\d+) bytes .* (\d+) chunks retransmitted", line)
+        if match:
+            result["sent_bytes"] = int(match.group(1))
+            result["retransmitted_chunks"] = int(match.group(2))
+    if "firmware_bytes" in result and "download" in phases and phases["download"] > 0:
+        # end to end rate: the firmware size over the whole download phase, as the client sees it
+        result["download_bytes_per_s"] = round(result["firmware_bytes"] / phases["download"])
+
+    if args.verbose or not result["ok"]:
+        for timestamp, line in sim_lines:
+            print("%8.3f sim    | %s" % (timestamp, line), file=sys.stderr)
+        for timestamp, line in client_lines:
+            print("%8.3f client | %s" % (timestamp, line), file=sys.stderr)
+    return result
+
+
+def summarize(runs):
+    """
+    Median of each numeric result over the successful runs.
+    """
+    ok_runs = [run for run in runs if run["ok"]]
+    summary = {"runs": len(runs), "failed_runs": len(runs) - len(ok_runs)}
+    if not ok_runs:
+        return summary
+    for key, value in ok_runs[0].items():
+        if isinstance(value, (int, float)) and not isinstance(value, bool):
+            values = [run[key] for run in ok_runs if key in run]
+            summary[key] = round(statistics.median(values), 3)
+    summary["phases_s"] = {}
+    for name in ok_runs[0]["phases_s"]:
+        values = [run["phases_s"][name] for run in ok_runs if name in run["phases_s"]]
+        summary["phases_s"][name] = round(statistics.median(values), 3)
+    return summary
+
+
+def compare(summary, baseline, tolerance):
+    """
+    List of the results that are more than tolerance percent worse than the baseline.
+    """
+    regressions = []
+    if summary["failed_runs"] > baseline.get("failed_runs", 0):
+        regressions.append("failed runs: %d (baseline %d)" % (summary["failed_runs"], baseline.get("failed_runs", 0)))
+    for key, higher_is_better in CHECKED_RESULTS:
+        if key not in summary or key not in baseline or baseline[key] == 0:
+            continue
+        change = 100 * (summary[key] - baseline[key]) / baseline[key]
+        if (change < -tolerance) if higher_is_better else (change > tolerance):
+            regressions.append("%s: %s (baseline %s, %+.1f%%)" % (key, summary[key], baseline[key], change))
+    return regressions
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Benchmark the OTA upgrade in the host simulation.")
+    parser.add_argument("--u5", action="store_true", help="benchmark U5FirmwareUpgrade() (default: BT122)")
+    parser.add_argument("--firmware", default=DEFAULT_FIRMWARE, help="image sent by the client")
+    parser.add_argument("--sim", default=DEFAULT_SIM, help="simulation executable")
+    parser.add_argument("--flash-timing", type=float, default=1, help="flash program and erase time scale")
+    parser.add_argument("--link-rate", type=int, default=0, help="link bytes/s in each direction, 0 for no limit")
+    parser.add_argument("--link-latency", type=float, default=0, help="link latency in ms")
+    parser.add_argument("--link-loss", type=float, default=0, help="percentage of link frames lost")
+    parser.add_argument("--link-loss-start", type=int, default=1024,
+                        help="bytes sent in each direction before frames are lost (the handshake is not retransmitted)")
+    parser.add_argument("--link-seed", type=int, default=1, help="seed of the losses of the first run")
+    parser.add_argument("--repeat", type=int, default=1, help="number of runs, the summary is the median")
+    parser.add_argument("--timeout", type=float, default=300, help="seconds before a run is stopped and failed")
+    parser.add_argument("--output", help="write the JSON result to this file (default: standard output)")
+    parser.add_argument("--baseline", help="JSON result of an earlier run to compare with")
+    parser.add_argument("--tolerance", type=float, default=10, help="percentage a result may be worse than the baseline")
+    parser.add_argument("--verbose", action="store_true", help="print the output of the simulation and the client")
+    args = parser.parse_args()
+
+    config = {"flow": "u5" if args.u5 else "bt122", "firmware": os.path.basename(args.firmware),
+              "flash_timing": args.flash_timing, "link_rate": args.link_rate, "link_latency_ms": args.link_latency,
+              "link_loss_percent": args.link_loss, "link_loss_start": args.link_loss_start,
+              "link_seed": args.link_seed}
+    runs = []
+    for run_index in range(args.repeat):
+        runs.append(run_once(args, run_index))
+        print("run %d: %s" % (run_index + 1, json.dumps(runs[-1])), file=sys.stderr)
+
+    report = {"config": config, "summary": summarize(runs), "runs": runs}
+    exit_code = 0 if report["summary"]["failed_runs"] == 0 else 1
+    if args.baseline:
+        with open(args.baseline) as file:
+            baseline = json.load(file)
+        if baseline.get("config") != config:
+            print("warning: the baseline was measured with another configuration", file=sys.stderr)
+        report["regressions"] = compare(report["summary"], baseline["summary"], args.tolerance)
+        for regression in report["regressions"]:
+            print("regression: " + regression, file=sys.stderr)
+        if report["regressions"]:
+            exit_code = 1
+
+    text = json.dumps(report, indent=2)
+    if args.output:
+        with open(args.output, "w") as file:
+            file.write(text + "\n")
+    else:
+        print(text)
+    return exit_code
+
+
+if __name__ == "__main__":
+    sys.exit(main())
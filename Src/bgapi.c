@@ -14,6 +14,7 @@
 #include "uart.h"
 #include "errno.h"
 #include "util.h"
+#include "trace.h"
 
 /**
  * Define BGLIB library
@@ -29,6 +30,26 @@ static void onMessageSend(uint8_t msg_len, uint8_t *msg_data, uint16_t data_len,
 // UART handle used for BGAPI communication with BT122
 UART_HandleTypeDef *huartBGAPI;
 
+/* Received packets (see bgapiFeed()) */
+static struct {
+	uint32_t packets[BGAPI_QUEUE_LENGTH][BGAPI_PACKET_MAXLEN / 4];	/* Queued packets, word aligned for BGLIB_MSG_ID() */
+	uint32_t head;							/* Packets framed */
+	uint32_t tail;							/* Packets dispatched */
+	int received;							/* Bytes of the packet being framed, in packets[head % BGAPI_QUEUE_LENGTH] */
+	int length;								/* Length of the packet being framed, 0 until its header is complete */
+	int skip;								/* Bytes still to drop of a packet longer than BGAPI_PACKET_MAXLEN */
+	uint32_t lastByteTick;					/* HAL tick of the last byte framed */
+	BgapiFramerStats stats;					/* Framer statistics */
+} bgapiFramer;
+
+/* Registered message handlers (see bgapiRegisterHandler()) */
+static struct {
+	uint32_t id;							/* Message ID, or BGAPI_DEFAULT_HANDLER_ID */
+	BgapiHandler handler;					/* Function called with the packet */
+	void *context;							/* Passed to the handler */
+} bgapiHandlers[BGAPI_MAX_HANDLERS];
+static int bgapiHandlerCount = 0;
+
 
 /* Functions */
 
@@ -47,7 +68,11 @@ void initializeBGLIB(UART_HandleTypeDef *huart) {
 }
 
 /**
- * Function called when a message needs to be written to the serial port.
+ * Function called when a message needs to be written to the serial port. The header and the payload
+ * go out as one background transfer (uart_tx_gather()): the header is copied, as BGLIB builds the next
+ * message in the same buffer, the payload is read in place. A payload in flash (the image chunks of
+ * dfu_flash_upload) stays valid, so only the next message waits for the transfer; any other payload may
+ * be on the caller's stack, so the transfer is waited for before returning.
  *
  * @param msg_len  Length of the message.
  * @param msg_data Message data, including the header.
@@ -58,21 +83,18 @@ static void onMessageSend(uint8_t msg_len, uint8_t *msg_data, uint16_t data_len,
 	/* Variable for storing function return values. */
 	int ret;
 
-	ret = uart_tx(huartBGAPI, msg_len, (char*) msg_data);
+	if (data == NULL) {
+		data_len = 0;
+	}
+	ret = uart_tx_gather(huartBGAPI, msg_len, (char*) msg_data, data_len, (char*) data);
 	if (ret < 0) {
 		printf("onMessageSend() - failed to write to serial port, ret: %d, errno: %d\r\n", ret,
 		errno);
 		return;
 	}
 
-	if (data_len && data) {
-		ret = uart_tx(huartBGAPI, data_len, (char*) data);
-
-		if (ret < 0) {
-			printf("onMessageSend() - failed to write to serial port, ret: %d, errno: %d\r\n", ret,
-					errno);
-			return;
-		}
+	if (data_len && (uint32_t) data - FLASH_BASE >= FLASH_SIZE) {
+		uart_tx_wait(huartBGAPI);
 	}
 }
 
@@ -142,6 +164,275 @@ HAL_StatusTypeDef setBT122UARTMode(int mode) {
 }
 
 
+/**
+ * A header is the start of a packet if it is from a dumo device. The length fits in 11 bits, so it is
+ * never more than BGLIB_MSG_MAXLEN allows.
+ */
+static int bgapiIsHeaderValid(const char *header) {
+	return (header[0] & 0x78) == dumo_dev_type_dumo;
+}
+
+/**
+ * Frame the bytes received from the BT122 into packets. Consumes whatever is in the UART receive buffer
+ * (up to the end of the packet that fills the queue) and returns without waiting for more.
+ *
+ * @retval  The number of packets waiting to be dispatched.
+ */
+int bgapiFeed() {
+	UART_Channel *channel = uart_get_channel(huartBGAPI);
+	const char *data;
+	int available;
+
+	// a packet whose bytes stopped arriving lost some of them, drop it and look for the next header
+	if ((bgapiFramer.received > 0 || bgapiFramer.skip > 0) && HAL_GetTick() - bgapiFramer.lastByteTick >= BGAPI_FRAMER_TIMEOUT_MS) {
+		bgapiFramer.stats.timeouts++;
+		bgapiFramer.received = 0;
+		bgapiFramer.length = 0;
+		bgapiFramer.skip = 0;
+	}
+
+	while (bgapiFramer.head - bgapiFramer.tail < BGAPI_QUEUE_LENGTH && (available = uart_channel_get_span(channel, &data)) > 0) {
+		bgapiFramer.lastByteTick = HAL_GetTick();
+
+		// rest of a packet that does not fit in the queue
+		if (bgapiFramer.skip > 0) {
+			int n = available < bgapiFramer.skip ? available : bgapiFramer.skip;
+			uart_channel_consume(channel, n);
+			bgapiFramer.skip -= n;
+			continue;
+		}
+
+		// header first, then the payload it announces
+		char *packet = (char *) bgapiFramer.packets[bgapiFramer.head % BGAPI_QUEUE_LENGTH];
+		int needed = (bgapiFramer.length ? bgapiFramer.length : BGLIB_MSG_HEADER_LEN) - bgapiFramer.received;
+		int n = available < needed ? available : needed;
+		memcpy(packet + bgapiFramer.received, data, n);
+		uart_channel_consume(channel, n);
+		bgapiFramer.received += n;
+
+		if (bgapiFramer.length == 0 && bgapiFramer.received == BGLIB_MSG_HEADER_LEN) {
+			if (!bgapiIsHeaderValid(packet)) {
+				// not the start of a packet (e.g. the 0 sent on module reset), drop a byte and try again
+				memmove(packet, packet + 1, BGLIB_MSG_HEADER_LEN - 1);
+				bgapiFramer.received--;
+				bgapiFramer.stats.resyncBytes++;
+				continue;
+			}
+			int length = BGLIB_MSG_HEADER_LEN + BGLIB_MSG_LEN(packet);
+			if (length > BGAPI_PACKET_MAXLEN) {
+				bgapiFramer.skip = length - BGLIB_MSG_HEADER_LEN;
+				bgapiFramer.received = 0;
+				bgapiFramer.stats.skippedPackets++;
+				continue;
+			}
+			bgapiFramer.length = length;
+		}
+
+		if (bgapiFramer.length && bgapiFramer.received == bgapiFramer.length) {
+			bgapiFramer.head++;
+			bgapiFramer.stats.packets++;
+			bgapiFramer.received = 0;
+			bgapiFramer.length = 0;
+		}
+	}
+
+	return bgapiFramer.head - bgapiFramer.tail;
+}
+
+/**
+ * Frame the received bytes (bgapiFeed()) and pass every queued packet to the handler registered for its
+ * message ID, or to the BGAPI_DEFAULT_HANDLER_ID handler. Packets without a handler are dropped.
+ *
+ * @retval  The number of packets dispatched.
+ */
+int bgapiDispatch() {
+	int dispatched = 0;
+
+	bgapiFeed();
+	while (bgapiFramer.head != bgapiFramer.tail) {
+		const char *packet = (const char *) bgapiFramer.packets[bgapiFramer.tail % BGAPI_QUEUE_LENGTH];
+		uint32_t id = BGLIB_MSG_ID(packet);
+		// released before the handler runs, the handler may reset the framer
+		bgapiFramer.tail++;
+		dispatched++;
+
+		int defaultHandler = -1;
+		int i;
+		for (i = 0; i < bgapiHandlerCount && bgapiHandlers[i].id != id; i++) {
+			if (bgapiHandlers[i].id == BGAPI_DEFAULT_HANDLER_ID) {
+				defaultHandler = i;
+			}
+		}
+		if (i == bgapiHandlerCount) {
+			i = defaultHandler;
+		}
+		if (i >= 0) {
+			TRACE_BEGIN(TRACE_BGAPI_HANDLER, ((uint8_t) packet[2] << 8) | (uint8_t) packet[3]);
+			bgapiHandlers[i].handler(BGLIB_MSG(packet), bgapiHandlers[i].context);
+			TRACE_END(TRACE_BGAPI_HANDLER);
+		}
+	}
+	return dispatched;
+}
+
+/**
+ * Register the handler of a message. Replaces the handler already registered for the same ID.
+ *
+ * @param   id The message ID (e.g. dumo_evt_dfu_boot_id), or BGAPI_DEFAULT_HANDLER_ID for all messages
+ * 			without a handler of their own.
+ * @param   handler The function called with the received packet.
+ * @param   context Passed to the handler.
+ * @retval  0 if the handler was registered, -1 if BGAPI_MAX_HANDLERS are registered already.
+ */
+int bgapiRegisterHandler(uint32_t id, BgapiHandler handler, void *context) {
+	int i;
+	for (i = 0; i < bgapiHandlerCount && bgapiHandlers[i].id != id; i++) {
+	}
+	if (i == BGAPI_MAX_HANDLERS) {
+		printf("Error: too many BGAPI handlers.\n");
+		return -1;
+	}
+	bgapiHandlers[i].id = id;
+	bgapiHandlers[i].handler = handler;
+	bgapiHandlers[i].context = context;
+	if (i == bgapiHandlerCount) {
+		bgapiHandlerCount++;
+	}
+	return 0;
+}
+
+/**
+ * Unregister all message handlers.
+ */
+void bgapiClearHandlers() {
+	bgapiHandlerCount = 0;
+}
+
+/**
+ * Drop everything received so far: the UART receive buffer, the packet being framed and the queue.
+ * The statistics are kept.
+ */
+void bgapiResetFramer() {
+	uart_channel_clear_buffer(uart_get_channel(huartBGAPI));
+	bgapiFramer.received = 0;
+	bgapiFramer.length = 0;
+	bgapiFramer.skip = 0;
+	bgapiFramer.tail = bgapiFramer.head;
+}
+
+/**
+ * Returns the framer statistics since boot.
+ */
+const BgapiFramerStats *bgapiGetFramerStats() {
+	return &bgapiFramer.stats;
+}
+
+/**
+ * Receive BGAPI messages until the one with the given ID arrives. Other messages are dropped, without
+ * being dispatched.
+ *
+ * @param   id The message ID (e.g. dumo_rsp_system_hello_id).
+ * @param   buffer Buffer of BGAPI_PACKET_MAXLEN bytes that receives the message.
+ * @param   timeout Time to wait in ms.
+ * @retval  HAL_OK if the message was received, HAL_TIMEOUT otherwise.
+ */
+static HAL_StatusTypeDef waitForBGAPIMessage(uint32_t id, char *buffer, uint32_t timeout) {
+	uint32_t startTick = HAL_GetTick();
+
+	while (HAL_GetTick() - startTick < timeout) {
+		bgapiFeed();
+		while (bgapiFramer.head != bgapiFramer.tail) {
+			const char *packet = (const char *) bgapiFramer.packets[bgapiFramer.tail % BGAPI_QUEUE_LENGTH];
+			bgapiFramer.tail++;
+			if (BGLIB_MSG_ID(packet) == id) {
+				memcpy(buffer, packet, BGLIB_MSG_HEADER_LEN + BGLIB_MSG_LEN(packet));
+				return HAL_OK;
+			}
+		}
+	}
+	return HAL_TIMEOUT;
+}
+
+/**
+ * Check that the BT122 answers BGAPI commands (system_hello) at the current baud rate. The BT122 UART
+ * must be in BGAPI mode.
+ *
+ * @retval  HAL_OK if the BT122 answered, HAL_TIMEOUT if none of BT122_PROBE_ATTEMPTS commands got a response.
+ */
+HAL_StatusTypeDef probeBT122() {
+	static char bg_buffer[BGAPI_PACKET_MAXLEN];
+
+	for (int i = 0; i < BT122_PROBE_ATTEMPTS; i++) {
+		bgapiResetFramer();
+		dumo_cmd_system_hello();
+		if (waitForBGAPIMessage(dumo_rsp_system_hello_id, bg_buffer, BT122_BGAPI_TIMEOUT_MS) == HAL_OK) {
+			return HAL_OK;
+		}
+	}
+	return HAL_TIMEOUT;
+}
+
+/**
+ * Ask the BT122 to change its UART rate, with RTS/CTS flow control (hardware_set_uart_configuration),
+ * and change the rate of the U5 UART to match. The link is then checked with probeBT122(). If that fails,
+ * both sides go back to the previous rate. The BT122 UART must be in BGAPI mode. The new rate lasts
+ * until the BT122 is reset (see BT122_DEFAULT_BAUD_RATE).
+ *
+ * @param   baudRate The new baud rate.
+ * @retval  HAL_OK if the link works at the new rate, HAL_ERROR if it is still (or again) at the previous
+ * 			rate, HAL_TIMEOUT if the BT122 cannot be reached at either rate.
+ */
+HAL_StatusTypeDef setBT122BaudRate(uint32_t baudRate) {
+	static char bg_buffer[BGAPI_PACKET_MAXLEN];
+	uint32_t previousBaudRate = huartBGAPI->Init.BaudRate;
+
+	if (baudRate == previousBaudRate) {
+		return HAL_OK;
+	}
+	if (probeBT122() != HAL_OK) {
+		printf("Error: BT122 does not respond at %ld baud.\n", previousBaudRate);
+		return HAL_TIMEOUT;
+	}
+
+	// The response is sent at the old rate, the new one is used BT122_UART_RECONFIGURE_DELAY_MS later.
+	// endpoint 0 (UART), 8 data bits, 1 stop bit, no parity, RTS/CTS flow control
+	dumo_cmd_hardware_set_uart_configuration(0, baudRate, 8, 1, 0, 1);
+	if (waitForBGAPIMessage(dumo_rsp_hardware_set_uart_configuration_id, bg_buffer, BT122_BGAPI_TIMEOUT_MS) != HAL_OK
+			|| BGLIB_MSG(bg_buffer)->rsp_hardware_set_uart_configuration.result != 0) {
+		printf("Error: BT122 did not accept %ld baud, staying at %ld baud.\n", baudRate, previousBaudRate);
+		return HAL_ERROR;
+	}
+	HAL_Delay(BT122_UART_RECONFIGURE_DELAY_MS);
+	if (followBT122BaudRate(baudRate) == HAL_OK && probeBT122() == HAL_OK) {
+		printf("BT122 UART set to %ld baud.\n", baudRate);
+		return HAL_OK;
+	}
+
+	// Fall back. The BT122 may still understand commands even though its responses are lost.
+	printf("Error: BT122 link does not work at %ld baud, falling back to %ld baud.\n", baudRate, previousBaudRate);
+	dumo_cmd_hardware_set_uart_configuration(0, previousBaudRate, 8, 1, 0, 1);
+	HAL_Delay(BT122_UART_RECONFIGURE_DELAY_MS);
+	followBT122BaudRate(previousBaudRate);
+	if (probeBT122() != HAL_OK) {
+		printf("Error: BT122 does not respond at %ld baud, it must be reset.\n", previousBaudRate);
+		return HAL_TIMEOUT;
+	}
+	return HAL_ERROR;
+}
+
+/**
+ * Change the rate of the U5 side of the BT122 link only, e.g. after a command that resets the BT122.
+ * Anything received but not dispatched yet is dropped.
+ *
+ * @param   baudRate The rate the BT122 uses now.
+ * @retval  HAL_OK if the U5 UART receives at the new rate, HAL_ERROR otherwise.
+ */
+HAL_StatusTypeDef followBT122BaudRate(uint32_t baudRate) {
+	HAL_StatusTypeDef status = uart_set_baud_rate(huartBGAPI, baudRate);
+	bgapiResetFramer();
+	return status;
+}
+
 /**
  * Test toggling between BT122 UART modes.
  */
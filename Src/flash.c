@@ -31,8 +31,25 @@
 
 #include "flash.h"
 #include "util.h"
+#include "trace.h"
 
 /* Private variables --------------------------------------------------------*/
+static uint32_t flashProgramBytes = 0;		/* Bytes programmed by writeFlashRange() since the last reset */
+static uint32_t flashProgramCycles = 0;		/* CPU cycles spent in writeFlashRange() since the last reset */
+static uint32_t flashSkippedBytes = 0;		/* Bytes writeFlashRange() did not program since the last reset, as they were all 0xFF */
+
+static int flashBanksSwapped = -1;			/* Bank swap state at boot (-1 until read by flashInit()) */
+
+/* State of the background (interrupt driven) erase started by eraseFlashRange_IT() */
+static struct {
+	volatile int busy;						/* 1 while an erase is in progress */
+	volatile HAL_StatusTypeDef status;		/* Result of the last background erase */
+	volatile uint32_t address;				/* Start of the segment currently being erased */
+	uint32_t endAddress;					/* End of the range to erase */
+	uint32_t startAddress;					/* Start of the range to erase, page 0 of pageMask */
+	const uint8_t *pageMask;				/* Pages of the range to erase (bit set), NULL to erase them all */
+	FlashEraseCallback callback;			/* Called (from the FLASH interrupt) when the erase finishes */
+} flashEraseIT = { 0, HAL_OK, 0, 0, 0, NULL, NULL };
 
 /* Functions ----------------------------------------------------------------*/
 
@@ -69,6 +86,17 @@ void clearAllFlashFlags() {
 	__HAL_FLASH_CLEAR_FLAG(FLASH_FLAG_ALL_ERRORS);
 }
 
+/**
+ * @brief   Cache the flash bank swap state and enable the FLASH interrupt used by eraseFlashRange_IT().
+ *          Call once at boot. The swap state only changes on the next option byte load, so the
+ *          cached value stays valid even after the swap bit has been reprogrammed.
+ */
+void flashInit() {
+	flashBanksSwapped = areFlashBanksSwapped();
+	HAL_NVIC_SetPriority(FLASH_IRQn, 0, 0);
+	HAL_NVIC_EnableIRQ(FLASH_IRQn);
+}
+
 /**
  * @brief   Query Flash option bytes to determine if flash banks are currently swapped or not.
  *          i.e.: check if bank 1 and bank 2 addresses are swapped.
@@ -105,25 +133,71 @@ uint32_t readFlash(int baseAddress, int offset) {
 }
 
 /**
- * 	Read a page of data from flash, and store it in buffer.
+ * 	Read a page of data from flash, and store it in buffer. Use flashImageOpen() instead to read flash without copying.
  *
  *	@param   page The page number of data to be read from flash (between 0 and (FLASH_PAGE_NB - 1)).
  * 	@param   buffer The buffer in which the read data will be stored. Must have a length of at least FLASH_PAGE_SIZE (8 KB).
  *	@retval  Status code indicating if read operation was successful or not.
  */
 HAL_StatusTypeDef readFlashPage(int page, char *buffer) {
-	__IO uint32_t *flashPage = (uint32_t*) (0x08000000 + (page * FLASH_PAGE_SIZE));
-	// Copy data from flash to buffer
-	for (int i = 0; i < FLASH_PAGE_SIZE; i++) {
-		char byte = ((char*) (flashPage))[i % 4];
-		buffer[i] = byte;
-		if (i != 0 && i % 4 == 0) {
-			flashPage++;
-		}
+	FlashImageView view;
+	if (flashImageOpen(&view, 0x08000000 + (page * FLASH_PAGE_SIZE), FLASH_PAGE_SIZE) != HAL_OK) {
+		return HAL_ERROR;
 	}
+	memcpy(buffer, flashImageData(&view, 0, FLASH_PAGE_SIZE), FLASH_PAGE_SIZE);
 	return HAL_OK;
 }
 
+/**
+ * Get the physical flash bank that a (logical) flash address is currently mapped to. Takes into
+ * account potentially swapped banks.
+ *
+ * @param flashAddress The flash address.
+ * @return FLASH_BANK_1 or FLASH_BANK_2.
+ */
+uint32_t flashGetBank(uint32_t flashAddress) {
+	if (flashBanksSwapped < 0) {
+		flashBanksSwapped = areFlashBanksSwapped();
+	}
+	int firstBank = (flashAddress < 0x08000000 + (FLASH_PAGE_NB * FLASH_PAGE_SIZE));
+	return (firstBank != flashBanksSwapped) ? FLASH_BANK_1 : FLASH_BANK_2;
+}
+
+/**
+ * Open a read-only view of an image stored in flash. The view hands out pointers straight into
+ * memory-mapped flash, so image data can be hashed, compared or transmitted without copying it.
+ *
+ * @param view The view to initialize.
+ * @param flashAddress Start address of the image.
+ * @param size Size of the image in bytes.
+ * @return Status code indicating if the image lies within flash.
+ */
+HAL_StatusTypeDef flashImageOpen(FlashImageView *view, uint32_t flashAddress, uint32_t size) {
+	if (flashAddress < 0x08000000 || size > FLASH_SIZE || flashAddress + size > 0x08000000 + FLASH_SIZE) {
+		printf("Error: image at %08lx (%ld bytes) is not within flash.\n", flashAddress, size);
+		return HAL_ERROR;
+	}
+	view->data = (const char *) flashAddress;
+	view->size = size;
+	view->bank = flashGetBank(flashAddress);
+	return HAL_OK;
+}
+
+/**
+ * Get a pointer to part of an image in flash.
+ *
+ * @param view The image view.
+ * @param offset Offset into the image.
+ * @param length Number of bytes that will be read from the returned pointer.
+ * @return Pointer into flash, or NULL if [offset, offset + length) is not within the image.
+ */
+const char *flashImageData(const FlashImageView *view, uint32_t offset, uint32_t length) {
+	if (offset > view->size || length > view->size - offset) {
+		return NULL;
+	}
+	return view->data + offset;
+}
+
 /**
  * 	Prints the data that is in the flash memory from FLASH_START_ADDR to (FLASH_END_ADDR - 4).
  *	Note: does not print the word located at FLASH_END_ADDR.
@@ -200,19 +274,117 @@ HAL_StatusTypeDef writeFlashPage(int page, const char *buffer) {
 	}
 	// Determine flash address based off page parameter.
 	uint32_t flashAddress = 0x08000000 + (page * FLASH_PAGE_SIZE);
-	uint32_t bufferCursor = (uint32_t) (buffer);
-	// write 8192 bytes to flash in sets of 16 bytes
-	for (int i = 0; i < FLASH_PAGE_SIZE / 16; i++) {
-		HAL_StatusTypeDef status = writeFlash(flashAddress, bufferCursor);
-		if (status != HAL_OK) {
-			printf("Page write failed at address: %ld\n", flashAddress);
-			return status;
+	// write 8192 bytes to flash in bursts of 128 bytes
+	return writeFlashRange(flashAddress, buffer, FLASH_PAGE_SIZE);
+}
+
+/**
+ * Check if data is all 0xFF (the erased state of flash).
+ */
+static int isErasedData(uint32_t dataAddress, uint32_t length) {
+	const uint32_t *words = (const uint32_t *) dataAddress;
+	for (uint32_t i = 0; i < length / 4; i++) {
+		if (words[i] != 0xFFFFFFFFU) {
+			return 0;
 		}
-		flashAddress += 16;
-		bufferCursor += 16;
 	}
+	return 1;
+}
 
-	return HAL_OK;
+/**
+ * Write a range of data to flash with a single unlock. Uses burst programming (8 quadwords / 128 bytes
+ * per operation) wherever the flash address is 128-byte aligned, and single quadwords at the edges.
+ * Assumes the range has already been erased, so bursts and quadwords that are all 0xFF are skipped
+ * rather than programmed (they already read as 0xFF, and can still be programmed later).
+ *
+ * @param flashAddress Address at which to start writing data. Must be 128-bit aligned.
+ * @param buffer The data to write to flash. Must be 32-bit aligned.
+ * @param length Number of bytes to write. Must be a multiple of 16.
+ * @return Status code indicating if write operation was successful or not.
+ */
+HAL_StatusTypeDef writeFlashRange(uint32_t flashAddress, const char *buffer, int length) {
+	if ((flashAddress & 0xf) != 0 || (length & 0xf) != 0) {
+		printf("Error: flash address and length must be 128-bit aligned.\n");
+		return HAL_ERROR;
+	}
+	if (((uint32_t) buffer & 0x3) != 0) {
+		printf("Error: data address to write to flash must be 32-bit aligned.\n");
+		return HAL_ERROR;
+	}
+	if (flashAddress < 0x08000000 || length < 0 || flashAddress + length > 0x08400000) {
+		printf("Error: flash address out of range. Must be between 0x08000000 and 0x083fffff.\n");
+		return HAL_ERROR;
+	}
+
+	TRACE_SCOPE(TRACE_FLASH_PROGRAM, length / 16);
+	uint32_t startCycles = DWT->CYCCNT;
+	HAL_StatusTypeDef status = HAL_OK;
+	uint32_t dataAddress = (uint32_t) buffer;
+	uint32_t endAddress = flashAddress + length;
+
+	HAL_FLASH_Unlock();
+	clearAllFlashFlags();
+
+	while (flashAddress < endAddress) {
+		uint32_t step = 16;
+		uint32_t typeProgram = FLASH_TYPEPROGRAM_QUADWORD;
+		if ((flashAddress & (FLASH_BURST_SIZE - 1)) == 0 && endAddress - flashAddress >= FLASH_BURST_SIZE) {
+			step = FLASH_BURST_SIZE;
+			typeProgram = FLASH_TYPEPROGRAM_BURST;
+		}
+		if (isErasedData(dataAddress, step)) {
+			flashSkippedBytes += step;
+		} else {
+			status = HAL_FLASH_Program(typeProgram, flashAddress, dataAddress);
+			if (status != HAL_OK) {
+				printf("Error: flash write failed at address: %08lx\n", flashAddress);
+				printFlashError(HAL_FLASH_GetError());
+				break;
+			}
+		}
+		flashAddress += step;
+		dataAddress += step;
+	}
+
+	HAL_FLASH_Lock();
+
+	flashProgramCycles += DWT->CYCCNT - startCycles;
+	flashProgramBytes += length;
+
+	return status;
+}
+
+/**
+ * Reset the flash programming time statistics. Also makes sure the DWT cycle counter used
+ * to time flash programming is running.
+ */
+void flashResetProgramStats() {
+	enableCycleCounter();
+	flashProgramBytes = 0;
+	flashProgramCycles = 0;
+	flashSkippedBytes = 0;
+}
+
+/**
+ * Get the average time taken by writeFlashRange() to program one flash page since the last call
+ * to flashResetProgramStats().
+ *
+ * @return Average programming time per FLASH_PAGE_SIZE bytes, in microseconds.
+ */
+uint32_t flashGetProgramTimePerPage() {
+	if (flashProgramBytes == 0) {
+		return 0;
+	}
+	uint64_t cyclesPerPage = ((uint64_t) flashProgramCycles * FLASH_PAGE_SIZE) / flashProgramBytes;
+	return (uint32_t) (cyclesPerPage / (SystemCoreClock / 1000000));
+}
+
+/**
+ * Get the number of bytes writeFlashRange() skipped because they were all 0xFF (already the erased
+ * state), since the last call to flashResetProgramStats().
+ */
+uint32_t flashGetSkippedBytes() {
+	return flashSkippedBytes;
 }
 
 /**
@@ -237,6 +409,11 @@ HAL_StatusTypeDef writeFlashLarge(uint32_t flashAddress, const char *buffer, con
 		return HAL_ERROR;
 	}
 
+	// aligned buffers can be programmed directly
+	if (((uint32_t) buffer & 0x3) == 0) {
+		return writeFlashRange(flashAddress, buffer, length);
+	}
+
 	char writeBuffer[16] __attribute__ ((aligned(4))); // Anything written to flash must be 32-bit aligned
 	uint32_t bufferCursor = (uint32_t) (&writeBuffer);
 
@@ -249,7 +426,7 @@ HAL_StatusTypeDef writeFlashLarge(uint32_t flashAddress, const char *buffer, con
 			return status;
 		}
 		flashAddress += 16;
-		bufferCursor += 16;
+		buffer += 16;
 	}
 
 	return HAL_OK;
@@ -284,56 +461,423 @@ HAL_StatusTypeDef eraseFlashPage(int page) {
  */
 HAL_StatusTypeDef eraseFlashPage(int page) {
 	// Make sure 'page' parameter is a valid page.
-	if (page < 0 || page > FLASH_SIZE / FLASH_PAGE_SIZE) {
-		printf("Error: invalid value for parameter 'page'. Must be between 0 and %ld.\n", FLASH_SIZE / FLASH_PAGE_SIZE);
+	if (page < 0 || page >= FLASH_SIZE / FLASH_PAGE_SIZE) {
+		printf("Error: invalid value for parameter 'page'. Must be between 0 and %ld.\n", FLASH_SIZE / FLASH_PAGE_SIZE - 1);
 		return HAL_ERROR;
 	}
-	// Determine what flash bank and page we are really erasing. May not match input 'page'
-	// due to swapped banks.
-	uint32_t flashEraseBank;
-	uint32_t flashErasePage;
-	if (areFlashBanksSwapped() == 0) { // flash banks not swapped
-		if (page < FLASH_PAGE_NB) {
-			// bank 1
-			flashEraseBank = FLASH_BANK_1;
-			flashErasePage = page;
-		} else {
-			// bank 2
-			flashEraseBank = FLASH_BANK_2;
-			flashErasePage = page - FLASH_PAGE_NB;
-		}
-	} else { // flash banks are swapped
-		if (page < FLASH_PAGE_NB) {
-			// bank 2
-			flashEraseBank = FLASH_BANK_2;
-			flashErasePage = page;
-		} else {
-			// bank 1
-			flashEraseBank = FLASH_BANK_1;
-			flashErasePage = page - FLASH_PAGE_NB;
-		}
+	return eraseFlashRange(0x08000000 + (page * FLASH_PAGE_SIZE), FLASH_PAGE_SIZE);
+}
+
+/**
+ * Work out the erase operation for the first part of a flash range that lies within one bank.
+ * Takes into account potentially swapped banks. Uses a mass bank erase if the part covers the whole bank.
+ *
+ * @param address Start of the range. Must be page aligned.
+ * @param endAddress End of the range. Must be page aligned.
+ * @param eraseInit Filled in with the erase operation.
+ * @return The address following the part covered by eraseInit.
+ */
+static uint32_t flashEraseSegment(uint32_t address, uint32_t endAddress, FLASH_EraseInitTypeDef *eraseInit) {
+	uint32_t bankSize = FLASH_PAGE_NB * FLASH_PAGE_SIZE;
+	uint32_t bankStart = address < 0x08000000 + bankSize ? 0x08000000 : 0x08000000 + bankSize;
+	uint32_t segmentEnd = endAddress < bankStart + bankSize ? endAddress : bankStart + bankSize;
+
+	eraseInit->Banks = flashGetBank(address);
+
+	if (address == bankStart && segmentEnd == bankStart + bankSize) {
+		eraseInit->TypeErase = FLASH_TYPEERASE_MASSERASE;
+	} else {
+		eraseInit->TypeErase = FLASH_TYPEERASE_PAGES;
+		eraseInit->Page = (address - bankStart) / FLASH_PAGE_SIZE;
+		eraseInit->NbPages = (segmentEnd - address) / FLASH_PAGE_SIZE;
 	}
-	// Configure flash erase init struct
-	FLASH_EraseInitTypeDef eraseInit;
-	eraseInit.TypeErase = FLASH_TYPEERASE_PAGES;
-	eraseInit.Banks = flashEraseBank;
-	eraseInit.Page = flashErasePage;
-	eraseInit.NbPages = 1;
-	uint32_t eraseError;
+	return segmentEnd;
+}
+
+/**
+ * Check that a flash range can be erased, and round it out to whole pages.
+ */
+static HAL_StatusTypeDef flashEraseCheckRange(uint32_t *address, uint32_t *endAddress, uint32_t length) {
+	uint32_t start = *address & ~(FLASH_PAGE_SIZE - 1);
+	uint32_t end = (*address + length + FLASH_PAGE_SIZE - 1) & ~(FLASH_PAGE_SIZE - 1);
+	if (length == 0 || start < 0x08000000 || end > 0x08000000 + FLASH_SIZE) {
+		printf("Error: erase range out of range. Must be between 0x08000000 and 0x083fffff.\n");
+		return HAL_ERROR;
+	}
+	// never erase the code that is currently running
+	uint32_t code = (uint32_t) &flashEraseCheckRange;
+	if (code >= start && code < end) {
+		printf("Error: erase range %08lx - %08lx contains the running firmware.\n", start, end);
+		return HAL_ERROR;
+	}
+	*address = start;
+	*endAddress = end;
+	return HAL_OK;
+}
+
+/**
+ * Erase every flash page overlapping [address, address + length). Takes into account potentially
+ * swapped banks. Pages are erased with one multi-page erase per bank, or a mass erase when a whole
+ * bank is covered.
+ *
+ * @param address Start of the range to erase.
+ * @param length Number of bytes to erase.
+ * @return Status code indicating if erase operation was successful or not.
+ */
+HAL_StatusTypeDef eraseFlashRange(uint32_t address, uint32_t length) {
+	uint32_t endAddress;
+	if (flashEraseCheckRange(&address, &endAddress, length) != HAL_OK) {
+		return HAL_ERROR;
+	}
+	if (flashEraseIT.busy) {
+		printf("Error: background flash erase in progress.\n");
+		return HAL_BUSY;
+	}
+	TRACE_SCOPE(TRACE_FLASH_ERASE, (endAddress - address) / FLASH_PAGE_SIZE);
+
+	HAL_StatusTypeDef eraseStatus = HAL_OK;
 	// Unlock flash for modification
 	HAL_FLASH_Unlock();
 	// clear flash error flags
 	clearAllFlashFlags();
-	// Perform flash erase operation
-	HAL_StatusTypeDef eraseStatus = HAL_FLASHEx_Erase(&eraseInit, &eraseError);
-	// Wait for flash erase operation to complete
-	FLASH_WaitForLastOperation(HAL_MAX_DELAY);
+
+	while (address < endAddress && eraseStatus == HAL_OK) {
+		FLASH_EraseInitTypeDef eraseInit;
+		uint32_t eraseError;
+		uint32_t segmentEnd = flashEraseSegment(address, endAddress, &eraseInit);
+		eraseStatus = HAL_FLASHEx_Erase(&eraseInit, &eraseError);
+		if (eraseStatus != HAL_OK) {
+			printf("Error: flash erase failed at address: %08lx\n", address);
+			printFlashError(HAL_FLASH_GetError());
+		}
+		address = segmentEnd;
+	}
+
 	// Lock flash
 	HAL_FLASH_Lock();
 	// Return status of flash erase operation
 	return eraseStatus;
 }
 
+/**
+ * Check if the page at address is one of the pages the background erase should erase.
+ */
+static int flashErasePageSelected_IT(uint32_t address) {
+	if (flashEraseIT.pageMask == NULL) {
+		return 1;
+	}
+	uint32_t page = (address - flashEraseIT.startAddress) / FLASH_PAGE_SIZE;
+	return (flashEraseIT.pageMask[page / 8] & (1U << (page % 8))) != 0;
+}
+
+/**
+ * Move the background erase on to the next page that should be erased.
+ */
+static void flashEraseSkipPages_IT() {
+	while (flashEraseIT.address < flashEraseIT.endAddress && !flashErasePageSelected_IT(flashEraseIT.address)) {
+		flashEraseIT.address += FLASH_PAGE_SIZE;
+	}
+}
+
+/**
+ * End of the run of pages to erase that starts at the current address of the background erase.
+ */
+static uint32_t flashEraseRunEnd_IT() {
+	uint32_t runEnd = flashEraseIT.address;
+	while (runEnd < flashEraseIT.endAddress && flashErasePageSelected_IT(runEnd)) {
+		runEnd += FLASH_PAGE_SIZE;
+	}
+	return runEnd;
+}
+
+/**
+ * Start erasing the next segment (the part of the run of pages within one bank) of the background erase.
+ */
+static HAL_StatusTypeDef flashEraseNextSegment_IT() {
+	FLASH_EraseInitTypeDef eraseInit;
+	flashEraseSegment(flashEraseIT.address, flashEraseRunEnd_IT(), &eraseInit);
+	return HAL_FLASHEx_Erase_IT(&eraseInit);
+}
+
+/**
+ * Finish the background erase, lock the flash and notify the caller.
+ */
+static void flashEraseFinish_IT(HAL_StatusTypeDef status) {
+	// disable the erase interrupts before locking, the HAL cannot clear them once the flash is locked
+	__HAL_FLASH_DISABLE_IT(FLASH_IT_EOP | FLASH_IT_OPERR);
+	HAL_FLASH_Lock();
+	flashEraseIT.status = status;
+	flashEraseIT.busy = 0;
+	if (flashEraseIT.callback != NULL) {
+		flashEraseIT.callback(status);
+	}
+}
+
+/**
+ * Erase every flash page overlapping [address, address + length) in the background, using the
+ * FLASH interrupt. Returns as soon as the first erase operation has started. Other flash write
+ * and erase functions must not be used until the erase has finished (see isFlashEraseBusy() and
+ * waitForFlashErase()). Requires flashInit() to have been called.
+ *
+ * @param address Start of the range to erase.
+ * @param length Number of bytes to erase.
+ * @param callback Called from the FLASH interrupt when the erase has finished. May be NULL.
+ * @return Status code indicating if the erase was started.
+ */
+HAL_StatusTypeDef eraseFlashRange_IT(uint32_t address, uint32_t length, FlashEraseCallback callback) {
+	return eraseFlashPages_IT(address, length, NULL, callback);
+}
+
+/**
+ * Erase selected flash pages of [address, address + length) in the background, like
+ * eraseFlashRange_IT(). Runs of consecutive selected pages are erased with one operation per bank,
+ * the other pages are left untouched.
+ *
+ * @param address Start of the range, rounded down to the start of its page (page 0 of pageMask).
+ * @param length Number of bytes in the range.
+ * @param pageMask Bitmap of the pages to erase, bit (i % 8) of byte (i / 8) for page i of the range.
+ *                 Must stay valid until the erase has finished. NULL to erase all pages.
+ * @param callback Called from the FLASH interrupt when the erase has finished. May be NULL.
+ * @return Status code indicating if the erase was started (HAL_OK if there was nothing to erase).
+ */
+HAL_StatusTypeDef eraseFlashPages_IT(uint32_t address, uint32_t length, const uint8_t *pageMask, FlashEraseCallback callback) {
+	uint32_t endAddress;
+	if (flashEraseCheckRange(&address, &endAddress, length) != HAL_OK) {
+		return HAL_ERROR;
+	}
+	if (flashEraseIT.busy) {
+		return HAL_BUSY;
+	}
+
+	flashEraseIT.address = address;
+	flashEraseIT.endAddress = endAddress;
+	flashEraseIT.startAddress = address;
+	flashEraseIT.pageMask = pageMask;
+	flashEraseIT.callback = callback;
+	flashEraseIT.status = HAL_OK;
+	flashEraseSkipPages_IT();
+	if (flashEraseIT.address >= flashEraseIT.endAddress) {
+		// no page selected
+		return HAL_OK;
+	}
+	flashEraseIT.busy = 1;
+
+	HAL_FLASH_Unlock();
+	clearAllFlashFlags();
+	HAL_StatusTypeDef status = flashEraseNextSegment_IT();
+	if (status != HAL_OK) {
+		HAL_FLASH_Lock();
+		flashEraseIT.status = status;
+		flashEraseIT.busy = 0;
+	}
+	return status;
+}
+
+/**
+ * @return 1 if a background erase started by eraseFlashRange_IT() is still in progress, 0 otherwise.
+ */
+int isFlashEraseBusy() {
+	return flashEraseIT.busy;
+}
+
+/**
+ * Wait for the background erase started by eraseFlashRange_IT() to finish.
+ *
+ * @return Result of the background erase (HAL_OK if no erase was started).
+ */
+HAL_StatusTypeDef waitForFlashErase() {
+	while (flashEraseIT.busy) {
+		// wait for the FLASH interrupt to finish the erase
+	}
+	return flashEraseIT.status;
+}
+
+/**
+ * FLASH end of operation callback, continues the background erase with the next bank or run of pages if needed.
+ *
+ * @param ReturnValue Erased page number, 0xFFFFFFFF at the end of a multi-page erase, or the bank for a mass erase.
+ */
+void HAL_FLASH_EndOfOperationCallback(uint32_t ReturnValue) {
+	if (!flashEraseIT.busy) {
+		return;
+	}
+	TRACE_MARK(TRACE_FLASH_ERASE_IT, ReturnValue);
+	FLASH_EraseInitTypeDef eraseInit;
+	uint32_t segmentEnd = flashEraseSegment(flashEraseIT.address, flashEraseRunEnd_IT(), &eraseInit);
+	if (eraseInit.TypeErase == FLASH_TYPEERASE_PAGES && ReturnValue != 0xFFFFFFFFU) {
+		// a page of a multi-page erase, more to come
+		return;
+	}
+
+	// segment finished, move on to the next bank or run of pages
+	flashEraseIT.address = segmentEnd;
+	flashEraseSkipPages_IT();
+	if (flashEraseIT.address >= flashEraseIT.endAddress) {
+		flashEraseFinish_IT(HAL_OK);
+	} else {
+		// the HAL only releases its lock after this callback returns
+		__HAL_UNLOCK(&pFlash);
+		if (flashEraseNextSegment_IT() != HAL_OK) {
+			flashEraseFinish_IT(HAL_ERROR);
+		}
+	}
+}
+
+/**
+ * FLASH operation error callback, aborts the background erase.
+ *
+ * @param ReturnValue Page, bank or address of the failed operation.
+ */
+void HAL_FLASH_OperationErrorCallback(uint32_t ReturnValue) {
+	if (flashEraseIT.busy) {
+		flashEraseFinish_IT(HAL_ERROR);
+	}
+}
+
+
+/**
+ * Start streaming data to a region of flash. Pages are erased as the data reaches them (or ahead of
+ * time with flashStreamEraseAhead()), and data is programmed (in bursts where possible) as soon as it
+ * is available, so the caller never needs to hold a whole page in RAM.
+ *
+ * @param writer The stream writer to initialize.
+ * @param flashAddress Start of the region. Must be the start of a flash page, or only quadword aligned if erased is 1.
+ * @param size Number of bytes that will be written.
+ * @param erased 1 if the region has already been erased (e.g. by eraseFlashRange_IT()), 0 otherwise.
+ * @return Status code indicating if the region is valid.
+ */
+HAL_StatusTypeDef flashStreamBegin(FlashStreamWriter *writer, uint32_t flashAddress, uint32_t size, int erased) {
+	if (flashAddress % (erased ? 16 : FLASH_PAGE_SIZE) != 0) {
+		printf("Error: flash stream must start at the beginning of a flash page (quadword if already erased).\n");
+		return HAL_ERROR;
+	}
+	if (flashAddress < 0x08000000 || flashAddress + size > 0x08400000) {
+		printf("Error: flash stream out of range. Must be between 0x08000000 and 0x083fffff.\n");
+		return HAL_ERROR;
+	}
+	writer->address = flashAddress;
+	writer->endAddress = flashAddress + ((size + 15) & ~0xfU);
+	writer->erasedAddress = erased ? (writer->endAddress + FLASH_PAGE_SIZE - 1) & ~(FLASH_PAGE_SIZE - 1) : flashAddress;
+	writer->quadwordLength = 0;
+	return HAL_OK;
+}
+
+/**
+ * Erase the next page of the stream region that has not been erased yet.
+ */
+static HAL_StatusTypeDef flashStreamErasePage(FlashStreamWriter *writer) {
+	if (eraseFlashPage((writer->erasedAddress - 0x08000000) / FLASH_PAGE_SIZE) != HAL_OK) {
+		printf("Error: failed to erase flash page at address: %08lx\n", writer->erasedAddress);
+		return HAL_ERROR;
+	}
+	writer->erasedAddress += FLASH_PAGE_SIZE;
+	return HAL_OK;
+}
+
+/**
+ * Program length bytes (a multiple of 16) at the current stream address, erasing pages first as needed.
+ */
+static HAL_StatusTypeDef flashStreamProgram(FlashStreamWriter *writer, const char *data, int length) {
+	if (writer->address + length > writer->endAddress) {
+		printf("Error: writing past the end of the flash stream.\n");
+		return HAL_ERROR;
+	}
+	while (length > 0) {
+		if (writer->address >= writer->erasedAddress) {
+			if (flashStreamErasePage(writer) != HAL_OK) {
+				return HAL_ERROR;
+			}
+		}
+		// program up to the end of the erased region
+		int n = writer->erasedAddress - writer->address;
+		if (n > length) {
+			n = length;
+		}
+		if (writeFlashRange(writer->address, data, n) != HAL_OK) {
+			return HAL_ERROR;
+		}
+		writer->address += n;
+		data += n;
+		length -= n;
+	}
+	return HAL_OK;
+}
+
+/**
+ * Write the next length bytes of the stream. Whole quadwords are programmed immediately (directly from
+ * data, in bursts, when it is 32-bit aligned), a trailing partial quadword is kept until more data arrives or
+ * flashStreamFinish() is called.
+ *
+ * @param writer The stream writer.
+ * @param data The data to write. No alignment requirement.
+ * @param length Number of bytes in data.
+ * @return Status code indicating if the write was successful.
+ */
+HAL_StatusTypeDef flashStreamWrite(FlashStreamWriter *writer, const char *data, int length) {
+	char *staging = (char*) writer->quadword;
+
+	while (length > 0) {
+		if (writer->quadwordLength > 0 || length < 16 || ((uint32_t) data & 0x3) != 0) {
+			// fill up the staging quadword
+			int n = 16 - writer->quadwordLength;
+			if (n > length) {
+				n = length;
+			}
+			memcpy(&staging[writer->quadwordLength], data, n);
+			writer->quadwordLength += n;
+			data += n;
+			length -= n;
+
+			if (writer->quadwordLength == 16) {
+				if (flashStreamProgram(writer, staging, 16) != HAL_OK) {
+					return HAL_ERROR;
+				}
+				writer->quadwordLength = 0;
+			}
+		} else {
+			// program all whole quadwords straight from the source
+			int n = length & ~0xf;
+			if (flashStreamProgram(writer, data, n) != HAL_OK) {
+				return HAL_ERROR;
+			}
+			data += n;
+			length -= n;
+		}
+	}
+
+	return HAL_OK;
+}
+
+/**
+ * Erase the next not yet erased page of the stream region, if any. Call this while waiting for
+ * data so that page erases do not delay programming.
+ *
+ * @param writer The stream writer.
+ * @return Status code indicating if the erase was successful (HAL_OK if there was nothing to erase).
+ */
+HAL_StatusTypeDef flashStreamEraseAhead(FlashStreamWriter *writer) {
+	if (writer->erasedAddress >= writer->endAddress) {
+		return HAL_OK;
+	}
+	return flashStreamErasePage(writer);
+}
+
+/**
+ * Program the remaining partial quadword, padded with 0xFF (erased flash value).
+ *
+ * @param writer The stream writer.
+ * @return Status code indicating if the write was successful.
+ */
+HAL_StatusTypeDef flashStreamFinish(FlashStreamWriter *writer) {
+	if (writer->quadwordLength == 0) {
+		return HAL_OK;
+	}
+	char *staging = (char*) writer->quadword;
+	memset(&staging[writer->quadwordLength], 0xFF, 16 - writer->quadwordLength);
+	writer->quadwordLength = 0;
+	return flashStreamProgram(writer, staging, 16);
+}
+
 
 /**
  *	Simplest flash test, use to test most basic functionality of flash functions. Does the following:
@@ -802,6 +1346,45 @@ void flashTest_5() {
 	}
 }
 
+/**
+ * Flash test 6: compare page programming time of quadword writes (writeFlash) against burst writes (writeFlashPage).
+ */
+void flashTest_6() {
+	HAL_StatusTypeDef testStatus = HAL_OK;
+	printf("\n\n***************************************\nFLASH TEST 6 - Quadword vs Burst Page Write\n***************************************\n\n");
+	char writeBuffer[FLASH_PAGE_SIZE] __attribute__ ((aligned(4)));
+	for (int i = 0; i < FLASH_PAGE_SIZE; i++) {
+		writeBuffer[i] = (char) i;
+	}
+	flashResetProgramStats();
+
+	// quadword at a time
+	eraseFlashPage(128);
+	uint32_t start = DWT->CYCCNT;
+	for (int i = 0; i < FLASH_PAGE_SIZE / 16; i++) {
+		writeFlash(0x08100000 + (i * 16), (uint32_t) &writeBuffer[i * 16]);
+	}
+	uint32_t quadwordCycles = DWT->CYCCNT - start;
+	testStatus |= compareBuffers(writeBuffer, (char *) 0x08100000, FLASH_PAGE_SIZE);
+
+	// burst
+	eraseFlashPage(128);
+	start = DWT->CYCCNT;
+	writeFlashPage(128, writeBuffer);
+	uint32_t burstCycles = DWT->CYCCNT - start;
+	testStatus |= compareBuffers(writeBuffer, (char *) 0x08100000, FLASH_PAGE_SIZE);
+
+	uint32_t cyclesPerMicro = SystemCoreClock / 1000000;
+	printf("Quadword page write: %ld us\n", quadwordCycles / cyclesPerMicro);
+	printf("Burst page write: %ld us\n", burstCycles / cyclesPerMicro);
+
+	if (testStatus == HAL_OK) {
+		printf("\n\n***************************************\nFLASH TEST 6 - Test Passed\n***************************************\n\n");
+	} else {
+		printf("\n\n***************************************\nFLASH TEST 6 - Test Failed\n***************************************\n\n");
+	}
+}
+
 /**
  * Compares two buffer to see if contents are the same. Buffers should be the same length.
  * Only used for testing.
@@ -0,0 +1,274 @@
+/**
+ ******************************************************************************
+ * @file           log.c
+ * @brief          Console log, buffered and sent in the background
+ ******************************************************************************
+ *
+ * printf() (through _write(), see main.c) and the LOG_ macros copy their
+ * message to a ring buffer and return. The buffer is sent over the console
+ * UART one contiguous span at a time, by DMA (LOG_TX_DMA_ENABLED, and a DMA
+ * channel linked to huart->hdmatx) or with TX interrupts, and each transfer
+ * complete callback starts the next one. Printing a line on the download
+ * path costs a copy instead of the ~100 us per character of a blocking
+ * transmit at 115200 baud.
+ *
+ * A message that does not fit in the buffer is dropped as a whole, and a
+ * note of how many were dropped is logged with the next one that fits.
+ *
+ * Messages may be written from interrupt handlers: interrupts are masked
+ * while a message is copied.
+ *
+ * With LOG_TOKENIZED, the LOG_ macros do not format their message: they send
+ * a record (LogRecord) of a few bytes, the offset of the format string in
+ * the log_strings section and the raw arguments. The format strings stay in
+ * the ELF file, "Python Client/log_decode.py" reads them from it to turn the
+ * records back into text. A record costs a few copies instead of
+ * vsnprintf(), and is a fraction of the size of the text (see testLogCost()).
+ *
+ ******************************************************************************
+ */
+
+/* Includes -----------------------------------------------------------------*/
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "log.h"
+#include "util.h"
+
+/* Variables ----------------------------------------------------------------*/
+static struct {
+	UART_HandleTypeDef *huart;				/* Console UART, NULL until logInit() (messages are kept until then) */
+	char buffer[LOG_BUFFER_LENGTH];
+	volatile uint32_t head;					/* Bytes written */
+	volatile uint32_t tail;					/* Bytes sent */
+	volatile uint32_t sending;				/* Bytes in the transfer in progress, 0 if none */
+	volatile uint32_t unreported;			/* Messages dropped since the last note */
+	int level;								/* Messages above this level are dropped */
+	LogStats stats;
+} logTx = { .level = LOG_LEVEL_DEFAULT };
+
+/* Functions ----------------------------------------------------------------*/
+
+/**
+ * Start sending the next contiguous span of the buffer, unless a transfer is in progress. Called with
+ * interrupts masked, or from the transfer complete callback.
+ */
+static void logStartTx() {
+	if (logTx.sending != 0 || logTx.huart == NULL || logTx.head == logTx.tail) {
+		return;
+	}
+	uint32_t start = logTx.tail & (LOG_BUFFER_LENGTH - 1);
+	uint32_t length = logTx.head - logTx.tail;
+	if (length > LOG_BUFFER_LENGTH - start) {
+		length = LOG_BUFFER_LENGTH - start;
+	}
+	HAL_StatusTypeDef status;
+#ifdef LOG_TX_DMA_ENABLED
+	if (logTx.huart->hdmatx != NULL) {
+		status = HAL_UART_Transmit_DMA(logTx.huart, (const uint8_t *) &logTx.buffer[start], length);
+	} else
+#endif
+	{
+		status = HAL_UART_Transmit_IT(logTx.huart, (const uint8_t *) &logTx.buffer[start], length);
+	}
+	// if the UART is busy (a blocking transmit, see traceDump()), the next message or logFlush() tries again
+	if (status == HAL_OK) {
+		logTx.sending = length;
+	}
+}
+
+/**
+ * Copy data to the buffer. Called with interrupts masked, there must be room.
+ */
+static void logPut(const char *data, int length) {
+	uint32_t start = logTx.head & (LOG_BUFFER_LENGTH - 1);
+	uint32_t first = length < LOG_BUFFER_LENGTH - start ? length : LOG_BUFFER_LENGTH - start;
+	memcpy(&logTx.buffer[start], data, first);
+	memcpy(logTx.buffer, data + first, length - first);
+	__DMB();
+	logTx.head += length;
+}
+
+/**
+ * Start sending the log over a UART. Messages logged before are sent first.
+ *
+ * @param huart The console UART (USART1). Its transfer complete callback must call logTxCallback().
+ */
+void logInit(UART_HandleTypeDef *huart) {
+	uint32_t primask = __get_PRIMASK();
+	__disable_irq();
+	logTx.huart = huart;
+	logStartTx();
+	__set_PRIMASK(primask);
+}
+
+/**
+ * Log a message, without waiting for the UART.
+ *
+ * @param data The message.
+ * @param length Number of bytes.
+ * @return length, or 0 if the message was dropped as the buffer is full.
+ */
+int logWrite(const char *data, int length) {
+	if (length <= 0) {
+		return 0;
+	}
+	// formatted before masking interrupts, a drop in between is reported with the next message
+	char note[48];
+	uint32_t unreported = logTx.unreported;
+	int noteLength = unreported > 0 ? snprintf(note, sizeof(note), "[log: %ld messages dropped]\n", unreported) : 0;
+
+	uint32_t primask = __get_PRIMASK();
+	__disable_irq();
+	uint32_t used = logTx.head - logTx.tail;
+	if (used + noteLength + length > LOG_BUFFER_LENGTH) {
+		logTx.stats.droppedMessages++;
+		logTx.stats.droppedBytes += length;
+		logTx.unreported++;
+		__set_PRIMASK(primask);
+		return 0;
+	}
+	if (noteLength > 0) {
+		logPut(note, noteLength);
+		logTx.unreported -= unreported;
+	}
+	logPut(data, length);
+	used += noteLength + length;
+	if (used > logTx.stats.maxUsed) {
+		logTx.stats.maxUsed = used;
+	}
+	logStartTx();
+	__set_PRIMASK(primask);
+	return length;
+}
+
+/**
+ * Log a formatted message (see the LOG_ macros) if level is enabled (see logSetLevel()).
+ *
+ * @param level LOG_LEVEL_ERROR, LOG_LEVEL_WARNING, LOG_LEVEL_INFO or LOG_LEVEL_DEBUG.
+ * @param format printf() format, the message is cut at LOG_LINE_LENGTH bytes.
+ */
+void logPrintf(int level, const char *format, ...) {
+	if (level > logTx.level) {
+		return;
+	}
+	char line[LOG_LINE_LENGTH];
+	va_list args;
+	va_start(args, format);
+	int length = vsnprintf(line, sizeof(line), format, args);
+	va_end(args);
+	if (length > (int) sizeof(line) - 1) {
+		length = sizeof(line) - 1;
+	}
+	logWrite(line, length);
+}
+
+/**
+ * Log bytes in hex after a label, "label: 0a1b2c\n" (see LOG_HEX()). Bytes that do not fit in LOG_LINE_LENGTH
+ * are left out.
+ */
+void logHexDump(int level, const char *label, const void *data, int length) {
+	static const char digits[] = "0123456789abcdef";
+	if (level > logTx.level) {
+		return;
+	}
+	char line[LOG_LINE_LENGTH];
+	int lineLength = snprintf(line, sizeof(line) - 1, "%s: ", label);
+	if (lineLength > (int) sizeof(line) - 1) {
+		lineLength = sizeof(line) - 1;
+	}
+	const uint8_t *bytes = data;
+	for (int i = 0; i < length && lineLength + 3 <= (int) sizeof(line); i++) {
+		line[lineLength++] = digits[bytes[i] >> 4];
+		line[lineLength++] = digits[bytes[i] & 0x0F];
+	}
+	line[lineLength++] = '\n';
+	logWrite(line, lineLength);
+}
+
+/**
+ * Drop the messages above a level from now on. printf() output is always logged.
+ */
+void logSetLevel(int level) {
+	logTx.level = level;
+}
+
+/**
+ * @return The level set with logSetLevel().
+ */
+int logGetLevel() {
+	return logTx.level;
+}
+
+/**
+ * Wait until the buffer has been sent, e.g. before a reset, or before sending on the console UART
+ * directly. Interrupts must be enabled.
+ *
+ * @retval HAL_OK, or HAL_TIMEOUT if the buffer was not sent within LOG_FLUSH_TIMEOUT_MS.
+ */
+HAL_StatusTypeDef logFlush() {
+	uint32_t startTick = HAL_GetTick();
+	while (logTx.head != logTx.tail) {
+		if (HAL_GetTick() - startTick >= LOG_FLUSH_TIMEOUT_MS) {
+			return HAL_TIMEOUT;
+		}
+		uint32_t primask = __get_PRIMASK();
+		__disable_irq();
+		logStartTx();
+		__set_PRIMASK(primask);
+	}
+	return HAL_OK;
+}
+
+/**
+ * @return The drop counters and the buffer high-water mark.
+ */
+const LogStats *logGetStats() {
+	return &logTx.stats;
+}
+
+/**
+ * A transfer finished, send what was logged meanwhile. Called from HAL_UART_TxCpltCallback().
+ */
+void logTxCallback(UART_HandleTypeDef *huart) {
+	if (huart != logTx.huart) {
+		return;
+	}
+	logTx.tail += logTx.sending;
+	logTx.sending = 0;
+	logStartTx();
+}
+
+
+
+
+// TESTING
+
+/**
+ * Measure the cost of a typical LOG_ message, in cycles to log it and in bytes to send: build with and without
+ * LOG_TOKENIZED to compare.
+ */
+void testLogCost() {
+	const int messages = 100;
+	int level = logGetLevel();
+	logSetLevel(LOG_LEVEL_DEBUG);
+	logFlush();
+	enableCycleCounter();
+
+	uint32_t head = logTx.head;
+	uint32_t start = DWT->CYCCNT;
+	for (int i = 0; i < messages; i++) {
+		LOG_DEBUG("Written %ld / %ld bytes.\n", (uint32_t) i * 8192, (uint32_t) 51724);
+	}
+	uint32_t cycles = DWT->CYCCNT - start;
+	uint32_t bytes = logTx.head - head;
+
+	logFlush();
+	logSetLevel(level);
+#ifdef LOG_TOKENIZED
+	printf("Log cost (tokenized): %ld cycles, %ld bytes per message\n", cycles / messages, bytes / messages);
+#else
+	printf("Log cost (text): %ld cycles, %ld bytes per message\n", cycles / messages, bytes / messages);
+#endif
+}
@@ -0,0 +1,191 @@
+/**
+ ******************************************************************************
+ * @file           lz.c
+ * @brief          Streaming LZ decompressor
+ ******************************************************************************
+ *
+ * Decompresses data in the LZ4 block format. The compressed data can be fed
+ * in pieces of any size (e.g. straight out of the UART receive buffer, which
+ * may wrap), the decoder keeps its position within the current sequence
+ * between calls.
+ *
+ * A block is a series of sequences:
+ *   token        high nibble: literal length, low nibble: match length - 4
+ *                (15 means more length bytes follow, each added, until one is not 255)
+ *   literals     copied to the output as is
+ *   offset       2 bytes little endian, distance back in the output to copy the match from
+ * The last sequence of a block has only literals.
+ *
+ * The output buffer doubles as the window, so matches can only refer to data
+ * of the same block. No other RAM is needed. A dictionary (e.g. an image
+ * already in flash) can be placed in front of the window, matches that reach
+ * back past the start of the output are copied from the dictionary. This is
+ * how delta updates refer to the running firmware.
+ *
+ ******************************************************************************
+ */
+
+/* Includes -----------------------------------------------------------------*/
+#include <stdio.h>
+#include <string.h>
+
+#include "lz.h"
+
+/* Private defines ----------------------------------------------------------*/
+#define LZ_STATE_TOKEN 0
+#define LZ_STATE_LITERAL_LENGTH 1
+#define LZ_STATE_LITERALS 2
+#define LZ_STATE_OFFSET_LOW 3
+#define LZ_STATE_OFFSET_HIGH 4
+#define LZ_STATE_MATCH_LENGTH 5
+
+/* Functions ----------------------------------------------------------------*/
+
+/**
+ * Start decompressing a new block.
+ *
+ * @param decoder The decoder.
+ * @param output Buffer that receives the decompressed data.
+ * @param outputSize Size of the output buffer, decompressing more than this is an error.
+ */
+void lzDecoderInit(LzDecoder *decoder, char *output, int outputSize) {
+	decoder->output = output;
+	decoder->outputSize = outputSize;
+	decoder->outputLength = 0;
+	decoder->dictionary = NULL;
+	decoder->dictionaryLength = 0;
+	decoder->state = LZ_STATE_TOKEN;
+	decoder->token = 0;
+	decoder->length = 0;
+	decoder->offset = 0;
+}
+
+/**
+ * Place a dictionary in front of the window. Must be called before any data is fed to the decoder.
+ *
+ * @param decoder The decoder.
+ * @param dictionary The dictionary, it must stay valid (and unchanged) while the block is decompressed.
+ * @param length Number of bytes in the dictionary, a match offset reaches back at most 65535 bytes.
+ */
+void lzDecoderSetDictionary(LzDecoder *decoder, const char *dictionary, int length) {
+	decoder->dictionary = dictionary;
+	decoder->dictionaryLength = length;
+}
+
+/**
+ * Copy the match of the current sequence. The match may overlap the data being written (e.g. offset 1
+ * repeats the last byte), so it is copied a byte at a time.
+ */
+static HAL_StatusTypeDef lzCopyMatch(LzDecoder *decoder) {
+	if (decoder->offset == 0 || decoder->offset > decoder->outputLength + decoder->dictionaryLength) {
+		printf("Error: LZ match offset %d out of range.\n", decoder->offset);
+		return HAL_ERROR;
+	}
+	if (decoder->length > decoder->outputSize - decoder->outputLength) {
+		printf("Error: LZ data decompresses to more than %d bytes.\n", decoder->outputSize);
+		return HAL_ERROR;
+	}
+	char *dst = decoder->output + decoder->outputLength;
+	int source = decoder->outputLength - decoder->offset; // relative to the start of the output
+	int i = 0;
+	// the part of the match in the dictionary
+	for (; i < decoder->length && source + i < 0; i++) {
+		dst[i] = decoder->dictionary[decoder->dictionaryLength + source + i];
+	}
+	for (; i < decoder->length; i++) {
+		dst[i] = decoder->output[source + i];
+	}
+	decoder->outputLength += decoder->length;
+	decoder->state = LZ_STATE_TOKEN;
+	return HAL_OK;
+}
+
+/**
+ * Decompress the next piece of a block.
+ *
+ * @param decoder The decoder.
+ * @param input The compressed data.
+ * @param length Number of bytes of compressed data.
+ * @retval HAL_OK, or HAL_ERROR if the data is not a valid block or decompresses to more than the output buffer.
+ */
+HAL_StatusTypeDef lzDecoderFeed(LzDecoder *decoder, const char *input, int length) {
+	const uint8_t *in = (const uint8_t *) input;
+	const uint8_t *end = in + length;
+
+	while (in < end) {
+		switch (decoder->state) {
+		case LZ_STATE_TOKEN:
+			decoder->token = *in++;
+			decoder->length = decoder->token >> 4;
+			if (decoder->length == 15) {
+				decoder->state = LZ_STATE_LITERAL_LENGTH;
+			} else if (decoder->length > 0) {
+				decoder->state = LZ_STATE_LITERALS;
+			} else {
+				decoder->state = LZ_STATE_OFFSET_LOW;
+			}
+			break;
+
+		case LZ_STATE_LITERAL_LENGTH:
+			decoder->length += *in;
+			if (*in++ != 255) {
+				decoder->state = LZ_STATE_LITERALS;
+			}
+			break;
+
+		case LZ_STATE_LITERALS: {
+			int n = decoder->length < end - in ? decoder->length : end - in;
+			if (n > decoder->outputSize - decoder->outputLength) {
+				printf("Error: LZ data decompresses to more than %d bytes.\n", decoder->outputSize);
+				return HAL_ERROR;
+			}
+			memcpy(decoder->output + decoder->outputLength, in, n);
+			decoder->outputLength += n;
+			decoder->length -= n;
+			in += n;
+			if (decoder->length == 0) {
+				decoder->state = LZ_STATE_OFFSET_LOW;
+			}
+			break;
+		}
+
+		case LZ_STATE_OFFSET_LOW:
+			decoder->offset = *in++;
+			decoder->state = LZ_STATE_OFFSET_HIGH;
+			break;
+
+		case LZ_STATE_OFFSET_HIGH:
+			decoder->offset |= (uint16_t) (*in++) << 8;
+			decoder->length = (decoder->token & 0xF) + LZ_MIN_MATCH;
+			if ((decoder->token & 0xF) == 15) {
+				decoder->state = LZ_STATE_MATCH_LENGTH;
+			} else if (lzCopyMatch(decoder) != HAL_OK) {
+				return HAL_ERROR;
+			}
+			break;
+
+		case LZ_STATE_MATCH_LENGTH:
+			decoder->length += *in;
+			if (*in++ != 255 && lzCopyMatch(decoder) != HAL_OK) {
+				return HAL_ERROR;
+			}
+			break;
+		}
+	}
+	return HAL_OK;
+}
+
+/**
+ * Check that the compressed data fed to the decoder ended on a sequence boundary.
+ *
+ * @param decoder The decoder.
+ * @retval HAL_OK if the block is complete, HAL_ERROR if it was truncated.
+ */
+HAL_StatusTypeDef lzDecoderFinish(LzDecoder *decoder) {
+	// a block ends after the literals of its last sequence
+	if (decoder->state != LZ_STATE_OFFSET_LOW && decoder->state != LZ_STATE_TOKEN) {
+		printf("Error: LZ data truncated.\n");
+		return HAL_ERROR;
+	}
+	return HAL_OK;
+}
@@ -31,6 +31,8 @@
 #include "flash.h"
 #include "util.h"
 #include "bgapi.h"
+#include "trace.h"
+#include "log.h"
 
 // BGLIB setup is done in bgapi.c
 //#include "dumo_bglib.h"
@@ -64,10 +66,6 @@ UART_HandleTypeDef huart2;
 
 /* USER CODE BEGIN PV */
 
-// UART Interrupt Buffers
-uint8_t huart1RxInterruptBuffer[1];
-uint8_t huart2RxInterruptBuffer[1];
-
 /* USER CODE END PV */
 
 /* Private function prototypes -----------------------------------------------*/
@@ -85,7 +83,7 @@ static void MX_USART2_UART_Init(void);
 /* Private user code ---------------------------------------------------------*/
 /* USER CODE BEGIN 0 */
 
-// Setup UART for printf
+// Setup UART for printf: output is buffered and sent in the background (see log.c)
 #ifdef __GNUC__
 #define PUTCHAR_PROTOTYPE int __io_putchar(int ch)
 #else
@@ -93,20 +91,44 @@ static void MX_USART2_UART_Init(void);
 #endif
 
 PUTCHAR_PROTOTYPE {
-	HAL_UART_Transmit(&huart1, (uint8_t*) &ch, 1, HAL_MAX_DELAY);
+	char c = ch;
+	logWrite(&c, 1);
 	return ch;
 }
 
-/** UART Callback **/
+// Whole printf() buffers at once, instead of the weak one in syscalls.c (one __io_putchar() per character)
+int _write(int file, char *ptr, int len) {
+	(void) file;
+	logWrite(ptr, len);
+	return len;
+}
+
+/** UART Callbacks **/
+
+// Interrupt mode (1 byte at a time)
 void HAL_UART_RxCpltCallback(UART_HandleTypeDef *huart) {
-	// check which UART it is
-	if (huart == &huart1) {
-		uart_rx_it_put(1, 1, (char *) huart1RxInterruptBuffer);
-		HAL_UART_Receive_IT(&huart1, huart1RxInterruptBuffer, 1);
+	uart_rx_it_callback(huart);
+}
+
+// DMA mode (half transfer, transfer complete and idle line events)
+void HAL_UARTEx_RxEventCallback(UART_HandleTypeDef *huart, uint16_t Size) {
+	uart_rx_dma_event(huart, Size);
+}
+
+// Transmit complete (console log, DMA or interrupt mode)
+void HAL_UART_TxCpltCallback(UART_HandleTypeDef *huart) {
+	logTxCallback(huart);
+}
+
+// Errors (ex: overrun) abort the reception, so restart it. Transmit errors (log or BGAPI DMA) end up here
+// too, with the reception still running.
+void HAL_UART_ErrorCallback(UART_HandleTypeDef *huart) {
+	if (huart->RxState == HAL_UART_STATE_READY) {
+		uart_rx_start(huart);
 	}
-	else if (huart == &huart2) {
-		uart_rx_it_put(2, 1, (char *) huart2RxInterruptBuffer);
-		HAL_UART_Receive_IT(&huart2, huart2RxInterruptBuffer, 1);
+	// a transmit error aborts the log transfer as well, skip it and send the rest
+	if (huart->gState == HAL_UART_STATE_READY) {
+		logTxCallback(huart);
 	}
 }
 
@@ -148,15 +170,25 @@ int main(void) {
 	MX_USART2_UART_Init();
 	/* USER CODE BEGIN 2 */
 
-	// Setup UART 2 interrupt
+	// Send printf() output in the background
+	logInit(&huart1);
+
+	// Cache flash bank swap state, enable background flash erase
+	flashInit();
+
+	// Setup UART receive (DMA or interrupt)
 	register_UART(1, &huart1);
 	register_UART(2, &huart2);
-	HAL_UART_Receive_IT(&huart1, huart1RxInterruptBuffer, 1);
-	HAL_UART_Receive_IT(&huart2, huart2RxInterruptBuffer, 1);
+	if (uart_rx_start(&huart1) != HAL_OK || uart_rx_start(&huart2) != HAL_OK) {
+		Error_Handler();
+	}
 
 	// Initialize BGIB with UART handle that will be used to communicate with BT122
 	initializeBGLIB(&huart2);
 
+	// Trace the OTA hot paths (if TRACE_ENABLED), dumped on the console
+	TRACE_INIT(&huart1);
+
 	printf("\n\nStarted on u5a5 - firmware 1.0\n\n");
 
 	/* TESTING */
@@ -176,6 +208,8 @@ int main(void) {
 //	testBGAPI_Test1();
 //	testBGAPI_Test2();
 //	testBGAPI_Test3();
+//	testTraceOverhead();
+//	testLogCost();
 //
 //	while (1) {
 //		// end of testing
@@ -204,6 +238,7 @@ int main(void) {
 	/* OTA */
 
 	BT122FirmwareUpgrade(FLASH_USER_START_ADDR, &huart2, &hhash);
+	TRACE_DUMP();
 
 	//if (U5FirmwareUpgrade(&huart2, &hhash) == HAL_ERROR) {
 	//	printf("U5 firmware upgrade failed.\n");
@@ -309,7 +344,7 @@ static void MX_HASH_Init(void) {
 	/* USER CODE BEGIN HASH_Init 1 */
 
 	/* USER CODE END HASH_Init 1 */
-	hhash.Init.DataType = HASH_DATATYPE_32B;
+	hhash.Init.DataType = HASH_DATATYPE_8B;
 	if (HAL_HASH_Init(&hhash) != HAL_OK) {
 		Error_Handler();
 	}
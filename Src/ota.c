@@ -12,6 +12,9 @@
 #include "uart.h"
 #include "flash.h"
 #include "util.h"
+#include "lz.h"
+#include "trace.h"
+#include "log.h"
 #include "main.h"
 
 
@@ -19,6 +22,12 @@
 
 /* Private variables */
 
+/* Static functions prototype */
+static void restoreBT122BaudRate();
+static HAL_StatusTypeDef receiveFirmware(UART_HandleTypeDef *huart, HASH_HandleTypeDef *hhash, uint32_t flashAddress, uint32_t deltaSourceAddress,
+		uint32_t *firmwareSize, char *expectedFirmwareDigest, char *firmwareDigest);
+static HAL_StatusTypeDef receiveFromClient(UART_Channel *channel, int length, char *data);
+
 /* Functions */
 
 /**
@@ -54,39 +63,24 @@ HAL_StatusTypeDef BT122FirmwareUpgrade(const uint32_t flashAddress, UART_HandleT
 //		HAL_NVIC_SystemReset();
 //	}
 
-	// Download firmware to flash
-	setBT122UARTMode(DATA_MODE);
-	checkConnection(huart);
-
-	// Get firmware size
+	// Download the firmware to flash. If the link is lost, wait for the client to connect again, the
+	// download resumes where it stopped.
 	uint32_t firmwareSize;
-	while (uart_rx_it_get_length(get_UART_num(huart)) != 4) {
-		// wait to receive 4 bytes
-	}
-	uart_rx_it(huart, 4, (char *) &firmwareSize);
-	printf("Size of firmware to be received: %ld\n", firmwareSize);
-
-	// Get SHA256 hash of original firmware data
 	char expectedFirmwareDigest[32];
-	while (uart_rx_it_get_length(get_UART_num(huart)) != 32) {
-		// wait to receive 32 bytes
-	}
-	uart_rx_it(huart, 32, expectedFirmwareDigest);
-	printf("Expected firmware hash: \n");
-	printBuffer(expectedFirmwareDigest, 32, "%02x");
-	printf("\n");
-
-	// Download actual firmware data
-	downloadFirmwareToFlash(huart, flashAddress, firmwareSize);
-
-	// check sha256 hash of downloaded firmware data
 	char firmwareDigest[32];
-	computeHashFromFlash(hhash, (uint32_t) flashAddress, firmwareSize, firmwareDigest);
-	printf("Firmware sha256 hash: \n");
-	printBuffer(firmwareDigest, 32, "%02x");
-	printf("\n");
+	HAL_StatusTypeDef downloadStatus;
+	while ((downloadStatus = receiveFirmware(huart, hhash, flashAddress, 0, &firmwareSize, expectedFirmwareDigest, firmwareDigest)) == HAL_TIMEOUT) {
+		printf("Link to the client lost, waiting for it to reconnect.\n");
+	}
+	if (downloadStatus != HAL_OK) {
+		printf("Error downloading new firmware.\n");
+		return HAL_ERROR;
+	}
+	LOG_HEX(LOG_LEVEL_INFO, "Firmware sha256 hash", firmwareDigest, 32);
 
-	// compare firmware hashes to ensure firmware data received correctly
+	// compare firmware hashes to ensure firmware data received correctly. Either way the download
+	// is over, the next one starts from the beginning.
+	clearDownloadJournal();
 	if (checkFirmwareHash(expectedFirmwareDigest, firmwareDigest) == HAL_ERROR) {
 		// hashes do not match, return error
 		printf("Error downloading new firmware, firmware hashes do not match.\n");
@@ -129,44 +123,29 @@ HAL_StatusTypeDef U5FirmwareUpgrade(UART_HandleTypeDef *huart, HASH_HandleTypeDe
 		uint32_t swap_banks = opbytes.USERConfig & (0x1 << 20U);
 		printf("Swap banks: 0x%08lx\n", swap_banks);
 
-		// Start firmware download
-		setBT122UARTMode(DATA_MODE);
-		checkConnection(huart);
-
-		// Get firmware size
-		uint32_t firmwareSize;
-		while (uart_rx_it_get_length(get_UART_num(huart)) != 4) {
-			// wait to receive 4 bytes
-		}
-		uart_rx_it(huart, 4, (char *) &firmwareSize);
-		printf("Size of firmware to be received: %ld\n", firmwareSize);
-
-		// Get SHA256 hash of original firmware data
-		char expectedFirmwareDigest[32];
-		while (uart_rx_it_get_length(get_UART_num(huart)) != 32) {
-			// wait to receive 32 bytes
-		}
-		uart_rx_it(huart, 32, expectedFirmwareDigest);
-		printf("Expected firmware hash: \n");
-		printBuffer(expectedFirmwareDigest, 32, "%02x");
-		printf("\n");
-
-
 		// Always download new firmware to 0x08200000 address. Underlying banks
-		// may swap, but addresses stay the same.
+		// may swap, but addresses stay the same. The running firmware is always
+		// mapped at FLASH_BASE, so chunks can be sent as a delta against it.
 		uint32_t u5FirmwareDownloadAddress = 0x08200000;
 
-		// download new u5 firmware
-		downloadFirmwareToFlash(huart, u5FirmwareDownloadAddress, firmwareSize);
-
-		// check sha256 hash of downloaded firmware data
+		// Download the firmware to flash. If the link is lost, wait for the client to connect again, the
+		// download resumes where it stopped.
+		uint32_t firmwareSize;
+		char expectedFirmwareDigest[32];
 		char firmwareDigest[32];
-		computeHashFromFlash(hhash, u5FirmwareDownloadAddress, firmwareSize, firmwareDigest);
-		printf("Firmware sha256 hash: \n");
-		printBuffer(firmwareDigest, 32, "%02x");
-		printf("\n");
+		HAL_StatusTypeDef downloadStatus;
+		while ((downloadStatus = receiveFirmware(huart, hhash, u5FirmwareDownloadAddress, FLASH_BASE, &firmwareSize, expectedFirmwareDigest, firmwareDigest)) == HAL_TIMEOUT) {
+			printf("Link to the client lost, waiting for it to reconnect.\n");
+		}
+		if (downloadStatus != HAL_OK) {
+			printf("Error downloading new firmware.\n");
+			return HAL_ERROR;
+		}
+		LOG_HEX(LOG_LEVEL_INFO, "Firmware sha256 hash", firmwareDigest, 32);
 
-		// compare firmware hashes to ensure firmware data received correctly
+		// compare firmware hashes to ensure firmware data received correctly. Either way the download
+		// is over, the next one starts from the beginning.
+		clearDownloadJournal();
 		if (checkFirmwareHash(expectedFirmwareDigest, firmwareDigest) == HAL_ERROR) {
 			// hashes do not match, return error
 			printf("Error downloading new firmware, firmware hashes do not match.\n");
@@ -200,6 +179,9 @@ HAL_StatusTypeDef U5FirmwareUpgrade(UART_HandleTypeDef *huart, HASH_HandleTypeDe
 			printf("Successfully programmed option bytes.\n");
 		}
 
+		// the reset loses the trace, dump it first
+		TRACE_DUMP();
+
 		// Wait for button to be pressed to confirm new firmware (optional step).
 		printf("Press button to HAL_FLASH_OB_Launch():...\n");
 		int status = HAL_GPIO_ReadPin(USER_BUTTON_GPIO_Port, USER_BUTTON_Pin);
@@ -214,6 +196,8 @@ HAL_StatusTypeDef U5FirmwareUpgrade(UART_HandleTypeDef *huart, HASH_HandleTypeDe
 
 		HAL_FLASHEx_OBGetConfig(&opbytes);
 		printf("UserConfig OB: 0x%08lx\n", opbytes.USERConfig);
+		// the launch resets the device, send what is still in the log first
+		logFlush();
 		// HAL_FLASH_OB_Launch should not return...
 		HAL_StatusTypeDef OBerror = HAL_FLASH_OB_Launch();
 		if (OBerror != HAL_OK) {
@@ -259,301 +243,922 @@ HAL_StatusTypeDef checkFirmwareHash(char *expectedDigest, char *actualDigest) {
 }
 
 /**
- * Download firmware over UART, and store it in flash memory.
+ * Return the BT122 UART to BT122_DEFAULT_BAUD_RATE after a download (see setBT122BaudRate()). Leaves the
+ * BT122 UART in BGAPI mode.
+ */
+static void restoreBT122BaudRate() {
+	setBT122UARTMode(BGAPI_MODE);
+	setBT122BaudRate(BT122_DEFAULT_BAUD_RATE);
+}
+
+/**
+ * Receive a firmware image from the client into flash: the handshake (see ota.h) then the download
+ * (see downloadFirmwareToFlash()). The BT122 UART runs at BT122_OTA_BAUD_RATE for the session, and is
+ * back at BT122_DEFAULT_BAUD_RATE (in BGAPI mode) when this returns.
  *
- * @param   huart         The UART handle that will be used to receive firmware data.
- * @param   flashAddress  The starting address of where to put firmware in flash. Must be an address corresponding to the start of a flash page.
- * @param   flashBank     The flash bank that the firmware should be written too.
- * @param   size          The size of the firmware in bytes that will be downloaded over UART.
- * @retval  Status code indicating success or failure of firmware download.
+ * @param   huart         The UART handle of the UART used for communication with BT122.
+ * @param   hhash         The HASH handle used for computing SHA256 hashes.
+ * @param   flashAddress  The address to download the image to.
+ * @param   deltaSourceAddress  Address of the running image, that chunks may be sent as a delta against. 0 for none.
+ * @param   firmwareSize  Receives the size of the image.
+ * @param   expectedFirmwareDigest  Receives the 32 byte SHA256 digest of the image sent by the client.
+ * @param   firmwareDigest  Receives the 32 byte SHA256 digest of the image in flash.
+ * @retval  HAL_OK, HAL_TIMEOUT if the link to the client was lost (try again, the download resumes), or HAL_ERROR.
  */
-HAL_StatusTypeDef downloadFirmwareToFlash(UART_HandleTypeDef *huart, uint32_t flashAddress, int size) {
-	if (flashAddress % FLASH_PAGE_SIZE != 0) {
-		printf("Error: input parameter 'flashAddress' must be an address corresponding to the start of a flash page (i.e. a multiple of FLASH_PAGE_SIZE).\n");
+static HAL_StatusTypeDef receiveFirmware(UART_HandleTypeDef *huart, HASH_HandleTypeDef *hhash, uint32_t flashAddress, uint32_t deltaSourceAddress,
+		uint32_t *firmwareSize, char *expectedFirmwareDigest, char *firmwareDigest) {
+	UART_Channel *channel = uart_get_channel(huart);
+
+	// Raise the BT122 UART rate for the download. If that does not work, download at the current rate.
+	setBT122UARTMode(BGAPI_MODE);
+	setBT122BaudRate(BT122_OTA_BAUD_RATE);
+
+	// Start firmware download
+	setBT122UARTMode(DATA_MODE);
+	checkConnection(huart);
+
+	// Get firmware size, then SHA256 hash of original firmware data
+	HAL_StatusTypeDef status = receiveFromClient(channel, 4, (char *) firmwareSize);
+	if (status == HAL_OK) {
+		printf("Size of firmware to be received: %ld\n", *firmwareSize);
+		status = receiveFromClient(channel, 32, expectedFirmwareDigest);
+	}
+
+	static uint8_t changedPages[OTA_PAGE_MASK_SIZE];
+	if (status == HAL_OK) {
+		LOG_HEX(LOG_LEVEL_INFO, "Expected firmware hash", expectedFirmwareDigest, 32);
+
+		// tell the client where to resume an interrupted download of the same image from
+		uint32_t resumeOffset = negotiateResume(huart, flashAddress, *firmwareSize, expectedFirmwareDigest);
+
+		// find out which pages of the download region differ from the image, only those are downloaded
+		status = exchangePageManifest(huart, hhash, flashAddress, *firmwareSize, resumeOffset, changedPages);
+		if (status == HAL_OK) {
+			// start erasing those pages in the background, the erase runs while the session parameters go out and
+			// the client fills the receive window
+			HAL_StatusTypeDef eraseStatus = eraseFlashPages_IT(flashAddress, *firmwareSize, changedPages, NULL);
+
+			// Download actual firmware data. If the background erase could not be started, erase before the download instead.
+			// The sha256 hash of the downloaded firmware data is computed while it is downloaded
+			status = downloadFirmwareToFlash(huart, flashAddress, *firmwareSize, resumeOffset, changedPages, eraseStatus == HAL_OK, deltaSourceAddress, hhash, firmwareDigest);
+		} else {
+			printf("Error exchanging the page manifest.\n");
+		}
+	}
+
+	// the rest of the upgrade runs at the default rate. The BT122 keeps its UART rate across a U5 reset, so this
+	// is also the rate both start with.
+	restoreBT122BaudRate();
+	if (status != HAL_OK) {
+		// a download that failed before its first chunk leaves the background erase running (on changedPages),
+		// and the HASH peripheral may be in the middle of a message
+		waitForFlashErase();
+		waitForHash(hhash, NULL);
+		HAL_HASH_Init(hhash);
+	}
+	return status;
+}
+
+/**
+ * Receive length bytes from the client.
+ *
+ * @param   channel  The UART channel of the client.
+ * @param   length   Number of bytes to receive, at most the size of the receive buffer.
+ * @param   data     Receives the bytes.
+ * @retval  HAL_OK, or HAL_TIMEOUT if nothing arrived for OTA_IDLE_TIMEOUT_MS (the link is lost).
+ */
+static HAL_StatusTypeDef receiveFromClient(UART_Channel *channel, int length, char *data) {
+	int buffered = uart_channel_get_length(channel);
+	uint32_t lastReceiveTick = HAL_GetTick();
+	while (buffered < length) {
+		int nowBuffered = uart_channel_get_length(channel);
+		if (nowBuffered != buffered) {
+			buffered = nowBuffered;
+			lastReceiveTick = HAL_GetTick();
+		} else if (HAL_GetTick() - lastReceiveTick > OTA_IDLE_TIMEOUT_MS) {
+			printf("Error: nothing received from the client for %d ms.\n", OTA_IDLE_TIMEOUT_MS);
+			return HAL_TIMEOUT;
+		}
+	}
+	uart_channel_rx(channel, length, data);
+	return HAL_OK;
+}
+
+/**
+ * Feed flash that has been programmed but not yet hashed to the running SHA256 computation. With a
+ * DMA channel linked to the HASH handle the data is fed in the background and the call returns right
+ * away (nothing is fed while the previous part is still going in), otherwise the CPU feeds it.
+ * Always leaves at least one byte unhashed, for finishProgrammedFlashHash().
+ *
+ * @param hhash The HASH handle.
+ * @param hashedAddress Flash below this address has been hashed (or is being fed by DMA). Updated.
+ * @param programmedAddress Flash below this address has been programmed.
+ * @param maxLength Maximum number of bytes to hash in this call.
+ * @retval Status of the hash operation.
+ */
+static HAL_StatusTypeDef hashProgrammedFlash(HASH_HandleTypeDef *hhash, uint32_t *hashedAddress, uint32_t programmedAddress, uint32_t maxLength) {
+	if (programmedAddress <= *hashedAddress + 4 || isHashBusy()) {
+		return HAL_OK;
+	}
+	uint32_t length = (programmedAddress - *hashedAddress - 1) & ~0x3U;
+	if (length > maxLength) {
+		length = maxLength;
+	}
+	TRACE_SCOPE(TRACE_OTA_HASH, length / 64);
+	HAL_StatusTypeDef status;
+	if (hhash->hdmain != NULL) {
+		status = accumulateHashFromFlash_DMA(hhash, *hashedAddress, length);
+	} else {
+		status = HAL_HASHEx_SHA256_Accmlt(hhash, (uint8_t *) *hashedAddress, length);
+	}
+	if (status != HAL_OK) {
+		printf("Error: accumulating hash at addr = %08lx\n", *hashedAddress);
 		return HAL_ERROR;
 	}
+	*hashedAddress += length;
+	return HAL_OK;
+}
 
-	// Receive and store to flash 1 page (8KB) at a time
-	int numPages = size / FLASH_PAGE_SIZE;
-	int leftOverBytes = size - (numPages * FLASH_PAGE_SIZE);
-	printf("Downloading %d pages of %d bytes each + %d left over bytes to flash.\n", numPages, FLASH_PAGE_SIZE, leftOverBytes);
+/**
+ * Hash the rest of the image (from hashedAddress to endAddress) and get the digest of the SHA256
+ * computation fed by hashProgrammedFlash().
+ *
+ * @param hhash The HASH handle.
+ * @param hashedAddress Flash below this address has been hashed (or is being fed by DMA).
+ * @param endAddress The end of the image, at least one byte past hashedAddress.
+ * @param digest Receives the 32 byte SHA256 digest.
+ * @retval Status of the hash operation.
+ */
+static HAL_StatusTypeDef finishProgrammedFlashHash(HASH_HandleTypeDef *hhash, uint32_t hashedAddress, uint32_t endAddress, char *digest) {
+	TRACE_SCOPE(TRACE_OTA_HASH, (endAddress - hashedAddress) / 64);
+	if (hhash->hdmain == NULL) {
+		return HAL_HASHEx_SHA256_Accmlt_End(hhash, (uint8_t *) hashedAddress, endAddress - hashedAddress, (uint8_t *) digest, HAL_MAX_DELAY);
+	}
+	// the part still going in by DMA must be in before the message can be continued
+	if (waitForHash(hhash, NULL) != HAL_OK
+			|| computeHashFromFlash_DMA(hhash, hashedAddress, endAddress - hashedAddress) != HAL_OK) {
+		return HAL_ERROR;
+	}
+	return waitForHash(hhash, digest);
+}
 
-	char firmwarePage[FLASH_PAGE_SIZE];
+/**
+ * Address of the journal slot that records that page of the download has been written.
+ */
+static uint32_t journalSlotAddress(int page) {
+	return OTA_JOURNAL_ADDRESS + OTA_JOURNAL_SLOTS_OFFSET + page * 16;
+}
 
+/**
+ * Check if the download journal belongs to the image at flashAddress.
+ */
+static int isJournalFor(uint32_t flashAddress) {
+	const OtaJournalHeader *journal = (const OtaJournalHeader *) OTA_JOURNAL_ADDRESS;
+	return journal->magic == OTA_JOURNAL_MAGIC && journal->flashAddress == flashAddress;
+}
 
-	uint32_t flashPage = (flashAddress - 0x08000000) / FLASH_PAGE_SIZE; // starting page
+/**
+ * Record in the journal that all pages of the download below completedBytes have been written.
+ * The journal is best effort, if it cannot be written the download carries on without it.
+ *
+ * @param journaledPages Number of pages already recorded. Updated.
+ * @param completedBytes All of the image below this offset has been written to flash.
+ */
+static void journalDownloadProgress(int *journaledPages, uint32_t completedBytes) {
+	while ((uint32_t) (*journaledPages + 1) * FLASH_PAGE_SIZE <= completedBytes) {
+		uint32_t slot[4] = { OTA_JOURNAL_MAGIC, *journaledPages, 0, 0 };
+		if (writeFlash(journalSlotAddress(*journaledPages), (uint32_t) slot) != HAL_OK) {
+			printf("Warning: failed to update the download journal.\n");
+			return;
+		}
+		(*journaledPages)++;
+	}
+}
 
-	for (int i = 0; i < numPages; i++) {
-		// received FLASH_PAGE_SIZE bytes over UART, CHUNK_SIZE bytes at a time
+/**
+ * Erase the download journal, so the next download starts from the beginning.
+ */
+void clearDownloadJournal() {
+	if (*(__IO uint32_t *) OTA_JOURNAL_ADDRESS == 0xFFFFFFFF) {
+		// already erased
+		return;
+	}
+	if (eraseFlashRange(OTA_JOURNAL_ADDRESS, FLASH_PAGE_SIZE) != HAL_OK) {
+		printf("Warning: failed to erase the download journal.\n");
+	}
+}
 
-		// how many bytes of firmware data to transmit at a time. Must fit evenly into FLASH_PAGE_SIZE.
-		const int CHUNK_SIZE = 8192;
-		if (FLASH_PAGE_SIZE % CHUNK_SIZE != 0) {
-			printf("Error: invalid CHUNK_SIZE. Must fit evenly into FLASH_PAGE_SIZE.\n");
-			return HAL_ERROR;
+/**
+ * Find out where to resume the download of an image from, and send the resume offset to the client.
+ * If the journal describes an earlier download of the same image (address, size and digest), the
+ * download resumes from the first page that was not written. Otherwise a new journal is started
+ * and the download starts from the beginning.
+ *
+ * @param   huart         The UART handle used to communicate with the client.
+ * @param   flashAddress  The address the image is downloaded to.
+ * @param   size          The size of the image in bytes.
+ * @param   digest        The expected SHA256 digest of the image.
+ * @retval  The offset in the image to resume the download from (a multiple of FLASH_PAGE_SIZE, less than size).
+ */
+uint32_t negotiateResume(UART_HandleTypeDef *huart, uint32_t flashAddress, uint32_t size, const char *digest) {
+	const OtaJournalHeader *journal = (const OtaJournalHeader *) OTA_JOURNAL_ADDRESS;
+	uint32_t resumeOffset = 0;
+
+	if (isJournalFor(flashAddress) && journal->size == size && memcmp(journal->digest, digest, 32) == 0) {
+		// count the pages that were written, in order
+		int pages = 0;
+		while (journalSlotAddress(pages) < OTA_JOURNAL_ADDRESS + FLASH_PAGE_SIZE
+				&& *(__IO uint32_t *) journalSlotAddress(pages) == OTA_JOURNAL_MAGIC
+				&& *(__IO uint32_t *) (journalSlotAddress(pages) + 4) == (uint32_t) pages) {
+			pages++;
 		}
-		int bytesReceived = 0;
-		while (bytesReceived != CHUNK_SIZE) {
-			while (uart_rx_it_get_length(get_UART_num(huart)) != CHUNK_SIZE) {
-				// waiting for all CHUNK_SIZE bytes to be received...
-			}
-			if (uart_rx_it(huart, CHUNK_SIZE, &firmwarePage[bytesReceived]) != CHUNK_SIZE) {
-				// did not received correct amount of bytes
-				printf("Error: did not receive correct amount of bytes.\n");
-				return HAL_ERROR;
-			}
-			bytesReceived += CHUNK_SIZE;
+		resumeOffset = pages * FLASH_PAGE_SIZE;
+		// always download at least the last page, so the download is not empty
+		if (resumeOffset >= size) {
+			resumeOffset = (size - 1) & ~(FLASH_PAGE_SIZE - 1);
 		}
+		printf("Resuming download at offset %ld (%ld of %ld bytes already written).\n", resumeOffset, resumeOffset, size);
+	} else {
+		// new download, start a new journal
+		clearDownloadJournal();
+		OtaJournalHeader header = { OTA_JOURNAL_MAGIC, flashAddress, size, 0xFFFFFFFF, { 0 } };
+		memcpy(header.digest, digest, 32);
+		if (writeFlashRange(OTA_JOURNAL_ADDRESS, (const char *) &header, sizeof(header)) != HAL_OK) {
+			printf("Warning: failed to write the download journal, the download will not be resumable.\n");
+		}
+	}
 
+	uart_tx(huart, sizeof(resumeOffset), (char *) &resumeOffset);
+	return resumeOffset;
+}
 
-		// OLD version with hard coded chunk size
-//		while (uart_rx_it_get_length(get_UART_num(huart)) != FLASH_PAGE_SIZE) {
-//			// waiting for all FLASH_PAGE_SIZE bytes to be received...
-//		}
-//		if (uart_rx_it(huart, FLASH_PAGE_SIZE, firmwarePage) != FLASH_PAGE_SIZE) {
-//			// did not received correct amount of bytes
-//			printf("Error: did not receive correct amount of bytes.\n");
-//			return HAL_ERROR;
-//		}
+/**
+ * Send an acknowledgement (OTA_ACK, OTA_NAK or OTA_RESYNC) for a chunk.
+ */
+static void sendChunkAck(UART_HandleTypeDef *huart, uint8_t type, uint16_t sequence) {
+	OtaAck ack = { type, sequence };
+	uart_tx(huart, sizeof(ack), (char *) &ack);
+}
 
-		uart_rx_it_clear_buffer(get_UART_num(huart));
+/**
+ * Check if page of the download region is in a bitmap of pages.
+ */
+static int isPageInMask(const uint8_t *pageMask, int page) {
+	return (pageMask[page / 8] & (1U << (page % 8))) != 0;
+}
 
-		// write firmware to flash
-		if (eraseFlashPage(flashPage+i) != HAL_OK) {
-			return HAL_ERROR;
+/**
+ * Size of the page of the image, the last one may be short.
+ */
+static int getPageLength(int page, uint32_t size) {
+	uint32_t pageOffset = page * FLASH_PAGE_SIZE;
+	return size - pageOffset < FLASH_PAGE_SIZE ? size - pageOffset : FLASH_PAGE_SIZE;
+}
+
+/**
+ * Send the page manifest to the client and receive the bitmap of pages it will send (see ota.h).
+ * Pages that already hold the image are neither erased nor programmed again, which saves both the
+ * transfer and flash wear when the same image is downloaded again (or an update is rolled back).
+ *
+ * @param   huart         The UART handle used to communicate with the client.
+ * @param   hhash         The HASH handle used to compute the page digests.
+ * @param   flashAddress  The address the image is downloaded to.
+ * @param   size          The size of the image in bytes.
+ * @param   resumeOffset  Offset the download resumes from, pages below it are never sent.
+ * @param   changedPages  Receives the bitmap of pages that will be sent (OTA_PAGE_MASK_SIZE bytes).
+ * @retval  Status of the exchange, HAL_TIMEOUT if the link to the client was lost.
+ */
+HAL_StatusTypeDef exchangePageManifest(UART_HandleTypeDef *huart, HASH_HandleTypeDef *hhash, uint32_t flashAddress, uint32_t size, uint32_t resumeOffset, uint8_t *changedPages) {
+	UART_Channel *channel = uart_get_channel(huart);
+	int numPages = (size + FLASH_PAGE_SIZE - 1) / FLASH_PAGE_SIZE;
+	if (channel == NULL || numPages > OTA_MAX_PAGES) {
+		return HAL_ERROR;
+	}
+
+	// with DMA, the next page is hashed while the digest of this one is sent
+	int overlap = hhash->hdmain != NULL;
+	if (overlap && computeHashFromFlash_DMA(hhash, flashAddress, getPageLength(0, size)) != HAL_OK) {
+		return HAL_ERROR;
+	}
+	for (int page = 0; page < numPages; page++) {
+		uint32_t pageAddress = flashAddress + page * FLASH_PAGE_SIZE;
+		char pageDigest[32];
+		HAL_StatusTypeDef status;
+		if (overlap) {
+			status = waitForHash(hhash, pageDigest);
+			if (status == HAL_OK && page + 1 < numPages) {
+				status = computeHashFromFlash_DMA(hhash, pageAddress + FLASH_PAGE_SIZE, getPageLength(page + 1, size));
+			}
+		} else {
+			status = computeHashFromFlash(hhash, pageAddress, getPageLength(page, size), pageDigest);
 		}
-		if (writeFlashPage(flashPage+i, firmwarePage) != HAL_OK) {
+		if (status != HAL_OK) {
 			return HAL_ERROR;
 		}
+		uart_tx(huart, sizeof(pageDigest), pageDigest);
+	}
+
+	memset(changedPages, 0, OTA_PAGE_MASK_SIZE);
+	if (receiveFromClient(channel, (numPages + 7) / 8, (char *) changedPages) != HAL_OK) {
+		return HAL_TIMEOUT;
+	}
+
+	// pages below the resume offset are already written
+	int pagesToSend = 0;
+	for (int page = 0; page < numPages; page++) {
+		if ((uint32_t) page < resumeOffset / FLASH_PAGE_SIZE) {
+			changedPages[page / 8] &= ~(1U << (page % 8));
+		} else if (isPageInMask(changedPages, page)) {
+			pagesToSend++;
+		}
+	}
+	printf("%d of %d pages differ from the image and will be downloaded.\n", pagesToSend, numPages);
+	return HAL_OK;
+}
 
-		printf("Downloaded page %d, sending confirmation:\n", i);
+/**
+ * Size of the chunk at offset, once decompressed.
+ */
+static int getChunkLength(uint32_t offset, int size) {
+	return size - offset < OTA_CHUNK_SIZE ? size - offset : OTA_CHUNK_SIZE;
+}
 
-		// send confirmation signal to receive next page
-		char confirmation[] = {0xFF};
-		uart_tx(huart, 1, confirmation);
+/**
+ * Check that a chunk header describes a chunk of the image.
+ */
+static int isChunkHeaderValid(const OtaChunkHeader *header, int size, int numChunks, uint16_t chunkFlags) {
+	if (header->sequence >= numChunks || header->offset != (uint32_t) header->sequence * OTA_CHUNK_SIZE) {
+		return 0;
+	}
+	if ((header->flags & ~chunkFlags) != 0 || header->flags == OTA_CHUNK_DELTA) {
+		// unsupported flags, or a delta chunk that is not compressed
+		return 0;
 	}
+	if (header->flags & OTA_CHUNK_ERASED) {
+		return header->flags == OTA_CHUNK_ERASED && header->length == 0;
+	}
+	if (header->flags & OTA_CHUNK_COMPRESSED) {
+		// only worth compressing if it makes the chunk smaller
+		return header->length > 0 && header->length < getChunkLength(header->offset, size);
+	}
+	return header->length == getChunkLength(header->offset, size);
+}
 
-	// receive left over bytes
-	if (leftOverBytes != 0) {
-		// clear firmwarePage buffer
-		memset((void *) firmwarePage, 255, FLASH_PAGE_SIZE);
+/**
+ * Compute the CRC32 of the next length bytes in the receive buffer, without consuming them.
+ */
+static uint32_t computeChunkCrc(UART_Channel *channel, int length) {
+	TRACE_SCOPE(TRACE_OTA_CRC, length);
+	crc32Begin();
+	for (int offset = 0; offset < length;) {
+		const char *data;
+		int n = uart_channel_peek_span(channel, offset, &data);
+		if (n > length - offset) {
+			n = length - offset;
+		}
+		crc32Update(data, n);
+		offset += n;
+	}
+	return crc32End();
+}
 
-		while (uart_rx_it_get_length(get_UART_num(huart)) != leftOverBytes) {
-			// wait until all left over bytes have been received
+/**
+ * Program the next length bytes in the receive buffer to (already erased) flash, without consuming them.
+ */
+static HAL_StatusTypeDef writeChunkToFlash(UART_Channel *channel, uint32_t flashAddress, int length) {
+	FlashStreamWriter writer;
+	if (flashStreamBegin(&writer, flashAddress, length, 1) != HAL_OK) {
+		return HAL_ERROR;
+	}
+	for (int offset = 0; offset < length;) {
+		const char *data;
+		int n = uart_channel_peek_span(channel, offset, &data);
+		if (n > length - offset) {
+			n = length - offset;
 		}
-		if (uart_rx_it(huart, leftOverBytes, firmwarePage) != leftOverBytes) {
-			printf("Error: did not receive correct amount of bytes.\n");
+		if (flashStreamWrite(&writer, data, n) != HAL_OK) {
 			return HAL_ERROR;
 		}
+		offset += n;
+	}
+	return flashStreamFinish(&writer);
+}
+
+/**
+ * Decompress the next length bytes in the receive buffer (an LZ compressed chunk), without consuming
+ * them, and program the result to (already erased) flash.
+ *
+ * @param   channel       The UART channel holding the compressed chunk.
+ * @param   flashAddress  Where to program the decompressed chunk.
+ * @param   length        Number of compressed bytes.
+ * @param   chunkLength   Number of bytes the chunk must decompress to.
+ * @param   dictionary    Data in front of the window (the running image for a delta chunk), or NULL.
+ * @param   dictionaryLength Number of bytes in the dictionary.
+ * @retval  HAL_OK, HAL_ERROR if the chunk could not be programmed, or HAL_BUSY if the data does not
+ *          decompress to chunkLength bytes (a corrupted chunk that should be sent again).
+ */
+static HAL_StatusTypeDef writeCompressedChunkToFlash(UART_Channel *channel, uint32_t flashAddress, int length, int chunkLength, const char *dictionary, int dictionaryLength) {
+	static uint32_t chunkBuffer[OTA_CHUNK_SIZE / 4]; // word aligned for programming
+	TRACE_SCOPE(TRACE_LZ_DECODE, length);
+	LzDecoder decoder;
+	lzDecoderInit(&decoder, (char *) chunkBuffer, chunkLength);
+	if (dictionary != NULL) {
+		lzDecoderSetDictionary(&decoder, dictionary, dictionaryLength);
+	}
 
-		uart_rx_it_clear_buffer(get_UART_num(huart));
+	for (int offset = 0; offset < length;) {
+		const char *data;
+		int n = uart_channel_peek_span(channel, offset, &data);
+		if (n > length - offset) {
+			n = length - offset;
+		}
+		if (lzDecoderFeed(&decoder, data, n) != HAL_OK) {
+			return HAL_BUSY;
+		}
+		offset += n;
+	}
+	if (lzDecoderFinish(&decoder) != HAL_OK || decoder.outputLength != chunkLength) {
+		return HAL_BUSY;
+	}
 
+	FlashStreamWriter writer;
+	if (flashStreamBegin(&writer, flashAddress, chunkLength, 1) != HAL_OK
+			|| flashStreamWrite(&writer, (const char *) chunkBuffer, chunkLength) != HAL_OK) {
+		return HAL_ERROR;
+	}
+	return flashStreamFinish(&writer);
+}
 
-		// write received data to flash
-		if (eraseFlashPage(flashPage + numPages) != HAL_OK) {
+/**
+ * Recover from a corrupted chunk header: the chunk boundaries are lost, so drop everything until the
+ * client stops sending (its window is exhausted), then start again on a clean buffer.
+ */
+static void resyncChunks(UART_Channel *channel) {
+	uart_channel_clear_buffer(channel);
+	uint32_t lastActivity = HAL_GetTick();
+	while (HAL_GetTick() - lastActivity < OTA_RESYNC_QUIET_MS) {
+		if (uart_channel_get_length(channel) > 0) {
+			uart_channel_clear_buffer(channel);
+			lastActivity = HAL_GetTick();
+		}
+	}
+}
+
+/**
+ * Erase the pages of the image that are downloaded (all of them if changedPages is NULL), from resumeOffset on.
+ */
+static HAL_StatusTypeDef eraseDownloadPages(uint32_t flashAddress, int size, int resumeOffset, const uint8_t *changedPages) {
+	for (int page = resumeOffset / FLASH_PAGE_SIZE; page * FLASH_PAGE_SIZE < size; page++) {
+		if ((changedPages == NULL || isPageInMask(changedPages, page)) && eraseFlashRange(flashAddress + page * FLASH_PAGE_SIZE, FLASH_PAGE_SIZE) != HAL_OK) {
 			return HAL_ERROR;
 		}
-		if (writeFlashPage(flashPage + numPages, firmwarePage) != HAL_OK) {
+	}
+	return HAL_OK;
+}
+
+/**
+ * Download firmware over UART, and store it in flash memory.
+ *
+ * The download uses a sliding window (see ota.h): the client keeps up to OTA_WINDOW_SIZE
+ * sequence-numbered chunks in flight, so the link stays busy while chunks are written to flash.
+ * Every chunk carries a CRC32 that is checked (on the CRC peripheral) before it is written. A bad
+ * chunk is NAKed and only that chunk is sent again, chunks following it are written at their offset
+ * in the meantime. Chunk data is programmed straight out of the receive buffer. Compressed chunks
+ * are decompressed out of the receive buffer, into a single chunk sized buffer, then programmed.
+ * Delta chunks are decompressed the same way, with matches also copied from the running image.
+ *
+ * The SHA256 digest is accumulated while downloading, over the data read back from flash once it
+ * has been programmed, so the digest is ready as soon as the last byte lands and also verifies
+ * what was actually written to flash. When resuming, the part of the image already in flash is
+ * hashed while the rest is downloaded.
+ *
+ * Completed pages are recorded in the download journal (see negotiateResume()), so an interrupted
+ * download can be resumed.
+ *
+ * @param   huart         The UART handle that will be used to receive firmware data.
+ * @param   flashAddress  The starting address of where to put firmware in flash. Must be an address corresponding to the start of a flash page.
+ * @param   size          The size of the firmware in bytes that will be downloaded over UART.
+ * @param   resumeOffset  Offset to resume the download from, the image below it is already in flash. A multiple of FLASH_PAGE_SIZE.
+ * @param   changedPages  Bitmap of the pages that are downloaded (see exchangePageManifest()), the others already hold the image. NULL if all pages are downloaded.
+ * @param   erased        1 if the pages to download are being erased in the background (eraseFlashPages_IT()) or
+ *                        already are, 0 to erase them before the download. A background erase runs while the
+ *                        first chunks are received, it is waited for before the first one is written.
+ * @param   deltaSourceAddress  Address of the running image, that chunks may be sent as a delta against. 0 to not accept delta chunks.
+ * @param   hhash         The HASH handle used for computing the SHA256 digest.
+ * @param   digest        Receives the 32 byte SHA256 digest of the firmware in flash.
+ * @retval  Status code indicating success or failure of firmware download. HAL_TIMEOUT if nothing was received
+ *          from the client for OTA_IDLE_TIMEOUT_MS (the link is lost), the pages written so far are in the journal.
+ */
+HAL_StatusTypeDef downloadFirmwareToFlash(UART_HandleTypeDef *huart, uint32_t flashAddress, int size, int resumeOffset, const uint8_t *changedPages, int erased, uint32_t deltaSourceAddress, HASH_HandleTypeDef *hhash, char *digest) {
+	if (flashAddress % FLASH_PAGE_SIZE != 0) {
+		printf("Error: input parameter 'flashAddress' must be an address corresponding to the start of a flash page (i.e. a multiple of FLASH_PAGE_SIZE).\n");
+		return HAL_ERROR;
+	}
+	if (size <= 0 || size > OTA_MAX_IMAGE_SIZE) {
+		printf("Error: firmware size must be between 1 and %d bytes.\n", OTA_MAX_IMAGE_SIZE);
+		return HAL_ERROR;
+	}
+	if (resumeOffset < 0 || resumeOffset >= size || resumeOffset % FLASH_PAGE_SIZE != 0) {
+		printf("Error: resume offset must be a multiple of FLASH_PAGE_SIZE, within the firmware.\n");
+		return HAL_ERROR;
+	}
+
+	// resolve the UART channel once, outside of the receive loop
+	UART_Channel *channel = uart_get_channel(huart);
+	if (channel == NULL) {
+		printf("Error: UART has not been registered.\n");
+		return HAL_ERROR;
+	}
+
+	int numChunks = (size + OTA_CHUNK_SIZE - 1) / OTA_CHUNK_SIZE;
+	printf("Downloading %d bytes to flash in %d chunks of up to %d bytes, window of %d chunks.\n", size, numChunks, OTA_CHUNK_SIZE, OTA_WINDOW_SIZE);
+
+	// chunks may be written out of order, so the pages to download must be erased before the first one is
+	if (!erased && eraseDownloadPages(flashAddress, size, resumeOffset, changedPages) != HAL_OK) {
+		return HAL_ERROR;
+	}
+	int erasing = erased && isFlashEraseBusy(); // background erase still running, nothing may be written to flash
+
+	// tell the client how to send the image. Delta chunks are only sent if the image the client has is
+	// the one running here, so send the digest of the running image for the size of the client's one.
+	uint32_t deltaSourceSize = 0;
+	if (receiveFromClient(channel, sizeof(deltaSourceSize), (char *) &deltaSourceSize) != HAL_OK) {
+		return HAL_TIMEOUT;
+	}
+	uint16_t chunkFlags = OTA_CHUNK_COMPRESSED | OTA_CHUNK_ERASED | (deltaSourceAddress != 0 ? OTA_CHUNK_DELTA : 0);
+	OtaSessionParams params = { OTA_CHUNK_SIZE, OTA_WINDOW_SIZE, chunkFlags, 0, { 0 } };
+	if (deltaSourceAddress != 0 && deltaSourceSize > 0 && deltaSourceSize <= OTA_MAX_IMAGE_SIZE) {
+		if (computeHashFromFlash(hhash, deltaSourceAddress, deltaSourceSize, params.deltaSourceDigest) != HAL_OK) {
 			return HAL_ERROR;
 		}
+	}
+	uart_tx(huart, sizeof(params), (char *) &params);
+
+	// measure how many receive interrupts the download takes
+	uart_rx_it_reset_stats(channel->huartNum);
+	flashResetProgramStats();
+	uint32_t startTick = HAL_GetTick();
+
+	static uint32_t chunksWritten[(OTA_MAX_CHUNKS + 31) / 32]; // bitmap of chunks written to flash
+	memset(chunksWritten, 0, sizeof(chunksWritten));
+	// chunks of pages that are not downloaded are already written
+	for (int sequence = 0; sequence < numChunks; sequence++) {
+		int page = sequence * OTA_CHUNK_SIZE / FLASH_PAGE_SIZE;
+		if (page < resumeOffset / FLASH_PAGE_SIZE || (changedPages != NULL && !isPageInMask(changedPages, page))) {
+			chunksWritten[sequence / 32] |= 1UL << (sequence % 32);
+		}
+	}
+	uint16_t firstMissing = 0; // all chunks before this one have been written
+	while (firstMissing < numChunks && (chunksWritten[firstMissing / 32] & (1UL << (firstMissing % 32))) != 0) {
+		firstMissing++;
+	}
+	int journaling = isJournalFor(flashAddress);
+	int journaledPages = resumeOffset / FLASH_PAGE_SIZE;
+	int crcErrors = 0;
+	int headerErrors = 0;
+	int bytesReceived = 0; // chunk data received, compressed or not
+	int firmwareBytesReceived = 0; // firmware in the chunks received
+
+	OtaChunkHeader header;
+	int haveHeader = 0;
+	uint32_t hashedAddress = flashAddress; // flash below this address has been fed to the HASH peripheral
+	int waiting = 0; // traced: waiting for the rest of a chunk
+	int lastBuffered = 0;
+	uint32_t lastReceiveTick = HAL_GetTick(); // when data last arrived, to notice a lost link
+
+	while (firstMissing < numChunks) {
+		int bytesBuffered = uart_channel_get_length(channel);
+		if (bytesBuffered != lastBuffered) {
+			lastBuffered = bytesBuffered;
+			lastReceiveTick = HAL_GetTick();
+		} else if (HAL_GetTick() - lastReceiveTick > OTA_IDLE_TIMEOUT_MS) {
+			printf("Error: nothing received from the client for %d ms, %d of %d chunks written.\n", OTA_IDLE_TIMEOUT_MS, firstMissing, numChunks);
+			if (waiting) {
+				TRACE_END(TRACE_OTA_WAIT);
+			}
+			return HAL_TIMEOUT;
+		}
+		int ready = haveHeader ? bytesBuffered >= header.length : bytesBuffered >= OTA_CHUNK_HEADER_SIZE;
+		if (ready && waiting) {
+			TRACE_END(TRACE_OTA_WAIT);
+			waiting = 0;
+		} else if (!ready && !waiting) {
+			TRACE_BEGIN(TRACE_OTA_WAIT, firstMissing);
+			waiting = 1;
+		}
 
-		printf("Downloaded extra bytes. Sending confirmation:\n");
+		if (!haveHeader && bytesBuffered >= OTA_CHUNK_HEADER_SIZE) {
+			// start of the next chunk
+			uart_channel_rx(channel, sizeof(header), (char *) &header);
+			if (!isChunkHeaderValid(&header, size, numChunks, chunkFlags)) {
+				LOG_WARNING("Error: invalid chunk header, resynchronizing.\n");
+				headerErrors++;
+				resyncChunks(channel);
+				// everything in flight was dropped, the client resends from the first missing chunk
+				sendChunkAck(huart, OTA_RESYNC, firstMissing);
+				continue;
+			}
+			haveHeader = 1;
+		} else if (haveHeader && bytesBuffered >= header.length) {
+			// whole chunk received, check it before writing it
+			TRACE_BEGIN(TRACE_OTA_CHUNK, header.sequence);
+			if (computeChunkCrc(channel, header.length) != header.crc) {
+				LOG_DEBUG("Chunk %d: CRC error.\n", header.sequence);
+				crcErrors++;
+				sendChunkAck(huart, OTA_NAK, header.sequence);
+			} else {
+				uint32_t mask = 1UL << (header.sequence % 32);
+				int isNewChunk = header.sequence >= firstMissing && (chunksWritten[header.sequence / 32] & mask) == 0;
+				if (isNewChunk && erasing) {
+					// first chunk to write (or journal): the pages must be erased by now. If the background
+					// erase failed, erase them here.
+					erasing = 0;
+					if (waitForFlashErase() != HAL_OK && eraseDownloadPages(flashAddress, size, resumeOffset, changedPages) != HAL_OK) {
+						TRACE_END(TRACE_OTA_CHUNK);
+						return HAL_ERROR;
+					}
+				}
+				HAL_StatusTypeDef writeStatus = HAL_OK;
+				if (isNewChunk && (header.flags & OTA_CHUNK_DELTA)) {
+					// the dictionary is the running image, up to OTA_DELTA_DICTIONARY_AHEAD past the chunk offset
+					uint32_t dictionaryEnd = deltaSourceAddress + header.offset + OTA_DELTA_DICTIONARY_AHEAD;
+					uint32_t dictionaryStart = dictionaryEnd - deltaSourceAddress > OTA_DELTA_DICTIONARY_SIZE ? dictionaryEnd - OTA_DELTA_DICTIONARY_SIZE : deltaSourceAddress;
+					writeStatus = writeCompressedChunkToFlash(channel, flashAddress + header.offset, header.length, getChunkLength(header.offset, size),
+							(const char *) dictionaryStart, dictionaryEnd - dictionaryStart);
+				} else if (isNewChunk && (header.flags & OTA_CHUNK_COMPRESSED)) {
+					writeStatus = writeCompressedChunkToFlash(channel, flashAddress + header.offset, header.length, getChunkLength(header.offset, size), NULL, 0);
+				} else if (isNewChunk && (header.flags & OTA_CHUNK_ERASED)) {
+					// the pages being downloaded are erased, so the chunk already reads as 0xFF
+					writeStatus = HAL_OK;
+				} else if (isNewChunk) {
+					writeStatus = writeChunkToFlash(channel, flashAddress + header.offset, header.length);
+				}
 
-		char confirmation[] = {0xFF};
-		uart_tx(huart, 1, confirmation);
+				if (writeStatus == HAL_ERROR) {
+					TRACE_END(TRACE_OTA_CHUNK);
+					return HAL_ERROR;
+				} else if (writeStatus == HAL_BUSY) {
+					// passed its CRC but does not decompress, treat it like a CRC error
+					LOG_DEBUG("Chunk %d: does not decompress.\n", header.sequence);
+					crcErrors++;
+					sendChunkAck(huart, OTA_NAK, header.sequence);
+				} else {
+					if (isNewChunk) {
+						bytesReceived += header.length;
+						firmwareBytesReceived += getChunkLength(header.offset, size);
+						chunksWritten[header.sequence / 32] |= mask;
+						while (firstMissing < numChunks && (chunksWritten[firstMissing / 32] & (1UL << (firstMissing % 32))) != 0) {
+							firstMissing++;
+						}
+						if (journaling) {
+							journalDownloadProgress(&journaledPages, (uint32_t) firstMissing * OTA_CHUNK_SIZE);
+						}
+					}
+					// duplicates (resent after a timeout) are only acknowledged again
+					if (!isNewChunk) {
+						LOG_DEBUG("Chunk %d: duplicate.\n", header.sequence);
+					}
+					sendChunkAck(huart, OTA_ACK, firstMissing);
+				}
+			}
+			uart_channel_consume(channel, header.length);
+			haveHeader = 0;
+			TRACE_END(TRACE_OTA_CHUNK);
+		} else if (!erasing || !isFlashEraseBusy()) {
+			// nothing to program yet, hash what has been written contiguously while waiting for data (not
+			// during the background erase, reads of the bank being erased would stall)
+			uint32_t writtenAddress = flashAddress + ((uint32_t) firstMissing * OTA_CHUNK_SIZE);
+			if (hashProgrammedFlash(hhash, &hashedAddress, writtenAddress, FLASH_PAGE_SIZE) != HAL_OK) {
+				return HAL_ERROR;
+			}
+		}
+	}
+
+	if (waiting) {
+		TRACE_END(TRACE_OTA_WAIT);
+	}
 
+	// hash the rest of the image and get the digest
+	if (finishProgrammedFlashHash(hhash, hashedAddress, flashAddress + size, digest) != HAL_OK) {
+		printf("Error: failed to compute firmware hash.\n");
+		return HAL_ERROR;
 	}
 
+	uint32_t elapsed = HAL_GetTick() - startTick;
+	if (elapsed == 0) {
+		elapsed = 1;
+	}
+	printf("Downloaded %d bytes in %ld ms (%ld bytes/s).\n", size, elapsed, (uint32_t) (((uint64_t) size * 1000) / elapsed));
+	printf("Chunk data received: %d bytes for %d bytes of firmware.\n", bytesReceived, firmwareBytesReceived);
+	printf("Chunks with CRC errors: %d, corrupted headers: %d\n", crcErrors, headerErrors);
+	printf("UART receive interrupts per KB: %ld, dropped bytes: %ld\n", uart_rx_it_get_interrupts_per_kb(channel->huartNum), channel->stats.dropped);
+	printf("Flash programming time per page: %ld us, bytes left erased (0xFF): %ld\n", flashGetProgramTimePerPage(), flashGetSkippedBytes());
+	printf("Log messages dropped: %ld, log buffer high-water mark: %ld / %d bytes\n", logGetStats()->droppedMessages, logGetStats()->maxUsed, LOG_BUFFER_LENGTH);
 
 	return HAL_OK;
 }
 
 
+/* State of the BT122 DFU upload, shared by the BGAPI handlers of uploadFirmwareToBT122() */
+static struct {
+	FlashImageView image;					/* Firmware image in flash */
+	uint32_t firmwareSize;					/* Size of the firmware image in bytes */
+	uint32_t bytesWritten;					/* Bytes sent with dfu_flash_upload */
+	uint32_t uploadCommands;				/* dfu_flash_upload commands sent */
+	int done;								/* 1 once the upload has finished (fi.status tells how) */
+	FirmwareInfo fi;						/* Result of the upload */
+} dfuUpload;
+
 /**
- * @brief   Once firmware has been downloaded to flash, use this function to upload it to the BT122 device,
- * 			and finish the firmware upgrade using BGAPI.
- *
- * @param   flashAddress The start address in flash where the firmware data is stored.
- * @param   firmwareSize The size of the firmware data in bytes.
- * @retval
+ * End the DFU upload with an error.
  */
-FirmwareInfo uploadFirmwareToBT122(UART_HandleTypeDef *huart, const uint32_t flashAddress, const uint32_t firmwareSize) {
-	//update firmware using BGAPI
+static void failDfuUpload() {
+	dfuUpload.fi.status = HAL_ERROR;
+	dfuUpload.done = 1;
+}
 
-	// set BT122 UART mode to BGAPI mode
-	setBT122UARTMode(BGAPI_MODE);
+/**
+ * Send the next part of the firmware with dfu_flash_upload, or dfu_flash_upload_finish once all of it has been sent.
+ */
+static void sendNextDfuChunk() {
+	// check how much firmware has been written to BT122
+	if (dfuUpload.bytesWritten == dfuUpload.firmwareSize) {
+		// if we have written all firmware bytes, go to flash_upload_finish
+		dumo_cmd_dfu_flash_upload_finish();
+		return;
+	}
 
-	// Variable for storing function return values.
-	int ret;
-	// Pointer to cmd packet
-	struct dumo_cmd_packet *pck;
-	// Buffer for storing data from the serial port
-	static char bg_buffer[BGLIB_MSG_MAXLEN];
-	// Length of message payload data.
-	uint16_t msg_length;
-	// flag for while loop
-	int firmwareFlag = 1;
-	// keep track of how many bytes of firmware we have written
-	int firmwareBytesWritten = 0;
-
-	// FirmwareInfo return variable
-	FirmwareInfo fi;
-	fi.oldBootloaderVersion = 0;
-	fi.major = 0;
-	fi.minor = 0;
-	fi.patch = 0;
-	fi.build = 0;
-	fi.newBootloaderVersion = 0;
-	fi.hardwareType = 0;
+	// else keep writing firmware data to BT122
+	// upload BT122_DFU_CHUNK_SIZE bytes at a time (less for the last chunk)
+	uint32_t chunkLength = dfuUpload.firmwareSize - dfuUpload.bytesWritten;
+	if (chunkLength > BT122_DFU_CHUNK_SIZE) {
+		chunkLength = BT122_DFU_CHUNK_SIZE;
+	}
+	const char *firmwareChunk = flashImageData(&dfuUpload.image, dfuUpload.bytesWritten, chunkLength);
 
-	// start firmware upgrade process by booting into DFU mode (1)
-	//dumo_cmd_system_reset((uint8_t) 1);
-	dumo_cmd_dfu_reset((uint8_t) 1);
+	dumo_cmd_dfu_flash_upload(chunkLength, firmwareChunk);
+	TRACE_BEGIN(TRACE_DFU_ROUND_TRIP, dfuUpload.uploadCommands);
+	dfuUpload.bytesWritten += chunkLength;
+	dfuUpload.uploadCommands++;
 
-	while (firmwareFlag) {
-		// Read enough data from UART to get BGAPI message header
-		ret = uart_rx_it(huart, 1, bg_buffer);
-		if (ret < 0) {
-			//Error_Handler();
-			fi.status = HAL_ERROR;
-			return fi;
-		}
+	// Print updates on progress
+	if (dfuUpload.bytesWritten / 8192 != (dfuUpload.bytesWritten - chunkLength) / 8192) {
+		LOG_DEBUG("Written %ld / %ld bytes.\n", dfuUpload.bytesWritten, dfuUpload.firmwareSize);
+	}
+}
 
-		// If first byte is zero skip it to avoid possible De-synchronization due to inherent UART framing error on module reset
-		if (bg_buffer[0] == 0) {
-			ret = uart_rx_it(huart, BGLIB_MSG_HEADER_LEN, bg_buffer);
-		} else {
-			ret = uart_rx_it(huart, BGLIB_MSG_HEADER_LEN - 1, bg_buffer + 1);
-		}
-		if (ret < 0) {
-			//Error_Handler();
-			fi.status = HAL_ERROR;
-			return fi;
-		}
+/**
+ * dfu_boot: the BT122 booted into DFU mode.
+ */
+static void onDfuBoot(const struct dumo_cmd_packet *pck, void *context) {
+	// if we boot into dfu mode after writing all flash data, then that means something was wrong with firmware image
+	if (dfuUpload.bytesWritten == dfuUpload.firmwareSize) {
+		printf("Error: problem with firmware image.. failed to boot with new firmware.\n");
+		dumo_cmd_dfu_reset(0);
+		followBT122BaudRate(BT122_DEFAULT_BAUD_RATE);
+		failDfuUpload();
+		return;
+	}
 
-		// The buffer now contains the message header. Refer to BGAPI protocol definition for details on packet format.
-		msg_length = BGLIB_MSG_LEN(bg_buffer);
-		// Read the payload data if required and store it after the header.
-		if (msg_length) {
-			ret = uart_rx_it(huart, msg_length, &bg_buffer[BGLIB_MSG_HEADER_LEN]);
-			if (ret < 0) {
-				//Error_Handler();
-				fi.status = HAL_ERROR;
-				return fi;
-			}
-		}
-		// To access the payload part of the message
-		pck = BGLIB_MSG(bg_buffer);
-
-		// upload new firmware
-		switch (BGLIB_MSG_ID(bg_buffer)) {
-		case dumo_evt_dfu_boot_id:
-			// if we boot into dfu mode after writing all flash data, then that means something was wrong with firmware image
-			if (firmwareBytesWritten == firmwareSize) {
-				printf("Error: problem with firmware image.. failed to boot with new firmware.\n");
-				dumo_cmd_dfu_reset(0);
-				fi.status = HAL_ERROR;
-				return fi;
-			}
+	dfuUpload.fi.oldBootloaderVersion = pck->evt_dfu_boot.version;
+	printf("Booted into DFU mode: version = %ld\n", dfuUpload.fi.oldBootloaderVersion);
 
-			// This event is triggered when device is booted into DFU mode.
-			fi.oldBootloaderVersion = pck->evt_dfu_boot.version;
+	// After re-booting device into DFU mode, start flash upload process by defining starting address.
+	// When uploading firmware + bootloader, value 0x00000000 should be used
+	dumo_cmd_dfu_flash_set_address(0x00000000);
+}
 
-			printf("Booted into DFU mode: version = %ld\n", fi.oldBootloaderVersion);
+/**
+ * dfu_flash_set_address response: start uploading the firmware.
+ */
+static void onDfuFlashSetAddress(const struct dumo_cmd_packet *pck, void *context) {
+	// Check result code (0: success, non-zero: error occurred)
+	if (pck->rsp_dfu_flash_set_address.result != 0) {
+		LOG_ERROR("dfu_flash_set_address: Error\n");
+		failDfuUpload();
+		return;
+	}
+	LOG_INFO("dfu_flash_set_address: Success\n");
+	sendNextDfuChunk();
+}
 
-			// After re-booting device into DFU mode, start flash upload process by defining starting address.
-			// When uploading firmware + bootloader, value 0x00000000 should be used
-			dumo_cmd_dfu_flash_set_address(0x00000000);
+/**
+ * dfu_flash_upload response: the previous part of the firmware was written, send the next one.
+ */
+static void onDfuFlashUpload(const struct dumo_cmd_packet *pck, void *context) {
+	TRACE_END(TRACE_DFU_ROUND_TRIP);
+	if (pck->rsp_dfu_flash_upload.result != 0) {
+		LOG_ERROR("dfu_flash_upload %ld: Error\n", dfuUpload.bytesWritten);
+		failDfuUpload();
+		return;
+	}
+	sendNextDfuChunk();
+}
 
-			break;
-		case dumo_rsp_dfu_flash_set_address_id:
-			// Used to define the starting address on the flash to where the new firmware will be written in.
+/**
+ * dfu_flash_upload_finish response: the whole image was uploaded, reboot into normal mode.
+ */
+static void onDfuFlashUploadFinish(const struct dumo_cmd_packet *pck, void *context) {
+	if (pck->rsp_dfu_flash_upload_finish.result != 0) {
+		LOG_ERROR("dfu_flash_upload_finish: Error\n");
+		failDfuUpload();
+		return;
+	}
+	LOG_INFO("dfu_flash_upload_finish: Success\n");
 
-			// Check result code (0: success, non-zero: error occurred)
-			ret = pck->rsp_dfu_flash_set_address.result;
-			if (ret == 0) {
-				printf("dfu_flash_set_address: Success\n");
-			} else {
-				printf("dfu_flash_set_address: Error\n");
-				fi.status = HAL_ERROR;
-				return fi;
-			}
+	// Command used to reset the system to normal mode.
+	printf("\r\nFirmware upload - OK -> Rebooting . . .\n");
+	dumo_cmd_dfu_reset(0);
+	followBT122BaudRate(BT122_DEFAULT_BAUD_RATE);
+}
 
-			// Fall-through to next case if dfu_flash_set_address was successful.
+/**
+ * system_boot: the BT122 booted into normal mode with the new firmware.
+ */
+static void onSystemBoot(const struct dumo_cmd_packet *pck, void *context) {
+	dfuUpload.fi.major = pck->evt_system_boot.major;
+	dfuUpload.fi.minor = pck->evt_system_boot.minor;
+	dfuUpload.fi.patch = pck->evt_system_boot.patch;
+	dfuUpload.fi.build = pck->evt_system_boot.build;
+	dfuUpload.fi.newBootloaderVersion = pck->evt_system_boot.bootloader;
+	dfuUpload.fi.hardwareType = pck->evt_system_boot.hw;
+
+	dfuUpload.fi.status = HAL_OK;
+	dfuUpload.done = 1;
+}
 
-		case dumo_rsp_dfu_flash_upload_id:
-			// check result code of previous flash upload (if not a fall-through)
-			if (BGLIB_MSG_ID(bg_buffer) == dumo_rsp_dfu_flash_upload_id) {
-				ret = pck->rsp_dfu_flash_upload.result;
-				if (ret == 0) {
-					//printf("dfu_flash_upload %d: Success\n", firmware_bytes_written);
-				} else {
-					printf("dfu_flash_upload %d: Error\n", firmwareBytesWritten);
-					fi.status = HAL_ERROR;
-					return fi;
-				}
-			}
+/**
+ * Any other message.
+ */
+static void onUnexpectedMessage(const struct dumo_cmd_packet *pck, void *context) {
+	LOG_WARNING("BGAPI response does match an expected rsp/evt.  unknown ID = %ld\n", BGLIB_MSG_ID(pck));
+}
 
-			// check how much firmware has been written to BT122
-			if (firmwareBytesWritten == firmwareSize) {
-				// if we have written all firmware bytes, go to flash_upload_finish
-				dumo_cmd_dfu_flash_upload_finish();
-			} else {
-				// else keep writing firmware data to BT122
-				// upload 128 bytes at a time
-				char firmwareChunk[128];
-				memcpy(firmwareChunk, (void *) flashAddress + firmwareBytesWritten, 128);
+/**
+ * @brief   Once firmware has been downloaded to flash, use this function to upload it to the BT122 device,
+ * 			and finish the firmware upgrade using BGAPI. BGAPI messages are received by bgapiDispatch(),
+ * 			which calls the handlers above, so a lost response ends the upload after BT122_DFU_TIMEOUT_MS
+ * 			instead of waiting forever.
+ *
+ * @param   flashAddress The start address in flash where the firmware data is stored.
+ * @param   firmwareSize The size of the firmware data in bytes.
+ * @retval
+ */
+FirmwareInfo uploadFirmwareToBT122(UART_HandleTypeDef *huart, const uint32_t flashAddress, const uint32_t firmwareSize) {
+	//update firmware using BGAPI
 
-				dumo_cmd_dfu_flash_upload(128, firmwareChunk);
-				firmwareBytesWritten += 128;
+	// set BT122 UART mode to BGAPI mode
+	setBT122UARTMode(BGAPI_MODE);
 
-				// Print updates on progress
-				if (firmwareBytesWritten % 8192 == 0) {
-					printf("Written %d / %ld bytes.\n", firmwareBytesWritten, firmwareSize);
-				}
-			}
+	memset(&dfuUpload, 0, sizeof(dfuUpload));
+	dfuUpload.firmwareSize = firmwareSize;
+	dfuUpload.fi.status = HAL_ERROR;
 
-			break;
-		case dumo_rsp_dfu_flash_upload_finish_id:
-			//Command used to tell to the device that the DFU file has been fully uploaded successfully.
+	// firmware image is uploaded straight from flash
+	if (flashImageOpen(&dfuUpload.image, flashAddress, firmwareSize) != HAL_OK) {
+		return dfuUpload.fi;
+	}
 
-			// check result code of dfu_flash_upload_finish
-			ret = pck->rsp_dfu_flash_upload_finish.result;
-			if (ret == 0) {
-				printf("dfu_flash_upload_finish: Success\n");
-			} else {
-				printf("dfu_flash_upload_finish: Error\n");
-				fi.status = HAL_ERROR;
-				return fi;
-			}
+	bgapiClearHandlers();
+	bgapiRegisterHandler(dumo_evt_dfu_boot_id, onDfuBoot, NULL);
+	bgapiRegisterHandler(dumo_rsp_dfu_flash_set_address_id, onDfuFlashSetAddress, NULL);
+	bgapiRegisterHandler(dumo_rsp_dfu_flash_upload_id, onDfuFlashUpload, NULL);
+	bgapiRegisterHandler(dumo_rsp_dfu_flash_upload_finish_id, onDfuFlashUploadFinish, NULL);
+	bgapiRegisterHandler(dumo_evt_system_boot_id, onSystemBoot, NULL);
+	bgapiRegisterHandler(BGAPI_DEFAULT_HANDLER_ID, onUnexpectedMessage, NULL);
+
+	// DFU phase statistics
+	uint32_t startTick = HAL_GetTick();
+	BgapiFramerStats framerStats = *bgapiGetFramerStats();
 
-			// Command used to reset the system to normal mode.
-			printf("\r\nFirmware upload - OK -> Rebooting . . .\n");
-			dumo_cmd_dfu_reset(0);
-
-			break;
-		case dumo_evt_system_boot_id:
-			// This event is triggered when device boots into normal mode
-			fi.major = pck->evt_system_boot.major;
-			fi.minor = pck->evt_system_boot.minor;
-			fi.patch = pck->evt_system_boot.patch;
-			fi.build = pck->evt_system_boot.build;
-			fi.newBootloaderVersion = pck->evt_system_boot.bootloader;
-			fi.hardwareType = pck->evt_system_boot.hw;
-
-			fi.status = HAL_OK;
-
-			// Sets firmware_flag to 0 after successful firmware upload to come out of infinite loop.
-			firmwareFlag = 0;
-
-			break;
-		default:
-			printf("BGAPI response does match an expected rsp/evt.  unknown ID = %ld\n", BGLIB_MSG_ID(bg_buffer));
-			break;
+	// start firmware upgrade process by booting into DFU mode (1)
+	//dumo_cmd_system_reset((uint8_t) 1);
+	dumo_cmd_dfu_reset((uint8_t) 1);
+	// the BT122 comes back at the rate of the DFU bootloader
+	followBT122BaudRate(BT122_DFU_BAUD_RATE);
+
+	uint32_t lastMessageTick = HAL_GetTick();
+	while (!dfuUpload.done) {
+		if (bgapiDispatch() > 0) {
+			lastMessageTick = HAL_GetTick();
+		} else if (HAL_GetTick() - lastMessageTick >= BT122_DFU_TIMEOUT_MS) {
+			printf("Error: no BGAPI message from BT122 for %d ms, %ld / %ld bytes uploaded.\n", BT122_DFU_TIMEOUT_MS,
+					dfuUpload.bytesWritten, firmwareSize);
+			failDfuUpload();
 		}
 	}
+	bgapiClearHandlers();
 
+	uint32_t elapsed = HAL_GetTick() - startTick;
+	if (elapsed == 0) {
+		elapsed = 1;
+	}
+	const BgapiFramerStats *stats = bgapiGetFramerStats();
 	printf("BT122 firmware upgrade procedure complete.\n");
+	printf("DFU phase: %ld bytes in %ld ms (%ld bytes/s), %ld dfu_flash_upload commands of up to %d bytes.\n",
+			firmwareSize, elapsed, (uint32_t) (((uint64_t) firmwareSize * 1000) / elapsed), dfuUpload.uploadCommands, BT122_DFU_CHUNK_SIZE);
+	printf("BGAPI packets: %ld, bytes dropped resynchronizing: %ld, packets timed out: %ld\n", stats->packets - framerStats.packets,
+			stats->resyncBytes - framerStats.resyncBytes, stats->timeouts - framerStats.timeouts);
 
-	return fi;
+	return dfuUpload.fi;
 }
@@ -21,7 +21,9 @@
 /* Includes ------------------------------------------------------------------*/
 #include "main.h"
 /* USER CODE BEGIN Includes */
-
+#include "uart.h"
+#include "util.h"
+#include "log.h"
 /* USER CODE END Includes */
 
 /* Private typedef -----------------------------------------------------------*/
@@ -42,11 +44,49 @@
 /* Private variables ---------------------------------------------------------*/
 /* USER CODE BEGIN PV */
 
+#ifdef UART_RX_DMA_ENABLED
+// GPDMA1 channel 0 -> USART1 RX (circular)
+DMA_NodeTypeDef Node_GPDMA1_Channel0;
+DMA_QListTypeDef List_GPDMA1_Channel0;
+DMA_HandleTypeDef handle_GPDMA1_Channel0;
+
+// GPDMA1 channel 1 -> USART2 RX (circular)
+DMA_NodeTypeDef Node_GPDMA1_Channel1;
+DMA_QListTypeDef List_GPDMA1_Channel1;
+DMA_HandleTypeDef handle_GPDMA1_Channel1;
+#endif /* UART_RX_DMA_ENABLED */
+
+#ifdef HASH_DMA_ENABLED
+// GPDMA1 channel 2 -> HASH DIN (memory to peripheral)
+DMA_HandleTypeDef handle_GPDMA1_Channel2;
+#endif /* HASH_DMA_ENABLED */
+
+#ifdef LOG_TX_DMA_ENABLED
+// GPDMA1 channel 3 -> USART1 TX (console log, memory to peripheral)
+DMA_HandleTypeDef handle_GPDMA1_Channel3;
+#endif /* LOG_TX_DMA_ENABLED */
+
+#ifdef UART_TX_DMA_ENABLED
+// GPDMA1 channel 4 -> USART2 TX (BGAPI, header node + payload node, see uart_tx_gather())
+DMA_NodeTypeDef Nodes_GPDMA1_Channel4[2];
+DMA_QListTypeDef List_GPDMA1_Channel4;
+DMA_HandleTypeDef handle_GPDMA1_Channel4;
+#endif /* UART_TX_DMA_ENABLED */
+
 /* USER CODE END PV */
 
 /* Private function prototypes -----------------------------------------------*/
 /* USER CODE BEGIN PFP */
 
+#ifdef UART_RX_DMA_ENABLED
+static void UART_RxDMA_Init(UART_HandleTypeDef *huart, DMA_HandleTypeDef *hdma, DMA_QListTypeDef *list,
+		DMA_NodeTypeDef *node, DMA_Channel_TypeDef *channel, uint32_t request, IRQn_Type irq);
+#endif /* UART_RX_DMA_ENABLED */
+#ifdef UART_TX_DMA_ENABLED
+static void UART_TxDMA_Init(UART_HandleTypeDef *huart, DMA_HandleTypeDef *hdma, DMA_QListTypeDef *list,
+		DMA_NodeTypeDef *nodes, DMA_Channel_TypeDef *channel, uint32_t request, IRQn_Type irq);
+#endif /* UART_TX_DMA_ENABLED */
+
 /* USER CODE END PFP */
 
 /* External functions --------------------------------------------------------*/
@@ -56,6 +96,167 @@
 
 /* USER CODE BEGIN 0 */
 
+#ifdef UART_RX_DMA_ENABLED
+/**
+* @brief Configure a GPDMA channel as a circular (1 node linked-list) UART receive channel and link
+* it to the UART handle. The buffer address and size are filled in by HAL_UARTEx_ReceiveToIdle_DMA().
+* @param huart: UART handle pointer
+* @param hdma: DMA handle that will be linked to huart->hdmarx
+* @param list: linked-list queue used by the channel
+* @param node: the single node of the linked-list queue
+* @param channel: GPDMA channel instance
+* @param request: GPDMA request of the UART RX line
+* @param irq: GPDMA channel interrupt
+* @retval None
+*/
+static void UART_RxDMA_Init(UART_HandleTypeDef *huart, DMA_HandleTypeDef *hdma, DMA_QListTypeDef *list,
+		DMA_NodeTypeDef *node, DMA_Channel_TypeDef *channel, uint32_t request, IRQn_Type irq)
+{
+  DMA_NodeConfTypeDef nodeConfig = {0};
+
+  __HAL_RCC_GPDMA1_CLK_ENABLE();
+
+  /* Build the single circular node: USARTx->RDR -> memory, byte wide */
+  nodeConfig.NodeType = DMA_GPDMA_LINEAR_NODE;
+  nodeConfig.Init.Request = request;
+  nodeConfig.Init.BlkHWRequest = DMA_BREQ_SINGLE_BURST;
+  nodeConfig.Init.Direction = DMA_PERIPH_TO_MEMORY;
+  nodeConfig.Init.SrcInc = DMA_SINC_FIXED;
+  nodeConfig.Init.DestInc = DMA_DINC_INCREMENTED;
+  nodeConfig.Init.SrcDataWidth = DMA_SRC_DATAWIDTH_BYTE;
+  nodeConfig.Init.DestDataWidth = DMA_DEST_DATAWIDTH_BYTE;
+  nodeConfig.Init.SrcBurstLength = 1;
+  nodeConfig.Init.DestBurstLength = 1;
+  nodeConfig.Init.TransferAllocatedPort = DMA_SRC_ALLOCATED_PORT0|DMA_DEST_ALLOCATED_PORT1;
+  nodeConfig.Init.TransferEventMode = DMA_TCEM_BLOCK_TRANSFER;
+  nodeConfig.Init.Mode = DMA_NORMAL;
+  nodeConfig.TriggerConfig.TriggerPolarity = DMA_TRIG_POLARITY_MASKED;
+  nodeConfig.DataHandlingConfig.DataExchange = DMA_EXCHANGE_NONE;
+  nodeConfig.DataHandlingConfig.DataAlignment = DMA_DATA_RIGHTALIGN_ZEROPADDED;
+  if (HAL_DMAEx_List_BuildNode(&nodeConfig, node) != HAL_OK)
+  {
+    Error_Handler();
+  }
+  if (HAL_DMAEx_List_InsertNode(list, NULL, node) != HAL_OK)
+  {
+    Error_Handler();
+  }
+  if (HAL_DMAEx_List_SetCircularMode(list) != HAL_OK)
+  {
+    Error_Handler();
+  }
+
+  /* Channel init */
+  hdma->Instance = channel;
+  hdma->InitLinkedList.Priority = DMA_HIGH_PRIORITY;
+  hdma->InitLinkedList.LinkStepMode = DMA_LSM_FULL_EXECUTION;
+  hdma->InitLinkedList.LinkAllocatedPort = DMA_LINK_ALLOCATED_PORT0;
+  hdma->InitLinkedList.TransferEventMode = DMA_TCEM_BLOCK_TRANSFER;
+  hdma->InitLinkedList.LinkedListMode = DMA_LINKEDLIST_CIRCULAR;
+  if (HAL_DMAEx_List_Init(hdma) != HAL_OK)
+  {
+    Error_Handler();
+  }
+  if (HAL_DMAEx_List_LinkQ(hdma, list) != HAL_OK)
+  {
+    Error_Handler();
+  }
+
+  __HAL_LINKDMA(huart, hdmarx, *hdma);
+
+  if (HAL_DMA_ConfigChannelAttributes(hdma, DMA_CHANNEL_NPRIV) != HAL_OK)
+  {
+    Error_Handler();
+  }
+
+  /* GPDMA1 interrupt Init */
+  HAL_NVIC_SetPriority(irq, 0, 0);
+  HAL_NVIC_EnableIRQ(irq);
+}
+#endif /* UART_RX_DMA_ENABLED */
+
+#ifdef UART_TX_DMA_ENABLED
+/**
+* @brief Configure a GPDMA channel as a UART transmit channel running a linked-list queue of 2 nodes, and
+* link it to the UART handle: uart_tx_gather() sends a header from the first node and a payload from the
+* second one in a single transfer, with one transfer complete interrupt after the last node. The head node
+* is filled in by HAL_UART_Transmit_DMA(), the second one by uart_tx_gather().
+* @param huart: UART handle pointer
+* @param hdma: DMA handle that will be linked to huart->hdmatx
+* @param list: linked-list queue used by the channel
+* @param nodes: the 2 nodes of the linked-list queue (in the same 64 KB region)
+* @param channel: GPDMA channel instance
+* @param request: GPDMA request of the UART TX line
+* @param irq: GPDMA channel interrupt
+* @retval None
+*/
+static void UART_TxDMA_Init(UART_HandleTypeDef *huart, DMA_HandleTypeDef *hdma, DMA_QListTypeDef *list,
+		DMA_NodeTypeDef *nodes, DMA_Channel_TypeDef *channel, uint32_t request, IRQn_Type irq)
+{
+  DMA_NodeConfTypeDef nodeConfig = {0};
+
+  __HAL_RCC_GPDMA1_CLK_ENABLE();
+
+  /* Build the 2 nodes: memory -> USARTx->TDR, byte wide */
+  nodeConfig.NodeType = DMA_GPDMA_LINEAR_NODE;
+  nodeConfig.Init.Request = request;
+  nodeConfig.Init.BlkHWRequest = DMA_BREQ_SINGLE_BURST;
+  nodeConfig.Init.Direction = DMA_MEMORY_TO_PERIPH;
+  nodeConfig.Init.SrcInc = DMA_SINC_INCREMENTED;
+  nodeConfig.Init.DestInc = DMA_DINC_FIXED;
+  nodeConfig.Init.SrcDataWidth = DMA_SRC_DATAWIDTH_BYTE;
+  nodeConfig.Init.DestDataWidth = DMA_DEST_DATAWIDTH_BYTE;
+  nodeConfig.Init.SrcBurstLength = 1;
+  nodeConfig.Init.DestBurstLength = 1;
+  nodeConfig.Init.TransferAllocatedPort = DMA_SRC_ALLOCATED_PORT0|DMA_DEST_ALLOCATED_PORT1;
+  nodeConfig.Init.TransferEventMode = DMA_TCEM_LAST_LL_ITEM_TRANSFER;
+  nodeConfig.Init.Mode = DMA_NORMAL;
+  nodeConfig.TriggerConfig.TriggerPolarity = DMA_TRIG_POLARITY_MASKED;
+  nodeConfig.DataHandlingConfig.DataExchange = DMA_EXCHANGE_NONE;
+  nodeConfig.DataHandlingConfig.DataAlignment = DMA_DATA_RIGHTALIGN_ZEROPADDED;
+  nodeConfig.DstAddress = (uint32_t) &huart->Instance->TDR;
+  nodeConfig.DataSize = 1;                  /* source address and size are set per transfer */
+  for (int i = 0; i < 2; i++)
+  {
+    if (HAL_DMAEx_List_BuildNode(&nodeConfig, &nodes[i]) != HAL_OK)
+    {
+      Error_Handler();
+    }
+    if (HAL_DMAEx_List_InsertNode_Tail(list, &nodes[i]) != HAL_OK)
+    {
+      Error_Handler();
+    }
+  }
+
+  /* Channel init: the queue runs once per transfer */
+  hdma->Instance = channel;
+  hdma->InitLinkedList.Priority = DMA_LOW_PRIORITY_HIGH_WEIGHT;
+  hdma->InitLinkedList.LinkStepMode = DMA_LSM_FULL_EXECUTION;
+  hdma->InitLinkedList.LinkAllocatedPort = DMA_LINK_ALLOCATED_PORT0;
+  hdma->InitLinkedList.TransferEventMode = DMA_TCEM_LAST_LL_ITEM_TRANSFER;
+  hdma->InitLinkedList.LinkedListMode = DMA_LINKEDLIST_NORMAL;
+  if (HAL_DMAEx_List_Init(hdma) != HAL_OK)
+  {
+    Error_Handler();
+  }
+  if (HAL_DMAEx_List_LinkQ(hdma, list) != HAL_OK)
+  {
+    Error_Handler();
+  }
+
+  __HAL_LINKDMA(huart, hdmatx, *hdma);
+
+  if (HAL_DMA_ConfigChannelAttributes(hdma, DMA_CHANNEL_NPRIV) != HAL_OK)
+  {
+    Error_Handler();
+  }
+
+  /* GPDMA1 interrupt Init */
+  HAL_NVIC_SetPriority(irq, 0, 0);
+  HAL_NVIC_EnableIRQ(irq);
+}
+#endif /* UART_TX_DMA_ENABLED */
+
 /* USER CODE END 0 */
 /**
   * Initializes the Global MSP.
@@ -89,6 +290,40 @@ void HAL_HASH_MspInit(HASH_HandleTypeDef* hhash)
     /* Peripheral clock enable */
     __HAL_RCC_HASH_CLK_ENABLE();
   /* USER CODE BEGIN HASH_MspInit 1 */
+#ifdef HASH_DMA_ENABLED
+    __HAL_RCC_GPDMA1_CLK_ENABLE();
+
+    /* GPDMA1 channel 2: memory -> HASH->DIN, one word per request */
+    handle_GPDMA1_Channel2.Instance = GPDMA1_Channel2;
+    handle_GPDMA1_Channel2.Init.Request = GPDMA1_REQUEST_HASH_IN;
+    handle_GPDMA1_Channel2.Init.BlkHWRequest = DMA_BREQ_SINGLE_BURST;
+    handle_GPDMA1_Channel2.Init.Direction = DMA_MEMORY_TO_PERIPH;
+    handle_GPDMA1_Channel2.Init.SrcInc = DMA_SINC_INCREMENTED;
+    handle_GPDMA1_Channel2.Init.DestInc = DMA_DINC_FIXED;
+    handle_GPDMA1_Channel2.Init.SrcDataWidth = DMA_SRC_DATAWIDTH_WORD;
+    handle_GPDMA1_Channel2.Init.DestDataWidth = DMA_DEST_DATAWIDTH_WORD;
+    handle_GPDMA1_Channel2.Init.Priority = DMA_LOW_PRIORITY_HIGH_WEIGHT;
+    handle_GPDMA1_Channel2.Init.SrcBurstLength = 1;
+    handle_GPDMA1_Channel2.Init.DestBurstLength = 1;
+    handle_GPDMA1_Channel2.Init.TransferAllocatedPort = DMA_SRC_ALLOCATED_PORT0|DMA_DEST_ALLOCATED_PORT1;
+    handle_GPDMA1_Channel2.Init.TransferEventMode = DMA_TCEM_BLOCK_TRANSFER;
+    handle_GPDMA1_Channel2.Init.Mode = DMA_NORMAL;
+    if (HAL_DMA_Init(&handle_GPDMA1_Channel2) != HAL_OK)
+    {
+      Error_Handler();
+    }
+
+    __HAL_LINKDMA(hhash, hdmain, handle_GPDMA1_Channel2);
+
+    if (HAL_DMA_ConfigChannelAttributes(&handle_GPDMA1_Channel2, DMA_CHANNEL_NPRIV) != HAL_OK)
+    {
+      Error_Handler();
+    }
+
+    /* GPDMA1 interrupt Init */
+    HAL_NVIC_SetPriority(GPDMA1_Channel2_IRQn, 0, 0);
+    HAL_NVIC_EnableIRQ(GPDMA1_Channel2_IRQn);
+#endif /* HASH_DMA_ENABLED */
 
   /* USER CODE END HASH_MspInit 1 */
 
@@ -108,6 +343,10 @@ void HAL_HASH_MspDeInit(HASH_HandleTypeDef* hhash)
     /* Peripheral clock disable */
     __HAL_RCC_HASH_CLK_DISABLE();
   /* USER CODE BEGIN HASH_MspDeInit 1 */
+#ifdef HASH_DMA_ENABLED
+    HAL_DMA_DeInit(hhash->hdmain);
+    HAL_NVIC_DisableIRQ(GPDMA1_Channel2_IRQn);
+#endif /* HASH_DMA_ENABLED */
 
   /* USER CODE END HASH_MspDeInit 1 */
 
@@ -157,7 +396,44 @@ void HAL_UART_MspInit(UART_HandleTypeDef* huart)
     HAL_NVIC_SetPriority(USART1_IRQn, 0, 0);
     HAL_NVIC_EnableIRQ(USART1_IRQn);
   /* USER CODE BEGIN USART1_MspInit 1 */
+#ifdef UART_RX_DMA_ENABLED
+    UART_RxDMA_Init(huart, &handle_GPDMA1_Channel0, &List_GPDMA1_Channel0, &Node_GPDMA1_Channel0,
+        GPDMA1_Channel0, GPDMA1_REQUEST_USART1_RX, GPDMA1_Channel0_IRQn);
+#endif /* UART_RX_DMA_ENABLED */
+#ifdef LOG_TX_DMA_ENABLED
+    __HAL_RCC_GPDMA1_CLK_ENABLE();
+
+    /* GPDMA1 channel 3: log buffer -> USART1->TDR, one byte per request */
+    handle_GPDMA1_Channel3.Instance = GPDMA1_Channel3;
+    handle_GPDMA1_Channel3.Init.Request = GPDMA1_REQUEST_USART1_TX;
+    handle_GPDMA1_Channel3.Init.BlkHWRequest = DMA_BREQ_SINGLE_BURST;
+    handle_GPDMA1_Channel3.Init.Direction = DMA_MEMORY_TO_PERIPH;
+    handle_GPDMA1_Channel3.Init.SrcInc = DMA_SINC_INCREMENTED;
+    handle_GPDMA1_Channel3.Init.DestInc = DMA_DINC_FIXED;
+    handle_GPDMA1_Channel3.Init.SrcDataWidth = DMA_SRC_DATAWIDTH_BYTE;
+    handle_GPDMA1_Channel3.Init.DestDataWidth = DMA_DEST_DATAWIDTH_BYTE;
+    handle_GPDMA1_Channel3.Init.Priority = DMA_LOW_PRIORITY_LOW_WEIGHT;
+    handle_GPDMA1_Channel3.Init.SrcBurstLength = 1;
+    handle_GPDMA1_Channel3.Init.DestBurstLength = 1;
+    handle_GPDMA1_Channel3.Init.TransferAllocatedPort = DMA_SRC_ALLOCATED_PORT0|DMA_DEST_ALLOCATED_PORT1;
+    handle_GPDMA1_Channel3.Init.TransferEventMode = DMA_TCEM_BLOCK_TRANSFER;
+    handle_GPDMA1_Channel3.Init.Mode = DMA_NORMAL;
+    if (HAL_DMA_Init(&handle_GPDMA1_Channel3) != HAL_OK)
+    {
+      Error_Handler();
+    }
 
+    __HAL_LINKDMA(huart, hdmatx, handle_GPDMA1_Channel3);
+
+    if (HAL_DMA_ConfigChannelAttributes(&handle_GPDMA1_Channel3, DMA_CHANNEL_NPRIV) != HAL_OK)
+    {
+      Error_Handler();
+    }
+
+    /* GPDMA1 interrupt Init */
+    HAL_NVIC_SetPriority(GPDMA1_Channel3_IRQn, 0, 0);
+    HAL_NVIC_EnableIRQ(GPDMA1_Channel3_IRQn);
+#endif /* LOG_TX_DMA_ENABLED */
   /* USER CODE END USART1_MspInit 1 */
   }
   else if(huart->Instance==USART2)
@@ -196,7 +472,14 @@ void HAL_UART_MspInit(UART_HandleTypeDef* huart)
     HAL_NVIC_SetPriority(USART2_IRQn, 0, 0);
     HAL_NVIC_EnableIRQ(USART2_IRQn);
   /* USER CODE BEGIN USART2_MspInit 1 */
-
+#ifdef UART_RX_DMA_ENABLED
+    UART_RxDMA_Init(huart, &handle_GPDMA1_Channel1, &List_GPDMA1_Channel1, &Node_GPDMA1_Channel1,
+        GPDMA1_Channel1, GPDMA1_REQUEST_USART2_RX, GPDMA1_Channel1_IRQn);
+#endif /* UART_RX_DMA_ENABLED */
+#ifdef UART_TX_DMA_ENABLED
+    UART_TxDMA_Init(huart, &handle_GPDMA1_Channel4, &List_GPDMA1_Channel4, Nodes_GPDMA1_Channel4,
+        GPDMA1_Channel4, GPDMA1_REQUEST_USART2_TX, GPDMA1_Channel4_IRQn);
+#endif /* UART_TX_DMA_ENABLED */
   /* USER CODE END USART2_MspInit 1 */
   }
 
@@ -227,7 +510,14 @@ void HAL_UART_MspDeInit(UART_HandleTypeDef* huart)
     /* USART1 interrupt DeInit */
     HAL_NVIC_DisableIRQ(USART1_IRQn);
   /* USER CODE BEGIN USART1_MspDeInit 1 */
-
+#ifdef UART_RX_DMA_ENABLED
+    HAL_DMAEx_List_DeInit(huart->hdmarx);
+    HAL_NVIC_DisableIRQ(GPDMA1_Channel0_IRQn);
+#endif /* UART_RX_DMA_ENABLED */
+#ifdef LOG_TX_DMA_ENABLED
+    HAL_DMA_DeInit(huart->hdmatx);
+    HAL_NVIC_DisableIRQ(GPDMA1_Channel3_IRQn);
+#endif /* LOG_TX_DMA_ENABLED */
   /* USER CODE END USART1_MspDeInit 1 */
   }
   else if(huart->Instance==USART2)
@@ -249,7 +539,14 @@ void HAL_UART_MspDeInit(UART_HandleTypeDef* huart)
     /* USART2 interrupt DeInit */
     HAL_NVIC_DisableIRQ(USART2_IRQn);
   /* USER CODE BEGIN USART2_MspDeInit 1 */
-
+#ifdef UART_RX_DMA_ENABLED
+    HAL_DMAEx_List_DeInit(huart->hdmarx);
+    HAL_NVIC_DisableIRQ(GPDMA1_Channel1_IRQn);
+#endif /* UART_RX_DMA_ENABLED */
+#ifdef UART_TX_DMA_ENABLED
+    HAL_DMAEx_List_DeInit(huart->hdmatx);
+    HAL_NVIC_DisableIRQ(GPDMA1_Channel4_IRQn);
+#endif /* UART_TX_DMA_ENABLED */
   /* USER CODE END USART2_MspDeInit 1 */
   }
 
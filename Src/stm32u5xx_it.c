@@ -22,6 +22,9 @@
 #include "stm32u5xx_it.h"
 /* Private includes ----------------------------------------------------------*/
 /* USER CODE BEGIN Includes */
+#include "uart.h"
+#include "util.h"
+#include "log.h"
 /* USER CODE END Includes */
 
 /* Private typedef -----------------------------------------------------------*/
@@ -58,7 +61,19 @@
 extern UART_HandleTypeDef huart1;
 extern UART_HandleTypeDef huart2;
 /* USER CODE BEGIN EV */
-
+#ifdef UART_RX_DMA_ENABLED
+extern DMA_HandleTypeDef handle_GPDMA1_Channel0;
+extern DMA_HandleTypeDef handle_GPDMA1_Channel1;
+#endif /* UART_RX_DMA_ENABLED */
+#ifdef HASH_DMA_ENABLED
+extern DMA_HandleTypeDef handle_GPDMA1_Channel2;
+#endif /* HASH_DMA_ENABLED */
+#ifdef LOG_TX_DMA_ENABLED
+extern DMA_HandleTypeDef handle_GPDMA1_Channel3;
+#endif /* LOG_TX_DMA_ENABLED */
+#ifdef UART_TX_DMA_ENABLED
+extern DMA_HandleTypeDef handle_GPDMA1_Channel4;
+#endif /* UART_TX_DMA_ENABLED */
 /* USER CODE END EV */
 
 /******************************************************************************/
@@ -229,4 +244,60 @@ void USART2_IRQHandler(void)
 
 /* USER CODE BEGIN 1 */
 
+/**
+  * @brief This function handles FLASH non-secure global interrupt (background erase).
+  */
+void FLASH_IRQHandler(void)
+{
+  HAL_FLASH_IRQHandler();
+}
+
+#ifdef UART_RX_DMA_ENABLED
+/**
+  * @brief This function handles GPDMA1 Channel 0 global interrupt (USART1 RX).
+  */
+void GPDMA1_Channel0_IRQHandler(void)
+{
+  HAL_DMA_IRQHandler(&handle_GPDMA1_Channel0);
+}
+
+/**
+  * @brief This function handles GPDMA1 Channel 1 global interrupt (USART2 RX).
+  */
+void GPDMA1_Channel1_IRQHandler(void)
+{
+  HAL_DMA_IRQHandler(&handle_GPDMA1_Channel1);
+}
+#endif /* UART_RX_DMA_ENABLED */
+
+#ifdef HASH_DMA_ENABLED
+/**
+  * @brief This function handles GPDMA1 Channel 2 global interrupt (HASH input).
+  */
+void GPDMA1_Channel2_IRQHandler(void)
+{
+  HAL_DMA_IRQHandler(&handle_GPDMA1_Channel2);
+}
+#endif /* HASH_DMA_ENABLED */
+
+#ifdef LOG_TX_DMA_ENABLED
+/**
+  * @brief This function handles GPDMA1 Channel 3 global interrupt (USART1 TX, console log).
+  */
+void GPDMA1_Channel3_IRQHandler(void)
+{
+  HAL_DMA_IRQHandler(&handle_GPDMA1_Channel3);
+}
+#endif /* LOG_TX_DMA_ENABLED */
+
+#ifdef UART_TX_DMA_ENABLED
+/**
+  * @brief This function handles GPDMA1 Channel 4 global interrupt (USART2 TX, BGAPI).
+  */
+void GPDMA1_Channel4_IRQHandler(void)
+{
+  HAL_DMA_IRQHandler(&handle_GPDMA1_Channel4);
+}
+#endif /* UART_TX_DMA_ENABLED */
+
 /* USER CODE END 1 */
@@ -0,0 +1,136 @@
+/**
+ ******************************************************************************
+ * @file           trace.c
+ * @brief          Cycle counted trace of the OTA hot paths
+ ******************************************************************************
+ *
+ * The TRACE_ macros (trace.h) record begin / end / mark events stamped with
+ * DWT->CYCCNT into traceBuffer, a ring of the most recent
+ * TRACE_BUFFER_LENGTH events. Recording is inline and takes a few cycles
+ * (see testTraceOverhead()). traceDump() sends the buffer over the console
+ * UART in binary (TraceDumpHeader), "Python Client/trace_view.py" finds it
+ * in the console output and turns it into a timeline and a flame graph.
+ *
+ * CYCCNT wraps every 2^32 cycles (about 27 s at 160 MHz): the host assumes
+ * consecutive events are less than half of that apart.
+ *
+ * Nothing here is compiled unless TRACE_ENABLED is defined.
+ *
+ ******************************************************************************
+ */
+
+/* Includes -----------------------------------------------------------------*/
+#include <stdio.h>
+#include <string.h>
+
+#include "log.h"
+#include "trace.h"
+#include "util.h"
+
+#ifdef TRACE_ENABLED
+
+/* Variables ----------------------------------------------------------------*/
+TraceEvent traceBuffer[TRACE_BUFFER_LENGTH];
+uint32_t traceRecorded = 0;					/* Events recorded, the next one goes to traceBuffer[traceRecorded % TRACE_BUFFER_LENGTH] */
+
+static UART_HandleTypeDef *traceUart = NULL;	/* Where traceDump() sends the buffer */
+
+/* Names of the TraceId values, in the dump */
+static const char *const traceNames[TRACE_ID_COUNT] = {
+	[TRACE_FLASH_ERASE] = "eraseFlashRange",
+	[TRACE_FLASH_ERASE_IT] = "eraseFlashPage_IT",
+	[TRACE_FLASH_PROGRAM] = "writeFlashRange",
+	[TRACE_OTA_WAIT] = "waitForChunk",
+	[TRACE_OTA_CHUNK] = "handleChunk",
+	[TRACE_OTA_CRC] = "computeChunkCrc",
+	[TRACE_OTA_HASH] = "hashProgrammedFlash",
+	[TRACE_LZ_DECODE] = "decompressChunk",
+	[TRACE_UART_RX_IRQ] = "uartRxIrq",
+	[TRACE_BGAPI_HANDLER] = "bgapiHandler",
+	[TRACE_DFU_ROUND_TRIP] = "dfuFlashUpload",
+};
+
+/* Functions ----------------------------------------------------------------*/
+
+/**
+ * Start tracing: empties the buffer and starts the DWT cycle counter.
+ *
+ * @param huart The UART traceDump() sends the buffer over (the console, USART1).
+ */
+void traceInit(UART_HandleTypeDef *huart) {
+	enableCycleCounter();
+	traceUart = huart;
+	traceRecorded = 0;
+}
+
+/**
+ * Send part of the dump, adding it to its CRC.
+ */
+static void traceSend(const void *data, int length) {
+	crc32Update((const char *) data, length);
+	HAL_UART_Transmit(traceUart, (const uint8_t *) data, length, HAL_MAX_DELAY);
+}
+
+/**
+ * Send the events in the buffer over the console UART (see TraceDumpHeader). Call it once the traced work
+ * is over: events recorded while it runs may overwrite the ones being sent.
+ */
+void traceDump() {
+	if (traceUart == NULL) {
+		return;
+	}
+	uint32_t recorded = traceRecorded;
+	uint32_t eventCount = recorded < TRACE_BUFFER_LENGTH ? recorded : TRACE_BUFFER_LENGTH;
+	TraceDumpHeader header = { TRACE_DUMP_MAGIC, TRACE_DUMP_VERSION, sizeof(TraceEvent), SystemCoreClock, recorded, eventCount, TRACE_ID_COUNT, 0 };
+
+	printf("\nTrace: %ld events recorded, dumping the last %ld.\n", recorded, eventCount);
+	// the dump is sent directly, after what was logged before it (the UART is busy until then)
+	logFlush();
+	HAL_UART_Transmit(traceUart, (const uint8_t *) header.magic, sizeof(header.magic), HAL_MAX_DELAY);
+	crc32Begin();
+	traceSend((const char *) &header + sizeof(header.magic), sizeof(header) - sizeof(header.magic));
+	for (int id = 0; id < TRACE_ID_COUNT; id++) {
+		uint8_t length = strlen(traceNames[id]);
+		traceSend(&length, 1);
+		traceSend(traceNames[id], length);
+	}
+	// oldest first: once the buffer has wrapped, the oldest event is the one to be overwritten next
+	uint32_t first = recorded - eventCount;
+	for (uint32_t i = 0; i < eventCount; i++) {
+		traceSend(&traceBuffer[(first + i) & (TRACE_BUFFER_LENGTH - 1)], sizeof(TraceEvent));
+	}
+	uint32_t crc = crc32End();
+	HAL_UART_Transmit(traceUart, (const uint8_t *) &crc, sizeof(crc), HAL_MAX_DELAY);
+	printf("\nTrace dump end.\n");
+}
+
+
+
+
+// TESTING
+
+/**
+ * Measure the cost of recording: cycles per TRACE_BEGIN / TRACE_END pair and per TRACE_SCOPE.
+ */
+void testTraceOverhead() {
+	const int pairs = 1000;
+	traceInit(traceUart);
+
+	uint32_t start = DWT->CYCCNT;
+	for (int i = 0; i < pairs; i++) {
+		TRACE_BEGIN(TRACE_OTA_CHUNK, i);
+		TRACE_END(TRACE_OTA_CHUNK);
+	}
+	uint32_t pairCycles = DWT->CYCCNT - start;
+
+	start = DWT->CYCCNT;
+	for (int i = 0; i < pairs; i++) {
+		TRACE_SCOPE(TRACE_OTA_CHUNK, i);
+	}
+	uint32_t scopeCycles = DWT->CYCCNT - start;
+
+	printf("Trace overhead: %ld cycles per begin / end pair, %ld cycles per scope\n", pairCycles / pairs, scopeCycles / pairs);
+	traceInit(traceUart);
+}
+
+#endif /* TRACE_ENABLED */
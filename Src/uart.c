@@ -18,16 +18,67 @@
  */
 #include <stdint.h>
 #include <stdio.h>
+#include <string.h>
 #include "uart.h"
+#include "trace.h"
+
+/* Private variables */
+
+/*
+ * Storage for the UART channels. A channel is created for each UART registered with register_UART().
+ */
+static UART_Channel uartChannelPool[UART_MAX_CHANNELS];
+static int uartChannelCount = 0;
 
 /*
- * Array that tracks associated between huart handle pointer, and uart number.
- * ie: &huart2 <=> 2
+ * Lookup tables from UART number and from UART peripheral instance to channel.
+ * Both are indexed directly so lookups are O(1).
+ * ie: 2 <=> &uartChannelPool[x] <=> USART2
+ */
+static UART_Channel *uartChannelsByNum[MAX_NUMBER_UART_HANDLES] = {NULL};
+static UART_Channel *uartChannelsByInstance[UART_INSTANCE_SLOTS] = {NULL};
+
+/* Private functions */
+static void rx_dma_drain(UART_Channel *channel, uint16_t position);
+
+/**
+ * @brief   Returns the slot in uartChannelsByInstance for a USART/UART/LPUART peripheral instance.
+ *
+ * @param   instance The UART peripheral instance (huart->Instance).
+ * @retval  The slot, or -1 if the instance is unknown.
  */
-UART_HandleTypeDef *UARTHandles[MAX_NUMBER_UART_HANDLES] = {NULL};
+static int uart_instance_slot(const USART_TypeDef *instance) {
+	switch ((uint32_t) instance) {
+	case USART1_BASE:
+		return 0;
+	case USART2_BASE:
+		return 1;
+#if defined(USART3)
+	case USART3_BASE:
+		return 2;
+#endif
+#if defined(UART4)
+	case UART4_BASE:
+		return 3;
+#endif
+#if defined(UART5)
+	case UART5_BASE:
+		return 4;
+#endif
+#if defined(USART6)
+	case USART6_BASE:
+		return 5;
+#endif
+	case LPUART1_BASE:
+		return 6;
+	default:
+		return -1;
+	}
+}
 
 /**
- * @brief   Associates the huartNum with a UART_HandleTypeDef pointer.
+ * @brief   Associates the huartNum with a UART_HandleTypeDef pointer, and creates the UART channel
+ * 			(receive buffer and statistics) for it.
  * This is mainly so that uart_rx and uart_rx_it can have the same function prototype.
  *
  * @param   huartNum The UART number to be associated with the UART handle pointer.
@@ -38,28 +89,72 @@ int register_UART(int huartNum, UART_HandleTypeDef *huart) {
 	if (huartNum >= MAX_NUMBER_UART_HANDLES || huartNum < 1) {
 		return -1;
 	}
-	UARTHandles[huartNum] = huart;
+	int slot = uart_instance_slot(huart->Instance);
+	if (slot < 0) {
+		return -1;
+	}
+
+	// Re-use the channel if this UART was already registered
+	UART_Channel *channel = uartChannelsByInstance[slot];
+	if (channel == NULL) {
+		if (uartChannelCount == UART_MAX_CHANNELS) {
+			return -1;
+		}
+		channel = &uartChannelPool[uartChannelCount++];
+		memset(channel, 0, sizeof(UART_Channel));
+	}
+	channel->huart = huart;
+	channel->huartNum = huartNum;
+
+	uartChannelsByInstance[slot] = channel;
+	uartChannelsByNum[huartNum] = channel;
 	return huartNum;
 }
 
 /**
  * Returns the huartNum associated with the specified UART_HandleTypeDef pointer.
- * Checks if huart pointer is in the UARTHandles array, if so returns the UART
- * number else returns -1.
  *
  * @param   huart
- * @retval  The associated huartNum
+ * @retval  The associated huartNum, or -1 if the UART has not been registered.
  */
 int get_UART_num(UART_HandleTypeDef *huart){
-	// get huartNum
-	int huartNum = -1;
-	for (int i = 0; i < MAX_NUMBER_UART_HANDLES; i++) {
-		if (UARTHandles[i] == huart) {
-			huartNum = i;
-			break;
-		}
+	UART_Channel *channel = uart_get_channel(huart);
+	if (channel == NULL) {
+		return -1;
 	}
-	return huartNum;
+	return channel->huartNum;
+}
+
+/**
+ * @brief   Returns the channel of a registered UART. Look it up once and keep the pointer when
+ * 			calling the uart_channel_*() functions in a loop.
+ *
+ * @param   huart The UART handle.
+ * @retval  The channel, or NULL if the UART has not been registered.
+ */
+UART_Channel* uart_get_channel(UART_HandleTypeDef *huart) {
+	int slot = uart_instance_slot(huart->Instance);
+	if (slot < 0) {
+		return NULL;
+	}
+	UART_Channel *channel = uartChannelsByInstance[slot];
+	if (channel == NULL || channel->huart != huart) {
+		return NULL;
+	}
+	return channel;
+}
+
+/**
+ * @brief   Returns the channel registered with the specified UART number.
+ *
+ * @param   huartNum The UART identifier. Ex: huart1 -> 1, huart2 -> 2.
+ * @retval  The channel, or NULL if no UART has been registered with that number.
+ */
+UART_Channel* uart_get_channel_by_num(int huartNum) {
+	if (huartNum >= MAX_NUMBER_UART_HANDLES || huartNum < 1) {
+		return NULL;
+	}
+	return uartChannelsByNum[huartNum];
 }
 
 /**
@@ -69,19 +164,18 @@ int get_UART_num(UART_HandleTypeDef *huart){
  * @param   huart The UART handle of the UART connection that is being checked.
  */
 void checkConnection(UART_HandleTypeDef *huart) {
+	UART_Channel *channel = uart_get_channel(huart);
 	char buffer[2];
 
 	// Clear any left over data from UART buffers
-	uart_rx_it_clear_buffer(get_UART_num(huart));
+	uart_channel_clear_buffer(channel);
 
 	// Wait for client to send confirmation bytes
 	printf("Waiting for confirmation...\n");
-	while (uart_rx_it_get_length(get_UART_num(huart)) != 2) {
-		//HAL_Delay(50);
-	}
+	uart_channel_rx(channel, 2, buffer);
 
 	// clear UART buffer
-	uart_rx_it_clear_buffer(get_UART_num(huart));
+	uart_channel_clear_buffer(channel);
 
 	// confirmation received
 	printf("Received confirmation: %c %c. Sending confirmation back...\n", buffer[0], buffer[1]);
@@ -92,6 +186,37 @@ void checkConnection(UART_HandleTypeDef *huart) {
 	//uart_tx();
 }
 
+/**
+ * @brief   Change the baud rate of a registered UART. Reception is stopped, the UART is re-initialized with
+ * 			the new rate and reception is started again. Received bytes that have not been read yet are
+ * 			discarded, the other side may have been sending at the other rate.
+ * @note    A uart_tx_gather() transfer in progress is waited for first.
+ *
+ * @param   huart The registered UART handle.
+ * @param   baudRate The new baud rate.
+ * @retval  HAL_OK if the UART is receiving at the new rate, HAL_ERROR otherwise.
+ */
+HAL_StatusTypeDef uart_set_baud_rate(UART_HandleTypeDef *huart, uint32_t baudRate) {
+	UART_Channel *channel = uart_get_channel(huart);
+	if (channel == NULL) {
+		return HAL_ERROR;
+	}
+
+	if (uart_tx_wait(huart) != HAL_OK || HAL_UART_AbortReceive(huart) != HAL_OK) {
+		return HAL_ERROR;
+	}
+	// what was received at the old rate is discarded, not drained on restart
+	channel->rxDmaStarted = 0;
+	huart->Init.BaudRate = baudRate;
+	if (HAL_UART_Init(huart) != HAL_OK) {
+		printf("Error: failed to set UART%d to %ld baud.\n", channel->huartNum, baudRate);
+		return HAL_ERROR;
+	}
+
+	uart_channel_clear_buffer(channel);
+	return uart_rx_start(huart);
+}
+
 /*******************************************************************************/
 /*							Polling UART									   */
 /*******************************************************************************/
@@ -150,20 +275,17 @@ int uart_rx(UART_HandleTypeDef *huart, int dataLength, char *data) {
 /**
  * Transmit a specified number of bytes using the specified UART in blocking mode.
  * The function will block until the desired amount has been written or an error occurs.
+ * A uart_tx_gather() transfer in progress on the UART is waited for first.
  *
  * @param   huart The handle of the UART used to transmit the data.
  * @param   dataLength The number of bytes that will be transmitted.
  * @param   data Pointer to the char array containing the data to be transmitted. Should be
  * 			at least <dataLength> bytes long, or else undefined behavior will result.
- * @retval  The number of bytes transmitted.
+ * @retval  The number of bytes transmitted, or -1 on error.
  */
 int uart_tx(UART_HandleTypeDef *huart, int dataLength, const char *data) {
 	/* Variable for storing function return values. */
 	HAL_StatusTypeDef ret;
-	/* The amount of bytes written. */
-	uint16_t data_written;
-	/* The amount of bytes still needed to be written. */
-	uint16_t data_to_write = dataLength;
 
 #ifdef UART_DEBUG
   printf("uart_tx() - dataLength: %d\r\n", dataLength);
@@ -176,82 +298,190 @@ int uart_tx(UART_HandleTypeDef *huart, int dataLength, const char *data) {
   printf("\r\n");
 #endif
 
-	while (data_to_write) {
-		do {
-			ret = HAL_UART_Transmit(huart, (uint8_t*) data, 1, HAL_MAX_DELAY);
-		} while (ret != HAL_OK);
-		data_written = 1;
-		if (ret != HAL_OK) {
-			printf("Failed to transmit on UART: %d\r\n", ret);
-			return -1;
-		}
-		data_to_write -= data_written;
-		data += data_written;
+	if (dataLength <= 0) {
+		return 0;
+	}
+	// the whole buffer in one call, busy while a background transfer is in progress
+	do {
+		ret = HAL_UART_Transmit(huart, (const uint8_t*) data, dataLength, HAL_MAX_DELAY);
+	} while (ret == HAL_BUSY);
+	if (ret != HAL_OK) {
+		printf("Failed to transmit on UART: %d\r\n", ret);
+		return -1;
 	}
 
 	return dataLength;
 }
 
+/**
+ * @brief   Wait until the transfer started by uart_tx_gather() (or any other background transmit) on the
+ * 			UART is complete.
+ *
+ * @param   huart The UART handle.
+ * @retval  HAL_OK, or HAL_TIMEOUT if the transfer did not complete within UART_TX_TIMEOUT_MS.
+ */
+HAL_StatusTypeDef uart_tx_wait(UART_HandleTypeDef *huart) {
+	uint32_t startTick = HAL_GetTick();
+	while (huart->gState != HAL_UART_STATE_READY) {
+		if (HAL_GetTick() - startTick >= UART_TX_TIMEOUT_MS) {
+			return HAL_TIMEOUT;
+		}
+	}
+	return HAL_OK;
+}
+
 
 /*******************************************************************************/
 /*							Interrupt UART									   */
 /*******************************************************************************/
 
-/* Private variables */
+/*
+ * The UART interrupt buffers are single-producer / single-consumer ring buffers. The producer is the
+ * UART (or DMA) interrupt calling uart_rx_it_put(), the consumer is the main loop calling uart_rx_it_get().
+ * Only the producer writes head and only the consumer writes tail, so no locking is needed. head and tail
+ * are free running counters, the buffer index is obtained by masking with UART_IT_BUFFER_MASK, which is
+ * why UART_IT_BUFFER_LENGTH must be a power of two. The number of bytes in the buffer is (head - tail).
+ */
+#if (UART_IT_BUFFER_LENGTH & (UART_IT_BUFFER_LENGTH - 1)) != 0
+#error "UART_IT_BUFFER_LENGTH must be a power of two"
+#endif
+
+#define UART_IT_BUFFER_MASK (UART_IT_BUFFER_LENGTH - 1)
+
+/**
+ * @brief   Copy up to dataLength bytes into the ring. Producer side only.
+ * @retval  The number of bytes actually added (less than dataLength if the ring is full).
+ */
+static int ring_put(UART_RingBuffer *ring, int dataLength, const char *data) {
+	uint32_t head = ring->head;
+	// acquire: tail must be read before we overwrite the space it frees
+	uint32_t tail = ring->tail;
+	__DMB();
+
+	uint32_t space = UART_IT_BUFFER_LENGTH - (head - tail);
+	uint32_t length = ((uint32_t) dataLength < space) ? (uint32_t) dataLength : space;
+
+	// copy in up to two spans (before and after wrap around)
+	uint32_t idx = head & UART_IT_BUFFER_MASK;
+	uint32_t firstSpan = UART_IT_BUFFER_LENGTH - idx;
+	if (firstSpan > length) {
+		firstSpan = length;
+	}
+	memcpy(&ring->buffer[idx], data, firstSpan);
+	memcpy(ring->buffer, data + firstSpan, length - firstSpan);
+
+	// release: data must be visible before the new head is
+	__DMB();
+	ring->head = head + length;
+
+	return (int) length;
+}
 
-// UART 1 Buffer Variables
-int uart1_rx_it_buffer_length = 0;
-int uart1_rx_it_put_idx = 0;
-int uart1_rx_it_get_idx = 0;
-char uart1_rx_it_buffer[UART_IT_BUFFER_LENGTH];
+/**
+ * @brief   Copy up to dataLength bytes out of the ring. Consumer side only.
+ * @retval  The number of bytes actually read (less than dataLength if the ring does not contain enough).
+ */
+static int ring_get(UART_RingBuffer *ring, int dataLength, char *data) {
+	uint32_t tail = ring->tail;
+	// acquire: head must be read before the data it publishes
+	uint32_t head = ring->head;
+	__DMB();
+
+	uint32_t available = head - tail;
+	uint32_t length = ((uint32_t) dataLength < available) ? (uint32_t) dataLength : available;
+
+	// copy out up to two spans (before and after wrap around)
+	uint32_t idx = tail & UART_IT_BUFFER_MASK;
+	uint32_t firstSpan = UART_IT_BUFFER_LENGTH - idx;
+	if (firstSpan > length) {
+		firstSpan = length;
+	}
+	memcpy(data, &ring->buffer[idx], firstSpan);
+	memcpy(data + firstSpan, ring->buffer, length - firstSpan);
 
-// UART 2 Buffer Variables
-int uart2_rx_it_buffer_length = 0;
-int uart2_rx_it_put_idx = 0;
-int uart2_rx_it_get_idx = 0;
-char uart2_rx_it_buffer[UART_IT_BUFFER_LENGTH];
+	// release: data must be read before the producer is allowed to overwrite it
+	__DMB();
+	ring->tail = tail + length;
+
+	return (int) length;
+}
+
+/**
+ * @brief   Start receiving on the specified UART in interrupt mode, 1 byte per interrupt.
+ * 			uart_rx_it_callback() must be called from HAL_UART_RxCpltCallback().
+ *
+ * @param   huart The registered UART handle to start receiving on.
+ * @retval  HAL_OK if reception was started, HAL_ERROR otherwise.
+ */
+HAL_StatusTypeDef uart_rx_it_start(UART_HandleTypeDef *huart) {
+	UART_Channel *channel = uart_get_channel(huart);
+	if (channel == NULL) {
+		return HAL_ERROR;
+	}
+	return HAL_UART_Receive_IT(huart, &channel->rxItByte, 1);
+}
+
+/**
+ * @brief   Stores the byte received in interrupt mode and re-arms the reception.
+ * 			Called from HAL_UART_RxCpltCallback().
+ *
+ * @param   huart The UART handle that generated the interrupt.
+ */
+void uart_rx_it_callback(UART_HandleTypeDef *huart) {
+	UART_Channel *channel = uart_get_channel(huart);
+	if (channel == NULL) {
+		return;
+	}
+	uart_channel_put(channel, 1, (char*) &channel->rxItByte);
+	HAL_UART_Receive_IT(huart, &channel->rxItByte, 1);
+}
+
+/**
+ * @brief   Start receiving on the specified UART. Uses DMA if a DMA channel has been linked to the UART
+ * 			(huart->hdmarx) and UART_RX_DMA_ENABLED is defined, interrupt mode otherwise.
+ *
+ * @param   huart The registered UART handle to start receiving on.
+ * @retval  HAL_OK if reception was started, HAL_ERROR otherwise.
+ */
+HAL_StatusTypeDef uart_rx_start(UART_HandleTypeDef *huart) {
+#ifdef UART_RX_DMA_ENABLED
+	if (huart->hdmarx != NULL) {
+		return uart_rx_dma_start(huart);
+	}
+#endif
+	return uart_rx_it_start(huart);
+}
 
 /**
  * @brief   Mimics the behavior of uart_rx() function, but utilizing the UART interrupt
- * 			buffers. Non-blocking function.
+ * 			buffers. Blocks until dataLength bytes have been received.
  *
- * @param   huartNum The UART identifier. Ex: huart1 -> 1, huart2 -> 2.
+ * @param   channel The UART channel (see uart_get_channel()).
  * @param   dataLength The number of bytes to be read from the UART.
  * @param   data The buffer to store the recieved data in.
  * @retval  The number of bytes read from the UART, or -1 if there was an error.
  */
-int uart_rx_it(UART_HandleTypeDef *huart, int dataLength, char *data) {
-	// get huartNum
-	int huartNum = -1;
-	for (int i = 0; i < MAX_NUMBER_UART_HANDLES; i++) {
-		if (UARTHandles[i] == huart) {
-			huartNum = i;
-		}
+int uart_channel_rx(UART_Channel *channel, int dataLength, char *data) {
+	if (channel == NULL) {
+		return -1;
 	}
 
 	/* The amount of bytes still needed to be read. */
-	uint16_t data_to_read = dataLength;
-	/* The amount of bytes read. */
-	uint16_t data_read;
+	int data_to_read = dataLength;
 
 #ifdef UART_DEBUG
   printf("uart_rx() - dataLength: %d\r\n", dataLength);
 #endif
 
 	while (data_to_read) {
-		if (uart_rx_it_get_length(huartNum) > 0) {
-			data_read = uart_rx_it_get(huartNum, data_to_read, data);
-			if (data_read == -1) {
-				return data_read;
-			}
-			data_to_read -= data_read;
-			data += data_read;
-		}
+		int data_read = ring_get(&channel->rx, data_to_read, data);
+		data_to_read -= data_read;
+		data += data_read;
 	}
 
 #ifdef UART_DEBUG
-  for (ret = 0; ret < dataLength; ++ret) {
-    printf("%02X", (data - dataLength)[ret]);
+  for (int i = 0; i < dataLength; ++i) {
+    printf("%02X", (data - dataLength)[i]);
   }
 
   printf("\r\n");
@@ -260,13 +490,135 @@ int uart_rx_it(UART_HandleTypeDef *huart, int dataLength, char *data) {
 	return dataLength;
 }
 
+/**
+ * @brief   Copy received data into the channel receive buffer and update the byte statistics.
+ * @retval  The number of bytes that were added. Bytes that did not fit are counted as dropped.
+ */
+static int channel_store(UART_Channel *channel, int dataLength, const char *data) {
+	int added = ring_put(&channel->rx, dataLength, data);
+	channel->stats.bytes += dataLength;
+	channel->stats.dropped += dataLength - added;
+	return added;
+}
+
+/**
+ * @brief   Adds newly received data to the channel receive buffer. Producer side only, i.e. the receive
+ * 			interrupt of this UART. Each call is counted as one receive interrupt.
+ *
+ * @param   channel The UART channel.
+ * @param   dataLength The number of bytes received.
+ * @param   data Pointer to the array containing the received data.
+ * @retval  The number of bytes that were added to the buffer. Bytes that did not fit are counted as dropped.
+ */
+int uart_channel_put(UART_Channel *channel, int dataLength, const char *data) {
+	channel->stats.interrupts++;
+	return channel_store(channel, dataLength, data);
+}
+
+/**
+ * @brief   Get up to dataLength bytes from the channel receive buffer. Consumer side only.
+ *
+ * @param   channel The UART channel.
+ * @param   dataLength The maximum number of bytes to read.
+ * @param   data The buffer the data will be written to.
+ * @retval  The number of bytes actually read.
+ */
+int uart_channel_get(UART_Channel *channel, int dataLength, char *data) {
+	return ring_get(&channel->rx, dataLength, data);
+}
+
+/**
+ * @brief   Zero-copy read. Returns a pointer to the oldest unread bytes in the receive buffer and the number
+ * 			of bytes that are contiguous in memory from there (the data may continue at the start of the ring).
+ * 			The bytes stay in the buffer until they are released with uart_channel_consume().
+ *
+ * @param   channel The UART channel.
+ * @param   data Set to point to the first unread byte.
+ * @retval  The number of contiguous bytes readable at *data.
+ */
+int uart_channel_get_span(UART_Channel *channel, const char **data) {
+	return uart_channel_peek_span(channel, 0, data);
+}
+
+/**
+ * @brief   Zero-copy look ahead. Like uart_channel_get_span(), but starts offset bytes after the oldest
+ * 			unread byte, so data further into the buffer can be inspected before anything is consumed.
+ *
+ * @param   channel The UART channel.
+ * @param   offset Number of unread bytes to skip.
+ * @param   data Set to point to the unread byte at offset.
+ * @retval  The number of contiguous bytes readable at *data (0 if there are no more than offset unread bytes).
+ */
+int uart_channel_peek_span(UART_Channel *channel, int offset, const char **data) {
+	UART_RingBuffer *ring = &channel->rx;
+	uint32_t tail = ring->tail;
+	uint32_t head = ring->head;
+	__DMB();
+
+	uint32_t available = head - tail;
+	if ((uint32_t) offset >= available) {
+		*data = NULL;
+		return 0;
+	}
+	tail += offset;
+	available -= offset;
+
+	uint32_t idx = tail & UART_IT_BUFFER_MASK;
+	uint32_t span = UART_IT_BUFFER_LENGTH - idx;
+
+	*data = &ring->buffer[idx];
+	return (int) ((available < span) ? available : span);
+}
+
+/**
+ * @brief   Release bytes previously obtained with uart_channel_get_span().
+ *
+ * @param   channel The UART channel.
+ * @param   dataLength The number of bytes to release. Must not be more than what is in the buffer.
+ */
+void uart_channel_consume(UART_Channel *channel, int dataLength) {
+	__DMB();
+	channel->rx.tail += dataLength;
+}
+
+/**
+ * @brief   Returns the number of received bytes that have not been read yet.
+ *
+ * @param   channel The UART channel.
+ * @retval  The current length of the receive buffer.
+ */
+int uart_channel_get_length(UART_Channel *channel) {
+	return (int) (channel->rx.head - channel->rx.tail);
+}
+
+/**
+ * @brief   Clear all received bytes from the receive buffer.
+ * @note    Does not technically clear the buffer, just marks everything received so far as read. Only the consumer
+ * 			index is modified so this is safe to call while the receive interrupt is active.
+ *
+ * @param   channel The UART channel.
+ */
+void uart_channel_clear_buffer(UART_Channel *channel) {
+	channel->rx.tail = channel->rx.head;
+}
+
+/**
+ * @brief   Mimics the behavior of uart_rx() function, but utilizing the UART interrupt
+ * 			buffers. Blocks until dataLength bytes have been received.
+ *
+ * @param   huart The UART handle.
+ * @param   dataLength The number of bytes to be read from the UART.
+ * @param   data The buffer to store the recieved data in.
+ * @retval  The number of bytes read from the UART, or -1 if there was an error.
+ */
+int uart_rx_it(UART_HandleTypeDef *huart, int dataLength, char *data) {
+	return uart_channel_rx(uart_get_channel(huart), dataLength, data);
+}
+
 /**
  * @brief   Used in the UART interrupt callback to add newly received data to the UART buffer. Once the data
  * 			is in the UART buffer, it can be consumed using the uart_rx_it() function.
  *
- *	When data is received through UART interrupt, call this function to store it in a buffer until
- * 	it is read back using uart_rx_it_get().
- *
  * @param   huartNum The UART identifier. Ex: huart1 -> 1, huart2 -> 2.
  * @param   dataLength The number of bytes received.
  * @param   data Pointer to the array containing the received data.
@@ -274,52 +626,16 @@ int uart_rx_it(UART_HandleTypeDef *huart, int dataLength, char *data) {
  * 			to the UART buffer.
  */
 int uart_rx_it_put(int huartNum, int dataLength, char *data) {
-	// Check which huart
-	if (huartNum == 1) {
-		// copy data to rx circular buffer
-		for (int i = 0; i < dataLength; i++) {
-			// check if buffer is full before adding more
-			if (uart1_rx_it_buffer_length == UART_IT_BUFFER_LENGTH) {
-				// return number of bytes actually added to buffer
-				return i;
-			}
-
-			uart1_rx_it_buffer[uart1_rx_it_put_idx] = data[i];
-			uart1_rx_it_put_idx++;
-			uart1_rx_it_buffer_length++;
-
-			// reached end of circular buffer, go back to beginning
-			if (uart1_rx_it_put_idx == UART_IT_BUFFER_LENGTH) {
-				uart1_rx_it_put_idx = 0;
-			}
-		}
-	} else if (huartNum == 2) {
-		// copy data to rx circular buffer
-		for (int i = 0; i < dataLength; i++) {
-			// check if buffer is full before adding more
-			if (uart2_rx_it_buffer_length == UART_IT_BUFFER_LENGTH) {
-				// return number of bytes actually added to buffer
-				return i;
-			}
-
-			uart2_rx_it_buffer[uart2_rx_it_put_idx] = data[i];
-			uart2_rx_it_put_idx++;
-			uart2_rx_it_buffer_length++;
-
-			// reached end of circular buffer, go back to beginning
-			if (uart2_rx_it_put_idx == UART_IT_BUFFER_LENGTH) {
-				uart2_rx_it_put_idx = 0;
-			}
-		}
+	UART_Channel *channel = uart_get_channel_by_num(huartNum);
+	if (channel == NULL) {
+		return -1;
 	}
-	return dataLength;
+	return uart_channel_put(channel, dataLength, data);
 }
 
 /**
  * @brief   Get data_lengths numbers of bytes from UART RX buffer.
  *
- * Used in the uart_rx_it() function to consume data from the UART buffer.
- *
  * @param   huartNum The UART identifier. Ex: huart1 -> 1, huart2 -> 2.
  * @param   dataLength The number of bytes of data that will be consumed from the UART buffer.
  * @param	data The pointer to the char buffer where the received data will be written to.
@@ -327,44 +643,39 @@ int uart_rx_it_put(int huartNum, int dataLength, char *data) {
  * 			actually read from the UART buffer.
  */
 int uart_rx_it_get(int huartNum, int dataLength, char *data) {
-	// Check which huart
-	if (huartNum == 1) {
-		for (int i = 0; i < dataLength; i++) {
-			// check that buffer has any data to read
-			if (uart1_rx_it_buffer_length == 0) {
-				// return number of bytes actually read from buffer
-				return i;
-			}
-
-			data[i] = uart1_rx_it_buffer[uart1_rx_it_get_idx];
-			uart1_rx_it_get_idx++;
-			uart1_rx_it_buffer_length--;
-
-			// reached end of circular buffer, go back to beginning
-			if (uart1_rx_it_put_idx == UART_IT_BUFFER_LENGTH) {
-				uart1_rx_it_put_idx = 0;
-			}
-		}
-	} else if (huartNum == 2) {
-		for (int i = 0; i < dataLength; i++) {
-			// check that buffer has any data to read
-			if (uart2_rx_it_buffer_length == 0) {
-				// return number of bytes actually read from buffer
-				return i;
-			}
-
-			data[i] = uart2_rx_it_buffer[uart2_rx_it_get_idx];
-			uart2_rx_it_get_idx++;
-			uart2_rx_it_buffer_length--;
+	UART_Channel *channel = uart_get_channel_by_num(huartNum);
+	if (channel == NULL) {
+		return -1;
+	}
+	return uart_channel_get(channel, dataLength, data);
+}
 
-			// reached end of circular buffer, go back to beginning
-			if (uart2_rx_it_put_idx == UART_IT_BUFFER_LENGTH) {
-				uart2_rx_it_put_idx = 0;
-			}
-		}
+/**
+ * @brief   See uart_channel_get_span().
+ *
+ * @param   huartNum The UART identifier. Ex: huart1 -> 1, huart2 -> 2.
+ * @param   data Set to point to the first unread byte.
+ * @retval  The number of contiguous bytes readable at *data, or -1 if error.
+ */
+int uart_rx_it_get_span(int huartNum, const char **data) {
+	UART_Channel *channel = uart_get_channel_by_num(huartNum);
+	if (channel == NULL) {
+		return -1;
 	}
+	return uart_channel_get_span(channel, data);
+}
 
-	return dataLength;
+/**
+ * @brief   See uart_channel_consume().
+ *
+ * @param   huartNum The UART identifier. Ex: huart1 -> 1, huart2 -> 2.
+ * @param   dataLength The number of bytes to release.
+ */
+void uart_rx_it_consume(int huartNum, int dataLength) {
+	UART_Channel *channel = uart_get_channel_by_num(huartNum);
+	if (channel != NULL) {
+		uart_channel_consume(channel, dataLength);
+	}
 }
 
 /**
@@ -376,32 +687,208 @@ int uart_rx_it_get(int huartNum, int dataLength, char *data) {
  * @retval  The current length of the UART RX buffer.
  */
 int uart_rx_it_get_length(int huartNum) {
-	if (huartNum == 1) {
-		return uart1_rx_it_buffer_length;
-	} else if (huartNum == 2) {
-		return uart2_rx_it_buffer_length;
+	UART_Channel *channel = uart_get_channel_by_num(huartNum);
+	if (channel == NULL) {
+		return -1;
 	}
-	return -1;
+	return uart_channel_get_length(channel);
 }
 
 /**
- * @brief   Clear all received bytes from the UART buffer.
- * @note    Does not technically clear the buffer, just resets put idx, get idx and length to 0. This will cause newly received
- * 			data to overwrite the old data, essentially clearing the buffer.
+ * @brief   Clear all received bytes from the UART buffer. See uart_channel_clear_buffer().
  *
  * @param   huartNum The UART identifier. Ex: huart1 -> 1, huart2 -> 2
  * @retval  void
  */
 void uart_rx_it_clear_buffer(int huartNum) {
-	if (huartNum == 1) {
-		uart1_rx_it_buffer_length = 0;
-		uart1_rx_it_put_idx = 0;
-		uart1_rx_it_get_idx = 0;
-	}
-	else if (huartNum == 2) {
-		uart2_rx_it_buffer_length = 0;
-		uart2_rx_it_put_idx = 0;
-		uart2_rx_it_get_idx = 0;
+	UART_Channel *channel = uart_get_channel_by_num(huartNum);
+	if (channel != NULL) {
+		uart_channel_clear_buffer(channel);
+	}
+}
+
+
+/*******************************************************************************/
+/*							DMA UART										   */
+/*******************************************************************************/
+
+/**
+ * @brief   Start receiving on the specified UART using GPDMA in circular mode. The DMA channel continuously
+ * 			writes into the UART_RX_DMA_BUFFER_LENGTH byte buffer of the UART channel, and on every half transfer,
+ * 			transfer complete or idle line event the new bytes are moved into the receive ring in bulk by
+ * 			uart_rx_dma_event(). Data is then consumed as usual with uart_rx_it(). When restarting after an
+ * 			error aborted the reception, the bytes the DMA wrote since the last event are moved into the
+ * 			receive ring first.
+ * @note    The UART must have been registered with register_UART(), and its hdmarx must be linked to a
+ * 			circular linked-list GPDMA channel (see HAL_UART_MspInit()). It must not be receiving.
+ *
+ * @param   huart The UART handle to start receiving on.
+ * @retval  HAL_OK if reception was started, HAL_BUSY if the UART is still receiving, HAL_ERROR otherwise.
+ */
+HAL_StatusTypeDef uart_rx_dma_start(UART_HandleTypeDef *huart) {
+	UART_Channel *channel = uart_get_channel(huart);
+	if (channel == NULL) {
+		return HAL_ERROR;
+	}
+	if (huart->RxState != HAL_UART_STATE_READY) {
+		// still receiving (ex: a transmit error reached HAL_UART_ErrorCallback()), the position is still valid
+		return HAL_BUSY;
+	}
+
+	uint32_t primask = __get_PRIMASK();
+	__disable_irq();
+	if (channel->rxDmaStarted) {
+		// the reception was aborted (ex: overrun): keep what the DMA wrote since the last event
+		rx_dma_drain(channel, UART_RX_DMA_BUFFER_LENGTH - __HAL_DMA_GET_COUNTER(huart->hdmarx));
+	}
+
+	// Half transfer events are left enabled, they are what keeps the DMA buffer from being
+	// overwritten before it is drained during long bursts without an idle line.
+	HAL_StatusTypeDef status = HAL_UARTEx_ReceiveToIdle_DMA(huart, (uint8_t*) channel->rxDmaBuffer, UART_RX_DMA_BUFFER_LENGTH);
+	if (status == HAL_OK) {
+		channel->rxDmaPosition = 0;
+		channel->rxDmaStarted = 1;
+	}
+	__set_PRIMASK(primask);
+	return status;
+}
+
+/**
+ * @brief   Moves the bytes the DMA has written between rxDmaPosition and position into the receive ring.
+ */
+static void rx_dma_drain(UART_Channel *channel, uint16_t position) {
+	uint16_t lastPosition = channel->rxDmaPosition;
+	if (position == lastPosition) {
+		// nothing new
+		return;
+	}
+
+	if (position > lastPosition) {
+		// data is contiguous in the DMA buffer
+		channel_store(channel, position - lastPosition, &channel->rxDmaBuffer[lastPosition]);
+	} else {
+		// DMA wrapped around, copy tail of the DMA buffer then the beginning
+		channel_store(channel, UART_RX_DMA_BUFFER_LENGTH - lastPosition, &channel->rxDmaBuffer[lastPosition]);
+		if (position > 0) {
+			channel_store(channel, position, channel->rxDmaBuffer);
+		}
+	}
+
+	// reached end of DMA buffer, DMA continues at the beginning
+	channel->rxDmaPosition = (position == UART_RX_DMA_BUFFER_LENGTH) ? 0 : position;
+}
+
+/**
+ * @brief   Moves the bytes the DMA has written since the last event into the receive ring.
+ * 			Called from HAL_UARTEx_RxEventCallback() (half transfer, transfer complete and idle line events).
+ *
+ * @param   huart The UART handle that generated the event.
+ * @param   position The current write position of the DMA in the DMA buffer (the Size argument of the
+ * 			HAL_UARTEx_RxEventCallback()).
+ */
+void uart_rx_dma_event(UART_HandleTypeDef *huart, uint16_t position) {
+	UART_Channel *channel = uart_get_channel(huart);
+	if (channel == NULL) {
+		return;
+	}
+	TRACE_SCOPE(TRACE_UART_RX_IRQ, channel->huartNum);
+
+	channel->stats.interrupts++;
+	rx_dma_drain(channel, position);
+}
+
+/**
+ * @brief   Transmit a header and a payload as one DMA transfer, and return without waiting for it. The header
+ * 			is copied to the UART channel, the payload is read in place: the DMA channel linked to hdmatx runs
+ * 			a linked-list queue of 2 nodes (see HAL_UART_MspInit()), the first sends the header and the
+ * 			second the payload, with a single transfer complete interrupt at the end. A header without a
+ * 			payload is split over the 2 nodes. The transfer in progress, if any, is waited for first.
+ * @note    The payload must not change until the transfer is complete (see uart_tx_wait()). Without
+ * 			UART_TX_DMA_ENABLED, or if hdmatx is not such a channel, both are sent with uart_tx().
+ *
+ * @param   huart The registered UART handle.
+ * @param   headerLength Bytes in header, at least 2 (sent blocking if more than UART_TX_HEADER_LENGTH).
+ * @param   header The header, copied.
+ * @param   payloadLength Bytes in payload, 0 for none.
+ * @param   payload The payload, read by the DMA.
+ * @retval  The number of bytes queued or transmitted, or -1 on error.
+ */
+int uart_tx_gather(UART_HandleTypeDef *huart, int headerLength, const char *header, int payloadLength, const char *payload) {
+#ifdef UART_TX_DMA_ENABLED
+	UART_Channel *channel = uart_get_channel(huart);
+	DMA_HandleTypeDef *hdma = huart->hdmatx;
+	if (channel != NULL && hdma != NULL && (hdma->Mode & DMA_LINKEDLIST) == DMA_LINKEDLIST
+			&& hdma->LinkedListQueue != NULL && hdma->LinkedListQueue->NodeNumber == 2
+			&& headerLength >= 2 && headerLength <= UART_TX_HEADER_LENGTH && payloadLength >= 0) {
+		if (uart_tx_wait(huart) != HAL_OK) {
+			printf("Failed to transmit on UART%d: the previous transfer did not complete\r\n", channel->huartNum);
+			return -1;
+		}
+		memcpy(channel->txHeader, header, headerLength);
+
+		// the second node, where the first one links to (nodes are in the 64 KB region of the head)
+		DMA_NodeTypeDef *head = hdma->LinkedListQueue->Head;
+		DMA_NodeTypeDef *node = (DMA_NodeTypeDef *) (((uint32_t) head & DMA_CLBAR_LBA)
+				| (head->LinkRegisters[NODE_CLLR_LINEAR_DEFAULT_OFFSET] & DMA_CLLR_LA));
+		int firstLength = headerLength;
+		if (payloadLength == 0) {
+			// no node may be empty, the last byte of the header goes in the second one
+			firstLength--;
+			payload = &channel->txHeader[firstLength];
+			payloadLength = 1;
+		}
+		node->LinkRegisters[NODE_CBR1_DEFAULT_OFFSET] = payloadLength;
+		node->LinkRegisters[NODE_CSAR_DEFAULT_OFFSET] = (uint32_t) payload;
+		// the node is read by the DMA when it gets to it
+		__DMB();
+
+		// fills in the head node (header) and starts the channel
+		HAL_StatusTypeDef ret = HAL_UART_Transmit_DMA(huart, (const uint8_t*) channel->txHeader, firstLength);
+		if (ret != HAL_OK) {
+			printf("Failed to transmit on UART: %d\r\n", ret);
+			return -1;
+		}
+		return firstLength + payloadLength;
+	}
+#endif /* UART_TX_DMA_ENABLED */
+
+	if (uart_tx(huart, headerLength, header) < 0) {
+		return -1;
+	}
+	if (payloadLength > 0 && uart_tx(huart, payloadLength, payload) < 0) {
+		return -1;
+	}
+	return headerLength + payloadLength;
+}
+
+/*******************************************************************************/
+/*							Statistics										   */
+/*******************************************************************************/
+
+/**
+ * @brief   Returns the number of receive interrupts taken per KB of received data since the last
+ * 			uart_rx_it_reset_stats(). With 1 byte interrupts this is 1024, with DMA it should be a small number.
+ *
+ * @param   huartNum The UART identifier. Ex: huart1 -> 1, huart2 -> 2.
+ * @retval  Interrupts per 1024 bytes received, or 0 if nothing has been received.
+ */
+uint32_t uart_rx_it_get_interrupts_per_kb(int huartNum) {
+	UART_Channel *channel = uart_get_channel_by_num(huartNum);
+	if (channel == NULL || channel->stats.bytes == 0) {
+		return 0;
+	}
+	return (uint32_t) (((uint64_t) channel->stats.interrupts * 1024) / channel->stats.bytes);
+}
+
+/**
+ * @brief   Reset the receive statistics of the specified UART.
+ *
+ * @param   huartNum The UART identifier. Ex: huart1 -> 1, huart2 -> 2.
+ */
+void uart_rx_it_reset_stats(int huartNum) {
+	UART_Channel *channel = uart_get_channel_by_num(huartNum);
+	if (channel != NULL) {
+		memset(&channel->stats, 0, sizeof(UART_Stats));
 	}
 }
 
@@ -10,9 +10,21 @@
 #include <string.h>
 
 #include "stm32u5xx_hal.h"
+#include "flash.h"
+#include "util.h"
+#include "log.h"
 
 /* Private variables --------------------------------------------------------*/
 
+/* State of the DMA fed hash started by computeHashFromFlash_DMA() or accumulateHashFromFlash_DMA() */
+static struct {
+	volatile int busy;					/* 1 while image data is still being fed to the HASH peripheral */
+	volatile HAL_StatusTypeDef status;	/* HAL_ERROR if a DMA transfer failed */
+	uint8_t *next;						/* Next byte of the image to feed */
+	uint32_t remaining;					/* Bytes of the image not yet fed */
+	int last;							/* 1 if the image is the end of the message (the digest is computed) */
+} hashDMA = { 0, HAL_OK, NULL, 0, 0 };
+
 /* Functions ----------------------------------------------------------------*/
 
 /**
@@ -73,7 +85,9 @@ HAL_StatusTypeDef fixEndianness(uint8_t *buffer, int size) {
 }
 
 /**
- * @brief Computes the SHA256 hash value of an array of bytes in flash memory.
+ * @brief Computes the SHA256 hash value of an array of bytes in flash memory. Uses DMA to feed the
+ *        HASH peripheral when the HASH handle has a DMA channel linked, polling otherwise. Either way it
+ *        blocks until the digest is ready; use computeHashFromFlash_DMA() to do other work meanwhile.
  *
  * @param hhash The HASH handle.
  * @param flashAddress The starting address of the byte array in memory.
@@ -82,34 +96,233 @@ HAL_StatusTypeDef fixEndianness(uint8_t *buffer, int size) {
  * @retval Status of the operation.
  */
 HAL_StatusTypeDef computeHashFromFlash(HASH_HandleTypeDef *hhash, uint32_t flashAddress, int size, char *digest) {
-	// Compute hash 1 flash page at a time.
-	int numPages = size / FLASH_PAGE_SIZE;
-	int leftOverBytes = size - (numPages * FLASH_PAGE_SIZE);
-	printf("Computing SHA256 Hash of %d bytes in flash starting at address: %08lx\n", size, flashAddress);
-
-	char firmwarePage[FLASH_PAGE_SIZE];
-
-	for (int i = 0; i < numPages; i++) {
-		memcpy(firmwarePage, (char *) flashAddress, FLASH_PAGE_SIZE);
-		fixEndianness((uint8_t *) firmwarePage, FLASH_PAGE_SIZE);
-		if (HAL_HASHEx_SHA256_Accmlt(hhash, (uint8_t *) firmwarePage, FLASH_PAGE_SIZE) != HAL_OK) {
-			printf("Error: accumulating hash at addr = %08lx\n", flashAddress);
+	LOG_DEBUG("Computing SHA256 Hash of %d bytes in flash starting at address: %08lx\n", size, flashAddress);
+
+	if (hhash->hdmain != NULL) {
+		if (computeHashFromFlash_DMA(hhash, flashAddress, size) != HAL_OK) {
 			return HAL_ERROR;
 		}
-		flashAddress += FLASH_PAGE_SIZE;
+		return waitForHash(hhash, digest);
 	}
 
-	// do leftover and call accumlt_end
-	memcpy(firmwarePage, (char *) flashAddress, leftOverBytes);
-	fixEndianness((uint8_t *) firmwarePage, leftOverBytes);
-	if (HAL_HASHEx_SHA256_Accmlt_End(hhash, (uint8_t *) firmwarePage, leftOverBytes, (uint8_t *) digest, HAL_MAX_DELAY) != HAL_OK) {
-		printf("Error: calling accmlt_end\n");
+	FlashImageView image;
+	if (flashImageOpen(&image, flashAddress, size) != HAL_OK) {
+		return HAL_ERROR;
+	}
+
+	// The HASH peripheral takes byte data (HASH_DATATYPE_8B), so the image is hashed straight out of flash.
+	uint8_t *data = (uint8_t *) flashImageData(&image, 0, size);
+	if (HAL_HASHEx_SHA256_Start(hhash, data, size, (uint8_t *) digest, HAL_MAX_DELAY) != HAL_OK) {
+		printf("Error: computing hash of image at addr = %08lx\n", flashAddress);
 		return HAL_ERROR;
 	}
 
 	return HAL_OK;
 }
 
+/**
+ * Feed the next block of the image to the HASH peripheral by DMA. MDMAT (multiple DMA transfers) is
+ * kept set for every block but the last one of the message, so the digest is only computed once the
+ * whole message is in.
+ */
+static HAL_StatusTypeDef hashStartNextBlock(HASH_HandleTypeDef *hhash) {
+	uint32_t length = hashDMA.remaining > HASH_DMA_BLOCK_SIZE ? HASH_DMA_BLOCK_SIZE : hashDMA.remaining;
+	if (length == hashDMA.remaining && hashDMA.last) {
+		__HAL_HASH_RESET_MDMAT();
+	} else {
+		__HAL_HASH_SET_MDMAT();
+	}
+	uint8_t *data = hashDMA.next;
+	hashDMA.next += length;
+	hashDMA.remaining -= length;
+	return HAL_HASHEx_SHA256_Start_DMA(hhash, data, length);
+}
+
+/**
+ * Start feeding an image in flash to the HASH peripheral by DMA.
+ */
+static HAL_StatusTypeDef hashStartImage(HASH_HandleTypeDef *hhash, uint32_t flashAddress, int size, int last) {
+	FlashImageView image;
+	if (hhash->hdmain == NULL || hashDMA.busy || size <= 0) {
+		return HAL_ERROR;
+	}
+	if (flashImageOpen(&image, flashAddress, size) != HAL_OK) {
+		return HAL_ERROR;
+	}
+
+	hashDMA.next = (uint8_t *) flashImageData(&image, 0, size);
+	hashDMA.remaining = size;
+	hashDMA.last = last;
+	hashDMA.status = HAL_OK;
+	hashDMA.busy = 1;
+
+	if (hashStartNextBlock(hhash) != HAL_OK) {
+		printf("Error: starting DMA hash of image at addr = %08lx\n", flashAddress);
+		hashDMA.busy = 0;
+		return HAL_ERROR;
+	}
+	return HAL_OK;
+}
+
+/**
+ * @brief Start computing the SHA256 hash of an array of bytes in flash memory, with the image fed to the
+ *        HASH peripheral by DMA straight out of flash. Returns immediately, the CPU is free until
+ *        waitForHash() is called to get the digest. Ends a message started by accumulateHashFromFlash_DMA().
+ *
+ * @param hhash The HASH handle. Must have a DMA channel linked (see HAL_HASH_MspInit()).
+ * @param flashAddress The starting address of the byte array in memory.
+ * @param size The length of the byte array to compute the hash for.
+ * @retval Status of starting the operation.
+ */
+HAL_StatusTypeDef computeHashFromFlash_DMA(HASH_HandleTypeDef *hhash, uint32_t flashAddress, int size) {
+	return hashStartImage(hhash, flashAddress, size, 1);
+}
+
+/**
+ * @brief Start feeding part of a message in flash to the HASH peripheral by DMA, like
+ *        HAL_HASHEx_SHA256_Accmlt() but returning immediately. The message is continued by further calls
+ *        once isHashBusy() returns 0, and ended by computeHashFromFlash_DMA().
+ *
+ * @param hhash The HASH handle. Must have a DMA channel linked (see HAL_HASH_MspInit()).
+ * @param flashAddress The starting address of the part in memory.
+ * @param size The length of the part, a multiple of 4.
+ * @retval Status of starting the operation.
+ */
+HAL_StatusTypeDef accumulateHashFromFlash_DMA(HASH_HandleTypeDef *hhash, uint32_t flashAddress, int size) {
+	if ((size % 4) != 0) {
+		return HAL_ERROR;
+	}
+	return hashStartImage(hhash, flashAddress, size, 0);
+}
+
+/**
+ * Check if data is still being fed to the HASH peripheral by DMA.
+ *
+ * @retval 1 if busy, 0 if not.
+ */
+int isHashBusy() {
+	return hashDMA.busy;
+}
+
+/**
+ * @brief Wait for the data fed by computeHashFromFlash_DMA() to be hashed and read the digest, or with no
+ *        digest only for the part fed by accumulateHashFromFlash_DMA(). Gives up after HASH_DMA_TIMEOUT_MS,
+ *        in case the DMA callbacks never come.
+ *
+ * @param hhash The HASH handle.
+ * @param digest Pointer to the 32 byte array that will store the SHA256 output digest, or NULL.
+ * @retval Status of the operation, HAL_TIMEOUT if the hash did not finish in time.
+ */
+HAL_StatusTypeDef waitForHash(HASH_HandleTypeDef *hhash, char *digest) {
+	uint32_t startTick = HAL_GetTick();
+	while (hashDMA.busy) {
+		if (HAL_GetTick() - startTick >= HASH_DMA_TIMEOUT_MS) {
+			printf("Error: DMA transfer to HASH peripheral timed out.\n");
+#ifndef OTA_SIMULATION
+			HAL_DMA_Abort(hhash->hdmain);
+#endif
+			hashDMA.busy = 0;
+			return HAL_TIMEOUT;
+		}
+	}
+	if (hashDMA.status != HAL_OK) {
+		printf("Error: DMA transfer to HASH peripheral failed.\n");
+		return HAL_ERROR;
+	}
+	if (digest == NULL) {
+		return HAL_OK;
+	}
+	return HAL_HASHEx_SHA256_Finish(hhash, (uint8_t *) digest, HASH_DMA_TIMEOUT_MS);
+}
+
+/**
+ * HASH input complete callback (DMA transfer of one block finished). Starts the next block.
+ */
+void HAL_HASH_InCpltCallback(HASH_HandleTypeDef *hhash) {
+	if (!hashDMA.busy) {
+		return;
+	}
+	if (hashDMA.remaining == 0) {
+		hashDMA.busy = 0;
+	} else if (hashStartNextBlock(hhash) != HAL_OK) {
+		hashDMA.status = HAL_ERROR;
+		hashDMA.busy = 0;
+	}
+}
+
+/**
+ * HASH error callback (DMA transfer error).
+ */
+void HAL_HASH_ErrorCallback(HASH_HandleTypeDef *hhash) {
+	hashDMA.status = HAL_ERROR;
+	hashDMA.busy = 0;
+}
+
+#ifndef OTA_SIMULATION
+/**
+ * Start a CRC32 computation on the CRC peripheral. Configured for the standard (zlib / Ethernet)
+ * CRC32: polynomial 0x04C11DB7, initial value 0xFFFFFFFF, reflected input and output, final XOR
+ * with 0xFFFFFFFF (done in crc32End()).
+ */
+void crc32Begin() {
+	__HAL_RCC_CRC_CLK_ENABLE();
+	CRC->POL = 0x04C11DB7;
+	CRC->INIT = 0xFFFFFFFF;
+	CRC->CR = CRC_CR_REV_OUT | CRC_CR_REV_IN_0 | CRC_CR_RESET;	// 32-bit polynomial, input reversed by byte
+}
+
+/**
+ * Feed bytes to the CRC32 computation started by crc32Begin().
+ *
+ * @param data The data.
+ * @param length Number of bytes.
+ */
+void crc32Update(const char *data, int length) {
+	__IO uint8_t *dr = (__IO uint8_t *) &CRC->DR;
+	for (int i = 0; i < length; i++) {
+		*dr = (uint8_t) data[i];
+	}
+}
+
+/**
+ * @return The CRC32 of all the data fed since crc32Begin().
+ */
+uint32_t crc32End() {
+	return CRC->DR ^ 0xFFFFFFFF;
+}
+#else
+/*
+ * The host simulation (see Sim/) has no CRC peripheral, the same CRC32 is computed a bit at a time
+ * (reflected polynomial 0xEDB88320).
+ */
+static uint32_t crc32Value;
+
+void crc32Begin() {
+	crc32Value = 0xFFFFFFFF;
+}
+
+void crc32Update(const char *data, int length) {
+	for (int i = 0; i < length; i++) {
+		crc32Value ^= (uint8_t) data[i];
+		for (int bit = 0; bit < 8; bit++) {
+			crc32Value = (crc32Value >> 1) ^ (0xEDB88320 & -(crc32Value & 1));
+		}
+	}
+}
+
+uint32_t crc32End() {
+	return crc32Value ^ 0xFFFFFFFF;
+}
+#endif
+
+/**
+ * Start the DWT cycle counter (CYCCNT) used for timing measurements.
+ */
+void enableCycleCounter() {
+	CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+	DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+}
+
 
 
 
@@ -139,3 +352,28 @@ void testEndianness(HASH_HandleTypeDef *hhash) {
 	printBuffer(reverseHash, 32, "%02x");
 	printf("\n");
 }
+
+/**
+ * Compare the time taken to hash a full 2 MB flash bank by polling and by DMA.
+ */
+void testHashBenchmark(HASH_HandleTypeDef *hhash) {
+	const uint32_t bankAddress = 0x08200000;
+	const int bankSize = FLASH_PAGE_NB * FLASH_PAGE_SIZE;
+	char pollingDigest[32];
+	char dmaDigest[32];
+	enableCycleCounter();
+
+	uint32_t start = DWT->CYCCNT;
+	HAL_HASHEx_SHA256_Start(hhash, (uint8_t *) bankAddress, bankSize, (uint8_t *) pollingDigest, HAL_MAX_DELAY);
+	uint32_t pollingCycles = DWT->CYCCNT - start;
+
+	start = DWT->CYCCNT;
+	if (computeHashFromFlash_DMA(hhash, bankAddress, bankSize) != HAL_OK || waitForHash(hhash, dmaDigest) != HAL_OK) {
+		printf("Error: DMA hash failed.\n");
+		return;
+	}
+	uint32_t dmaCycles = DWT->CYCCNT - start;
+
+	printf("SHA256 of %d bytes: polling %ld cycles, DMA %ld cycles\n", bankSize, pollingCycles, dmaCycles);
+	printf("Digests %s\n", memcmp(pollingDigest, dmaDigest, 32) == 0 ? "match" : "DO NOT match");
+}